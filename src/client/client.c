@@ -27,97 +27,303 @@ Client_Player cpl;
 
 /** Structure of all the socket commands */
 static socket_command_struct commands[CLIENT_CMD_NROF] = {
-    {socket_command_map},
-    {socket_command_drawinfo},
-    {socket_command_file_update},
-    {socket_command_item},
-    {socket_command_sound},
-    {socket_command_target},
-    {socket_command_item_update},
-    {socket_command_item_delete},
-    {socket_command_stats},
-    {socket_command_image},
-    {socket_command_anim},
-    {socket_command_crypto},
-    {socket_command_player},
-    {socket_command_mapstats},
-    {socket_command_resource},
-    {socket_command_version},
-    {socket_command_setup},
-    {socket_command_control},
-    {socket_command_painting},
-    {socket_command_characters},
-    {socket_command_book},
-    {socket_command_party},
-    {socket_command_quickslots},
-    {socket_command_compressed},
-    {NULL},
-    {socket_command_sound_ambient},
-    {socket_command_interface},
-    {socket_command_notification},
-    {socket_command_keepalive},
+    {socket_command_map, COMMAND_PRIORITY_CRITICAL, "map"},
+    {socket_command_drawinfo, COMMAND_PRIORITY_BULK, "drawinfo"},
+    {socket_command_file_update, COMMAND_PRIORITY_BULK, "file_update"},
+    {socket_command_item, COMMAND_PRIORITY_BULK, "item"},
+    {socket_command_sound, COMMAND_PRIORITY_NORMAL, "sound"},
+    {socket_command_target, COMMAND_PRIORITY_CRITICAL, "target"},
+    {socket_command_item_update, COMMAND_PRIORITY_BULK, "item_update"},
+    {socket_command_item_delete, COMMAND_PRIORITY_BULK, "item_delete"},
+    {socket_command_stats, COMMAND_PRIORITY_CRITICAL, "stats"},
+    {socket_command_image, COMMAND_PRIORITY_NORMAL, "image"},
+    {socket_command_anim, COMMAND_PRIORITY_NORMAL, "anim"},
+    {socket_command_crypto, COMMAND_PRIORITY_NORMAL, "crypto"},
+    {socket_command_player, COMMAND_PRIORITY_NORMAL, "player"},
+    {socket_command_mapstats, COMMAND_PRIORITY_NORMAL, "mapstats"},
+    {socket_command_resource, COMMAND_PRIORITY_BULK, "resource"},
+    {socket_command_version, COMMAND_PRIORITY_NORMAL, "version"},
+    {socket_command_setup, COMMAND_PRIORITY_NORMAL, "setup"},
+    {socket_command_control, COMMAND_PRIORITY_NORMAL, "control"},
+    {socket_command_painting, COMMAND_PRIORITY_NORMAL, "painting"},
+    {socket_command_characters, COMMAND_PRIORITY_NORMAL, "characters"},
+    {socket_command_book, COMMAND_PRIORITY_NORMAL, "book"},
+    {socket_command_party, COMMAND_PRIORITY_NORMAL, "party"},
+    {socket_command_quickslots, COMMAND_PRIORITY_NORMAL, "quickslots"},
+    /* Compressed commands are inflated by the socket reader thread. */
+    {NULL, COMMAND_PRIORITY_NORMAL, "compressed"},
+    {NULL, COMMAND_PRIORITY_NORMAL, NULL},
+    {socket_command_sound_ambient, COMMAND_PRIORITY_NORMAL, "sound_ambient"},
+    {socket_command_interface, COMMAND_PRIORITY_NORMAL, "interface"},
+    {socket_command_notification, COMMAND_PRIORITY_NORMAL, "notification"},
+    {socket_command_keepalive, COMMAND_PRIORITY_CRITICAL, "keepalive"},
 };
 
+/**
+ * Statistics about the commands received from the server, indexed by
+ * command type.
+ */
+static client_command_stats_t commands_stats[CLIENT_CMD_NROF];
+
+/**
+ * Commands received from the server that have yet to be handled, in the
+ * order they were received. Linked using the 'next' and 'prev' members.
+ */
+static command_buffer *commands_pending;
+
+
+/**
+ * Call the handler of a command received from the server.
+ * @param data
+ * The command data.
+ * @param len
+ * Length of the command data.
+ * @return
+ * False if the command is not valid, true otherwise.
+ */
+bool client_command_call(uint8_t *data, size_t len)
+{
+    size_t pos = 0;
+    uint8_t type = packet_to_uint8(data, len, &pos);
+
+    if (len == 0 || type >= CLIENT_CMD_NROF ||
+            commands[type].handle_func == NULL) {
+        LOG(ERROR, "Bad command from server (%d)", type);
+        return false;
+    }
+
+    commands[type].handle_func(data, len, pos);
+    return true;
+}
+
+/**
+ * Dispatch a single command received from the server.
+ * @param cmd
+ * The command.
+ * @return
+ * False if the connection should be dropped, true otherwise.
+ */
+static bool client_command_dispatch(command_buffer *cmd)
+{
+    if (cmd->state == COMMAND_BUFFER_FAILED) {
+        draw_info(COLOR_RED,
+                  "!!! Cryptography decryption failed; someone is "
+                  "likely hijacking your connection (MITM attack) !!!");
+        cpl.state = ST_START;
+        return false;
+    }
+
+    size_t pos = 0;
+    uint8_t type = packet_to_uint8(cmd->data, cmd->len, &pos);
+
+    if (socket_is_secure(csocket.sc) &&
+        type != CLIENT_CMD_CRYPTO &&
+        !socket_crypto_is_done(socket_get_crypto(csocket.sc))) {
+        LOG(PACKET,
+            "Received non-crypto packet before crypto exchange from %s",
+            socket_get_str(csocket.sc));
+        cpl.state = ST_START;
+        return false;
+    }
+
+    netcapture_record(cmd->data, cmd->len);
+
+    uint64_t start = SDL_GetPerformanceCounter();
+
+    if (client_command_call(cmd->data, cmd->len)) {
+        client_command_stats_t *stats = &commands_stats[type];
+        stats->count++;
+        stats->bytes += cmd->len;
+        stats->handler_time += SDL_GetPerformanceCounter() - start;
+
+        if (cmd->ticks != 0) {
+            stats->wait_time += start - cmd->ticks;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Get the priority of a command received from the server.
+ * @param cmd
+ * The command.
+ * @return
+ * One of @ref COMMAND_PRIORITY_xxx.
+ */
+static uint8_t client_command_priority(command_buffer *cmd)
+{
+    /* Commands that have not been decrypted yet must be handled in order. */
+    if (cmd->state != COMMAND_BUFFER_READY || cmd->len == 0 ||
+            cmd->data[0] >= CLIENT_CMD_NROF) {
+        return COMMAND_PRIORITY_NORMAL;
+    }
+
+    return commands[cmd->data[0]].priority;
+}
+
+/**
+ * Handle a command received from the server.
+ * @param cmd
+ * The command; will be freed.
+ * @return
+ * False if the connection should be dropped, true otherwise.
+ */
+static bool client_command_handle(command_buffer *cmd)
+{
+    bool raw = cmd->state == COMMAND_BUFFER_RAW;
+
+    if (raw) {
+        cmd = socket_command_prepare(cmd);
+    }
+
+    bool ok = cmd == NULL || client_command_dispatch(cmd);
+
+    if (cmd != NULL) {
+        command_buffer_free(cmd);
+    }
+
+    /* Let the reader thread carry on. */
+    if (raw) {
+        socket_command_raw_done();
+    }
+
+    return ok;
+}
+
 /**
  * Do client. The main loop for commands. From this, the data and
  * commands from server are received.
+ *
+ * Commands normally arrive already decrypted and decompressed by the socket
+ * reader thread; during the crypto exchange, they are handled here instead.
+ *
+ * Latency-critical commands are handled first, overtaking any bulk commands
+ * received before them. The rest are handled in order until the command
+ * processing budget for the frame is used up, leaving the remaining ones
+ * for the following frames.
  */
 void DoClient(void)
 {
-    command_buffer *cmd;
-    /* Handle all enqueued commands */
+    command_buffer *cmd, *tmp;
+
     while ((cmd = get_next_input_command()) != NULL) {
-        uint8_t *data = cmd->data;
-        size_t len = cmd->len;
-
-        uint8_t *decrypted_data;
-        size_t decrypted_len;
-        bool was_decrypted = true;
-        if (socket_is_secure(csocket.sc)) {
-            if (!socket_crypto_decrypt(csocket.sc,
-                                       data,
-                                       len,
-                                       &decrypted_data,
-                                       &decrypted_len)) {
-                draw_info(COLOR_RED,
-                          "!!! Cryptography decryption failed; someone is "
-                          "likely hijacking your connection (MITM attack) !!!");
-                cpl.state = ST_START;
-                break;
-            }
-        } else {
-            decrypted_data = data;
-            decrypted_len = len;
-            was_decrypted = false;
-        }
+        DL_APPEND(commands_pending, cmd);
+    }
 
-        size_t pos = 0;
-        uint8_t type = packet_to_uint8(decrypted_data, decrypted_len, &pos);
+    DL_FOREACH_SAFE(commands_pending, cmd, tmp) {
+        uint8_t priority = client_command_priority(cmd);
 
-        if (socket_is_secure(csocket.sc) &&
-            type != CLIENT_CMD_CRYPTO &&
-            !socket_crypto_is_done(socket_get_crypto(csocket.sc))) {
-            LOG(PACKET,
-                "Received non-crypto packet before crypto exchange from %s",
-                socket_get_str(csocket.sc));
-            cpl.state = ST_START;
+        if (priority == COMMAND_PRIORITY_NORMAL) {
             break;
         }
 
-        if (type >= CLIENT_CMD_NROF || commands[type].handle_func == NULL) {
-            LOG(ERROR, "Bad command from server (%d)", type);
-        } else {
-            commands[type].handle_func(decrypted_data, decrypted_len, pos);
+        if (priority == COMMAND_PRIORITY_CRITICAL) {
+            DL_DELETE(commands_pending, cmd);
+
+            if (!client_command_handle(cmd)) {
+                return;
+            }
+        }
+    }
+
+    uint32_t budget = setting_get_int(OPT_CAT_CLIENT, OPT_COMMAND_BUDGET);
+    uint32_t start = SDL_GetTicks();
+
+    while (commands_pending != NULL) {
+        cmd = commands_pending;
+        DL_DELETE(commands_pending, cmd);
+
+        if (!client_command_handle(cmd)) {
+            return;
         }
 
-        if (was_decrypted) {
-            efree(decrypted_data);
+        if (budget != 0 && SDL_GetTicks() - start >= budget) {
+            break;
         }
+    }
+}
 
+/**
+ * Drop all the commands received from the server that have yet to be
+ * handled.
+ */
+void client_commands_clear(void)
+{
+    command_buffer *cmd, *tmp;
+
+    DL_FOREACH_SAFE(commands_pending, cmd, tmp) {
+        DL_DELETE(commands_pending, cmd);
         command_buffer_free(cmd);
     }
 }
 
+/**
+ * Get the name of a command received from the server.
+ * @param type
+ * The command type.
+ * @return
+ * The name, NULL if the command type is not valid.
+ */
+const char *client_command_name(uint8_t type)
+{
+    if (type >= CLIENT_CMD_NROF) {
+        return NULL;
+    }
+
+    return commands[type].name;
+}
+
+/**
+ * Get statistics about a command received from the server.
+ * @param type
+ * The command type.
+ * @return
+ * The statistics, NULL if the command type is not valid.
+ */
+const client_command_stats_t *client_command_stats(uint8_t type)
+{
+    if (type >= CLIENT_CMD_NROF) {
+        return NULL;
+    }
+
+    return &commands_stats[type];
+}
+
+/**
+ * Reset the statistics about the commands received from the server.
+ */
+void client_command_stats_reset(void)
+{
+    memset(&commands_stats, 0, sizeof(commands_stats));
+}
+
+/**
+ * Dump the statistics about the commands received from the server to the
+ * log.
+ */
+void client_command_stats_dump(void)
+{
+    double freq = SDL_GetPerformanceFrequency();
+
+    LOG(INFO, "Server command statistics:");
+
+    for (size_t i = 0; i < CLIENT_CMD_NROF; i++) {
+        client_command_stats_t *stats = &commands_stats[i];
+
+        if (stats->count == 0) {
+            continue;
+        }
+
+        LOG(INFO, "%-15s %8" PRIu64 " commands, %10" PRIu64 " bytes, "
+                "handler %.3f ms (avg %.1f us), queue wait avg %.1f us",
+                commands[i].name, stats->count, stats->bytes,
+                stats->handler_time * 1000.0 / freq,
+                stats->handler_time * 1000000.0 / freq / stats->count,
+                stats->wait_time * 1000000.0 / freq / stats->count);
+    }
+}
+
 /**
  * Check animation status.
  * @param anum
@@ -95,6 +95,7 @@ void socket_command_image(uint8_t *data, size_t len, size_t pos)
 
     FaceList[facenum].sprite = sprite_tryload_file(buf, 0, NULL);
     map_redraw_flag = minimap_redraw_flag = 1;
+    map_minimap_invalidate();
 
     book_redraw();
     interface_redraw();
@@ -613,9 +614,11 @@ void socket_command_mapstats(uint8_t *data, size_t len, size_t pos)
             packet_to_string(data, len, &pos, buf, sizeof(buf));
             update_map_weather(buf);
         } else if (type == CMD_MAPSTATS_TEXT_ANIM) {
-            packet_to_string(data, len, &pos, msg_anim.color, sizeof(msg_anim.color));
-            packet_to_string(data, len, &pos, msg_anim.message, sizeof(msg_anim.message));
-            msg_anim.tick = LastTick;
+            char color[COLOR_BUF];
+
+            packet_to_string(data, len, &pos, color, sizeof(color));
+            packet_to_string(data, len, &pos, buf, sizeof(buf));
+            map_msg_anim_start(color, buf);
         }
     }
 }
@@ -631,6 +634,9 @@ void socket_command_map(uint8_t *data, size_t len, size_t pos)
     uint8_t num_layers, in_building;
     region_map_def_map_t *def_map;
     bool region_map_fow_need_update;
+    /* Whether the whole map must be redrawn; otherwise, only the cells that
+     * changed are. */
+    bool full_redraw = false;
 
     mapstat = packet_to_uint8(data, len, &pos);
 
@@ -681,6 +687,7 @@ void socket_command_map(uint8_t *data, size_t len, size_t pos)
         update_map_region_name(region_name);
         update_map_region_longname(region_longname);
         update_map_path(mappath);
+        full_redraw = true;
     } else {
         xpos = packet_to_uint8(data, len, &pos);
         ypos = packet_to_uint8(data, len, &pos);
@@ -689,6 +696,7 @@ void socket_command_map(uint8_t *data, size_t len, size_t pos)
         if ((xpos - mx || ypos - my)) {
             display_mapscroll(xpos - mx, ypos - my, 0, 0);
             map_play_footstep();
+            full_redraw = true;
         }
 
         mx = xpos;
@@ -697,11 +705,21 @@ void socket_command_map(uint8_t *data, size_t len, size_t pos)
 
     MapData.posx = xpos;
     MapData.posy = ypos;
-    MapData.player_sub_layer = packet_to_uint8(data, len, &pos);
+    uint8_t player_sub_layer = packet_to_uint8(data, len, &pos);
+
+    if (player_sub_layer != MapData.player_sub_layer) {
+        MapData.player_sub_layer = player_sub_layer;
+        full_redraw = true;
+    }
+
     def_map = region_map_find_map(MapData.region_map, MapData.map_path);
 
     in_building = packet_to_uint8(data, len, &pos);
 
+    if (in_building != MapData.in_building) {
+        full_redraw = true;
+    }
+
     map_get_real_coords(&rx, &ry);
     region_map_fow_need_update = false;
 
@@ -883,7 +901,11 @@ void socket_command_map(uint8_t *data, size_t len, size_t pos)
 
     adjust_tile_stretch();
     map_update_in_building(in_building);
-    map_redraw_flag = minimap_redraw_flag = 1;
+    minimap_redraw_flag = 1;
+
+    if (full_redraw) {
+        map_redraw_flag = 1;
+    }
 
     if (region_map_fow_need_update) {
         region_map_fow_update(MapData.region_map);
@@ -903,31 +925,6 @@ void socket_command_version(uint8_t *data, size_t len, size_t pos)
     cpl.state = ST_VERSION;
 }
 
-/** @copydoc socket_command_struct::handle_func */
-void socket_command_compressed(uint8_t *data, size_t len, size_t pos)
-{
-    unsigned long ucomp_len;
-    uint8_t type, *dest;
-    size_t dest_size;
-
-    type = packet_to_uint8(data, len, &pos);
-    ucomp_len = packet_to_uint32(data, len, &pos);
-
-    dest_size = ucomp_len + 1;
-    dest = emalloc(dest_size);
-    dest[0] = type;
-
-    if (uncompress((Bytef *) dest + 1, (uLongf *) & ucomp_len,
-            (const Bytef *) data + pos, (uLong) len - pos) == Z_OK) {
-        command_buffer *buf;
-
-        buf = command_buffer_new(ucomp_len + 1, dest);
-        add_input_command(buf);
-    }
-
-    efree(dest);
-}
-
 /** @copydoc socket_command_struct::handle_func */
 void socket_command_control(uint8_t *data, size_t len, size_t pos)
 {
@@ -420,6 +420,18 @@ void clioption_settings_deinit(void)
     if (clioption_settings.game_news_url) {
         efree(clioption_settings.game_news_url);
     }
+
+    if (clioption_settings.netcapture) {
+        efree(clioption_settings.netcapture);
+    }
+
+    if (clioption_settings.netreplay) {
+        efree(clioption_settings.netreplay);
+    }
+
+    if (clioption_settings.selftest) {
+        efree(clioption_settings.selftest);
+    }
 }
 
 /**
@@ -570,6 +582,65 @@ clioptions_option_reconnect (const char *arg,
     return true;
 }
 
+/**
+ * Description of the --netcapture command.
+ */
+static const char *clioptions_option_netcapture_desc =
+"Records the commands received from the server, as they are handled, to "
+"the specified file, for later use with --netreplay.\n\n"
+"Usage:\n"
+" --netcapture=capture.bin";
+/** @copydoc clioptions_handler_func */
+static bool
+clioptions_option_netcapture (const char *arg,
+                              char      **errmsg)
+{
+    clioption_settings.netcapture = estrdup(arg);
+    return true;
+}
+
+/**
+ * Description of the --netreplay command.
+ */
+static const char *clioptions_option_netreplay_desc =
+"Runs the commands recorded with --netcapture through the command handlers "
+"as fast as possible without a window, logs per-command throughput and "
+"handler latency percentiles, then checks that drawing the resulting map "
+"using the retained draw list gives the same result as drawing it in full "
+"passes and that the map indexes stay consistent as the map is scrolled, "
+"and exits with a non-zero status if not.\n\n"
+"Usage:\n"
+" --netreplay=capture.bin";
+/** @copydoc clioptions_handler_func */
+static bool
+clioptions_option_netreplay (const char *arg,
+                             char      **errmsg)
+{
+    clioption_settings.netreplay = estrdup(arg);
+    return true;
+}
+
+#ifdef HAVE_SELFTEST
+/**
+ * Description of the --selftest command.
+ */
+static const char *clioptions_option_selftest_desc =
+"Runs the specified self-test without a window, comparing the optimized "
+"rendering code against reference implementations on generated surfaces, "
+"logs the results, and exits with a non-zero status if any of them "
+"differ. Use 'all' to run all the self-tests.\n\n"
+"Usage:\n"
+" --selftest=pixel";
+/** @copydoc clioptions_handler_func */
+static bool
+clioptions_option_selftest (const char *arg,
+                            char      **errmsg)
+{
+    clioption_settings.selftest = estrdup(arg);
+    return true;
+}
+#endif
+
 /**
  * The main function.
  * @param argc
@@ -583,6 +654,8 @@ int main(int argc, char *argv[])
 {
     char *path;
     int done = 0, update, frames;
+    int last_state = -1;
+    SDL_Rect drag_box = {0, 0, 0, 0};
     uint32_t anim_tick, frame_start_time, elapsed_time, fps_limit,
             last_frame_ticks, last_memory_check;
     int fps_limits[] = {30, 60, 120, 0};
@@ -636,6 +709,11 @@ int main(int argc, char *argv[])
     CLIOPTIONS_CREATE_ARGUMENT(cli, metaserver, "Add a metaserver to the list");
     CLIOPTIONS_CREATE_ARGUMENT(cli, connect, "Connect to the specified server");
     CLIOPTIONS_CREATE_ARGUMENT(cli, game_news_url, "Set game news URL");
+    CLIOPTIONS_CREATE_ARGUMENT(cli, netcapture, "Record server commands");
+    CLIOPTIONS_CREATE_ARGUMENT(cli, netreplay, "Replay recorded commands");
+#ifdef HAVE_SELFTEST
+    CLIOPTIONS_CREATE_ARGUMENT(cli, selftest, "Run a self-test");
+#endif
 
     /* Argument options*/
     CLIOPTIONS_CREATE(cli, nometa, "Disable querying the metaserver");
@@ -660,11 +738,24 @@ int main(int argc, char *argv[])
     settings_init();
     init_game_data();
 
+    /* Replaying and self-tests do not need a window or sound. */
+    if (clioption_settings.netreplay != NULL ||
+        clioption_settings.selftest != NULL) {
+        SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+        SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+    }
+
     if (SDL_Init(SDL_INIT_AUDIO | SDL_INIT_VIDEO) < 0) {
         LOG(ERROR, "Couldn't initialize SDL: %s", SDL_GetError());
         exit(1);
     }
 
+#ifdef HAVE_SELFTEST
+    if (clioption_settings.selftest != NULL) {
+        exit(selftest_run(clioption_settings.selftest));
+    }
+#endif
+
     /* Start the system after starting SDL */
     video_init();
     system_start();
@@ -716,6 +807,15 @@ int main(int argc, char *argv[])
 
     sound_background_hook_register(sound_background_hook);
 
+    if (clioption_settings.netreplay != NULL) {
+        cpl.state = ST_PLAY;
+        exit(netreplay_run(clioption_settings.netreplay));
+    }
+
+    if (clioption_settings.netcapture != NULL) {
+        netcapture_open(clioption_settings.netcapture);
+    }
+
     LastTick = anim_tick = last_frame_ticks = last_memory_check =
             SDL_GetTicks();
     frames = 0;
@@ -767,69 +867,69 @@ int main(int argc, char *argv[])
             play_action_sounds();
         }
 
-        update = 1; // 0
+        if (cpl.state != last_state) {
+            last_state = cpl.state;
+            screen_damage_add_all();
+        }
 
-        /* Disabling this for now ...
-         * - it appears to introduce glitches with mouse events
-         *   and redrawing when the screen resolution is changed
-        
-        if (!(SDL_GetWindowFlags(ScreenWindow) & (SDL_WINDOW_MOUSE_FOCUS | SDL_WINDOW_INPUT_FOCUS))) {
+        if (cpl.state <= ST_WAITFORPLAY) {
+            screen_damage_add_all();
         } else if (cpl.state == ST_PLAY) {
-            static int old_cursor_x = -1, old_cursor_y = -1;
-
-            if (widgets_need_redraw()) {
-                update = 1;
-            } else if (cursor_x != old_cursor_x || cursor_y != old_cursor_y) {
-                update = 1;
-                old_cursor_x = cursor_x;
-                old_cursor_y = cursor_y;
-            } else if (event_dragging_need_redraw()) {
-                update = 1;
-            } else if (popup_need_redraw()) {
-                update = 1;
-            } else if (tooltip_need_redraw()) {
-                update = 1;
-            } else if (map_redraw_flag || minimap_redraw_flag) {
-                update = 1;
-            } else if (map_anims_need_redraw()) {
-                update = 1;
-            }
-        } else {
-            update = 1;
+            widgets_damage(1);
         }
-        
-        */
-        
+
+        popup_damage();
+        tooltip_damage();
+
+        /* The dragged item moves with the mouse. */
+        screen_damage_add_rect(&drag_box);
+        drag_box.w = drag_box.h = 0;
+
+        if (event_dragging_check()) {
+            int mx, my;
+            float lx, ly;
+
+            SDL_GetMouseState(&mx, &my);
+
+            // map the mouse coordinates to our logical render size
+            SDL_RenderWindowToLogical(ScreenRenderer, mx, my, &lx, &ly);
+            drag_box.x = (int) lx - INVENTORY_ICON_SIZE;
+            drag_box.y = (int) ly - INVENTORY_ICON_SIZE;
+            drag_box.w = INVENTORY_ICON_SIZE * 3;
+            drag_box.h = INVENTORY_ICON_SIZE * 3;
+            screen_damage_add_rect(&drag_box);
+        }
+
+        /* Recomposite only the damaged part of the screen; everything is
+         * still drawn, as drawing has side effects. */
+        SDL_Rect clip;
+        update = screen_damage_begin(&clip);
+        SDL_SetClipRect(ScreenSurface, &clip);
+
         if (update) {
-            SDL_FillRect(ScreenSurface, NULL, 0);
+            SDL_FillRect(ScreenSurface, &clip, 0);
             SDL_SetRenderDrawColor(ScreenRenderer, 0, 0, 0, 255);
         }
 
         if (cpl.state <= ST_WAITFORPLAY) {
             intro_show();
         } else if (cpl.state == ST_PLAY) {
-            process_widgets(update);
+            process_widgets(1);
         }
 
         popup_render_all();
         tooltip_show();
 
         /* Show the currently dragged item. */
-        if (event_dragging_check()) {
-            int mx, my;
-            float lx, ly;
-            
-            SDL_GetMouseState(&mx, &my);
-            
-            // map the mouse coordinates to our logical render size
-            SDL_RenderWindowToLogical(ScreenRenderer, mx, my, &lx, &ly);
-            mx = (int) lx;
-            my = (int) ly;
-            
+        if (drag_box.w != 0) {
             object_show_centered(ScreenSurface, object_find(cpl.dragging_tag),
-                    mx, my, INVENTORY_ICON_SIZE, INVENTORY_ICON_SIZE, false);
+                    drag_box.x + INVENTORY_ICON_SIZE,
+                    drag_box.y + INVENTORY_ICON_SIZE, INVENTORY_ICON_SIZE,
+                    INVENTORY_ICON_SIZE, false);
         }
 
+        SDL_SetClipRect(ScreenSurface, NULL);
+
         /* Disabling this for now ...
          * - SDL is unable to hide the system cursor on WSL / x11
          * - the surface coordinates get messed up when changing resolution
@@ -854,7 +954,7 @@ int main(int argc, char *argv[])
         sprite_cache_gc();
 
         if (update) {
-            SDL_UpdateTexture(ScreenTexture, NULL, ScreenSurface->pixels, ScreenSurface->pitch);
+            screen_damage_upload();
             SDL_RenderClear(ScreenRenderer);
             SDL_RenderCopy(ScreenRenderer, ScreenTexture, NULL, NULL);
             SDL_RenderPresent(ScreenRenderer);
@@ -196,6 +196,35 @@ int client_command_check(const char *cmd)
         }
 
         draw_info_format(COLOR_RED, "Unknown %s.", type == TYPE_SPELL ? "spell" : "skill");
+        return 1;
+    } else if (strncasecmp(cmd, "/netstats", 9) == 0) {
+        if (strcasecmp(cmd + 9, " reset") == 0) {
+            client_command_stats_reset();
+            draw_info(COLOR_GREEN, "Server command statistics reset.");
+        } else {
+            client_command_stats_dump();
+            draw_info(COLOR_GREEN, "Server command statistics written to "
+                    "the log.");
+        }
+
+        return 1;
+    } else if (strncasecmp(cmd, "/spritecache", 12) == 0) {
+        if (strcasecmp(cmd + 12, " reset") == 0) {
+            sprite_cache_stats_reset();
+            draw_info(COLOR_GREEN, "Sprite cache statistics reset.");
+        } else {
+            sprite_cache_stats_t stats;
+            sprite_cache_get_stats(&stats);
+            uint64_t lookups = stats.hits + stats.misses;
+            draw_info_format(COLOR_GREEN, "Sprite cache: %" PRIu64 " entries, "
+                    "%.1f MB (peak %.1f MB), %" PRIu64 " hits, %" PRIu64
+                    " misses (%.1f%% hit rate), %" PRIu64 " evictions",
+                    (uint64_t) stats.entries, stats.bytes / (1024.0 * 1024.0),
+                    stats.peak_bytes / (1024.0 * 1024.0), stats.hits,
+                    stats.misses, lookups != 0 ?
+                    stats.hits * 100.0 / lookups : 0.0, stats.evictions);
+        }
+
         return 1;
     } else if (strncasecmp(cmd, "/clearcache", 11) == 0) {
         cmd += 12;
@@ -0,0 +1,353 @@
+/**
+ * @file
+ * Capturing of the command stream received from the server, and offline
+ * replay of such captures for profiling the command handlers.
+ *
+ * A capture file starts with ::NETCAPTURE_MAGIC followed by
+ * ::NETCAPTURE_VERSION. Each command follows as a record consisting of the
+ * number of milliseconds since the capture started and the length of the
+ * command (both 32-bit big-endian integers), followed by the decrypted and
+ * decompressed command data, as it was passed to the command handlers.
+ *
+ * The crypto exchange commands are not captured, as they can only be
+ * handled on a live connection.
+ */
+
+#include <global.h>
+
+/** Magic string at the start of capture files. */
+#define NETCAPTURE_MAGIC "DMNC"
+/** Version of the capture file format. */
+#define NETCAPTURE_VERSION 1
+/** How many times to draw the replayed map in map_draw_check(). */
+#define NETREPLAY_MAP_FRAMES 100
+
+/**
+ * Scrolls done after replaying a capture, each followed by a check of the
+ * map indexes; they end where they started.
+ */
+static const int netreplay_scrolls[][2] = {
+    {1, 0}, {0, 1}, {-1, 0}, {0, -1}, {3, -2}, {-3, 2}
+};
+
+/**
+ * Replay statistics of a single command type.
+ */
+typedef struct netreplay_stats {
+    /** Handler run times, in performance counter ticks. */
+    uint64_t *samples;
+
+    /** Number of samples. */
+    size_t num;
+
+    /** Allocated number of samples. */
+    size_t size;
+
+    /** Total handler run time, in performance counter ticks. */
+    uint64_t total;
+
+    /** Total size of the commands. */
+    uint64_t bytes;
+} netreplay_stats_t;
+
+/** File the command stream is being captured to, if any. */
+static FILE *netcapture_fp;
+/** When the capture was started. */
+static uint32_t netcapture_ticks;
+
+/**
+ * Write a 32-bit big-endian integer to a capture file.
+ * @param fp
+ * The file.
+ * @param val
+ * The integer.
+ */
+static void netcapture_write_uint32(FILE *fp, uint32_t val)
+{
+    uint8_t buf[4];
+
+    buf[0] = (val >> 24) & 0xff;
+    buf[1] = (val >> 16) & 0xff;
+    buf[2] = (val >> 8) & 0xff;
+    buf[3] = val & 0xff;
+    fwrite(buf, 1, sizeof(buf), fp);
+}
+
+/**
+ * Read a 32-bit big-endian integer from a capture file.
+ * @param fp
+ * The file.
+ * @param[out] val
+ * Will contain the integer.
+ * @return
+ * True on success, false on end of file.
+ */
+static bool netcapture_read_uint32(FILE *fp, uint32_t *val)
+{
+    uint8_t buf[4];
+
+    if (fread(buf, 1, sizeof(buf), fp) != sizeof(buf)) {
+        return false;
+    }
+
+    *val = ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) |
+            ((uint32_t) buf[2] << 8) | buf[3];
+    return true;
+}
+
+/**
+ * Start capturing the command stream.
+ * @param path
+ * File to capture the command stream to.
+ */
+void netcapture_open(const char *path)
+{
+    HARD_ASSERT(path != NULL);
+
+    netcapture_close();
+
+    netcapture_fp = fopen(path, "wb");
+
+    if (netcapture_fp == NULL) {
+        LOG(ERROR, "Could not open %s for writing: %s", path,
+                strerror(errno));
+        return;
+    }
+
+    fwrite(NETCAPTURE_MAGIC, 1, strlen(NETCAPTURE_MAGIC), netcapture_fp);
+    fputc(NETCAPTURE_VERSION, netcapture_fp);
+    netcapture_ticks = SDL_GetTicks();
+
+    LOG(INFO, "Capturing server commands to %s", path);
+}
+
+/**
+ * Stop capturing the command stream.
+ */
+void netcapture_close(void)
+{
+    if (netcapture_fp == NULL) {
+        return;
+    }
+
+    fclose(netcapture_fp);
+    netcapture_fp = NULL;
+}
+
+/**
+ * Check whether a command can be replayed from a capture.
+ * @param data
+ * The command data.
+ * @param len
+ * Length of the command data.
+ * @return
+ * True if the command can be replayed, false otherwise.
+ */
+static bool netcapture_is_replayable(const uint8_t *data, size_t len)
+{
+    /* The crypto handlers need the socket and the selected server. */
+    return len != 0 && data[0] != CLIENT_CMD_CRYPTO;
+}
+
+/**
+ * Record a command about to be handled, if the command stream is being
+ * captured.
+ * @param data
+ * The command data.
+ * @param len
+ * Length of the command data.
+ */
+void netcapture_record(const uint8_t *data, size_t len)
+{
+    if (netcapture_fp == NULL || !netcapture_is_replayable(data, len)) {
+        return;
+    }
+
+    netcapture_write_uint32(netcapture_fp, SDL_GetTicks() - netcapture_ticks);
+    netcapture_write_uint32(netcapture_fp, len);
+    fwrite(data, 1, len, netcapture_fp);
+}
+
+/**
+ * Comparison function for sorting handler run times.
+ */
+static int netreplay_sample_compare(const void *a, const void *b)
+{
+    uint64_t sample_a = *(const uint64_t *) a;
+    uint64_t sample_b = *(const uint64_t *) b;
+
+    if (sample_a < sample_b) {
+        return -1;
+    } else if (sample_a > sample_b) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Get a percentile of sorted handler run times, in microseconds.
+ * @param stats
+ * The statistics, with sorted samples.
+ * @param percentile
+ * The percentile.
+ * @return
+ * The handler run time.
+ */
+static double netreplay_percentile(const netreplay_stats_t *stats, int percentile)
+{
+    size_t idx = (stats->num - 1) * percentile / 100;
+    return stats->samples[idx] * 1000000.0 / SDL_GetPerformanceFrequency();
+}
+
+/**
+ * Replay a capture of the command stream through the command handlers as
+ * fast as possible, and log per-command throughput and handler latency
+ * percentiles.
+ *
+ * The map the capture ends on is then drawn with and without the retained
+ * draw list, which must give the same result; see map_draw_check(). The
+ * map indexes are checked with map_index_check() as well, both as they are
+ * and after scrolling the map around.
+ * @param path
+ * The capture file.
+ * @return
+ * 0 on success, 1 on failure.
+ */
+int netreplay_run(const char *path)
+{
+    HARD_ASSERT(path != NULL);
+
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL) {
+        LOG(ERROR, "Could not open %s for reading: %s", path, strerror(errno));
+        return 1;
+    }
+
+    char magic[sizeof(NETCAPTURE_MAGIC) - 1];
+
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+            memcmp(magic, NETCAPTURE_MAGIC, sizeof(magic)) != 0 ||
+            fgetc(fp) != NETCAPTURE_VERSION) {
+        LOG(ERROR, "%s is not a valid capture file", path);
+        fclose(fp);
+        return 1;
+    }
+
+    /* Get the size of the file, so that the length of each command can be
+     * checked before allocating its buffer; a corrupt length could
+     * otherwise make the allocation fail. */
+    long start_pos = ftell(fp), end_pos = -1;
+
+    if (start_pos != -1 && fseek(fp, 0, SEEK_END) == 0) {
+        end_pos = ftell(fp);
+    }
+
+    if (end_pos == -1 || fseek(fp, start_pos, SEEK_SET) != 0) {
+        LOG(ERROR, "Could not get the size of %s: %s", path, strerror(errno));
+        fclose(fp);
+        return 1;
+    }
+
+    netreplay_stats_t stats[CLIENT_CMD_NROF];
+    memset(&stats, 0, sizeof(stats));
+
+    uint32_t ticks = 0, len;
+    uint64_t total = 0, bytes = 0;
+    size_t num = 0;
+
+    while (netcapture_read_uint32(fp, &ticks) &&
+            netcapture_read_uint32(fp, &len)) {
+        long pos = ftell(fp);
+
+        if (pos == -1 || len > (uint64_t) (end_pos - pos)) {
+            LOG(ERROR, "Truncated command in %s", path);
+            break;
+        }
+
+        command_buffer *buf = command_buffer_new(len, NULL);
+
+        if (fread(buf->data, 1, len, fp) != len) {
+            LOG(ERROR, "Truncated command in %s", path);
+            command_buffer_free(buf);
+            break;
+        }
+
+        /* Captures made by older builds may include the crypto exchange. */
+        if (!netcapture_is_replayable(buf->data, buf->len)) {
+            command_buffer_free(buf);
+            continue;
+        }
+
+        uint64_t start = SDL_GetPerformanceCounter();
+        bool valid = client_command_call(buf->data, buf->len);
+        uint64_t elapsed = SDL_GetPerformanceCounter() - start;
+
+        if (valid) {
+            netreplay_stats_t *stat = &stats[buf->data[0]];
+
+            if (stat->num == stat->size) {
+                stat->size = stat->size != 0 ? stat->size * 2 : 64;
+                stat->samples = erealloc(stat->samples,
+                        sizeof(*stat->samples) * stat->size);
+            }
+
+            stat->samples[stat->num++] = elapsed;
+            stat->total += elapsed;
+            stat->bytes += len;
+            total += elapsed;
+            bytes += len;
+            num++;
+        }
+
+        command_buffer_free(buf);
+    }
+
+    fclose(fp);
+
+    double freq = SDL_GetPerformanceFrequency();
+    LOG(INFO, "Replayed %" PRIu64 " commands (%" PRIu64 " bytes, captured "
+            "over %.1f s) in %.3f ms: %.0f commands/s, %.2f MB/s",
+            (uint64_t) num, bytes, ticks / 1000.0, total * 1000.0 / freq,
+            total != 0 ? num * freq / total : 0.0,
+            total != 0 ? bytes * freq / total / (1024.0 * 1024.0) : 0.0);
+
+    for (size_t i = 0; i < CLIENT_CMD_NROF; i++) {
+        if (stats[i].num == 0) {
+            continue;
+        }
+
+        qsort(stats[i].samples, stats[i].num, sizeof(*stats[i].samples),
+                netreplay_sample_compare);
+
+        LOG(INFO, "Command %s: %" PRIu64 " calls, %" PRIu64 " bytes, "
+                "%.0f calls/s, p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+                "max %.1f us", client_command_name(i), (uint64_t) stats[i].num,
+                stats[i].bytes, stats[i].total != 0 ?
+                stats[i].num * freq / stats[i].total : 0.0,
+                netreplay_percentile(&stats[i], 50),
+                netreplay_percentile(&stats[i], 90),
+                netreplay_percentile(&stats[i], 99),
+                netreplay_percentile(&stats[i], 100));
+
+        efree(stats[i].samples);
+    }
+
+    if (!map_draw_check(NETREPLAY_MAP_FRAMES) || !map_index_check()) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < arraysize(netreplay_scrolls); i++) {
+        display_mapscroll(netreplay_scrolls[i][0], netreplay_scrolls[i][1], 0,
+                0);
+
+        if (!map_index_check()) {
+            LOG(ERROR, "The map indexes are inconsistent after scrolling by "
+                    "%d,%d", netreplay_scrolls[i][0], netreplay_scrolls[i][1]);
+            return 1;
+        }
+    }
+
+    return 0;
+}
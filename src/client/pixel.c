@@ -0,0 +1,802 @@
+/**
+ * @file
+ * Pixel kernels used to render sprite effects.
+ *
+ * The kernels work directly on rows of 32-bit pixels, using integer math
+ * only. Besides the portable scalar kernels there are SSE2 and AVX2 kernels
+ * on x86; the fastest kernels supported by the CPU are selected at runtime
+ * by pixel_init().
+ *
+ * The luminance used by the color effects is calculated using the same
+ * weights as the floating-point math the effects used to use, in 15-bit
+ * fixed point, so the results differ from it by at most one.
+ *
+ * Surfaces can also be scaled using a ::pixel_scaler_t, which maps the
+ * destination pixels to the source pixels in advance, so that only the
+ * part of the destination affected by a change of the source needs to be
+ * scaled again.
+ */
+
+#include <global.h>
+#include <cmake.h>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#   define PIXEL_X86 1
+#   include <immintrin.h>
+#endif
+
+/**
+ * @defgroup PIXEL_LUM_xxx Luminance weights
+ * Luminance weights of the color channels, in 15-bit fixed point. They add
+ * up to exactly 1 << 15.
+ *@{*/
+#define PIXEL_LUM_R 6969
+#define PIXEL_LUM_G 23434
+#define PIXEL_LUM_B 2365
+/*@}*/
+
+/**
+ * Fog of war brightness, in 8-bit fixed point (about 0.34).
+ */
+#define PIXEL_FOW_SCALE 87
+
+/**
+ * Amount of blue added to fog of war pixels.
+ */
+#define PIXEL_FOW_BLUE 16
+
+/**
+ * A set of pixel kernels.
+ */
+typedef struct pixel_kernels {
+    /** Name of the kernels. */
+    const char *name;
+
+    /**
+     * Check whether the CPU supports the kernels.
+     * @return
+     * True if the kernels can be used, false otherwise.
+     */
+    bool (*supported)(void);
+
+    /**
+     * Apply a color effect to a row of RGBA8888 pixels.
+     * @param row
+     * The pixels.
+     * @param num
+     * Number of pixels.
+     * @param effect
+     * The effect.
+     */
+    void (*effect)(uint32_t *row, size_t num, pixel_effect_t effect);
+
+    /**
+     * Scale the alpha channel of a row of 32-bit pixels.
+     * @param row
+     * The pixels.
+     * @param num
+     * Number of pixels.
+     * @param alpha
+     * Alpha value to scale by.
+     * @param shift
+     * Bit position of the alpha channel.
+     */
+    void (*alpha)(uint32_t *row, size_t num, uint8_t alpha, int shift);
+} pixel_kernels_t;
+
+/**
+ * Scale an 8-bit value.
+ * @param val
+ * The value.
+ * @param scale
+ * Value to scale by; 255 keeps the value as is.
+ * @return
+ * The scaled value, rounded down.
+ */
+static inline uint32_t pixel_scale(uint32_t val, uint32_t scale)
+{
+    uint32_t x = val * scale;
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+/**
+ * Check whether the scalar kernels are supported.
+ * @return
+ * Always true.
+ */
+static bool pixel_scalar_supported(void)
+{
+    return true;
+}
+
+/** @copydoc pixel_kernels::effect */
+static void pixel_scalar_effect(uint32_t *row, size_t num,
+        pixel_effect_t effect)
+{
+    for (size_t i = 0; i < num; i++) {
+        uint32_t px = row[i];
+        uint32_t lum = (PIXEL_LUM_R * (px >> 24) +
+                PIXEL_LUM_G * ((px >> 16) & 0xff) +
+                PIXEL_LUM_B * ((px >> 8) & 0xff)) >> 15;
+        uint32_t a = px & 0xff;
+
+        switch (effect) {
+        case PIXEL_EFFECT_RED:
+            row[i] = (lum << 24) | a;
+            break;
+
+        case PIXEL_EFFECT_GRAY:
+            row[i] = (lum << 24) | (lum << 16) | (lum << 8) | a;
+            break;
+
+        case PIXEL_EFFECT_FOW:
+            lum = (lum * PIXEL_FOW_SCALE) >> 8;
+            row[i] = (lum << 24) | (lum << 16) |
+                    ((lum + PIXEL_FOW_BLUE) << 8) | a;
+            break;
+        }
+    }
+}
+
+/** @copydoc pixel_kernels::alpha */
+static void pixel_scalar_alpha(uint32_t *row, size_t num, uint8_t alpha,
+        int shift)
+{
+    uint32_t mask = (uint32_t) 0xff << shift;
+
+    for (size_t i = 0; i < num; i++) {
+        uint32_t a = pixel_scale((row[i] & mask) >> shift, alpha);
+        row[i] = (row[i] & ~mask) | (a << shift);
+    }
+}
+
+#ifdef PIXEL_X86
+
+/**
+ * Check whether the SSE2 kernels are supported.
+ * @return
+ * True if the CPU supports SSE2, false otherwise.
+ */
+static bool pixel_sse2_supported(void)
+{
+    return SDL_HasSSE2();
+}
+
+/**
+ * Calculate the luminance of four RGBA8888 pixels.
+ * @param px
+ * The pixels.
+ * @return
+ * The luminance of each pixel, in 32-bit lanes.
+ */
+__attribute__((target("sse2")))
+static inline __m128i pixel_sse2_lum(__m128i px)
+{
+    /* Blue and red end up in the low and high halves of each lane, so that
+     * a single multiply-add can weight and sum them. */
+    __m128i rb = _mm_and_si128(_mm_srli_epi32(px, 8),
+            _mm_set1_epi32(0x00ff00ff));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(px, 16), _mm_set1_epi32(0xff));
+    __m128i sum = _mm_add_epi32(
+            _mm_madd_epi16(rb, _mm_set1_epi32((PIXEL_LUM_R << 16) |
+            PIXEL_LUM_B)),
+            _mm_madd_epi16(g, _mm_set1_epi32(PIXEL_LUM_G)));
+    return _mm_srli_epi32(sum, 15);
+}
+
+/** @copydoc pixel_kernels::effect */
+__attribute__((target("sse2")))
+static void pixel_sse2_effect(uint32_t *row, size_t num,
+        pixel_effect_t effect)
+{
+    __m128i amask = _mm_set1_epi32(0xff);
+    size_t i;
+
+    for (i = 0; i + 4 <= num; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i *) (row + i));
+        __m128i lum = pixel_sse2_lum(px);
+        __m128i out = _mm_and_si128(px, amask);
+
+        switch (effect) {
+        case PIXEL_EFFECT_RED:
+            out = _mm_or_si128(out, _mm_slli_epi32(lum, 24));
+            break;
+
+        case PIXEL_EFFECT_GRAY:
+            out = _mm_or_si128(out, _mm_or_si128(
+                    _mm_or_si128(_mm_slli_epi32(lum, 24),
+                    _mm_slli_epi32(lum, 16)), _mm_slli_epi32(lum, 8)));
+            break;
+
+        case PIXEL_EFFECT_FOW:
+            lum = _mm_srli_epi32(_mm_mullo_epi16(lum,
+                    _mm_set1_epi32(PIXEL_FOW_SCALE)), 8);
+            out = _mm_or_si128(out, _mm_or_si128(
+                    _mm_or_si128(_mm_slli_epi32(lum, 24),
+                    _mm_slli_epi32(lum, 16)), _mm_slli_epi32(_mm_add_epi32(lum,
+                    _mm_set1_epi32(PIXEL_FOW_BLUE)), 8)));
+            break;
+        }
+
+        _mm_storeu_si128((__m128i *) (row + i), out);
+    }
+
+    pixel_scalar_effect(row + i, num - i, effect);
+}
+
+/** @copydoc pixel_kernels::alpha */
+__attribute__((target("sse2")))
+static void pixel_sse2_alpha(uint32_t *row, size_t num, uint8_t alpha,
+        int shift)
+{
+    __m128i count = _mm_cvtsi32_si128(shift);
+    __m128i mask = _mm_sll_epi32(_mm_set1_epi32(0xff), count);
+    __m128i scale = _mm_set1_epi32(alpha);
+    __m128i one = _mm_set1_epi32(1);
+    size_t i;
+
+    for (i = 0; i + 4 <= num; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i *) (row + i));
+        __m128i x = _mm_mullo_epi16(_mm_srl_epi32(_mm_and_si128(px, mask),
+                count), scale);
+        x = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, one),
+                _mm_srli_epi16(x, 8)), 8);
+        px = _mm_or_si128(_mm_andnot_si128(mask, px), _mm_sll_epi32(x, count));
+        _mm_storeu_si128((__m128i *) (row + i), px);
+    }
+
+    pixel_scalar_alpha(row + i, num - i, alpha, shift);
+}
+
+/**
+ * Check whether the AVX2 kernels are supported.
+ * @return
+ * True if the CPU supports AVX2, false otherwise.
+ */
+static bool pixel_avx2_supported(void)
+{
+    return SDL_HasAVX2();
+}
+
+/**
+ * Calculate the luminance of eight RGBA8888 pixels.
+ * @param px
+ * The pixels.
+ * @return
+ * The luminance of each pixel, in 32-bit lanes.
+ */
+__attribute__((target("avx2")))
+static inline __m256i pixel_avx2_lum(__m256i px)
+{
+    __m256i rb = _mm256_and_si256(_mm256_srli_epi32(px, 8),
+            _mm256_set1_epi32(0x00ff00ff));
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(px, 16),
+            _mm256_set1_epi32(0xff));
+    __m256i sum = _mm256_add_epi32(
+            _mm256_madd_epi16(rb, _mm256_set1_epi32((PIXEL_LUM_R << 16) |
+            PIXEL_LUM_B)),
+            _mm256_madd_epi16(g, _mm256_set1_epi32(PIXEL_LUM_G)));
+    return _mm256_srli_epi32(sum, 15);
+}
+
+/** @copydoc pixel_kernels::effect */
+__attribute__((target("avx2")))
+static void pixel_avx2_effect(uint32_t *row, size_t num,
+        pixel_effect_t effect)
+{
+    __m256i amask = _mm256_set1_epi32(0xff);
+    size_t i;
+
+    for (i = 0; i + 8 <= num; i += 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i *) (row + i));
+        __m256i lum = pixel_avx2_lum(px);
+        __m256i out = _mm256_and_si256(px, amask);
+
+        switch (effect) {
+        case PIXEL_EFFECT_RED:
+            out = _mm256_or_si256(out, _mm256_slli_epi32(lum, 24));
+            break;
+
+        case PIXEL_EFFECT_GRAY:
+            out = _mm256_or_si256(out, _mm256_or_si256(
+                    _mm256_or_si256(_mm256_slli_epi32(lum, 24),
+                    _mm256_slli_epi32(lum, 16)), _mm256_slli_epi32(lum, 8)));
+            break;
+
+        case PIXEL_EFFECT_FOW:
+            lum = _mm256_srli_epi32(_mm256_mullo_epi16(lum,
+                    _mm256_set1_epi32(PIXEL_FOW_SCALE)), 8);
+            out = _mm256_or_si256(out, _mm256_or_si256(
+                    _mm256_or_si256(_mm256_slli_epi32(lum, 24),
+                    _mm256_slli_epi32(lum, 16)),
+                    _mm256_slli_epi32(_mm256_add_epi32(lum,
+                    _mm256_set1_epi32(PIXEL_FOW_BLUE)), 8)));
+            break;
+        }
+
+        _mm256_storeu_si256((__m256i *) (row + i), out);
+    }
+
+    pixel_scalar_effect(row + i, num - i, effect);
+}
+
+/** @copydoc pixel_kernels::alpha */
+__attribute__((target("avx2")))
+static void pixel_avx2_alpha(uint32_t *row, size_t num, uint8_t alpha,
+        int shift)
+{
+    __m128i count = _mm_cvtsi32_si128(shift);
+    __m256i mask = _mm256_sll_epi32(_mm256_set1_epi32(0xff), count);
+    __m256i scale = _mm256_set1_epi32(alpha);
+    __m256i one = _mm256_set1_epi32(1);
+    size_t i;
+
+    for (i = 0; i + 8 <= num; i += 8) {
+        __m256i px = _mm256_loadu_si256((const __m256i *) (row + i));
+        __m256i x = _mm256_mullo_epi16(_mm256_srl_epi32(
+                _mm256_and_si256(px, mask), count), scale);
+        x = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, one),
+                _mm256_srli_epi16(x, 8)), 8);
+        px = _mm256_or_si256(_mm256_andnot_si256(mask, px),
+                _mm256_sll_epi32(x, count));
+        _mm256_storeu_si256((__m256i *) (row + i), px);
+    }
+
+    pixel_scalar_alpha(row + i, num - i, alpha, shift);
+}
+
+#endif
+
+/**
+ * All the available pixel kernels, fastest first.
+ */
+static const pixel_kernels_t pixel_kernels_list[] = {
+#ifdef PIXEL_X86
+    {"AVX2", pixel_avx2_supported, pixel_avx2_effect, pixel_avx2_alpha},
+    {"SSE2", pixel_sse2_supported, pixel_sse2_effect, pixel_sse2_alpha},
+#endif
+    {"scalar", pixel_scalar_supported, pixel_scalar_effect, pixel_scalar_alpha}
+};
+
+/**
+ * The pixel kernels in use.
+ */
+static const pixel_kernels_t *pixel_kernels =
+        &pixel_kernels_list[arraysize(pixel_kernels_list) - 1];
+
+/**
+ * Select the fastest pixel kernels supported by the CPU.
+ */
+void pixel_init(void)
+{
+    for (size_t i = 0; i < arraysize(pixel_kernels_list); i++) {
+        if (pixel_kernels_list[i].supported()) {
+            pixel_kernels = &pixel_kernels_list[i];
+            break;
+        }
+    }
+
+    LOG(INFO, "Using %s pixel kernels", pixel_kernels->name);
+}
+
+#ifdef HAVE_SELFTEST
+/**
+ * Get the number of sets of pixel kernels, including the ones the CPU does
+ * not support.
+ * @return
+ * The number of sets of pixel kernels.
+ */
+size_t pixel_kernels_num(void)
+{
+    return arraysize(pixel_kernels_list);
+}
+
+/**
+ * Use the specified set of pixel kernels instead of the fastest one, so
+ * that each set can be checked; pixel_init() selects the fastest one
+ * again.
+ * @param idx
+ * Index of the set of pixel kernels, below pixel_kernels_num().
+ * @return
+ * Name of the kernels, NULL if the CPU does not support them.
+ */
+const char *pixel_kernels_select(size_t idx)
+{
+    HARD_ASSERT(idx < arraysize(pixel_kernels_list));
+
+    if (!pixel_kernels_list[idx].supported()) {
+        return NULL;
+    }
+
+    pixel_kernels = &pixel_kernels_list[idx];
+    return pixel_kernels->name;
+}
+#endif
+
+/**
+ * Apply a color effect to a surface using the specified kernels.
+ * @param kernels
+ * The kernels.
+ * @param surface
+ * The surface; must be in the RGBA8888 format.
+ * @param effect
+ * The effect.
+ */
+static void pixel_kernels_effect(const pixel_kernels_t *kernels,
+        SDL_Surface *surface, pixel_effect_t effect)
+{
+    SDL_LockSurface(surface);
+
+    for (int y = 0; y < surface->h; y++) {
+        kernels->effect((uint32_t *) ((uint8_t *) surface->pixels +
+                y * surface->pitch), surface->w, effect);
+    }
+
+    SDL_UnlockSurface(surface);
+}
+
+/**
+ * Scale the alpha channel of a surface using the specified kernels.
+ * @param kernels
+ * The kernels.
+ * @param surface
+ * The surface.
+ * @param alpha
+ * Alpha value to scale by.
+ * @return
+ * False if the surface is not in a 32-bit format with an 8-bit alpha
+ * channel, true otherwise.
+ */
+static bool pixel_kernels_alpha(const pixel_kernels_t *kernels,
+        SDL_Surface *surface, uint8_t alpha)
+{
+    SDL_PixelFormat *fmt = surface->format;
+
+    if (fmt->BytesPerPixel != 4 || fmt->Ashift % 8 != 0 ||
+            fmt->Amask != (uint32_t) 0xff << fmt->Ashift) {
+        return false;
+    }
+
+    SDL_LockSurface(surface);
+
+    for (int y = 0; y < surface->h; y++) {
+        kernels->alpha((uint32_t *) ((uint8_t *) surface->pixels +
+                y * surface->pitch), surface->w, alpha, fmt->Ashift);
+    }
+
+    SDL_UnlockSurface(surface);
+    return true;
+}
+
+/**
+ * Apply a color effect to a surface.
+ * @param surface
+ * The surface; must be in the RGBA8888 format.
+ * @param effect
+ * The effect.
+ */
+void pixel_effect_surface(SDL_Surface *surface, pixel_effect_t effect)
+{
+    HARD_ASSERT(surface != NULL);
+    HARD_ASSERT(surface->format->format == SDL_PIXELFORMAT_RGBA8888);
+
+    pixel_kernels_effect(pixel_kernels, surface, effect);
+}
+
+/**
+ * Apply a color effect to a single color, the same way it is applied to
+ * surfaces.
+ * @param color
+ * The color.
+ * @param effect
+ * The effect.
+ * @return
+ * The color with the effect applied.
+ */
+SDL_Color pixel_effect_color(SDL_Color color, pixel_effect_t effect)
+{
+    uint32_t px = ((uint32_t) color.r << 24) | ((uint32_t) color.g << 16) |
+            ((uint32_t) color.b << 8) | color.a;
+    pixel_scalar_effect(&px, 1, effect);
+
+    color.r = px >> 24;
+    color.g = (px >> 16) & 0xff;
+    color.b = (px >> 8) & 0xff;
+    return color;
+}
+
+/**
+ * Scale the alpha channel of a surface.
+ * @param surface
+ * The surface.
+ * @param alpha
+ * Alpha value to scale by.
+ * @return
+ * False if the surface is not in a 32-bit format with an 8-bit alpha
+ * channel, in which case nothing is done, true otherwise.
+ */
+bool pixel_alpha_surface(SDL_Surface *surface, uint8_t alpha)
+{
+    HARD_ASSERT(surface != NULL);
+
+    return pixel_kernels_alpha(pixel_kernels, surface, alpha);
+}
+
+/**
+ * Light a row of 32-bit pixels, as the last step of drawing the map.
+ * @param row
+ * The pixels.
+ * @param light
+ * Light of each pixel: how much to darken it, from 0 (not at all) to 255
+ * (black), or ::PIXEL_LIGHT_FOW to apply the fog of war effect instead.
+ * @param num
+ * Number of pixels.
+ * @param fmt
+ * Format of the pixels; must be 32-bit with 8-bit color channels.
+ */
+void pixel_light_row(uint32_t *row, const uint16_t *light, size_t num,
+        const SDL_PixelFormat *fmt)
+{
+    HARD_ASSERT(row != NULL);
+    HARD_ASSERT(light != NULL);
+    HARD_ASSERT(fmt != NULL);
+
+    uint32_t color_mask = fmt->Rmask | fmt->Gmask | fmt->Bmask;
+
+    for (size_t i = 0; i < num; i++) {
+        if (light[i] == 0) {
+            continue;
+        }
+
+        uint32_t px = row[i];
+        uint32_t r = (px >> fmt->Rshift) & 0xff;
+        uint32_t g = (px >> fmt->Gshift) & 0xff;
+        uint32_t b = (px >> fmt->Bshift) & 0xff;
+
+        if (light[i] == PIXEL_LIGHT_FOW) {
+            r = (PIXEL_LUM_R * r + PIXEL_LUM_G * g + PIXEL_LUM_B * b) >> 15;
+            r = g = (r * PIXEL_FOW_SCALE) >> 8;
+            b = r + PIXEL_FOW_BLUE;
+        } else {
+            uint32_t scale = 255 - light[i];
+            r = pixel_scale(r, scale);
+            g = pixel_scale(g, scale);
+            b = pixel_scale(b, scale);
+        }
+
+        row[i] = (px & ~color_mask) | (r << fmt->Rshift) |
+                (g << fmt->Gshift) | (b << fmt->Bshift);
+    }
+}
+
+/**
+ * Calculate the source coordinates sampled for each destination coordinate
+ * along one axis of a ::pixel_scaler_t.
+ * @param src
+ * Will contain the first source coordinate of each destination coordinate.
+ * @param weights
+ * If not NULL, will contain the weight of the next source coordinate, from
+ * 0 to 256, for smooth scaling.
+ * @param src_size
+ * Source size.
+ * @param dst_size
+ * Destination size.
+ */
+static void pixel_scaler_axis(int *src, uint16_t *weights, int src_size,
+        int dst_size)
+{
+    for (int i = 0; i < dst_size; i++) {
+        if (weights == NULL) {
+            src[i] = (int) ((int64_t) i * src_size / dst_size);
+            continue;
+        }
+
+        /* 16.16 fixed point position, spanning the source from the first
+         * to the last pixel. */
+        int64_t pos = (int64_t) i * (src_size - 1) * 65536 / dst_size;
+        src[i] = pos >> 16;
+        weights[i] = ((pos & 0xffff) + 128) >> 8;
+    }
+}
+
+/**
+ * Prepare a scaler for scaling surfaces of the specified size. Nothing is
+ * done if the scaler is already prepared for the same sizes.
+ * @param scaler
+ * The scaler; must be zero-initialized before the first call.
+ * @param src_w
+ * Source width.
+ * @param src_h
+ * Source height.
+ * @param dst_w
+ * Destination width.
+ * @param dst_h
+ * Destination height.
+ * @param smooth
+ * Whether to interpolate the pixels, instead of picking the nearest ones.
+ * @return
+ * True if the scaler changed, false otherwise.
+ */
+bool pixel_scaler_setup(pixel_scaler_t *scaler, int src_w, int src_h,
+        int dst_w, int dst_h, bool smooth)
+{
+    HARD_ASSERT(scaler != NULL);
+    HARD_ASSERT(src_w > 0 && src_h > 0 && dst_w > 0 && dst_h > 0);
+
+    if (scaler->cols != NULL && scaler->src_w == src_w &&
+            scaler->src_h == src_h && scaler->dst_w == dst_w &&
+            scaler->dst_h == dst_h && scaler->smooth == smooth) {
+        return false;
+    }
+
+    pixel_scaler_free(scaler);
+
+    scaler->src_w = src_w;
+    scaler->src_h = src_h;
+    scaler->dst_w = dst_w;
+    scaler->dst_h = dst_h;
+    scaler->smooth = smooth;
+    scaler->cols = emalloc(sizeof(*scaler->cols) * dst_w);
+    scaler->rows = emalloc(sizeof(*scaler->rows) * dst_h);
+
+    if (smooth) {
+        scaler->col_weights = emalloc(sizeof(*scaler->col_weights) * dst_w);
+        scaler->row_weights = emalloc(sizeof(*scaler->row_weights) * dst_h);
+    }
+
+    pixel_scaler_axis(scaler->cols, scaler->col_weights, src_w, dst_w);
+    pixel_scaler_axis(scaler->rows, scaler->row_weights, src_h, dst_h);
+    return true;
+}
+
+/**
+ * Free the data of a scaler; it can be prepared again afterwards.
+ * @param scaler
+ * The scaler.
+ */
+void pixel_scaler_free(pixel_scaler_t *scaler)
+{
+    HARD_ASSERT(scaler != NULL);
+
+    if (scaler->cols != NULL) {
+        efree(scaler->cols);
+        efree(scaler->rows);
+    }
+
+    if (scaler->col_weights != NULL) {
+        efree(scaler->col_weights);
+        efree(scaler->row_weights);
+    }
+
+    memset(scaler, 0, sizeof(*scaler));
+}
+
+/**
+ * Find the range of destination coordinates along one axis of a scaler
+ * that sample any of the specified source coordinates.
+ * @param src
+ * First source coordinate of each destination coordinate.
+ * @param dst_size
+ * Destination size.
+ * @param smooth
+ * Whether the next source coordinate is sampled as well.
+ * @param start
+ * First source coordinate.
+ * @param end
+ * Source coordinate after the last one.
+ * @param[out] dst_start
+ * Will contain the first destination coordinate.
+ * @param[out] dst_end
+ * Will contain the destination coordinate after the last one.
+ */
+static void pixel_scaler_range(const int *src, int dst_size, bool smooth,
+        int start, int end, int *dst_start, int *dst_end)
+{
+    int i = 0;
+
+    while (i < dst_size && src[i] + (smooth ? 1 : 0) < start) {
+        i++;
+    }
+
+    *dst_start = i;
+
+    while (i < dst_size && src[i] < end) {
+        i++;
+    }
+
+    *dst_end = i;
+}
+
+/**
+ * Interpolate between two 32-bit pixels, each 8-bit channel separately.
+ * @param a
+ * The first pixel.
+ * @param b
+ * The second pixel.
+ * @param weight
+ * Weight of the second pixel, from 0 to 256.
+ * @return
+ * The interpolated pixel.
+ */
+static inline uint32_t pixel_lerp(uint32_t a, uint32_t b, uint32_t weight)
+{
+    uint32_t rb = ((a & 0x00ff00ff) * (256 - weight) +
+            (b & 0x00ff00ff) * weight) >> 8;
+    uint32_t ag = ((a >> 8) & 0x00ff00ff) * (256 - weight) +
+            ((b >> 8) & 0x00ff00ff) * weight;
+    return (rb & 0x00ff00ff) | (ag & 0xff00ff00);
+}
+
+/**
+ * Scale a surface, or only the part of it affected by a changed area of the
+ * source surface, using a prepared scaler.
+ *
+ * Each destination pixel only depends on the source pixels it samples, so
+ * after a part of the source changes, updating the affected part of the
+ * destination gives the same result as scaling the whole surface again.
+ * @param scaler
+ * The scaler, prepared for the sizes of the surfaces.
+ * @param src
+ * Source surface; must use 32-bit pixels.
+ * @param dst
+ * Destination surface; must use the same format as @p src.
+ * @param box
+ * Area of the source surface that changed; if NULL, the whole surface is
+ * scaled.
+ */
+void pixel_scaler_scale(const pixel_scaler_t *scaler, SDL_Surface *src,
+        SDL_Surface *dst, const SDL_Rect *box)
+{
+    HARD_ASSERT(scaler != NULL);
+    HARD_ASSERT(src != NULL);
+    HARD_ASSERT(dst != NULL);
+    HARD_ASSERT(src->w == scaler->src_w && src->h == scaler->src_h);
+    HARD_ASSERT(dst->w == scaler->dst_w && dst->h == scaler->dst_h);
+    HARD_ASSERT(src->format->BytesPerPixel == 4);
+    HARD_ASSERT(dst->format->BytesPerPixel == 4);
+
+    int x_start = 0, x_end = scaler->dst_w, y_start = 0, y_end = scaler->dst_h;
+
+    if (box != NULL) {
+        pixel_scaler_range(scaler->cols, scaler->dst_w, scaler->smooth,
+                box->x, box->x + box->w, &x_start, &x_end);
+        pixel_scaler_range(scaler->rows, scaler->dst_h, scaler->smooth,
+                box->y, box->y + box->h, &y_start, &y_end);
+    }
+
+    if (x_start >= x_end || y_start >= y_end) {
+        return;
+    }
+
+    const uint8_t *src_pixels = src->pixels;
+    uint8_t *dst_pixels = dst->pixels;
+
+    for (int y = y_start; y < y_end; y++) {
+        uint32_t *dst_row = (uint32_t *) (dst_pixels + y * dst->pitch);
+        const uint32_t *row = (const uint32_t *) (src_pixels +
+                scaler->rows[y] * src->pitch);
+
+        if (!scaler->smooth) {
+            for (int x = x_start; x < x_end; x++) {
+                dst_row[x] = row[scaler->cols[x]];
+            }
+
+            continue;
+        }
+
+        int next_y = MIN(scaler->rows[y] + 1, src->h - 1);
+        const uint32_t *next_row = (const uint32_t *) (src_pixels +
+                next_y * src->pitch);
+        uint32_t weight_y = scaler->row_weights[y];
+
+        for (int x = x_start; x < x_end; x++) {
+            int col = scaler->cols[x];
+            int next_col = MIN(col + 1, src->w - 1);
+            uint32_t weight_x = scaler->col_weights[x];
+            uint32_t top = pixel_lerp(row[col], row[next_col], weight_x);
+            uint32_t bottom = pixel_lerp(next_row[col], next_row[next_col],
+                    weight_x);
+            dst_row[x] = pixel_lerp(top, bottom, weight_y);
+        }
+    }
+}
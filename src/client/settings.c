@@ -512,6 +512,11 @@ static void setting_apply_runtime(int cat, int setting)
             }
 
             break;
+
+        case OPT_SMOOTH_LIGHTING:
+        case OPT_PRECISE_MOUSE:
+            map_redraw_flag = 1;
+            break;
         }
 
         break;
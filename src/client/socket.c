@@ -8,13 +8,136 @@
 #include <network_graph.h>
 #include <toolkit/socket_crypto.h>
 
+/**
+ * Size of the buffer the reader thread reads incoming data into.
+ */
+#define SOCKET_READ_BUF_SIZE (64 * 1024)
+
+/**
+ * Commands with a body at least this big that have not been received in full
+ * yet will have the rest of their body read directly into their command
+ * buffer, instead of going through the read buffer first.
+ */
+#define SOCKET_READ_DIRECT_MIN (4 * 1024)
+
+/**
+ * Initial size of the buffer the writer thread coalesces outgoing packets
+ * into. Once this much data has been staged, it is flushed regardless of
+ * ::output_flush_delay.
+ */
+#define SOCKET_WRITE_BUF_SIZE (16 * 1024)
+
+/**
+ * Number of command buffer size classes.
+ */
+#define COMMAND_BUFFER_POOLS 5
+
+/**
+ * Pool of command buffers of one size class.
+ */
+typedef struct command_buffer_pool {
+    /** Name of the pool. */
+    const char *name;
+
+    /** Size of the buffers' data, including the null terminator. */
+    size_t size;
+
+    /** How many buffers to allocate at a time. */
+    size_t expand;
+
+    /** The memory pool. */
+    mempool_struct *pool;
+
+    /** Number of buffers requested from the pool. */
+    uint64_t gets;
+
+    /** Number of requests served by a previously returned buffer. */
+    uint64_t hits;
+
+    /** Number of buffers currently in use. */
+    size_t used;
+
+    /** Highest number of buffers in use at the same time. */
+    size_t used_peak;
+} command_buffer_pool_t;
+
+/**
+ * The command buffer pools, sorted by size. Commands too large for any of
+ * them are allocated directly.
+ */
+static command_buffer_pool_t command_buffer_pools[COMMAND_BUFFER_POOLS] = {
+    {"command buffers (64)", 64, 128, NULL, 0, 0, 0, 0},
+    {"command buffers (256)", 256, 64, NULL, 0, 0, 0, 0},
+    {"command buffers (1024)", 1024, 32, NULL, 0, 0, 0, 0},
+    {"command buffers (4096)", 4096, 8, NULL, 0, 0, 0, 0},
+    {"command buffers (16384)", 16384, 4, NULL, 0, 0, 0, 0},
+};
+
+/**
+ * Lock protecting the command buffer pools and their statistics; buffers are
+ * allocated and freed by all of the socket threads and the main thread.
+ */
+static SDL_SpinLock command_buffer_pools_lock;
+/** Bytes used by command buffers currently in use. */
+static size_t command_buffer_bytes;
+/** Highest number of bytes used by command buffers at the same time. */
+static size_t command_buffer_bytes_peak;
+/** Number of command buffers too large for any pool. */
+static uint64_t command_buffer_oversized;
+
+/**
+ * Lock-free single-producer/single-consumer command queue.
+ *
+ * The producer pushes commands onto a lock-free stack. The consumer takes
+ * everything from the stack with a single atomic exchange and reverses it
+ * into its own private FIFO list, so a whole burst of commands is drained
+ * without any lock traffic.
+ */
+typedef struct command_queue {
+    /**
+     * Stack of pushed commands, most recent first; linked using the 'next'
+     * member. Only accessed atomically.
+     */
+    void *pending;
+
+    /** First command in the consumer's list. */
+    command_buffer *start;
+
+    /** Last command in the consumer's list. */
+    command_buffer *end;
+} command_queue_t;
+
 static SDL_Thread *input_thread;
-static SDL_mutex *input_buffer_mutex;
-static SDL_cond *input_buffer_cond;
+/**
+ * Commands received from the server; produced by the reader thread, consumed
+ * by the main thread.
+ */
+static command_queue_t input_queue;
+/**
+ * Semaphore the reader thread waits on after queueing a
+ * @ref COMMAND_BUFFER_RAW command, until the main thread has handled it.
+ */
+static SDL_sem *input_sem;
 
 static SDL_Thread *output_thread;
-static SDL_mutex *output_buffer_mutex;
-static SDL_cond *output_buffer_cond;
+/**
+ * Commands to send to the server; produced by the main thread, consumed by
+ * the writer thread.
+ */
+static command_queue_t output_queue;
+/**
+ * Semaphore the writer thread sleeps on when it has nothing to do.
+ */
+static SDL_sem *output_sem;
+/**
+ * Set while the writer thread is (about to go) sleeping on ::output_sem.
+ */
+static SDL_atomic_t output_idle;
+/**
+ * How long, in milliseconds, the writer thread may hold back staged data
+ * waiting for more packets to send in the same write.
+ */
+static uint32_t output_flush_delay;
 
 /**
  * Mutex to protect socket deinitialization.
@@ -26,9 +149,50 @@ static SDL_mutex *socket_mutex;
  */
 static int abort_thread = 0;
 
-/* start is the first waiting item in queue, end is the most recent enqueued */
-static command_buffer *input_queue_start = NULL, *input_queue_end = NULL;
-static command_buffer *output_queue_start = NULL, *output_queue_end = NULL;
+
+/**
+ * Create the command buffer pools.
+ */
+static void command_buffer_pools_init(void)
+{
+    toolkit_import(mempool);
+
+    for (size_t i = 0; i < COMMAND_BUFFER_POOLS; i++) {
+        command_buffer_pool_t *pool = &command_buffer_pools[i];
+        pool->pool = mempool_create(pool->name, pool->expand,
+                sizeof(command_buffer) + pool->size, MEMPOOL_ALLOW_FREEING,
+                NULL, NULL, NULL, NULL);
+    }
+}
+
+/**
+ * Log statistics about the command buffer pools, so that the size classes
+ * can be tuned.
+ */
+static void command_buffer_pools_stats(void)
+{
+    uint64_t gets = 0, hits = 0;
+
+    SDL_AtomicLock(&command_buffer_pools_lock);
+
+    for (size_t i = 0; i < COMMAND_BUFFER_POOLS; i++) {
+        command_buffer_pool_t *pool = &command_buffer_pools[i];
+        LOG(INFO, "Pool %s: %" PRIu64 " requests, %.1f%% hit rate, "
+                "peak %" PRIu64 " buffers in use", pool->name, pool->gets,
+                pool->gets != 0 ? pool->hits * 100.0 / pool->gets : 0.0,
+                (uint64_t) pool->used_peak);
+        gets += pool->gets;
+        hits += pool->hits;
+    }
+
+    LOG(INFO, "Command buffers: %.1f%% pool hit rate, %" PRIu64 " oversized, "
+            "peak %" PRIu64 " bytes in use",
+            gets + command_buffer_oversized != 0 ? hits * 100.0 /
+            (gets + command_buffer_oversized) : 0.0, command_buffer_oversized,
+            (uint64_t) command_buffer_bytes_peak);
+
+    SDL_AtomicUnlock(&command_buffer_pools_lock);
+}
 
 /**
  * Create a new command buffer of the given size, copying the data buffer
@@ -43,10 +207,55 @@ static command_buffer *output_queue_start = NULL, *output_queue_end = NULL;
  */
 command_buffer *command_buffer_new(size_t len, uint8_t *data)
 {
-    command_buffer *buf = emalloc(sizeof(command_buffer) + len + 1);
+    command_buffer *buf = NULL;
+    size_t size = len + 1;
+
+    SDL_AtomicLock(&command_buffer_pools_lock);
+
+    for (size_t i = 0; i < COMMAND_BUFFER_POOLS; i++) {
+        command_buffer_pool_t *pool = &command_buffer_pools[i];
+
+        if (pool->pool == NULL || size > pool->size) {
+            continue;
+        }
+
+        buf = mempool_get(pool->pool);
+        size = pool->size;
+        pool->gets++;
+
+        if (pool->used < pool->used_peak) {
+            pool->hits++;
+        }
+
+        if (++pool->used > pool->used_peak) {
+            pool->used_peak = pool->used;
+        }
+
+        break;
+    }
+
+    if (buf == NULL) {
+        command_buffer_oversized++;
+    }
+
+    command_buffer_bytes += sizeof(command_buffer) + size;
+
+    if (command_buffer_bytes > command_buffer_bytes_peak) {
+        command_buffer_bytes_peak = command_buffer_bytes;
+    }
+
+    SDL_AtomicUnlock(&command_buffer_pools_lock);
+
+    if (buf == NULL) {
+        buf = emalloc(sizeof(command_buffer) + size);
+    }
 
     buf->next = buf->prev = NULL;
+    buf->size = size;
     buf->len = len;
+    buf->state = COMMAND_BUFFER_READY;
+    buf->ticks = 0;
+    buf->packet = NULL;
 
     if (data) {
         memcpy(buf->data, data, len);
@@ -63,26 +272,30 @@ command_buffer *command_buffer_new(size_t len, uint8_t *data)
  */
 void command_buffer_free(command_buffer *buf)
 {
-    efree(buf);
-}
+    if (buf->packet != NULL) {
+        packet_free(buf->packet);
+    }
 
-/**
- * Enqueue a command buffer last in a queue.
- */
-static void command_buffer_enqueue(command_buffer *buf, command_buffer **queue_start, command_buffer **queue_end)
-{
-    buf->next = NULL;
-    buf->prev = *queue_end;
+    SDL_AtomicLock(&command_buffer_pools_lock);
 
-    if (*queue_start == NULL) {
-        *queue_start = buf;
-    }
+    command_buffer_bytes -= sizeof(command_buffer) + buf->size;
+
+    for (size_t i = 0; i < COMMAND_BUFFER_POOLS; i++) {
+        command_buffer_pool_t *pool = &command_buffer_pools[i];
 
-    if (buf->prev) {
-        buf->prev->next = buf;
+        if (pool->pool != NULL && buf->size == pool->size) {
+            pool->used--;
+            mempool_return(pool->pool, buf);
+            buf = NULL;
+            break;
+        }
     }
 
-    *queue_end = buf;
+    SDL_AtomicUnlock(&command_buffer_pools_lock);
+
+    if (buf != NULL) {
+        efree(buf);
+    }
 }
 
 /**
@@ -124,6 +337,126 @@ static command_buffer *command_buffer_dequeue(command_buffer **queue_start, comm
     return buf;
 }
 
+/**
+ * Push a list of commands onto a command queue. Must only be called by the
+ * producer of the queue.
+ * @param queue
+ * The queue.
+ * @param top
+ * Most recent command of the list; the commands are linked from the most
+ * recent one to the oldest one using the 'next' member.
+ * @param bottom
+ * Oldest command of the list.
+ */
+static void command_queue_push(command_queue_t *queue, command_buffer *top, command_buffer *bottom)
+{
+    void *pending;
+
+    do {
+        pending = SDL_AtomicGetPtr(&queue->pending);
+        bottom->next = pending;
+    } while (!SDL_AtomicCASPtr(&queue->pending, pending, top));
+}
+
+/**
+ * Move all pushed commands of a queue into the consumer's list. Must only
+ * be called by the consumer of the queue.
+ * @param queue
+ * The queue.
+ */
+static void command_queue_take(command_queue_t *queue)
+{
+    command_buffer *buf, *next, *start = NULL, *end = NULL;
+
+    if (SDL_AtomicGetPtr(&queue->pending) == NULL) {
+        return;
+    }
+
+    /* Reverse the stack to get the commands in the order they were
+     * pushed. */
+    for (buf = SDL_AtomicSetPtr(&queue->pending, NULL); buf; buf = next) {
+        next = buf->next;
+        command_buffer_enqueue_first(buf, &start, &end);
+    }
+
+    if (queue->end != NULL) {
+        queue->end->next = start;
+        start->prev = queue->end;
+    } else {
+        queue->start = start;
+    }
+
+    queue->end = end;
+}
+
+/**
+ * Remove the first command from a queue. Must only be called by the
+ * consumer of the queue.
+ * @param queue
+ * The queue.
+ * @return
+ * The command, NULL if the queue is empty.
+ */
+static command_buffer *command_queue_pop(command_queue_t *queue)
+{
+    if (queue->start == NULL) {
+        command_queue_take(queue);
+    }
+
+    return command_buffer_dequeue(&queue->start, &queue->end);
+}
+
+/**
+ * Free all commands in a queue. Neither the producer nor the consumer may
+ * be running.
+ * @param queue
+ * The queue.
+ */
+static void command_queue_clear(command_queue_t *queue)
+{
+    command_buffer *buf;
+
+    while ((buf = command_queue_pop(queue)) != NULL) {
+        command_buffer_free(buf);
+    }
+}
+
+/**
+ * Wake up the writer thread, if it is sleeping.
+ */
+static void output_thread_wakeup(void)
+{
+    if (SDL_AtomicCAS(&output_idle, 1, 0)) {
+        SDL_SemPost(output_sem);
+    }
+}
+
+/**
+ * Check whether the crypto exchange is in progress on the client socket.
+ *
+ * While it is, commands cannot be decrypted until all the previous commands
+ * have been handled by the main thread, and packets must be encrypted in the
+ * order they are sent, since both affect the crypto state.
+ * @return
+ * True if the crypto exchange is in progress, false otherwise.
+ */
+static bool socket_crypto_pending(void)
+{
+    if (!socket_is_secure(csocket.sc)) {
+        return false;
+    }
+
+    socket_crypto_t *crypto = socket_get_crypto(csocket.sc);
+    return crypto == NULL || !socket_crypto_is_done(crypto);
+}
+
+/**
+ * Send a packet to the server.
+ *
+ * The packet is normally encrypted and serialized by the writer thread.
+ * @param packet
+ * The packet; will be freed.
+ */
 void socket_send_packet(struct packet_struct *packet)
 {
     HARD_ASSERT(packet != NULL);
@@ -133,8 +466,11 @@ void socket_send_packet(struct packet_struct *packet)
         return;
     }
 
-    packet_struct *packet_meta = packet_new(0, 4, 0);
-    if (socket_is_secure(csocket.sc)) {
+    command_buffer *buf;
+
+    if (socket_crypto_pending()) {
+        /* The crypto state may still change, so encrypt the packet now. */
+        packet_struct *packet_meta = packet_new(0, 4, 0);
         bool checksum_only = !socket_crypto_client_should_encrypt(packet->type);
         packet = socket_crypto_encrypt(csocket.sc,
                                        packet,
@@ -145,23 +481,20 @@ void socket_send_packet(struct packet_struct *packet)
             cpl.state = ST_START;
             return;
         }
+
+        buf = command_buffer_new(packet_meta->len + packet->len, NULL);
+        memcpy(buf->data, packet_meta->data, packet_meta->len);
+        memcpy(buf->data + packet_meta->len, packet->data, packet->len);
+        packet_free(packet_meta);
+        packet_free(packet);
     } else {
-        packet_append_uint16(packet_meta, packet->len + 1);
-        packet_append_uint8(packet_meta, packet->type);
-    }
-
-    command_buffer *buf1 = command_buffer_new(packet_meta->len,
-                                              packet_meta->data);
-    packet_free(packet_meta);
-    command_buffer *buf2 = command_buffer_new(packet->len,
-                                              packet->data);
-    packet_free(packet);
-
-    SDL_LockMutex(output_buffer_mutex);
-    command_buffer_enqueue(buf1, &output_queue_start, &output_queue_end);
-    command_buffer_enqueue(buf2, &output_queue_start, &output_queue_end);
-    SDL_CondSignal(output_buffer_cond);
-    SDL_UnlockMutex(output_buffer_mutex);
+        buf = command_buffer_new(0, NULL);
+        buf->packet = packet;
+    }
+
+    buf->next = NULL;
+    command_queue_push(&output_queue, buf, buf);
+    output_thread_wakeup();
 }
 
 /**
@@ -172,153 +505,502 @@ void socket_send_packet(struct packet_struct *packet)
  */
 command_buffer *get_next_input_command(void)
 {
-    command_buffer *buf;
+    return command_queue_pop(&input_queue);
+}
+
+/**
+ * Inflate a compressed command.
+ * @param cmd
+ * The compressed command.
+ * @return
+ * New command buffer with the inflated command, NULL on failure.
+ */
+static command_buffer *socket_command_inflate(command_buffer *cmd)
+{
+    size_t pos = 1;
+    uint8_t type = packet_to_uint8(cmd->data, cmd->len, &pos);
+    uLongf ucomp_len = packet_to_uint32(cmd->data, cmd->len, &pos);
+
+    /* Inflate straight into the buffer the command will be dispatched
+     * from. */
+    command_buffer *buf = command_buffer_new(ucomp_len + 1, NULL);
+    buf->data[0] = type;
+
+    if (uncompress((Bytef *) buf->data + 1, &ucomp_len,
+            (const Bytef *) cmd->data + pos, (uLong) cmd->len - pos) != Z_OK) {
+        command_buffer_free(buf);
+        return NULL;
+    }
 
-    SDL_LockMutex(input_buffer_mutex);
-    buf = command_buffer_dequeue(&input_queue_start, &input_queue_end);
-    SDL_UnlockMutex(input_buffer_mutex);
+    buf->len = ucomp_len + 1;
+    buf->data[buf->len] = '\0';
     return buf;
 }
 
-void add_input_command(command_buffer *buf)
+/**
+ * Decrypt and decompress a command received from the server, so that it
+ * can be dispatched.
+ *
+ * As before, an inflated command goes through the whole process again.
+ * @param cmd
+ * The command; must not be used afterwards.
+ * @return
+ * The command to dispatch, NULL if it should be dropped. If decryption
+ * failed, the command's state is set to @ref COMMAND_BUFFER_FAILED.
+ */
+command_buffer *socket_command_prepare(command_buffer *cmd)
 {
-    SDL_LockMutex(input_buffer_mutex);
-    command_buffer_enqueue_first(buf, &input_queue_start, &input_queue_end);
-    SDL_CondSignal(input_buffer_cond);
-    SDL_UnlockMutex(input_buffer_mutex);
+    while (true) {
+        if (socket_is_secure(csocket.sc)) {
+            uint8_t *decrypted_data;
+            size_t decrypted_len;
+
+            if (!socket_crypto_decrypt(csocket.sc, cmd->data, cmd->len,
+                    &decrypted_data, &decrypted_len)) {
+                cmd->len = 0;
+                cmd->data[0] = '\0';
+                cmd->state = COMMAND_BUFFER_FAILED;
+                return cmd;
+            }
+
+            if (decrypted_len <= cmd->len) {
+                memcpy(cmd->data, decrypted_data, decrypted_len);
+                cmd->len = decrypted_len;
+                cmd->data[cmd->len] = '\0';
+            } else {
+                command_buffer *buf = command_buffer_new(decrypted_len,
+                        decrypted_data);
+                buf->ticks = cmd->ticks;
+                command_buffer_free(cmd);
+                cmd = buf;
+            }
+
+            efree(decrypted_data);
+        }
+
+        cmd->state = COMMAND_BUFFER_READY;
+
+        if (cmd->len == 0 || cmd->data[0] != CLIENT_CMD_COMPRESSED) {
+            return cmd;
+        }
+
+        command_buffer *buf = socket_command_inflate(cmd);
+
+        if (buf != NULL) {
+            buf->ticks = cmd->ticks;
+        }
+
+        command_buffer_free(cmd);
+
+        if (buf == NULL) {
+            return NULL;
+        }
+
+        cmd = buf;
+    }
 }
 
-static int reader_thread_loop(void *dummy)
+/**
+ * Let the reader thread know that the main thread has handled a
+ * @ref COMMAND_BUFFER_RAW command.
+ */
+void socket_command_raw_done(void)
 {
-    static uint8_t *readbuf = NULL;
-    static int readbuf_size = 256;
-    int readbuf_len = 0;
-    int header_len = 0;
-    int cmd_len = -1;
+    SDL_SemPost(input_sem);
+}
 
-    if (!readbuf) {
-        readbuf = emalloc(readbuf_size);
+/**
+ * Parse a command length header.
+ *
+ * @param data
+ * Data to parse.
+ * @param len
+ * Number of bytes available in data.
+ * @param[out] header_len
+ * Will contain the length of the header (2 or 3 bytes).
+ * @param[out] cmd_len
+ * Will contain the length of the command body.
+ * @return
+ * True if the header is complete, false otherwise.
+ */
+static bool
+socket_parse_header (const uint8_t *data,
+                     size_t         len,
+                     size_t        *header_len,
+                     size_t        *cmd_len)
+{
+    if (len < 2) {
+        return false;
     }
 
-    while (!abort_thread) {
-        int toread;
+    /* Three-byte length? */
+    *header_len = (data[0] & 0x80) ? 3 : 2;
 
-        /* First, try to read a command length sequence */
-        if (readbuf_len < 2) {
-            /* Three-byte length? */
-            if (readbuf_len > 0 && (readbuf[0] & 0x80)) {
-                toread = 3 - readbuf_len;
-            } else {
-                toread = 2 - readbuf_len;
-            }
-        } else if (readbuf_len == 2 && (readbuf[0] & 0x80)) {
-            toread = 1;
-        } else {
-            /* If we have a finished header, get the packet size from it. */
-            if (readbuf_len <= 3) {
-                uint8_t *p = readbuf;
+    if (len < *header_len) {
+        return false;
+    }
 
-                header_len = (*p & 0x80) ? 3 : 2;
-                cmd_len = 0;
+    *cmd_len = 0;
 
-                if (header_len == 3) {
-                    cmd_len += ((int) (*p++) & 0x7f) << 16;
-                }
+    if (*header_len == 3) {
+        *cmd_len += ((size_t) (*data++) & 0x7f) << 16;
+    }
 
-                cmd_len += ((int) (*p++)) << 8;
-                cmd_len += ((int) (*p++));
-            }
+    *cmd_len += ((size_t) (*data++)) << 8;
+    *cmd_len += ((size_t) (*data++));
+    return true;
+}
 
-            toread = cmd_len + header_len - readbuf_len;
+/**
+ * Hand over framed commands to the main thread.
+ * @param[out] batch_top
+ * Most recent command in the batch; will be reset.
+ * @param[out] batch_bottom
+ * Oldest command in the batch; will be reset.
+ */
+static void reader_thread_flush(command_buffer **batch_top, command_buffer **batch_bottom)
+{
+    if (*batch_top == NULL) {
+        return;
+    }
 
-            if (readbuf_len + toread > readbuf_size) {
-                uint8_t *tmp = readbuf;
+    if (abort_thread) {
+        while (*batch_top != NULL) {
+            command_buffer *next = (*batch_top)->next;
+            command_buffer_free(*batch_top);
+            *batch_top = next;
+        }
+    } else {
+        command_queue_push(&input_queue, *batch_top, *batch_bottom);
+    }
 
-                readbuf_size = readbuf_len + toread;
-                readbuf = emalloc(readbuf_size);
-                memcpy(readbuf, tmp, readbuf_len);
-                efree(tmp);
-            }
+    *batch_top = *batch_bottom = NULL;
+}
+
+/**
+ * Handle a command framed by the reader thread: decrypt and decompress it
+ * and add it to the batch of commands to hand over to the main thread.
+ * @param buf
+ * The command.
+ * @param[out] batch_top
+ * Most recent command in the batch.
+ * @param[out] batch_bottom
+ * Oldest command in the batch.
+ */
+static void reader_thread_command(command_buffer *buf, command_buffer **batch_top, command_buffer **batch_bottom)
+{
+    buf->ticks = SDL_GetPerformanceCounter();
+
+    if (socket_crypto_pending()) {
+        /* The main thread has to handle this one itself, and we must wait
+         * until it does, as it may change the crypto state. */
+        reader_thread_flush(batch_top, batch_bottom);
+
+        if (abort_thread) {
+            command_buffer_free(buf);
+            return;
         }
 
+        buf->state = COMMAND_BUFFER_RAW;
+        buf->next = NULL;
+        command_queue_push(&input_queue, buf, buf);
+        SDL_SemWait(input_sem);
+        return;
+    }
+
+    buf = socket_command_prepare(buf);
+
+    if (buf == NULL) {
+        return;
+    }
+
+    buf->next = *batch_top;
+    *batch_top = buf;
+
+    if (*batch_bottom == NULL) {
+        *batch_bottom = buf;
+    }
+}
+
+/**
+ * Worker for the reader thread.
+ *
+ * Reads incoming data in large chunks and frames as many complete commands
+ * as are available after each read. The commands are decrypted and
+ * decompressed here, and handed over to the main thread in a single batch.
+ * Large commands that have only been partially received have the rest of
+ * their body read directly into their command buffer.
+ */
+static int reader_thread_loop(void *dummy)
+{
+    uint8_t *readbuf = emalloc(SOCKET_READ_BUF_SIZE);
+    /* Start and end of the unprocessed data in readbuf. */
+    size_t start = 0, end = 0;
+    /* Partially received large command, if any. */
+    command_buffer *partial = NULL;
+    size_t partial_len = 0;
+
+    while (!abort_thread) {
         size_t amt;
-        bool success = socket_read(csocket.sc, (void *) (readbuf + readbuf_len),
-                toread, &amt);
+        bool success;
+
+        if (partial != NULL) {
+            success = socket_read(csocket.sc, partial->data + partial_len,
+                    partial->len - partial_len, &amt);
+        } else {
+            success = socket_read(csocket.sc, readbuf + end,
+                    SOCKET_READ_BUF_SIZE - end, &amt);
+        }
+
         if (!success) {
             break;
         }
 
-        readbuf_len += amt;
         network_graph_update(NETWORK_GRAPH_TYPE_GAME, NETWORK_GRAPH_TRAFFIC_RX,
                 amt);
 
-        /* Finished with a command? */
-        if (readbuf_len == cmd_len + header_len && !abort_thread) {
-            command_buffer *buf = command_buffer_new(readbuf_len - header_len,
-                    readbuf + header_len);
+        /* Framed commands, most recent first. */
+        command_buffer *batch_top = NULL, *batch_bottom = NULL;
+
+        if (partial != NULL) {
+            partial_len += amt;
 
-            SDL_LockMutex(input_buffer_mutex);
-            command_buffer_enqueue(buf, &input_queue_start, &input_queue_end);
-            SDL_CondSignal(input_buffer_cond);
-            SDL_UnlockMutex(input_buffer_mutex);
+            if (partial_len != partial->len) {
+                continue;
+            }
 
-            cmd_len = -1;
-            header_len = 0;
-            readbuf_len = 0;
+            reader_thread_command(partial, &batch_top, &batch_bottom);
+            partial = NULL;
+            partial_len = 0;
+        } else {
+            end += amt;
         }
+
+        /* Frame as many commands as possible. */
+        while (partial == NULL) {
+            size_t header_len, cmd_len;
+
+            if (!socket_parse_header(readbuf + start, end - start, &header_len,
+                    &cmd_len)) {
+                break;
+            }
+
+            size_t avail = end - start - header_len;
+
+            if (avail >= cmd_len) {
+                command_buffer *buf = command_buffer_new(cmd_len,
+                        readbuf + start + header_len);
+                reader_thread_command(buf, &batch_top, &batch_bottom);
+                start += header_len + cmd_len;
+            } else if (cmd_len >= SOCKET_READ_DIRECT_MIN ||
+                    header_len + cmd_len > SOCKET_READ_BUF_SIZE) {
+                /* Read the rest of the command directly into its buffer. */
+                partial = command_buffer_new(cmd_len, NULL);
+                memcpy(partial->data, readbuf + start + header_len, avail);
+                partial_len = avail;
+                start = end;
+            } else {
+                break;
+            }
+        }
+
+        /* Move any incomplete command to the start of the buffer. */
+        if (start == end) {
+            start = end = 0;
+        } else if (start != 0) {
+            memmove(readbuf, readbuf + start, end - start);
+            end -= start;
+            start = 0;
+        }
+
+        reader_thread_flush(&batch_top, &batch_bottom);
     }
 
     client_socket_close(&csocket);
 
-    if (readbuf != NULL) {
-        efree(readbuf);
-        readbuf = NULL;
+    if (partial != NULL) {
+        command_buffer_free(partial);
     }
 
+    efree(readbuf);
+
     return -1;
 }
 
 /**
- * Worker for the writer thread. It waits for enqueued outgoing packets
- * and sends them to the server as fast as it can.
+ * Encrypt and serialize an outgoing command into the writer thread's staging
+ * buffer.
+ * @param buf
+ * The command.
+ * @param[out] staging
+ * The staging buffer; may be reallocated.
+ * @param[out] staging_size
+ * Size of the staging buffer.
+ * @param[out] staging_len
+ * Length of the data in the staging buffer.
+ * @return
+ * False on failure, true on success.
+ */
+static bool writer_thread_stage(command_buffer *buf, uint8_t **staging, size_t *staging_size, size_t *staging_len)
+{
+    packet_struct *packet = buf->packet, *packet_meta = NULL;
+    const uint8_t *header = NULL, *data = buf->data;
+    size_t header_len = 0, len = buf->len;
+
+    if (packet != NULL) {
+        buf->packet = NULL;
+        packet_meta = packet_new(0, 4, 0);
+
+        if (socket_is_secure(csocket.sc)) {
+            bool checksum_only =
+                    !socket_crypto_client_should_encrypt(packet->type);
+            packet = socket_crypto_encrypt(csocket.sc,
+                                           packet,
+                                           packet_meta,
+                                           checksum_only);
+            if (packet == NULL) {
+                /* Logging already done. */
+                return false;
+            }
+        } else {
+            packet_append_uint16(packet_meta, packet->len + 1);
+            packet_append_uint8(packet_meta, packet->type);
+        }
+
+        header = packet_meta->data;
+        header_len = packet_meta->len;
+        data = packet->data;
+        len = packet->len;
+    }
+
+    if (*staging_len + header_len + len > *staging_size) {
+        while (*staging_len + header_len + len > *staging_size) {
+            *staging_size *= 2;
+        }
+
+        *staging = erealloc(*staging, *staging_size);
+    }
+
+    if (header_len != 0) {
+        memcpy(*staging + *staging_len, header, header_len);
+        *staging_len += header_len;
+    }
+
+    memcpy(*staging + *staging_len, data, len);
+    *staging_len += len;
+
+    if (packet != NULL) {
+        packet_free(packet_meta);
+        packet_free(packet);
+    }
+
+    return true;
+}
+
+/**
+ * Write out the writer thread's staging buffer.
+ * @param staging
+ * The staging buffer.
+ * @param staging_len
+ * Length of the data in the staging buffer.
+ * @return
+ * False on failure, true on success.
+ */
+static bool writer_thread_flush(const uint8_t *staging, size_t staging_len)
+{
+    size_t written = 0;
+
+    while (written < staging_len && !abort_thread) {
+        size_t amt;
+        bool success = socket_write(csocket.sc, (const void *) (staging +
+                written), staging_len - written, &amt);
+        if (!success) {
+            return false;
+        }
+
+        written += amt;
+        network_graph_update(NETWORK_GRAPH_TYPE_GAME,
+                NETWORK_GRAPH_TRAFFIC_TX, amt);
+    }
+
+    return true;
+}
+
+/**
+ * Worker for the writer thread. It waits for enqueued outgoing packets,
+ * encrypts them, and sends them to the server.
+ *
+ * All the packets that are queued up are coalesced into a single staging
+ * buffer, which is then sent with as few writes as possible. If
+ * ::output_flush_delay is set, staged data may be held back for up to that
+ * long, so that packets sent in quick succession share the same write.
  *
  * If any error is detected, the socket is closed and the thread exits. It is
  * up to them main thread to detect this and join() the worker threads.
  */
 static int writer_thread_loop(void *dummy)
 {
-    command_buffer *buf = NULL;
+    size_t staging_size = SOCKET_WRITE_BUF_SIZE, staging_len = 0;
+    uint8_t *staging = emalloc(staging_size);
+    /* When the staged data must be flushed by. */
+    uint32_t flush_ticks = 0;
 
     while (!abort_thread) {
-        SDL_LockMutex(output_buffer_mutex);
+        command_buffer *buf = command_queue_pop(&output_queue);
 
-        while (output_queue_start == NULL && !abort_thread) {
-            SDL_CondWait(output_buffer_cond, output_buffer_mutex);
-        }
+        if (buf != NULL) {
+            if (staging_len == 0) {
+                flush_ticks = SDL_GetTicks() + output_flush_delay;
+            }
 
-        buf = command_buffer_dequeue(&output_queue_start, &output_queue_end);
-        SDL_UnlockMutex(output_buffer_mutex);
-        size_t written = 0;
+            bool success = writer_thread_stage(buf, &staging, &staging_size,
+                    &staging_len);
+            command_buffer_free(buf);
 
-        while (buf != NULL && written < buf->len && !abort_thread) {
-            size_t amt;
-            bool success = socket_write(csocket.sc, (const void *) (buf->data +
-                    written), buf->len - written, &amt);
             if (!success) {
                 break;
             }
 
-            written += amt;
-            network_graph_update(NETWORK_GRAPH_TYPE_GAME,
-                    NETWORK_GRAPH_TRAFFIC_TX, amt);
+            if (staging_len < SOCKET_WRITE_BUF_SIZE) {
+                continue;
+            }
+        } else {
+            uint32_t timeout = SDL_MUTEX_MAXWAIT;
+
+            if (staging_len != 0) {
+                uint32_t now = SDL_GetTicks();
+
+                if (SDL_TICKS_PASSED(now, flush_ticks)) {
+                    timeout = 0;
+                } else {
+                    timeout = flush_ticks - now;
+                }
+            }
+
+            if (timeout != 0) {
+                /* Announce that we're going to sleep, then check the queue
+                 * once more, in case something was pushed in the
+                 * meantime. */
+                SDL_AtomicSet(&output_idle, 1);
+
+                if (SDL_AtomicGetPtr(&output_queue.pending) == NULL &&
+                        !abort_thread) {
+                    SDL_SemWaitTimeout(output_sem, timeout);
+                }
+
+                SDL_AtomicSet(&output_idle, 0);
+                continue;
+            }
         }
 
-        if (buf != NULL) {
-            command_buffer_free(buf);
-            buf = NULL;
+        if (!writer_thread_flush(staging, staging_len)) {
+            break;
         }
+
+        staging_len = 0;
     }
 
+    efree(staging);
     client_socket_close(&csocket);
     return 0;
 }
@@ -328,15 +1010,17 @@ static int writer_thread_loop(void *dummy)
  */
 void socket_thread_start(void)
 {
-    if (input_buffer_cond == NULL) {
-        input_buffer_cond = SDL_CreateCond();
-        input_buffer_mutex = SDL_CreateMutex();
-        output_buffer_cond = SDL_CreateCond();
-        output_buffer_mutex = SDL_CreateMutex();
+    if (socket_mutex == NULL) {
+        command_buffer_pools_init();
+        input_sem = SDL_CreateSemaphore(0);
+        output_sem = SDL_CreateSemaphore(0);
         socket_mutex = SDL_CreateMutex();
     }
 
     abort_thread = 0;
+    SDL_AtomicSet(&output_idle, 0);
+    output_flush_delay = setting_get_int(OPT_CAT_CLIENT,
+            OPT_OUTPUT_FLUSH_DELAY);
 
     input_thread = SDL_CreateThread(reader_thread_loop, "reader_thread_loop", NULL);
 
@@ -382,15 +1066,19 @@ int handle_socket_shutdown(void)
         abort_thread = 0;
 
         /* Empty all queues */
-        while (input_queue_start) {
-            command_buffer_free(command_buffer_dequeue(&input_queue_start, &input_queue_end));
+        command_queue_clear(&input_queue);
+        command_queue_clear(&output_queue);
+        client_commands_clear();
+
+        /* Drain any stale wakeups. */
+        while (SDL_SemTryWait(input_sem) == 0) {
         }
 
-        while (output_queue_start) {
-            command_buffer_free(command_buffer_dequeue(&output_queue_start, &output_queue_end));
+        while (SDL_SemTryWait(output_sem) == 0) {
         }
 
         LOG(INFO, "Connection lost.");
+        command_buffer_pools_stats();
         return 1;
     }
 
@@ -415,9 +1103,14 @@ void client_socket_close(client_socket_t *csock)
 
     abort_thread = 1;
 
-    /* Poke anyone waiting at a cond */
-    SDL_CondSignal(input_buffer_cond);
-    SDL_CondSignal(output_buffer_cond);
+    /* Poke the socket threads, in case they're sleeping. */
+    if (input_sem != NULL) {
+        SDL_SemPost(input_sem);
+    }
+
+    if (output_sem != NULL) {
+        SDL_SemPost(output_sem);
+    }
 
     SDL_UnlockMutex(socket_mutex);
 }
@@ -7,14 +7,35 @@
 #include <toolkit/string.h>
 #include <toolkit/colorspace.h>
 
+/**
+ * Key of a sprite cache entry; identifies the source surface and all the
+ * effects rendered on it. Always zeroed before being filled in, so that the
+ * padding bytes compare equal.
+ */
+typedef struct sprite_cache_key {
+    SDL_Surface *src; ///< The source surface.
+    const char *overlay; ///< Effect overlay identifier.
+    uint32_t flags; ///< Bit combination of @ref SPRITE_FLAG_xxx.
+    uint32_t stretch; ///< Tile stretching value.
+    int16_t zoom_x; ///< Horizontal zoom.
+    int16_t zoom_y; ///< Vertical zoom.
+    int16_t rotate; ///< Rotate value.
+    uint8_t dark_level; ///< Dark level.
+    uint8_t alpha; ///< Alpha value.
+    char glow[COLOR_BUF]; ///< Glow color; only set for glow masks.
+} sprite_cache_key_t;
+
 /**
  * Structure used to cache sprite surfaces that have had special effects
  * rendered on them.
  */
 typedef struct sprite_cache {
-    char *name; ///< Name of the sprite. Used for hash table lookups.
+    sprite_cache_key_t key; ///< Key of the entry. Used for hash table lookups.
     SDL_Surface *surface; ///< The sprite's surface.
-    time_t last_used; ///< Last time the sprite was used.
+    size_t bytes; ///< Memory used by the entry.
+    uint32_t last_used; ///< Ticks when the sprite was last used.
+    struct sprite_cache *next; ///< Next (less recently used) entry.
+    struct sprite_cache *prev; ///< Previous (more recently used) entry.
     UT_hash_handle hh; ///< Hash handle.
 } sprite_cache_t;
 
@@ -31,6 +52,16 @@ static int dark_alpha[DARK_LEVELS] = {
  */
 static sprite_cache_t *sprites_cache = NULL;
 
+/**
+ * The sprite cache entries, most recently used first.
+ */
+static sprite_cache_t *sprites_cache_lru = NULL;
+
+/**
+ * Sprite cache statistics.
+ */
+static sprite_cache_stats_t sprites_cache_stats;
+
 /**
  * Initialize the sprite system.
  */
@@ -45,6 +76,7 @@ sprite_init_system (void)
                                         0x00FF0000,
                                         0x0000FF00,
                                         0x000000FF);
+    pixel_init();
 }
 
 /**
@@ -150,23 +182,133 @@ sprite_free_sprite (sprite_struct *sprite)
 }
 
 /**
- * Find a sprite in the sprite cache.
+ * Get the average color of a sprite's visible pixels, for showing the
+ * sprite as a single color. Calculated only once per sprite.
+ *
+ * @param sprite
+ * The sprite.
+ * @return
+ * The average color; its alpha value is 0 if the sprite has no visible
+ * pixels, 255 otherwise.
+ */
+const SDL_Color *
+sprite_get_average_color (sprite_struct *sprite)
+{
+    HARD_ASSERT(sprite != NULL);
+
+    if (sprite->average_color_done) {
+        return &sprite->average_color;
+    }
+
+    sprite->average_color_done = true;
+    memset(&sprite->average_color, 0, sizeof(sprite->average_color));
+
+    SDL_Surface *surface = sprite->bitmap;
+    if (surface == NULL) {
+        return &sprite->average_color;
+    }
+
+    uint32_t ckey = 0;
+    bool has_ckey = SDL_GetColorKey(surface, &ckey) == 0;
+    uint64_t r = 0, g = 0, b = 0, num = 0;
+
+    SDL_LockSurface(surface);
+
+    for (int y = 0; y < surface->h; y++) {
+        for (int x = 0; x < surface->w; x++) {
+            Uint32 pixel = getpixel(surface, x, y);
+            if (has_ckey && pixel == ckey) {
+                continue;
+            }
+
+            Uint8 pr, pg, pb, pa;
+            SDL_GetRGBA(pixel, surface->format, &pr, &pg, &pb, &pa);
+            if (pa < 127) {
+                continue;
+            }
+
+            r += pr;
+            g += pg;
+            b += pb;
+            num++;
+        }
+    }
+
+    SDL_UnlockSurface(surface);
+
+    if (num != 0) {
+        sprite->average_color.r = r / num;
+        sprite->average_color.g = g / num;
+        sprite->average_color.b = b / num;
+        sprite->average_color.a = 255;
+    }
+
+    return &sprite->average_color;
+}
+
+/**
+ * Construct the sprite cache key of a sprite with effects rendered on it.
+ * The glow effect is left out; glow masks use the same key with the glow
+ * color added and the alpha value left out.
  *
- * @param name
- * Name of the sprite to find.
+ * @param[out] key
+ * Will contain the key.
+ * @param src
+ * Source surface.
+ * @param effects
+ * Effects rendered on the source surface.
+ */
+static void
+sprite_cache_key_init (sprite_cache_key_t     *key,
+                       SDL_Surface            *src,
+                       const sprite_effects_t *effects)
+{
+    HARD_ASSERT(key != NULL);
+    HARD_ASSERT(src != NULL);
+    HARD_ASSERT(effects != NULL);
+
+    memset(key, 0, sizeof(*key));
+    key->src = src;
+    key->overlay = effect_overlay_identifier();
+    key->flags = effects->flags;
+    key->stretch = effects->stretch;
+    key->zoom_x = effects->zoom_x;
+    key->zoom_y = effects->zoom_y;
+    key->rotate = effects->rotate;
+    key->dark_level = effects->dark_level;
+    key->alpha = effects->alpha;
+}
+
+/**
+ * Find a sprite in the sprite cache, and mark it as the most recently used
+ * one.
+ *
+ * @param key
+ * Key of the sprite to find.
+ * @param hash
+ * Hash value of the key.
  * @return
  * Sprite if found, NULL otherwise.
  */
 static sprite_cache_t *
-sprite_cache_find (const char *name)
+sprite_cache_find (const sprite_cache_key_t *key, unsigned hash)
 {
-    HARD_ASSERT(name != NULL);
+    HARD_ASSERT(key != NULL);
 
     sprite_cache_t *cache;
-    HASH_FIND_STR(sprites_cache, name, cache);
+    HASH_FIND_BYHASHVALUE(hh, sprites_cache, key, sizeof(*key), hash, cache);
 
-    if (cache != NULL) {
-        cache->last_used = time(NULL);
+    if (cache == NULL) {
+        sprites_cache_stats.misses++;
+        return NULL;
+    }
+
+    sprites_cache_stats.hits++;
+    cache->last_used = SDL_GetTicks();
+
+    if (cache != sprites_cache_lru) {
+        DL_DELETE(sprites_cache_lru, cache);
+        DL_PREPEND(sprites_cache_lru, cache);
     }
 
     return cache;
@@ -175,35 +317,27 @@ sprite_cache_find (const char *name)
 /**
  * Create a new sprite cache entry.
  *
- * @param name
- * Name of the cache entry.
+ * @param key
+ * Key of the cache entry.
+ * @param surface
+ * The sprite's surface; the entry takes ownership of it.
  * @return
  * Created sprite entry.
  */
 static sprite_cache_t *
-sprite_cache_create (const char *name)
+sprite_cache_create (const sprite_cache_key_t *key, SDL_Surface *surface)
 {
-    HARD_ASSERT(name != NULL);
+    HARD_ASSERT(key != NULL);
+    HARD_ASSERT(surface != NULL);
 
     sprite_cache_t *cache = ecalloc(1, sizeof(*cache));
-    cache->name = estrdup(name);
-    cache->last_used = time(NULL);
+    cache->key = *key;
+    cache->surface = surface;
+    cache->bytes = sizeof(*cache) + (size_t) surface->h * surface->pitch;
+    cache->last_used = SDL_GetTicks();
     return cache;
 }
 
-/**
- * Add a sprite cache entry to the sprite cache.
- *
- * @param cache
- * Cache entry to add.
- */
-static void
-sprite_cache_add (sprite_cache_t *cache)
-{
-    HARD_ASSERT(cache != NULL);
-    HASH_ADD_KEYPTR(hh, sprites_cache, cache->name, strlen(cache->name), cache);
-}
-
 /**
  * Remove a sprite entry from the sprite cache.
  *
@@ -214,7 +348,11 @@ static void
 sprite_cache_remove (sprite_cache_t *cache)
 {
     HARD_ASSERT(cache != NULL);
+
     HASH_DEL(sprites_cache, cache);
+    DL_DELETE(sprites_cache_lru, cache);
+    sprites_cache_stats.entries--;
+    sprites_cache_stats.bytes -= cache->bytes;
 }
 
 /**
@@ -226,11 +364,51 @@ sprite_cache_free (sprite_cache_t *cache)
 {
     HARD_ASSERT(cache != NULL);
 
-    efree(cache->name);
     SDL_FreeSurface(cache->surface);
     efree(cache);
 }
 
+/**
+ * Add a sprite cache entry to the sprite cache as the most recently used
+ * one, evicting the least recently used entries to keep the cache within
+ * its memory budget.
+ *
+ * @param cache
+ * Cache entry to add.
+ * @param hash
+ * Hash value of the entry's key.
+ */
+static void
+sprite_cache_add (sprite_cache_t *cache, unsigned hash)
+{
+    HARD_ASSERT(cache != NULL);
+
+    size_t budget = (size_t) setting_get_int(OPT_CAT_CLIENT,
+                                             OPT_SPRITE_CACHE_SIZE) *
+                    1024 * 1024;
+
+    /* The most recently used entry is never evicted, as the caller may
+     * still be using it. */
+    while (sprites_cache_lru != NULL &&
+           sprites_cache_lru->prev != sprites_cache_lru &&
+           sprites_cache_stats.bytes + cache->bytes > budget) {
+        sprite_cache_t *lru = sprites_cache_lru->prev;
+        sprite_cache_remove(lru);
+        sprite_cache_free(lru);
+        sprites_cache_stats.evictions++;
+    }
+
+    HASH_ADD_BYHASHVALUE(hh, sprites_cache, key, sizeof(cache->key), hash,
+                         cache);
+    DL_PREPEND(sprites_cache_lru, cache);
+    sprites_cache_stats.entries++;
+    sprites_cache_stats.bytes += cache->bytes;
+
+    if (sprites_cache_stats.bytes > sprites_cache_stats.peak_bytes) {
+        sprites_cache_stats.peak_bytes = sprites_cache_stats.bytes;
+    }
+}
+
 /**
  * Free all the sprite cache entries.
  */
@@ -244,33 +422,70 @@ void sprite_cache_free_all(void)
 }
 
 /**
- * Free unused sprite cache entries.
+ * Free sprite cache entries that have not been used for
+ * ::SPRITE_CACHE_GC_FREE_TIME.
  */
 void sprite_cache_gc(void)
 {
-    if (!rndm_chance(SPRITE_CACHE_GC_CHANCE)) {
-        return;
-    }
+    uint32_t now = SDL_GetTicks();
 
-    time_t now = time(NULL);
+    /* The least recently used entries are at the end of the list, so stop
+     * at the first one that has been used recently. */
+    while (sprites_cache_lru != NULL) {
+        sprite_cache_t *lru = sprites_cache_lru->prev;
 
-    struct timeval tv1;
-    gettimeofday(&tv1, NULL);
-
-    sprite_cache_t *cache, *tmp;
-    HASH_ITER(hh, sprites_cache, cache, tmp) {
-        if (now - cache->last_used >= SPRITE_CACHE_GC_FREE_TIME) {
-            sprite_cache_remove(cache);
-            sprite_cache_free(cache);
-        }
-
-        /* Avoid executing this loop for too long. */
-        struct timeval tv2;
-        if (gettimeofday(&tv2, NULL) == 0 &&
-            tv2.tv_usec - tv1.tv_usec >= SPRITE_CACHE_GC_MAX_TIME) {
+        if (now - lru->last_used < SPRITE_CACHE_GC_FREE_TIME) {
             break;
         }
+
+        sprite_cache_remove(lru);
+        sprite_cache_free(lru);
+    }
+}
+
+/**
+ * Get the sprite cache statistics.
+ *
+ * @param[out] stats
+ * Will contain the statistics.
+ */
+void
+sprite_cache_get_stats (sprite_cache_stats_t *stats)
+{
+    HARD_ASSERT(stats != NULL);
+    *stats = sprites_cache_stats;
+}
+
+/**
+ * Reset the sprite cache hit, miss and eviction counters.
+ */
+void
+sprite_cache_stats_reset (void)
+{
+    sprites_cache_stats.hits = 0;
+    sprites_cache_stats.misses = 0;
+    sprites_cache_stats.evictions = 0;
+    sprites_cache_stats.peak_bytes = sprites_cache_stats.bytes;
+}
+
+/**
+ * Get the alpha value of the black used to darken sprites at the specified
+ * dark level.
+ *
+ * @param dark_level
+ * The dark level.
+ * @return
+ * The alpha value; 255 if the dark level is ::DARK_LEVELS or higher, which
+ * means total darkness.
+ */
+int
+sprite_dark_alpha (uint8_t dark_level)
+{
+    if (dark_level >= DARK_LEVELS) {
+        return 255;
     }
+
+    return dark_alpha[dark_level];
 }
 
 /**
@@ -286,26 +501,15 @@ void sprite_cache_gc(void)
 static SDL_Surface *
 sprite_effect_red (SDL_Surface *surface)
 {
-    SDL_Surface *tmp = SDL_ConvertSurface(surface,
-                                          FormatHolder->format,
-                                          FormatHolder->flags);
+    SDL_Surface *tmp = SDL_ConvertSurfaceFormat(surface,
+                                                SDL_PIXELFORMAT_RGBA8888,
+                                                0);
     if (tmp == NULL) {
         return NULL;
     }
 
-    for (int y = 0; y < tmp->h; y++) {
-        for (int x = 0; x < tmp->w; x++) {
-            Uint8 r, g, b, a;
-            SDL_GetRGBA(getpixel(tmp, x, y), tmp->format, &r, &g, &b, &a);
-            r = (Uint8) (0.212671 * r + 0.715160 * g + 0.072169 * b);
-            g = b = 0;
-            putpixel(tmp, x, y, SDL_MapRGBA(tmp->format, r, g, b, a));
-        }
-    }
-
-    SDL_Surface *ret = SDL_ConvertSurfaceFormat(tmp, SDL_PIXELFORMAT_RGBA8888, 0);
-    SDL_FreeSurface(tmp);
-    return ret;
+    pixel_effect_surface(tmp, PIXEL_EFFECT_RED);
+    return tmp;
 }
 
 /**
@@ -321,25 +525,15 @@ sprite_effect_red (SDL_Surface *surface)
 static SDL_Surface *
 sprite_effect_gray (SDL_Surface *surface)
 {
-    SDL_Surface *tmp = SDL_ConvertSurface(surface,
-                                          FormatHolder->format,
-                                          FormatHolder->flags);
+    SDL_Surface *tmp = SDL_ConvertSurfaceFormat(surface,
+                                                SDL_PIXELFORMAT_RGBA8888,
+                                                0);
     if (tmp == NULL) {
         return NULL;
     }
 
-    for (int y = 0; y < tmp->h; y++) {
-        for (int x = 0; x < tmp->w; x++) {
-            Uint8 r, g, b, a;
-            SDL_GetRGBA(getpixel(tmp, x, y), tmp->format, &r, &g, &b, &a);
-            r = g = b = (Uint8) (0.212671 * r + 0.715160 * g + 0.072169 * b);
-            putpixel(tmp, x, y, SDL_MapRGBA(tmp->format, r, g, b, a));
-        }
-    }
-
-    SDL_Surface *ret = SDL_ConvertSurfaceFormat(tmp, SDL_PIXELFORMAT_RGBA8888, 0);
-    SDL_FreeSurface(tmp);
-    return ret;
+    pixel_effect_surface(tmp, PIXEL_EFFECT_GRAY);
+    return tmp;
 }
 
 /**
@@ -355,57 +549,65 @@ sprite_effect_gray (SDL_Surface *surface)
 static SDL_Surface *
 sprite_effect_fow (SDL_Surface *surface)
 {
-    SDL_Surface *tmp = SDL_ConvertSurface(surface,
-                                          FormatHolder->format,
-                                          FormatHolder->flags);
+    SDL_Surface *tmp = SDL_ConvertSurfaceFormat(surface,
+                                                SDL_PIXELFORMAT_RGBA8888,
+                                                0);
     if (tmp == NULL) {
         return NULL;
     }
 
-    for (int y = 0; y < tmp->h; y++) {
-        for (int x = 0; x < tmp->w; x++) {
-            Uint8 r, g, b, a;
-            SDL_GetRGBA(getpixel(tmp, x, y), tmp->format, &r, &g, &b, &a);
-            r = (Uint8) ((0.212671 * r + 0.715160 * g + 0.072169 * b) * 0.34);
-            g = b = r;
-            b += 16;
-            putpixel(tmp, x, y, SDL_MapRGBA(tmp->format, r, g, b, a));
-        }
-    }
+    pixel_effect_surface(tmp, PIXEL_EFFECT_FOW);
+    return tmp;
+}
 
-    SDL_Surface *ret = SDL_ConvertSurfaceFormat(tmp, SDL_PIXELFORMAT_RGBA8888, 0);
-    SDL_FreeSurface(tmp);
-    return ret;
+/**
+ * Get the alpha value of a glow effect at the specified point of its
+ * pulsing animation.
+ *
+ * @param speed
+ * Animation speed of the glow.
+ * @param state
+ * Current animation state of the glow.
+ * @return
+ * The alpha value.
+ */
+static uint8_t
+sprite_glow_alpha (double speed, double state)
+{
+    speed = MAX(1.0, speed);
+    state = MAX(1.0, state);
+    double mod = (speed - state - speed / 2.0) / (speed / 2.0);
+    return 200.0 * fabs(mod);
 }
 
 /**
- * Creates a glow effect for the specified sprite surface.
+ * Creates a glow mask for the specified sprite surface: the glow and its
+ * outline around the sprite's visible pixels, without the sprite itself.
+ *
+ * The mask does not depend on the state of the glow animation; the glow
+ * pixels are opaque and the outline pixels use
+ * ::SPRITE_GLOW_OUTLINE_ALPHA, and the animation is done by modulating the
+ * mask's alpha when rendering it.
  *
  * @param surface
  * Surface.
  * @param color
  * Glow color.
- * @param speed
- * Animation speed of the glow.
- * @param state
- * Current animation state of the glow.
  * @return
- * New surface.
+ * New surface, which is ::SPRITE_GLOW_SIZE pixels larger than @p surface
+ * on each side.
  */
 static SDL_Surface *
-sprite_effect_glow (SDL_Surface     *surface,
-                    const SDL_Color *color,
-                    double           speed,
-                    double           state)
+sprite_effect_glow_mask (SDL_Surface *surface, const SDL_Color *color)
 {
     SDL_Surface *tmp = SDL_CreateRGBSurface(0,
                                             surface->w + SPRITE_GLOW_SIZE * 2,
                                             surface->h + SPRITE_GLOW_SIZE * 2,
-                                            surface->format->BitsPerPixel,
-                                            surface->format->Rmask,
-                                            surface->format->Gmask,
-                                            surface->format->Bmask,
-                                            surface->format->Amask);
+                                            32,
+                                            0xFF000000,
+                                            0x00FF0000,
+                                            0x0000FF00,
+                                            0x000000FF);
     if (tmp == NULL) {
         return NULL;
     }
@@ -420,20 +622,17 @@ sprite_effect_glow (SDL_Surface     *surface,
      * coordinates contain visible pixels. */
     uint8_t *grid = ecalloc(1, sizeof(*grid) * tmp->w * tmp->h);
 
+    uint32_t ckey = 0;
+    SDL_GetColorKey(surface, &ckey);
+
     for (int x = 0; x < surface->w; x++) {
         for (int y = 0; y < surface->h; y++) {
             Uint32 pixel = getpixel(surface, x, y);
-            uint32_t ckey = 0;
-            
-            SDL_GetColorKey(surface, ckey);
-            
             if (pixel == ckey) {
                 /* Transparent pixel. */
                 continue;
             }
 
-            putpixel(tmp, x + SPRITE_GLOW_SIZE, y + SPRITE_GLOW_SIZE, pixel);
-
             Uint8 r, g, b, a;
             SDL_GetRGBA(pixel, surface->format, &r, &g, &b, &a);
             if (a < 127) {
@@ -447,13 +646,6 @@ sprite_effect_glow (SDL_Surface     *surface,
         }
     }
 
-    /* Figure out the alpha value based on the animation speed and the current
-     * animation state for a fade-out/pulsing effect. */
-    speed = MAX(1.0, speed);
-    state = MAX(1.0, state);
-    double mod = (speed - state - speed / 2.0) / (speed / 2.0);
-    Uint8 alpha = 200.0 * fabs(mod);
-
     /* It's much easier to work in HSV for this. */
     double rgb[3], hsv[3];
     rgb[0] = color->r / 255.0;
@@ -476,7 +668,7 @@ sprite_effect_glow (SDL_Surface     *surface,
                                 rgb2[0] * 255.0,
                                 rgb2[1] * 255.0,
                                 rgb2[2] * 255.0,
-                                alpha);
+                                255);
     }
 
     hsv[1] += 0.10;
@@ -490,7 +682,7 @@ sprite_effect_glow (SDL_Surface     *surface,
                                     rgb[0] * 255.0,
                                     rgb[1] * 255.0,
                                     rgb[2] * 255.0,
-                                    MAX(0, alpha - 25));
+                                    SPRITE_GLOW_OUTLINE_ALPHA);
 
     /* Iterate the pixels in the sprite's surface. */
     for (int x = 0; x < tmp->w; x++) {
@@ -563,9 +755,7 @@ sprite_effect_glow (SDL_Surface     *surface,
 
     efree(grid);
 
-    SDL_Surface *ret = SDL_ConvertSurfaceFormat(tmp, SDL_PIXELFORMAT_RGBA8888, 0);
-    SDL_FreeSurface(tmp);
-    return ret;
+    return tmp;
 
 #undef GLOW_GRID_PIXEL_NONE
 #undef GLOW_GRID_PIXEL_VISIBLE
@@ -581,6 +771,8 @@ sprite_effect_glow (SDL_Surface     *surface,
  * Surface to use as the base.
  * @param effects
  * Effects to apply.
+ * The glow effect is not applied; see sprite_cache_glow_mask().
+ *
  * @return
  * New surface, NULL on failure.
  */
@@ -688,22 +880,6 @@ do {                            \
         FREE_TMP_SURFACE();
     }
 
-    /* Apply glow effects. */
-    if (effects->glow[0] != '\0') {
-        SDL_Color color;
-        if (text_color_parse(effects->glow, &color)) {
-            surface = sprite_effect_glow(surface,
-                                         &color,
-                                         effects->glow_speed,
-                                         effects->glow_state);
-            if (surface == NULL) {
-                goto done;
-            }
-
-            FREE_TMP_SURFACE();
-        }
-    }
-
     /* Alpha transparency. */
     if (effects->alpha != 0) {
         surface = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA8888, 0);
@@ -722,6 +898,70 @@ done:
 #undef FREE_TMP_SURFACE
 }
 
+/**
+ * Find the glow mask of a sprite in the sprite cache, creating it and
+ * adding it to the cache if necessary.
+ *
+ * The mask is created from the sprite without the alpha effect, so that the
+ * glow keeps its shape regardless of the sprite's transparency; the alpha
+ * effect is applied when rendering the mask instead.
+ *
+ * @param key
+ * Sprite cache key of the sprite the glow is around.
+ * @param src
+ * The sprite's source surface, without any effects.
+ * @param effects
+ * Effects rendered on the sprite.
+ * @return
+ * The glow mask, NULL on failure.
+ */
+static SDL_Surface *
+sprite_cache_glow_mask (const sprite_cache_key_t *key,
+                        SDL_Surface              *src,
+                        const sprite_effects_t   *effects)
+{
+    sprite_cache_key_t mask_key = *key;
+    mask_key.alpha = 0;
+    snprintf(VS(mask_key.glow), "%s", effects->glow);
+
+    unsigned hash;
+    HASH_VALUE(&mask_key, sizeof(mask_key), hash);
+
+    sprite_cache_t *cache = sprite_cache_find(&mask_key, hash);
+    if (cache != NULL) {
+        return cache->surface;
+    }
+
+    SDL_Color color;
+    if (!text_color_parse(effects->glow, &color)) {
+        return NULL;
+    }
+
+    sprite_effects_t opaque = *effects;
+    opaque.alpha = 0;
+
+    SDL_Surface *surface = src;
+    if (SPRITE_EFFECTS_CHANGE_SPRITE(&opaque)) {
+        surface = sprite_effects_create(src, &opaque);
+        if (surface == NULL) {
+            return NULL;
+        }
+    }
+
+    SDL_Surface *mask = sprite_effect_glow_mask(surface, &color);
+
+    if (surface != src) {
+        SDL_FreeSurface(surface);
+    }
+
+    if (mask == NULL) {
+        return NULL;
+    }
+
+    sprite_cache_add(sprite_cache_create(&mask_key, mask), hash);
+    return mask;
+}
+
 /**
  * Render the specified surface.
  *
@@ -804,8 +1044,13 @@ surface_show_fill (SDL_Surface *surface,
  * Source surface to render.
  * @param effects
  * Effects to apply.
+ * @return
+ * The surface that was rendered: @p src, or a copy of it with the effects
+ * applied, which is owned by the sprite cache. Stretched copies are taller
+ * than @p src, and rendered higher up by the difference. NULL if nothing
+ * was rendered.
  */
-void
+SDL_Surface *
 surface_show_effects (SDL_Surface            *surface,
                       int                     x,
                       int                     y,
@@ -816,47 +1061,37 @@ surface_show_effects (SDL_Surface            *surface,
     HARD_ASSERT(surface != NULL);
 
     if (src == NULL) {
-        return;
+        return NULL;
     }
 
+    SDL_Surface *glow = NULL;
+
     if (effects != NULL && SPRITE_EFFECTS_NEED_RENDERING(effects)) {
         /* Maximum darkness; do not render at all. */
         if (BIT_QUERY(effects->flags, SPRITE_FLAG_DARK) &&
             effects->dark_level == DARK_LEVELS) {
-            return;
+            return NULL;
         }
 
-        /* Construct a cache entry string. */
-        char name[HUGE_BUF];
-        snprintf(VS(name),
-                 "%p;%u;%u;%s;%u;%u;%d;%d;%d;%s;%u;%u",
-                 src,
-                 effects->flags,
-                 effects->dark_level,
-                 effect_overlay_identifier(),
-                 effects->alpha,
-                 effects->stretch,
-                 effects->zoom_x,
-                 effects->zoom_y,
-                 effects->rotate,
-                 effects->glow,
-                 effects->glow_speed,
-                 effects->glow_state);
+        sprite_cache_key_t key;
+        sprite_cache_key_init(&key, src, effects);
 
         /* Try to find the sprite we need in the cache, otherwise,
          * render it out and add it to the cache. */
         SDL_Surface *old_src = src;
-        sprite_cache_t *cache = sprite_cache_find(name);
-        if (cache != NULL) {
-            src = cache->surface;
-        } else {
-            SDL_Surface *tmp = sprite_effects_create(src, effects);
-            if (tmp != NULL) {
-                src = tmp;
-
-                cache = sprite_cache_create(name);
-                cache->surface = src;
-                sprite_cache_add(cache);
+        if (SPRITE_EFFECTS_CHANGE_SPRITE(effects)) {
+            unsigned hash;
+            HASH_VALUE(&key, sizeof(key), hash);
+
+            sprite_cache_t *cache = sprite_cache_find(&key, hash);
+            if (cache != NULL) {
+                src = cache->surface;
+            } else {
+                SDL_Surface *tmp = sprite_effects_create(src, effects);
+                if (tmp != NULL) {
+                    src = tmp;
+                    sprite_cache_add(sprite_cache_create(&key, src), hash);
+                }
             }
         }
 
@@ -865,12 +1100,44 @@ surface_show_effects (SDL_Surface            *surface,
         }
 
         if (effects->glow[0] != '\0') {
-            y -= SPRITE_GLOW_SIZE;
-            x -= SPRITE_GLOW_SIZE;
+            glow = sprite_cache_glow_mask(&key, old_src, effects);
         }
     }
 
     surface_show(surface, x, y, srcrect, src);
+
+    if (glow == NULL) {
+        return src;
+    }
+
+    /* The glow pulses by modulating the alpha of its mask, which is also
+     * where the sprite's alpha effect is applied to the glow. */
+    uint8_t alpha = sprite_glow_alpha(effects->glow_speed,
+                                      effects->glow_state);
+    if (effects->alpha != 0) {
+        alpha = alpha * effects->alpha / 255;
+    }
+
+    if (alpha == 0) {
+        return src;
+    }
+
+    SDL_Rect glowrect;
+    if (srcrect != NULL) {
+        glowrect.x = srcrect->x;
+        glowrect.y = srcrect->y;
+        glowrect.w = srcrect->w + SPRITE_GLOW_SIZE * 2;
+        glowrect.h = srcrect->h + SPRITE_GLOW_SIZE * 2;
+    }
+
+    SDL_SetSurfaceAlphaMod(glow, alpha);
+    surface_show(surface,
+                 x - SPRITE_GLOW_SIZE,
+                 y - SPRITE_GLOW_SIZE,
+                 srcrect != NULL ? &glowrect : NULL,
+                 glow);
+
+    return src;
 }
 
 /**
@@ -1458,7 +1725,7 @@ surface_set_alpha (SDL_Surface *surface, uint8_t alpha)
 
     if (fmt->Amask == 0) {
         SDL_SetSurfaceAlphaMod(surface, alpha);
-    } else {
+    } else if (!pixel_alpha_surface(surface, alpha)) {
         Uint8 bpp = fmt->BytesPerPixel;
         double scale = alpha / 255.0f;
 
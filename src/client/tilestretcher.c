@@ -10,6 +10,10 @@
  * align_tile_stretch() calculates how much to stretch each tile in all
  * 4 directions based on the surrounding tiles.
  *
+ * tile_stretch() computes the mapping of the source tile pixels to the
+ * stretched tile pixels once for each stretch signature (a plan), and then
+ * copies the pixels directly as the plan describes.
+ *
  * @todo Most fmasks (grass, for example) are not properly stretched.
  *
  * @author James "JLittle" Little
@@ -17,6 +21,7 @@
  */
 
 #include <global.h>
+#include <cmake.h>
 
 /**
  * Pixel y-co-ordinate (offset) of the edge of a standard
@@ -78,6 +83,125 @@ typedef struct line_and_slope {
     double slope;
 } line_and_slope;
 
+/**
+ * Maximum number of tile stretching plans to keep; once there are more,
+ * they are all freed.
+ */
+#define TILE_STRETCH_PLANS_MAX 1024
+
+/** Indices of the brightness values of the sides of a stretched tile. */
+enum {
+    TILE_STRETCH_WEST, ///< Western side.
+    TILE_STRETCH_EAST, ///< Eastern side.
+
+    TILE_STRETCH_SIDES ///< Number of sides.
+};
+
+/**
+ * Operations used by tile_stretch_walk() to produce a stretched tile.
+ */
+typedef struct tile_stretch_ops {
+    /**
+     * Copy a vertical line; see copy_vertical_line() for the parameters,
+     * except for @p side, which is one of the TILE_STRETCH_xxx side indices
+     * and selects the brightness.
+     */
+    void (*line)(void *data, int src_x, int src_sy, int src_ey, int dest_x,
+            int dest_sy, int dest_ey, int side, bool extra);
+
+    /**
+     * Copy a single pixel; see copy_pixel_to_pixel() for the parameters,
+     * except for @p side.
+     */
+    void (*pixel)(void *data, int x, int y, int x2, int y2, int side);
+} tile_stretch_ops_t;
+
+/**
+ * A run of pixels copied from a column of the source tile to consecutive
+ * rows of a column of the stretched tile.
+ */
+typedef struct tile_stretch_span {
+    /** Source X coordinate. */
+    int src_x;
+
+    /** Destination X coordinate. */
+    int dest_x;
+
+    /** Destination Y coordinate of the first pixel. */
+    int dest_y;
+
+    /** Number of pixels. */
+    int num;
+
+    /** Index of the source Y coordinate of the first pixel in the plan. */
+    size_t src_y;
+
+    /** Side of the tile, selects the brightness table. */
+    int side;
+
+    /**
+     * Whether to copy the pixels as they are, without adjusting their
+     * brightness or skipping transparent ones.
+     */
+    bool raw;
+} tile_stretch_span_t;
+
+/** Identifies a tile stretching plan. */
+typedef struct tile_stretch_key {
+    int src_w; ///< Source tile width.
+    int src_h; ///< Source tile height.
+    int n; ///< North stretch.
+    int e; ///< East stretch.
+    int s; ///< South stretch.
+    int w; ///< West stretch.
+} tile_stretch_key_t;
+
+/**
+ * Precomputed mapping of the source tile pixels to the stretched tile
+ * pixels for one stretch signature; the geometry only depends on the
+ * stretch values and the source tile size, so it is computed once and
+ * then replayed for every tile stretched the same way.
+ */
+typedef struct tile_stretch_plan {
+    /** The key. */
+    tile_stretch_key_t key;
+
+    /** Width of the stretched tile. */
+    int dest_w;
+
+    /** Height of the stretched tile. */
+    int dest_h;
+
+    /** The spans, in the order they are copied. */
+    tile_stretch_span_t *spans;
+
+    /** Number of spans. */
+    size_t spans_num;
+
+    /** Allocated number of spans. */
+    size_t spans_size;
+
+    /** Source Y coordinates of the pixels of all the spans. */
+    int *src_y;
+
+    /** Number of source Y coordinates. */
+    size_t src_y_num;
+
+    /** Allocated number of source Y coordinates. */
+    size_t src_y_size;
+
+    /** Color channel lookup tables applying the brightness of each side. */
+    uint8_t brightness[TILE_STRETCH_SIDES][256];
+
+    /** Hash handle. */
+    UT_hash_handle hh;
+} tile_stretch_plan_t;
+
+/** The tile stretching plans. */
+static tile_stretch_plan_t *tile_stretch_plans;
+/** Number of tile stretching plans. */
+static size_t tile_stretch_plans_num;
+
 /**
  * Calculate line information given its start and end co-ordinates.
  *
@@ -185,10 +309,13 @@ int tilestretcher_coords_in_tile(uint32_t stretch, int x, int y)
             arraysize(corners_x));
 }
 
+#ifdef HAVE_SELFTEST
+
 /**
  * Adds a color to the palette in a bitmap ("surface").
  */
-int add_color_to_surface(SDL_Surface *dest, Uint8 red, Uint8 green, Uint8 blue)
+static int add_color_to_surface(SDL_Surface *dest, Uint8 red, Uint8 green,
+        Uint8 blue)
 {
     HARD_ASSERT(dest != NULL);
 
@@ -226,8 +353,8 @@ int add_color_to_surface(SDL_Surface *dest, Uint8 red, Uint8 green, Uint8 blue)
  * @warning brightness above 1.0 is (apparently) allowed but brightness < 0
  * is not tested and could cause problems.
  */
-void copy_pixel_to_pixel(SDL_Surface *src, SDL_Surface *dest, int x, int y,
-        int x2, int y2, double brightness)
+static void copy_pixel_to_pixel(SDL_Surface *src, SDL_Surface *dest, int x,
+        int y, int x2, int y2, double brightness)
 {
     HARD_ASSERT(src != NULL);
     HARD_ASSERT(dest != NULL);
@@ -309,9 +436,9 @@ void copy_pixel_to_pixel(SDL_Surface *src, SDL_Surface *dest, int x, int y,
  * @note This function would be horribly inefficient if ever used to shrink
  * a long line down to a few pixels.
  */
-void copy_vertical_line(SDL_Surface *src, SDL_Surface *dest, int src_x,
-        int src_sy, int src_ey, int dest_x, int dest_sy, int dest_ey,
-        double brightness, bool extra)
+static void copy_vertical_line(SDL_Surface *src, SDL_Surface *dest,
+        int src_x, int src_sy, int src_ey, int dest_x, int dest_sy,
+        int dest_ey, double brightness, bool extra)
 {
     HARD_ASSERT(src != NULL);
     HARD_ASSERT(dest != NULL);
@@ -356,8 +483,55 @@ void copy_vertical_line(SDL_Surface *src, SDL_Surface *dest, int src_x,
     SDL_UnlockSurface(dest);
 }
 
+#endif
+
 /**
- * Generates the bitmap ("surface") for displaying a tile after stretching.
+ * Calculate the brightness (contrast) of the sides of a stretched tile.
+ * @param n
+ * North stretch.
+ * @param e
+ * East stretch.
+ * @param s
+ * South stretch.
+ * @param w
+ * West stretch.
+ * @param[out] dark
+ * Will contain the brightness of each side, indexed by the TILE_STRETCH_xxx
+ * side indices.
+ */
+static void tile_stretch_brightness(int n, int e, int s, int w,
+        double dark[TILE_STRETCH_SIDES])
+{
+    double e_dark, w_dark;
+
+    if (w > e) {
+        w_dark = 1.0 - ((w - e) / 25.0);
+
+        if (n > 0 || s > 0) {
+            e_dark = w_dark;
+        } else {
+            e_dark = 1.0;
+        }
+    } else if (e > w) {
+        e_dark = 1.0 + ((e - w) / 25.0);
+
+        if (s > 0 || n > 0) {
+            w_dark = e_dark;
+        } else {
+            w_dark = 1.0;
+        }
+    } else {
+        e_dark = 1.0;
+        w_dark = 1.0;
+    }
+
+    dark[TILE_STRETCH_WEST] = w_dark;
+    dark[TILE_STRETCH_EAST] = e_dark;
+}
+
+/**
+ * Walk the lines and pixels that make up a stretched tile, calling the
+ * specified operations to copy them from the source tile.
  *
  * Stretching takes place from the horizontal centre, so from a "standard"
  * viewpoint (i.e. some distance away from the viewed object), horizontal
@@ -382,66 +556,28 @@ void copy_vertical_line(SDL_Surface *src, SDL_Surface *dest, int src_x,
  *    tile is stretched.
  *  - Both the SE and NW corners move close the more South and further
  *    away the more North the tile is stretched
+ * @param n
+ * North stretch.
+ * @param e
+ * East stretch.
+ * @param s
+ * South stretch.
+ * @param w
+ * West stretch.
+ * @param ops
+ * Operations to call.
+ * @param data
+ * Passed to the operations.
  */
-SDL_Surface *tile_stretch(SDL_Surface *src, int n, int e, int s, int w)
+static void tile_stretch_walk(int n, int e, int s, int w,
+        const tile_stretch_ops_t *ops, void *data)
 {
-    HARD_ASSERT(src != NULL);
-
-    /* Initialization and housekeeping */
-    SDL_LockSurface(src);
-
-    SDL_Surface *tmp = SDL_CreateRGBSurface(0, src->w, src->h + n,
-            src->format->BitsPerPixel, src->format->Rmask,
-            src->format->Gmask, src->format->Bmask, src->format->Amask);
-
-    SDL_Surface *destination = SDL_ConvertSurfaceFormat(tmp, SDL_PIXELFORMAT_RGBA8888, 0);
-    SDL_FreeSurface(tmp);
-    SDL_LockSurface(destination);
-
-    Uint32 color = getpixel(src, 0, 0);
-
-    Uint8 red, green, blue, alpha;
-    SDL_GetRGBA(color, src->format, &red, &green, &blue, &alpha);
-
-    if (src->format->BitsPerPixel == 8) {
-        add_color_to_surface(destination, red, green, blue);
-    }
-
-    /* We fill with black and full transparency */
-    color = SDL_MapRGBA(destination->format, 0, 0, 0, 0);
-    SDL_FillRect( destination, NULL, color);
-
-    if (src->format->BitsPerPixel == 8) {
-        SDL_SetColorKey(destination, SDL_TRUE, color);
-    }
+    HARD_ASSERT(ops != NULL);
 
     /* If the target is the same size we don't want copy_vertical_line()
      * to try to extent the line by 1 pixel */
     bool flat = n != 0 || e != 0 || w != 0 || s != 0;
 
-    /* Calculate the darkness (contrast) of one or both sides */
-    double e_dark, w_dark;
-    if (w > e) {
-        w_dark = 1.0 - ((w - e) / 25.0);
-
-        if (n > 0 || s > 0) {
-            e_dark = w_dark;
-        } else {
-            e_dark = 1.0;
-        }
-    } else if (e > w) {
-        e_dark = 1.0 + ((e - w) / 25.0);
-
-        if (s > 0 || n > 0) {
-            w_dark = e_dark;
-        } else {
-            w_dark = 1.0;
-        }
-    } else {
-        e_dark = 1.0;
-        w_dark = 1.0;
-    }
-
     line_and_slope dest_lines[4];
     determine_lines(dest_lines, n, e, s, w);
 
@@ -504,8 +640,8 @@ SDL_Surface *tile_stretch(SDL_Surface *src, int n, int e, int s, int w)
 
             /* Choose y co-ordinates either side of the central horizontal */
             int src_len = std_tile_half_len[x];
-            copy_vertical_line(src, destination, x, 11 + src_len, 11 - src_len,
-                    x, y, y2, ln_num < 2 ? w_dark : e_dark, flat);
+            ops->line(data, x, 11 + src_len, 11 - src_len, x, y, y2,
+                    ln_num < 2 ? TILE_STRETCH_WEST : TILE_STRETCH_EAST, flat);
 
             x = x + dest_x_inc;
 
@@ -515,24 +651,470 @@ SDL_Surface *tile_stretch(SDL_Surface *src, int n, int e, int s, int w)
     }
 
     for (int x = 22; x < 22 + 2; x++) {
-        copy_vertical_line(src, destination, x, 0, 23, x, 0, 23 + n - s,
-                w_dark, flat);
+        ops->line(data, x, 0, 23, x, 0, 23 + n - s, TILE_STRETCH_WEST, flat);
     }
 
     for (int x = 24; x < 24 + 2; x++) {
-        copy_vertical_line(src, destination, x, 0, 23, x, 0, 23 + n - s,
-                e_dark, flat);
+        ops->line(data, x, 0, 23, x, 0, 23 + n - s, TILE_STRETCH_EAST, flat);
     }
 
     for (int x = 0; x < 2; x++) {
-        copy_pixel_to_pixel(src, destination, x, 11, x, 11 + n - w, w_dark);
+        ops->pixel(data, x, 11, x, 11 + n - w, TILE_STRETCH_WEST);
     }
 
     for (int x = 46; x < 48; x++) {
-        copy_pixel_to_pixel(src, destination, x, 11, x, 11 + n - e, e_dark);
+        ops->pixel(data, x, 11, x, 11 + n - e, TILE_STRETCH_EAST);
+    }
+}
+
+#ifdef HAVE_SELFTEST
+
+/**
+ * Data of the tile stretching operations that copy the pixels one by one.
+ */
+typedef struct tile_stretch_reference_data {
+    SDL_Surface *src; ///< Source tile.
+    SDL_Surface *dest; ///< Stretched tile.
+    double dark[TILE_STRETCH_SIDES]; ///< Brightness of each side.
+} tile_stretch_reference_data_t;
+
+/**
+ * Implements tile_stretch_ops::line for tile_stretch_reference().
+ */
+static void tile_stretch_reference_line(void *data, int src_x, int src_sy,
+        int src_ey, int dest_x, int dest_sy, int dest_ey, int side, bool extra)
+{
+    tile_stretch_reference_data_t *ref = data;
+    copy_vertical_line(ref->src, ref->dest, src_x, src_sy, src_ey, dest_x,
+            dest_sy, dest_ey, ref->dark[side], extra);
+}
+
+/**
+ * Implements tile_stretch_ops::pixel for tile_stretch_reference().
+ */
+static void tile_stretch_reference_pixel(void *data, int x, int y, int x2,
+        int y2, int side)
+{
+    tile_stretch_reference_data_t *ref = data;
+    copy_pixel_to_pixel(ref->src, ref->dest, x, y, x2, y2, ref->dark[side]);
+}
+
+/**
+ * Generates the bitmap ("surface") for displaying a tile after stretching,
+ * copying the pixels one by one using copy_vertical_line() and
+ * copy_pixel_to_pixel().
+ *
+ * This is how tiles used to be stretched before tile_stretch() started
+ * using precomputed plans; it is kept as the reference the plans are
+ * checked against by the tile stretching self-test.
+ *
+ * Only 32-bit source tiles are supported: for an 8-bit tile, the old code
+ * tried to add colors to the palette of the RGBA8888 destination, which
+ * has none. The self-test checks palettized tiles by comparing them with
+ * the same tile converted to RGBA8888 by hand.
+ * @param src
+ * Source tile; must use 32-bit pixels.
+ * @param n
+ * North stretch.
+ * @param e
+ * East stretch.
+ * @param s
+ * South stretch.
+ * @param w
+ * West stretch.
+ * @return
+ * The stretched tile, NULL on failure.
+ */
+SDL_Surface *tile_stretch_reference(SDL_Surface *src, int n, int e, int s,
+        int w)
+{
+    HARD_ASSERT(src != NULL);
+    HARD_ASSERT(src->format->BytesPerPixel == 4);
+
+    /* Initialization and housekeeping */
+    SDL_LockSurface(src);
+
+    SDL_Surface *tmp = SDL_CreateRGBSurface(0, src->w, src->h + n,
+            src->format->BitsPerPixel, src->format->Rmask,
+            src->format->Gmask, src->format->Bmask, src->format->Amask);
+
+    if (tmp == NULL) {
+        SDL_UnlockSurface(src);
+        return NULL;
+    }
+
+    SDL_Surface *destination = SDL_ConvertSurfaceFormat(tmp,
+            SDL_PIXELFORMAT_RGBA8888, 0);
+    SDL_FreeSurface(tmp);
+
+    if (destination == NULL) {
+        SDL_UnlockSurface(src);
+        return NULL;
+    }
+
+    SDL_LockSurface(destination);
+
+    Uint32 color = getpixel(src, 0, 0);
+
+    Uint8 red, green, blue, alpha;
+    SDL_GetRGBA(color, src->format, &red, &green, &blue, &alpha);
+
+    if (src->format->BitsPerPixel == 8) {
+        add_color_to_surface(destination, red, green, blue);
+    }
+
+    /* We fill with black and full transparency */
+    color = SDL_MapRGBA(destination->format, 0, 0, 0, 0);
+    SDL_FillRect(destination, NULL, color);
+
+    if (src->format->BitsPerPixel == 8) {
+        SDL_SetColorKey(destination, SDL_TRUE, color);
     }
 
+    static const tile_stretch_ops_t ops = {
+        tile_stretch_reference_line, tile_stretch_reference_pixel
+    };
+
+    tile_stretch_reference_data_t data;
+    data.src = src;
+    data.dest = destination;
+    tile_stretch_brightness(n, e, s, w, data.dark);
+    tile_stretch_walk(n, e, s, w, &ops, &data);
+
     SDL_UnlockSurface(src);
     SDL_UnlockSurface(destination);
     return destination;
 }
+
+#endif
+
+/**
+ * Add a pixel copy to a tile stretching plan, extending the last span if
+ * the pixel continues it.
+ * @param plan
+ * The plan.
+ * @param x
+ * Source X coordinate.
+ * @param y
+ * Source Y coordinate.
+ * @param x2
+ * Destination X coordinate.
+ * @param y2
+ * Destination Y coordinate.
+ * @param side
+ * Side of the tile.
+ * @param raw
+ * Whether to copy the pixel as it is.
+ */
+static void tile_stretch_plan_add(tile_stretch_plan_t *plan, int x, int y,
+        int x2, int y2, int side, bool raw)
+{
+    if (x < 0 || y < 0 || x2 < 0 || y2 < 0 || x >= plan->key.src_w ||
+            x2 >= plan->dest_w || y >= plan->key.src_h ||
+            y2 >= plan->dest_h) {
+        return;
+    }
+
+    if (plan->src_y_num == plan->src_y_size) {
+        plan->src_y_size = plan->src_y_size != 0 ? plan->src_y_size * 2 : 256;
+        plan->src_y = erealloc(plan->src_y,
+                sizeof(*plan->src_y) * plan->src_y_size);
+    }
+
+    plan->src_y[plan->src_y_num++] = y;
+
+    tile_stretch_span_t *span = plan->spans_num != 0 ?
+            &plan->spans[plan->spans_num - 1] : NULL;
+
+    if (span != NULL && span->src_x == x && span->dest_x == x2 &&
+            span->dest_y + span->num == y2 && span->side == side &&
+            span->raw == raw) {
+        span->num++;
+        return;
+    }
+
+    if (plan->spans_num == plan->spans_size) {
+        plan->spans_size = plan->spans_size != 0 ? plan->spans_size * 2 : 64;
+        plan->spans = erealloc(plan->spans,
+                sizeof(*plan->spans) * plan->spans_size);
+    }
+
+    span = &plan->spans[plan->spans_num++];
+    span->src_x = x;
+    span->dest_x = x2;
+    span->dest_y = y2;
+    span->num = 1;
+    span->src_y = plan->src_y_num - 1;
+    span->side = side;
+    span->raw = raw;
+}
+
+/**
+ * Implements tile_stretch_ops::line for tile stretching plans; records the
+ * pixels copy_vertical_line() would copy.
+ */
+static void tile_stretch_plan_line(void *data, int src_x, int src_sy,
+        int src_ey, int dest_x, int dest_sy, int dest_ey, int side, bool extra)
+{
+    tile_stretch_plan_t *plan = data;
+
+    int min_src_y = MIN(src_sy, src_ey);
+    int max_src_y = MAX(src_sy, src_ey);
+    int min_dest_y = MIN(dest_sy, dest_ey);
+    int max_dest_y = MAX(dest_sy, dest_ey);
+    int src_h = max_src_y - min_src_y;
+    int dest_h = max_dest_y - min_dest_y;
+
+    if (dest_h == 0) {
+        int src_y = src_h == 0 ? min_src_y : (max_src_y - min_src_y) / 2;
+        tile_stretch_plan_add(plan, src_x, src_y, dest_x, min_dest_y, side,
+                false);
+    } else if (src_h == 0) {
+        for (int y = min_dest_y; y <= max_dest_y; y++) {
+            tile_stretch_plan_add(plan, src_x, min_src_y, dest_x, y, side,
+                    true);
+        }
+    } else {
+        double ratio = (double) src_h / (double) dest_h;
+
+        for (int y = 0; y <= dest_h; y++) {
+            int go_y = min_dest_y + y;
+            int get_y = (int) (min_src_y + (y * ratio));
+            tile_stretch_plan_add(plan, src_x, get_y, dest_x, go_y, side,
+                    false);
+        }
+
+        if (extra && max_dest_y + 1 < plan->dest_h) {
+            tile_stretch_plan_add(plan, src_x, src_ey, dest_x, max_dest_y + 1,
+                    side, false);
+        }
+    }
+}
+
+/**
+ * Implements tile_stretch_ops::pixel for tile stretching plans; records the
+ * pixel copy_pixel_to_pixel() would copy.
+ */
+static void tile_stretch_plan_pixel(void *data, int x, int y, int x2, int y2,
+        int side)
+{
+    tile_stretch_plan_add(data, x, y, x2, y2, side, false);
+}
+
+/**
+ * Free a tile stretching plan.
+ * @param plan
+ * Plan to free.
+ */
+static void tile_stretch_plan_free(tile_stretch_plan_t *plan)
+{
+    HARD_ASSERT(plan != NULL);
+
+    if (plan->spans != NULL) {
+        efree(plan->spans);
+    }
+
+    if (plan->src_y != NULL) {
+        efree(plan->src_y);
+    }
+
+    efree(plan);
+}
+
+/**
+ * Create a tile stretching plan.
+ * @param key
+ * Key of the plan.
+ * @return
+ * The plan.
+ */
+static tile_stretch_plan_t *tile_stretch_plan_create(
+        const tile_stretch_key_t *key)
+{
+    HARD_ASSERT(key != NULL);
+
+    static const tile_stretch_ops_t ops = {
+        tile_stretch_plan_line, tile_stretch_plan_pixel
+    };
+
+    tile_stretch_plan_t *plan = ecalloc(1, sizeof(*plan));
+    plan->key = *key;
+    plan->dest_w = key->src_w;
+    plan->dest_h = key->src_h + key->n;
+
+    double dark[TILE_STRETCH_SIDES];
+    tile_stretch_brightness(key->n, key->e, key->s, key->w, dark);
+
+    /* Same clamping and rounding as copy_pixel_to_pixel(). */
+    for (int side = 0; side < TILE_STRETCH_SIDES; side++) {
+        for (int i = 0; i < 256; i++) {
+            Uint16 val = i * dark[side];
+            plan->brightness[side][i] = MIN(255, val);
+        }
+    }
+
+    tile_stretch_walk(key->n, key->e, key->s, key->w, &ops, plan);
+    return plan;
+}
+
+/**
+ * Get the tile stretching plan for the specified source tile size and
+ * stretch values, creating it if necessary.
+ * @param src_w
+ * Source tile width.
+ * @param src_h
+ * Source tile height.
+ * @param n
+ * North stretch.
+ * @param e
+ * East stretch.
+ * @param s
+ * South stretch.
+ * @param w
+ * West stretch.
+ * @return
+ * The plan.
+ */
+static tile_stretch_plan_t *tile_stretch_plan_get(int src_w, int src_h, int n,
+        int e, int s, int w)
+{
+    tile_stretch_key_t key;
+    memset(&key, 0, sizeof(key));
+    key.src_w = src_w;
+    key.src_h = src_h;
+    key.n = n;
+    key.e = e;
+    key.s = s;
+    key.w = w;
+
+    tile_stretch_plan_t *plan;
+    HASH_FIND(hh, tile_stretch_plans, &key, sizeof(key), plan);
+
+    if (plan != NULL) {
+        return plan;
+    }
+
+    if (tile_stretch_plans_num == TILE_STRETCH_PLANS_MAX) {
+        tilestretcher_deinit();
+    }
+
+    plan = tile_stretch_plan_create(&key);
+    HASH_ADD(hh, tile_stretch_plans, key, sizeof(plan->key), plan);
+    tile_stretch_plans_num++;
+    return plan;
+}
+
+/**
+ * Copy the pixels of a tile as described by a tile stretching plan.
+ * @param plan
+ * The plan.
+ * @param src
+ * Source tile; must be in the RGBA8888 format and of the size the plan was
+ * created for.
+ * @param dest
+ * Stretched tile; must be in the RGBA8888 format and of the size described
+ * by the plan.
+ */
+static void tile_stretch_plan_run(const tile_stretch_plan_t *plan,
+        SDL_Surface *src, SDL_Surface *dest)
+{
+    const uint8_t *src_pixels = src->pixels;
+    uint8_t *dest_pixels = dest->pixels;
+
+    for (size_t i = 0; i < plan->spans_num; i++) {
+        const tile_stretch_span_t *span = &plan->spans[i];
+        const int *src_y = &plan->src_y[span->src_y];
+        const uint8_t *lut = plan->brightness[span->side];
+        uint8_t *dest_ptr = dest_pixels + span->dest_y * dest->pitch +
+                span->dest_x * 4;
+
+        for (int j = 0; j < span->num; j++, dest_ptr += dest->pitch) {
+            uint32_t pixel = *(const uint32_t *) (src_pixels +
+                    src_y[j] * src->pitch + span->src_x * 4);
+
+            if (!span->raw) {
+                uint8_t alpha = pixel & 0xff;
+
+                if (alpha == 0) {
+                    continue;
+                }
+
+                pixel = ((uint32_t) lut[(pixel >> 24) & 0xff] << 24) |
+                        ((uint32_t) lut[(pixel >> 16) & 0xff] << 16) |
+                        ((uint32_t) lut[(pixel >> 8) & 0xff] << 8) | alpha;
+            }
+
+            *(uint32_t *) dest_ptr = pixel;
+        }
+    }
+}
+
+/**
+ * Generates the bitmap ("surface") for displaying a tile after stretching.
+ *
+ * See tile_stretch_walk() for how the stretch values are interpreted. The
+ * geometry of the stretched tile is computed once for each source tile
+ * size and stretch values, and the pixels are then copied directly as
+ * described by it.
+ * @param src
+ * Source tile.
+ * @param n
+ * North stretch.
+ * @param e
+ * East stretch.
+ * @param s
+ * South stretch.
+ * @param w
+ * West stretch.
+ * @return
+ * The stretched tile, in the RGBA8888 format, NULL on failure.
+ */
+SDL_Surface *tile_stretch(SDL_Surface *src, int n, int e, int s, int w)
+{
+    HARD_ASSERT(src != NULL);
+
+    tile_stretch_plan_t *plan = tile_stretch_plan_get(src->w, src->h, n, e,
+            s, w);
+
+    SDL_Surface *source = src;
+
+    if (src->format->format != SDL_PIXELFORMAT_RGBA8888) {
+        source = SDL_ConvertSurfaceFormat(src, SDL_PIXELFORMAT_RGBA8888, 0);
+
+        if (source == NULL) {
+            return NULL;
+        }
+    }
+
+    SDL_Surface *destination = SDL_CreateRGBSurface(0, plan->dest_w,
+            plan->dest_h, 32, 0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF);
+
+    if (destination != NULL) {
+        SDL_LockSurface(source);
+        SDL_LockSurface(destination);
+        tile_stretch_plan_run(plan, source, destination);
+        SDL_UnlockSurface(source);
+        SDL_UnlockSurface(destination);
+    }
+
+    if (source != src) {
+        SDL_FreeSurface(source);
+    }
+
+    return destination;
+}
+
+/**
+ * Free all the tile stretching plans.
+ */
+void tilestretcher_deinit(void)
+{
+    tile_stretch_plan_t *plan, *tmp;
+
+    HASH_ITER(hh, tile_stretch_plans, plan, tmp) {
+        HASH_DEL(tile_stretch_plans, plan);
+        tile_stretch_plan_free(plan);
+    }
+
+    tile_stretch_plans_num = 0;
+}
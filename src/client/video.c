@@ -376,6 +376,7 @@ int video_set_size(void)
         
         SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
         SDL_RenderSetLogicalSize(ScreenRenderer, wRen, hRen);
+        screen_damage_add_all();
         
         return 1;
     }
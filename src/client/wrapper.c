@@ -33,6 +33,7 @@ void system_end(void)
     resources_deinit();
     toolkit_widget_deinit();
     client_socket_deinitialize();
+    netcapture_close();
     metaserver_clear_data();
     effects_deinit();
     sound_ambient_clear();
@@ -47,6 +48,7 @@ void system_end(void)
     settings_deinit();
     keybind_deinit();
     image_bmaps_deinit();
+    tilestretcher_deinit();
     anims_deinit();
     skills_deinit();
     spells_deinit();
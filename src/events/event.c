@@ -168,6 +168,11 @@ int Event_PollInputDevice(void)
         }
 
         switch (event.type) {
+            /* Window contents may have been lost, redraw everything. */
+        case SDL_WINDOWEVENT:
+            screen_damage_add_all();
+            break;
+
             /* Screen has been resized, update screen size. */
         case SDL_WINDOWEVENT_RESIZED:
             SDL_SetWindowSize(ScreenWindow, event.window.data1, event.window.data2);
@@ -261,6 +261,9 @@ void effects_deinit(void)
     }
 
     effects = current_effect = NULL;
+
+    /* The sprite cache is keyed on the effect overlay identifiers. */
+    sprite_cache_free_all();
 }
 
 /**
@@ -670,6 +673,16 @@ void effect_stop(void)
     current_effect = NULL;
 }
 
+/**
+ * Check whether an effect is currently playing.
+ * @return
+ * 1 if an effect is playing, 0 otherwise.
+ */
+uint8_t effect_is_playing(void)
+{
+    return current_effect != NULL ? 1 : 0;
+}
+
 /**
  * Check whether there is an overlay on the active effect (if any).
  * @return
@@ -0,0 +1,194 @@
+/**
+ * @file
+ * Screen damage API.
+ *
+ * Keeps track of the regions of ::ScreenSurface that have changed, so that
+ * each frame only those need to be recomposited and uploaded to
+ * ::ScreenTexture.
+ *
+ * Anything that draws onto the screen surface reports the area it is going
+ * to change using screen_damage_add() before the frame is composited. When
+ * the frame starts, screen_damage_begin() takes all the reported damage,
+ * which is recomposited by clipping all the rendering to its bounds, and
+ * finally uploaded using screen_damage_upload(). Damage reported while the
+ * frame is being composited is handled in the next frame.
+ */
+
+#include <global.h>
+
+/**
+ * Maximum number of separate damaged rectangles; once there are more, they
+ * are all merged into one.
+ */
+#define SCREEN_DAMAGE_RECTS_MAX 16
+
+/**
+ * Damaged rectangles.
+ */
+typedef struct screen_damage {
+    /** The rectangles; they never overlap each other. */
+    SDL_Rect rects[SCREEN_DAMAGE_RECTS_MAX];
+
+    /** Number of rectangles. */
+    size_t num;
+} screen_damage_t;
+
+/** Damage to handle in the next frame. */
+static screen_damage_t screen_damage_next;
+/** Damage being handled in the current frame. */
+static screen_damage_t screen_damage_cur;
+
+/**
+ * Report that an area of the screen has changed.
+ * @param x
+ * X position.
+ * @param y
+ * Y position.
+ * @param w
+ * Width.
+ * @param h
+ * Height.
+ */
+void screen_damage_add(int x, int y, int w, int h)
+{
+    if (ScreenSurface == NULL) {
+        return;
+    }
+
+    SDL_Rect box, screen;
+    box.x = x;
+    box.y = y;
+    box.w = w;
+    box.h = h;
+    screen.x = 0;
+    screen.y = 0;
+    screen.w = ScreenSurface->w;
+    screen.h = ScreenSurface->h;
+
+    if (!SDL_IntersectRect(&box, &screen, &box)) {
+        return;
+    }
+
+    screen_damage_t *damage = &screen_damage_next;
+
+    /* Merge with the overlapping rectangles; the merged rectangle may now
+     * overlap others, so start over whenever it grows. */
+    for (size_t i = 0; i < damage->num; ) {
+        if (SDL_HasIntersection(&box, &damage->rects[i])) {
+            SDL_UnionRect(&box, &damage->rects[i], &box);
+            damage->rects[i] = damage->rects[--damage->num];
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    if (damage->num == SCREEN_DAMAGE_RECTS_MAX) {
+        for (size_t i = 0; i < damage->num; i++) {
+            SDL_UnionRect(&box, &damage->rects[i], &box);
+        }
+
+        damage->num = 0;
+    }
+
+    damage->rects[damage->num++] = box;
+}
+
+/**
+ * Report that an area of the screen has changed.
+ * @param box
+ * The area; if empty, nothing is done.
+ */
+void screen_damage_add_rect(const SDL_Rect *box)
+{
+    HARD_ASSERT(box != NULL);
+
+    if (box->w <= 0 || box->h <= 0) {
+        return;
+    }
+
+    screen_damage_add(box->x, box->y, box->w, box->h);
+}
+
+/**
+ * Report that the whole screen has changed.
+ */
+void screen_damage_add_all(void)
+{
+    if (ScreenSurface == NULL) {
+        return;
+    }
+
+    screen_damage_next.num = 0;
+    screen_damage_add(0, 0, ScreenSurface->w, ScreenSurface->h);
+}
+
+/**
+ * Start handling the damage reported so far.
+ * @param[out] bounds
+ * Will contain the bounds of the damaged area, which must be recomposited;
+ * empty if there is none.
+ * @return
+ * True if any part of the screen is damaged, false otherwise.
+ */
+bool screen_damage_begin(SDL_Rect *bounds)
+{
+    HARD_ASSERT(bounds != NULL);
+
+    screen_damage_cur = screen_damage_next;
+    screen_damage_next.num = 0;
+
+    bounds->x = bounds->y = bounds->w = bounds->h = 0;
+
+    for (size_t i = 0; i < screen_damage_cur.num; i++) {
+        if (i == 0) {
+            *bounds = screen_damage_cur.rects[i];
+        } else {
+            SDL_UnionRect(bounds, &screen_damage_cur.rects[i], bounds);
+        }
+    }
+
+    return screen_damage_cur.num != 0;
+}
+
+/**
+ * Check whether an area is completely covered by the damage being handled
+ * in the current frame.
+ * @param box
+ * The area.
+ * @return
+ * True if the area is covered, false otherwise.
+ */
+bool screen_damage_covers(const SDL_Rect *box)
+{
+    HARD_ASSERT(box != NULL);
+
+    for (size_t i = 0; i < screen_damage_cur.num; i++) {
+        const SDL_Rect *rect = &screen_damage_cur.rects[i];
+
+        if (box->x >= rect->x && box->y >= rect->y &&
+                box->x + box->w <= rect->x + rect->w &&
+                box->y + box->h <= rect->y + rect->h) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Upload the damaged areas of the screen surface handled in the current
+ * frame to the screen texture.
+ */
+void screen_damage_upload(void)
+{
+    for (size_t i = 0; i < screen_damage_cur.num; i++) {
+        const SDL_Rect *rect = &screen_damage_cur.rects[i];
+        const uint8_t *pixels = (const uint8_t *) ScreenSurface->pixels +
+                rect->y * ScreenSurface->pitch +
+                rect->x * ScreenSurface->format->BytesPerPixel;
+        SDL_UpdateTexture(ScreenTexture, rect, pixels, ScreenSurface->pitch);
+    }
+
+    screen_damage_cur.num = 0;
+}
@@ -117,6 +117,19 @@ typedef struct widgetdata {
 
     double zoom; ///< Zoom factor of the widget.
 
+    /**
+     * Area of the screen the widget was drawn to in the last frame; empty if
+     * it was not drawn.
+     */
+    SDL_Rect damage_box;
+
+    /**
+     * If 1, the widget sets its redraw flag whenever what it draws changes,
+     * even though it draws directly onto the screen surface. Otherwise such
+     * widgets are assumed to change every frame.
+     */
+    uint8_t damage_tracked;
+
     void (*draw_func)(struct widgetdata *widget);
 
     void (*background_func)(struct widgetdata *widget, int draw);
@@ -81,6 +81,8 @@ void popup_destroy(popup_struct *popup)
     }
 
     DL_DELETE(popup_head, popup);
+    screen_damage_add(popup->x, popup->y, popup->surface->w,
+            popup->surface->h);
     SDL_FreeSurface(popup->surface);
 
     if (popup->buf) {
@@ -187,6 +189,22 @@ void popup_render_all(void)
     }
 }
 
+/**
+ * Report the areas of the screen the visible popups will be drawn to as
+ * damaged; popups are redrawn every frame.
+ */
+void popup_damage(void)
+{
+    popup_struct *popup;
+
+    DL_FOREACH(popup_head, popup)
+    {
+        screen_damage_add(ScreenSurface->w / 2 - popup->surface->w / 2,
+                ScreenSurface->h / 2 - popup->surface->h / 2,
+                popup->surface->w, popup->surface->h);
+    }
+}
+
 /**
  * Handle popup button event.
  * @param button
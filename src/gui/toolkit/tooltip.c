@@ -20,6 +20,8 @@ static int tooltip_w = -1;
 static uint32_t tooltip_created = 0;
 static uint32_t tooltip_delay = 0;
 static uint8_t tooltip_opacity = 0;
+/** Area of the screen the tooltip was last drawn to. */
+static SDL_Rect tooltip_box;
 
 /**
  * Creates a new tooltip. This must be called every frame in order for
@@ -86,6 +88,63 @@ void tooltip_multiline(int max_width)
     tooltip_w = box.w;
 }
 
+/**
+ * Calculate where the tooltip will be shown.
+ * @param[out] box
+ * Will contain the tooltip's background box.
+ * @param[out] text_box
+ * Will contain the tooltip's text box.
+ */
+static void tooltip_get_box(SDL_Rect *box, SDL_Rect *text_box)
+{
+    text_box->w = tooltip_w;
+    text_box->h = tooltip_h;
+
+    if (tooltip_w == -1 || tooltip_h == -1) {
+        text_get_width_height(tooltip_font,
+                              tooltip_text,
+                              TEXT_MARKUP,
+                              text_box,
+                              tooltip_w == -1 ? &text_box->w : NULL,
+                              tooltip_h == -1 ? &text_box->h : NULL);
+    }
+
+    /* Generate the tooltip's background. */
+    box->x = tooltip_x + 9;
+    box->y = tooltip_y + 17;
+    box->w = text_box->w + 4;
+    box->h = text_box->h;
+
+    /* Push the tooltip to the left if it would go beyond maximum screen
+     * size. */
+    if (box->x + box->w >= ScreenSurface->w) {
+        box->x -= (box->x + box->w + 1) - ScreenSurface->w;
+    }
+
+    if (box->y + box->h >= ScreenSurface->h) {
+        box->y -= (box->y + box->h + 1) - ScreenSurface->h;
+    }
+}
+
+/**
+ * Report the areas of the screen the tooltip was last drawn to and will be
+ * drawn to as damaged.
+ */
+void tooltip_damage(void)
+{
+    screen_damage_add_rect(&tooltip_box);
+    tooltip_box.w = tooltip_box.h = 0;
+
+    if (tooltip_x == -1 || tooltip_y == -1) {
+        return;
+    }
+
+    SDL_Rect box, text_box;
+    tooltip_get_box(&box, &text_box);
+    /* The background box includes its right and bottom edges. */
+    screen_damage_add(box.x, box.y, box.w + 1, box.h + 1);
+}
+
 /**
  * Actually show the tooltip.
  */
@@ -109,32 +168,14 @@ void tooltip_show(void)
         tooltip_opacity = 255;
     }
 
-    text_box.w = tooltip_w;
-    text_box.h = tooltip_h;
-
-    if (tooltip_w == -1 || tooltip_h == -1) {
-        text_get_width_height(tooltip_font,
-                              tooltip_text,
-                              TEXT_MARKUP,
-                              &text_box,
-                              tooltip_w == -1 ? &text_box.w : NULL,
-                              tooltip_h == -1 ? &text_box.h : NULL);
-    }
-
-    /* Generate the tooltip's background. */
-    box.x = tooltip_x + 9;
-    box.y = tooltip_y + 17;
-    box.w = text_box.w + 4;
-    box.h = text_box.h;
-
-    /* Push the tooltip to the left if it would go beyond maximum screen
-     * size. */
-    if (box.x + box.w >= ScreenSurface->w) {
-        box.x -= (box.x + box.w + 1) - ScreenSurface->w;
-    }
+    tooltip_get_box(&box, &text_box);
+    tooltip_box = box;
+    tooltip_box.w++;
+    tooltip_box.h++;
 
-    if (box.y + box.h >= ScreenSurface->h) {
-        box.y -= (box.y + box.h + 1) - ScreenSurface->h;
+    /* Created while drawing this frame; show it next frame. */
+    if (!screen_damage_covers(&tooltip_box)) {
+        screen_damage_add_rect(&tooltip_box);
     }
 
     boxRGBA(ScreenSurface, box.x, box.y, box.x + box.w, box.y + box.h, 255, 255, 255, tooltip_opacity);
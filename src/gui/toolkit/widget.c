@@ -455,6 +455,7 @@ void remove_widget_object_intern(widgetdata *widget)
 {
     widgetdata *tmp;
 
+    screen_damage_add_rect(&widget->damage_box);
     remove_widget_inv(widget);
 
     /* If this widget happens to be the owner of an event, keeping them pointed
@@ -1640,6 +1641,87 @@ int widgets_need_redraw(void)
     return widgets_need_redraw_rec(widget_list_head);
 }
 
+/**
+ * Report the areas of the screen a widget and the widgets inside it were
+ * drawn to as damaged.
+ * @param widget
+ * The widget.
+ */
+static void widget_damage_tree(widgetdata *widget)
+{
+    screen_damage_add_rect(&widget->damage_box);
+
+    for (widgetdata *tmp = widget->inv; tmp != NULL; tmp = tmp->next) {
+        widget_damage_tree(tmp);
+    }
+}
+
+/**
+ * Get the area of the screen a widget draws to.
+ * @param widget
+ * The widget.
+ * @param[out] box
+ * Will contain the area.
+ */
+static void widget_get_damage_box(widgetdata *widget, SDL_Rect *box)
+{
+    box->x = widget_x(widget);
+    box->y = widget_y(widget);
+    box->w = widget_w(widget);
+    box->h = widget_h(widget);
+}
+
+/**
+ * Call the background handlers of widgets, and report the areas of the
+ * screen that the widgets will change when drawn as damaged.
+ * @param draw
+ * Whether the widgets are being drawn.
+ * @param widget
+ * Widget to start at.
+ */
+static void widgets_damage_rec(int draw, widgetdata *widget)
+{
+    for (; widget; widget = widget->prev) {
+        if (widget->background_func) {
+            widget->background_func(widget, draw);
+        }
+
+        SDL_Rect box = {0, 0, 0, 0};
+
+        if (draw && widget->show && !widget->hidden && widget->draw_func) {
+            widget_get_damage_box(widget, &box);
+
+            if (widget->redraw || (widget->texture_type ==
+                    WIDGET_TEXTURE_TYPE_NONE && !widget->damage_tracked)) {
+                screen_damage_add_rect(&box);
+            }
+        }
+
+        /* Moved, resized, shown or hidden. */
+        if (!SDL_RectEquals(&box, &widget->damage_box)) {
+            screen_damage_add_rect(&widget->damage_box);
+            screen_damage_add_rect(&box);
+            widget->damage_box = box;
+        }
+
+        if (widget->inv_rev) {
+            widgets_damage_rec(widget->show ? draw : 0, widget->inv_rev);
+        }
+    }
+}
+
+/**
+ * Call the background handlers of all the widgets, and report the areas of
+ * the screen that the widgets will change when drawn as damaged. Must be
+ * called before process_widgets().
+ * @param draw
+ * Whether the widgets are being drawn.
+ */
+void widgets_damage(int draw)
+{
+    widgets_damage_rec(draw, widget_list_foot);
+}
+
 /**
  * The priority list is a binary tree, so we walk the tree by using loops and
  * recursions.
@@ -1652,10 +1734,6 @@ static void process_widgets_rec(int draw, widgetdata *widget)
     uint8_t redraw;
 
     for (; widget; widget = widget->prev) {
-        if (widget->background_func) {
-            widget->background_func(widget, draw);
-        }
-
         if (draw && widget->show && !widget->hidden && widget->draw_func) {
             if (widget->resize_flags) {
                 if (!widget_event_resize.active &&
@@ -1731,6 +1809,12 @@ static void process_widgets_rec(int draw, widgetdata *widget)
             }
 
             widget->redraw -= redraw;
+
+            /* Redraw requested while drawing this frame, after the damage
+             * was collected; make sure it gets to the screen next frame. */
+            if (redraw != 0 && !screen_damage_covers(&widget->damage_box)) {
+                screen_damage_add_rect(&widget->damage_box);
+            }
         }
 
         /* we want to process the widgets starting from the right hand side of
@@ -1742,9 +1826,12 @@ static void process_widgets_rec(int draw, widgetdata *widget)
 }
 
 /**
- * Traverse through all the widgets and call the corresponding handlers.
+ * Traverse through all the widgets and draw them.
  * This is now a wrapper function just to make the sanity checks before
  * continuing with the actual handling.
+ *
+ * The background handlers are called by widgets_damage(), which must be
+ * called first.
  */
 void process_widgets(int draw)
 {
@@ -1823,6 +1910,9 @@ void SetPriorityWidget(widgetdata *node)
         return;
     }
 
+    /* The node will now be drawn on top of its siblings. */
+    widget_damage_tree(node);
+
     /* Unlink node from its current position in the priority tree. */
 
     /* node is last sibling, clear the pointer of the previous sibling */
@@ -35,6 +35,11 @@ typedef struct widget_fps_struct {
      * Real number of frames drawn since last calculation.
      */
     uint32_t frames_real;
+
+    /**
+     * Number of animated map cells.
+     */
+    size_t animated;
 } widget_fps_struct;
 
 /** @copydoc widgetdata::draw_func */
@@ -49,7 +54,8 @@ static void widget_draw(widgetdata *widget)
     tmp = widget->subwidget;
 
     text_show_format(widget->surface, FONT_ARIAL11, 4, 4, COLOR_WHITE, 0, NULL,
-            "%d (%d)", tmp->current, tmp->current_real);
+            "%d (%d) A:%" PRIu64, tmp->current, tmp->current_real,
+            (uint64_t) tmp->animated);
 }
 
 /** @copydoc widgetdata::background_func */
@@ -65,10 +71,12 @@ static void widget_background(widgetdata *widget, int draw)
 
     if (tmp->lasttime < ticks - 1000) {
         if (tmp->current != tmp->frames ||
-                tmp->current_real != tmp->frames_real) {
+                tmp->current_real != tmp->frames_real ||
+                tmp->animated != map_anim_index_count()) {
             widget->redraw = 1;
         }
 
+        tmp->animated = map_anim_index_count();
         tmp->lasttime = ticks;
         tmp->current = tmp->frames;
         tmp->current_real = tmp->frames_real;
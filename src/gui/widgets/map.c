@@ -25,10 +25,124 @@ static int map_width;
  * Map's height.
  */
 static int map_height;
+/**
+ * Physical X index in the cells array of the logical 0,0 cell.
+ */
+static int map_origin_x;
+/**
+ * Physical Y index in the cells array of the logical 0,0 cell.
+ */
+static int map_origin_y;
+/**
+ * Number of cells the cells array has been allocated for.
+ */
+static size_t cells_num;
 /**
  * Zoomed map.
  */
 static SDL_Surface *zoomed = NULL;
+/**
+ * Scaler used to update ::zoomed.
+ */
+static pixel_scaler_t map_zoom_scaler;
+/**
+ * Maximum number of separate areas to redraw in a partial map redraw; if
+ * there are more, the whole map is redrawn.
+ */
+#define MAP_DIRTY_RECTS_MAX 16
+
+/**
+ * Number of cells that changed since the map was last drawn.
+ */
+static size_t map_dirty_num = 0;
+/**
+ * Position of a map cell on the minimap surface.
+ */
+#define MAP_MINIMAP_X(_x, _y) \
+    (((_x) - (_y) + map_height * MAP_FOW_SIZE - 1) * (MAP_MINIMAP_TILE_W / 2))
+#define MAP_MINIMAP_Y(_x, _y) (((_x) + (_y)) * (MAP_MINIMAP_TILE_H / 2))
+/**
+ * Number of cells that changed since the minimap was last updated.
+ */
+static size_t map_minimap_dirty_num = 0;
+/**
+ * Whether all the cells of the minimap must be updated.
+ */
+static bool map_minimap_full = true;
+/**
+ * Minimum alpha of an object's pixel for the object to be picked when the
+ * mouse is over that pixel.
+ */
+#define MAP_PICK_ALPHA 128
+/**
+ * ID of an object in ::map_pick.
+ */
+#define MAP_PICK_ID(_x, _y, _map_layer) \
+    ((((uint32_t) (_y) * map_width * MAP_FOW_SIZE + (_x)) * NUM_REAL_LAYERS + \
+    (_map_layer)) + 1)
+/**
+ * ID buffer of the map surface, used for picking the object under the
+ * mouse. Holds the ID (see MAP_PICK_ID()) of the object drawn on top at
+ * each pixel of the map surface, or 0 if there is none. Written along with
+ * the map surface, using the shapes of the objects' sprites.
+ */
+static uint32_t *map_pick = NULL;
+/** Width of ::map_pick. */
+static int map_pick_w = 0;
+/** Height of ::map_pick. */
+static int map_pick_h = 0;
+/** Whether ::map_pick is in use and up to date with the map surface. */
+static bool map_pick_valid = false;
+/**
+ * Player height offset the map was last fully drawn with.
+ */
+static int map_drawn_height_offset;
+/**
+ * Whether the retained map draw list is up to date.
+ */
+static bool map_draw_list_valid = false;
+/**
+ * Index of the visible cells with animated or glowing objects, as X/Y
+ * coordinates relative to the visible area.
+ */
+static struct {
+    int16_t x; ///< X coordinate.
+    int16_t y; ///< Y coordinate.
+} *map_anim_index = NULL;
+/** Number of cells in ::map_anim_index. */
+static size_t map_anim_index_num = 0;
+/** Allocated number of cells in ::map_anim_index. */
+static size_t map_anim_index_size = 0;
+/**
+ * Distance bucket of the target index.
+ */
+typedef struct map_target_bucket {
+    struct {
+        int16_t x; ///< X coordinate.
+        int16_t y; ///< Y coordinate.
+    } *cells; ///< The cells.
+    size_t num; ///< Number of cells.
+    size_t size; ///< Allocated number of cells.
+} map_target_bucket_t;
+/**
+ * Index of the visible cells with targetable objects, bucketed by their
+ * distance from the player; each bucket holds X/Y coordinates relative to
+ * the visible area.
+ */
+static map_target_bucket_t *map_target_index = NULL;
+/** Number of distance buckets in ::map_target_index. */
+static size_t map_target_index_num = 0;
+/**
+ * Objects that have already been targeted in the current targeting cycle.
+ */
+static struct map_target_visited {
+    uint32_t count; ///< Object's UID.
+    UT_hash_handle hh; ///< Hash handle.
+} *map_target_visited = NULL;
+/** Distance bucket to continue the targeting cycle from. */
+static size_t map_target_cursor_bucket = 0;
+/** Position in the distance bucket to continue the targeting cycle from. */
+static size_t map_target_cursor_pos = 0;
 /**
  * Map animation queue.
  */
@@ -63,6 +177,41 @@ static int right_click_ticks = -1;
  */
 static bool tiles_debug = false;
 
+/**
+ * Entry in the interned map strings table.
+ */
+typedef struct map_string {
+    char *str; ///< The string.
+    uint32_t refcount; ///< Number of map cell layers referencing the string.
+    map_string_id_t id; ///< ID of the string.
+    UT_hash_handle hh; ///< Hash handle.
+} map_string_t;
+
+/**
+ * Interned map strings, indexed by their IDs. ID 0 is never used.
+ */
+static map_string_t **map_strings;
+/**
+ * Number of allocated entries in ::map_strings.
+ */
+static size_t map_strings_size;
+/**
+ * Number of used IDs in ::map_strings.
+ */
+static size_t map_strings_num;
+/**
+ * Hash table of the interned map strings, for looking them up by value.
+ */
+static map_string_t *map_strings_hash;
+/**
+ * IDs that have been released and can be re-used.
+ */
+static map_string_id_t *map_strings_free;
+/**
+ * Number of entries in ::map_strings_free.
+ */
+static size_t map_strings_free_num;
+
 static int get_top_floor_height(struct MapCell *cell, int sub_layer);
 
 /**
@@ -122,6 +271,158 @@ void load_mapdef_dat(void)
     fclose(stream);
 }
 
+/**
+ * Acquire an ID for the specified string from the interned map strings
+ * table, adding it to the table if necessary.
+ *
+ * @param str
+ * String to intern.
+ * @return
+ * ID of the string. Must be released with map_string_release().
+ */
+static map_string_id_t
+map_string_intern (const char *str)
+{
+    HARD_ASSERT(str != NULL);
+
+    if (*str == '\0') {
+        return 0;
+    }
+
+    map_string_t *entry;
+    HASH_FIND_STR(map_strings_hash, str, entry);
+
+    if (entry != NULL) {
+        entry->refcount++;
+        return entry->id;
+    }
+
+    map_string_id_t id;
+
+    if (map_strings_free_num != 0) {
+        id = map_strings_free[--map_strings_free_num];
+    } else {
+        if (map_strings_num + 1 > UINT16_MAX) {
+            LOG(BUG, "Interned map strings table is full, dropping: %s", str);
+            return 0;
+        }
+
+        /* ID 0 is reserved for empty strings. */
+        id = ++map_strings_num;
+
+        if (id >= map_strings_size) {
+            map_strings_size = MAX(64, map_strings_size * 2);
+            map_strings = erealloc(map_strings,
+                                   sizeof(*map_strings) * map_strings_size);
+            map_strings_free = erealloc(map_strings_free,
+                                        sizeof(*map_strings_free) *
+                                        map_strings_size);
+        }
+    }
+
+    entry = emalloc(sizeof(*entry));
+    entry->str = estrdup(str);
+    entry->refcount = 1;
+    entry->id = id;
+    HASH_ADD_KEYPTR(hh, map_strings_hash, entry->str, strlen(entry->str),
+                    entry);
+    map_strings[id] = entry;
+
+    return id;
+}
+
+/**
+ * Release a string ID acquired with map_string_intern().
+ *
+ * @param id
+ * ID to release.
+ */
+static void
+map_string_release (map_string_id_t id)
+{
+    if (id == 0) {
+        return;
+    }
+
+    map_string_t *entry = map_strings[id];
+    SOFT_ASSERT(entry != NULL, "Releasing unknown map string ID: %u", id);
+
+    if (--entry->refcount != 0) {
+        return;
+    }
+
+    HASH_DEL(map_strings_hash, entry);
+    efree(entry->str);
+    efree(entry);
+    map_strings[id] = NULL;
+    map_strings_free[map_strings_free_num++] = id;
+}
+
+/**
+ * Acquire the string with the specified ID from the interned map strings
+ * table.
+ *
+ * @param id
+ * ID of the string.
+ * @return
+ * The string; never NULL.
+ */
+static const char *
+map_string_get (map_string_id_t id)
+{
+    if (id == 0 || map_strings[id] == NULL) {
+        return "";
+    }
+
+    return map_strings[id]->str;
+}
+
+/**
+ * Free all the interned map strings.
+ *
+ * Should only be used when all the map cells are about to be cleared.
+ */
+static void
+map_strings_clear (void)
+{
+    map_string_t *entry, *tmp;
+    HASH_ITER(hh, map_strings_hash, entry, tmp) {
+        HASH_DEL(map_strings_hash, entry);
+        efree(entry->str);
+        efree(entry);
+    }
+
+    if (map_strings != NULL) {
+        efree(map_strings);
+        map_strings = NULL;
+    }
+
+    if (map_strings_free != NULL) {
+        efree(map_strings_free);
+        map_strings_free = NULL;
+    }
+
+    map_strings_size = 0;
+    map_strings_num = 0;
+    map_strings_free_num = 0;
+}
+
+/**
+ * Release all the interned strings referenced by a map cell.
+ *
+ * @param cell
+ * The map cell.
+ */
+static void
+map_cell_release_strings (struct MapCell *cell)
+{
+    for (int layer = 0; layer < NUM_REAL_LAYERS; layer++) {
+        map_string_release(cell->pname[layer]);
+        map_string_release(cell->pcolor[layer]);
+        map_string_release(cell->glow[layer]);
+    }
+}
+
 /**
  * Clear the map.
  * @param hard
@@ -129,20 +430,34 @@ void load_mapdef_dat(void)
  */
 void clear_map(bool hard)
 {
-    size_t cells_size;
+    size_t num;
 
     /* Cache the map width and height. */
     map_width = setting_get_int(OPT_CAT_MAP, OPT_MAP_WIDTH);
     map_height = setting_get_int(OPT_CAT_MAP, OPT_MAP_HEIGHT);
 
-    cells_size = sizeof(*cells) * map_width * MAP_FOW_SIZE * map_height *
-            MAP_FOW_SIZE;
+    num = map_width * MAP_FOW_SIZE * map_height * MAP_FOW_SIZE;
+
+    if (cells == NULL || cells_num != num) {
+        if (cells != NULL) {
+            efree(cells);
+        }
 
-    if (cells == NULL) {
-        cells = emalloc(cells_size);
+        cells = emalloc(sizeof(*cells) * num);
+        cells_num = num;
     }
 
-    memset(cells, 0, cells_size);
+    map_strings_clear();
+    memset(cells, 0, sizeof(*cells) * num);
+    map_origin_x = 0;
+    map_origin_y = 0;
+    map_dirty_num = 0;
+    map_minimap_full = true;
+    map_pick_valid = false;
+    map_draw_list_valid = false;
+    map_anim_index_num = 0;
+    map_target_index_clear();
+    map_target_cycle_reset();
     sound_ambient_clear();
     map_anims_clear();
 
@@ -183,1317 +498,3165 @@ map_update_size (int w, int h)
 }
 
 /**
- * Scroll the map.
- * @param dx
- * X offset.
- * @param dy
- * Y offset.
- * @param old_w
- * Old width. 0 if width hasn't changed.
- * @param old_h
- * Old height. 0 if height hasn't changed.
+ * Check whether the specified logical cell coordinates are in the visible
+ * (middle) part of the cells array.
+ *
+ * @param x
+ * X coordinate.
+ * @param y
+ * Y coordinate.
+ * @return
+ * Whether the coordinates are visible.
  */
-void display_mapscroll(int dx, int dy, int old_w, int old_h)
+static inline bool
+map_cell_is_visible (int x, int y)
 {
-    int x, y, w, h;
-    struct MapCell *cells_old;
-
-    w = map_width * MAP_FOW_SIZE;
-    h = map_height * MAP_FOW_SIZE;
-
-    if (old_w == 0) {
-        old_w = w;
-    }
+    return x >= MAP_STARTX && x < MAP_STARTX + map_width &&
+           y >= MAP_STARTY && y < MAP_STARTY + map_height;
+}
 
-    if (old_h == 0) {
-        old_h = h;
+/**
+ * Mark a map cell as changed, so that it gets redrawn.
+ *
+ * @param x
+ * Logical X coordinate of the cell.
+ * @param y
+ * Logical Y coordinate of the cell.
+ */
+static void
+map_cell_set_dirty (int x, int y)
+{
+    if (x < 0 || y < 0 || x >= map_width * MAP_FOW_SIZE ||
+        y >= map_height * MAP_FOW_SIZE) {
+        return;
     }
 
-    cells_old = cells;
-    cells = emalloc(sizeof(*cells) * w * h);
+    struct MapCell *cell = MAP_CELL_GET(x, y);
 
-    for (x = 0; x < w; x++) {
-        for (y = 0; y < h; y++) {
-            if (x + dx < 0 || x + dx >= old_w || y + dy < 0 ||
-                    y + dy >= old_h) {
-                memset(&(cells[y * w + x]), 0, sizeof(struct MapCell));
-            } else {
-                memcpy(&(cells[y * w + x]),
-                        &(cells_old[(y + dy) * old_w + x + dx]),
-                        sizeof(struct MapCell));
-            }
+    if (!cell->dirty) {
+        cell->dirty = 1;
+        map_dirty_num++;
+    }
+}
 
-            if (x < map_width * (MAP_FOW_SIZE / 2) ||
-                    x >= map_width + map_width * (MAP_FOW_SIZE / 2) ||
-                    y < map_height * (MAP_FOW_SIZE / 2) ||
-                    y >= map_height + map_height * (MAP_FOW_SIZE / 2)) {
-                cells[y * w + x].fow = 1;
-            }
-        }
+/**
+ * Mark a map cell as changed, so that it gets updated on the minimap.
+ *
+ * @param x
+ * Logical X coordinate of the cell.
+ * @param y
+ * Logical Y coordinate of the cell.
+ */
+static void
+map_minimap_set_dirty (int x, int y)
+{
+    if (x < 0 || y < 0 || x >= map_width * MAP_FOW_SIZE ||
+        y >= map_height * MAP_FOW_SIZE) {
+        return;
     }
 
-    efree(cells_old);
+    struct MapCell *cell = MAP_CELL_GET(x, y);
 
-    sound_ambient_mapcroll(dx, dy);
-    map_anims_mapscroll(dx, dy);
-    cpl.target_object_index = 0;
+    if (!cell->minimap_dirty) {
+        cell->minimap_dirty = 1;
+        map_minimap_dirty_num++;
+    }
 }
 
 /**
- * Update map's name.
- * @param name
- * New map name.
+ * Mark a map cell as changed after its objects have changed.
+ *
+ * Objects near the player are culled depending on the walls north and west
+ * of them, so the cells south and east of the changed one are marked as
+ * well.
+ *
+ * @param x
+ * X coordinate of the cell, relative to the visible area.
+ * @param y
+ * Y coordinate of the cell, relative to the visible area.
  */
-void update_map_name(const char *name)
+static void
+map_cell_set_changed (int x, int y)
 {
-    snprintf(MapData.name_new, sizeof(MapData.name_new), "%s", name);
+    map_draw_list_valid = false;
+    map_minimap_set_dirty(MAP_STARTX + x, MAP_STARTY + y);
+
+    for (int dx = 0; dx <= 2; dx++) {
+        for (int dy = 0; dy <= 2; dy++) {
+            map_cell_set_dirty(MAP_STARTX + x + dx, MAP_STARTY + y + dy);
+        }
+    }
 }
 
 /**
- * Update map's weather.
- * @param weather
- * New weather.
+ * Get the layers of a visible cell that have animated or glowing objects.
+ *
+ * @param cell
+ * The cell.
+ * @return
+ * Bitmask of the layers; 0 if the cell is in the fog of war.
  */
-void update_map_weather(const char *weather)
+static uint64_t
+map_anim_index_layers (struct MapCell *cell)
 {
-    effect_start(weather);
+    uint64_t layers = 0;
+
+    if (!cell->fow) {
+        for (int layer = 0; layer < NUM_REAL_LAYERS; layer++) {
+            if (cell->glow_speed[layer] > 1 || cell->anim_speed[layer] != 0) {
+                layers |= UINT64_C(1) << layer;
+            }
+        }
+    }
+
+    return layers;
 }
 
 /**
- * Update map's height difference rendering flag.
+ * Update the animated cells index for a visible cell whose objects have
+ * changed.
+ *
+ * @param x
+ * X coordinate of the cell, relative to the visible area.
+ * @param y
+ * Y coordinate of the cell, relative to the visible area.
  */
-void update_map_height_diff(uint8_t height_diff)
+static void
+map_anim_index_update (int x, int y)
 {
-    MapData.height_diff = height_diff;
+    struct MapCell *cell = MAP_CELL_GET_MIDDLE(x, y);
+    uint64_t layers = map_anim_index_layers(cell);
+
+    if (layers != 0 && cell->anim_layers == 0) {
+        if (map_anim_index_num == map_anim_index_size) {
+            map_anim_index_size = map_anim_index_size != 0 ?
+                                  map_anim_index_size * 2 : 64;
+            map_anim_index = erealloc(map_anim_index,
+                                      sizeof(*map_anim_index) *
+                                      map_anim_index_size);
+        }
+
+        cell->anim_index = map_anim_index_num;
+        map_anim_index[map_anim_index_num].x = x;
+        map_anim_index[map_anim_index_num].y = y;
+        map_anim_index_num++;
+    } else if (layers == 0 && cell->anim_layers != 0) {
+        /* Move the last cell in the index into the removed one's place. */
+        map_anim_index[cell->anim_index] =
+            map_anim_index[--map_anim_index_num];
+
+        if (cell->anim_index != map_anim_index_num) {
+            MAP_CELL_GET_MIDDLE(map_anim_index[cell->anim_index].x,
+                                map_anim_index[cell->anim_index].y)->
+                anim_index = cell->anim_index;
+        }
+    }
+
+    cell->anim_layers = layers;
 }
 
 /**
- * Update map's region name.
- * @param region_name
- * New region name.
+ * Clear the animated cells index.
  */
-void update_map_region_name(const char *region_name)
+static void
+map_anim_index_clear (void)
 {
-    if (strcmp(MapData.region_name, region_name) == 0) {
-        return;
+    for (size_t i = 0; i < map_anim_index_num; i++) {
+        MAP_CELL_GET_MIDDLE(map_anim_index[i].x,
+                            map_anim_index[i].y)->anim_layers = 0;
     }
 
-    snprintf(VS(MapData.region_name), "%s", region_name);
-    region_map_update(MapData.region_map, region_name);
+    map_anim_index_num = 0;
 }
 
 /**
- * Update map's region long name.
- * @param region_longname
- * New region long name.
+ * Rebuild the animated cells index from the visible cells.
  */
-void update_map_region_longname(const char *region_longname)
+static void
+map_anim_index_rebuild (void)
 {
-    snprintf(VS(MapData.region_longname), "%s", region_longname);
+    map_anim_index_clear();
+
+    for (int x = 0; x < map_width; x++) {
+        for (int y = 0; y < map_height; y++) {
+            map_anim_index_update(x, y);
+        }
+    }
 }
 
 /**
- * Update map's path.
- * @param map_path
- * New map path.
+ * Get the number of visible cells with animated or glowing objects.
+ *
+ * @return
+ * Number of animated cells.
  */
-void update_map_path(const char *map_path)
+size_t
+map_anim_index_count (void)
 {
-    snprintf(VS(MapData.map_path), "%s", map_path);
+    return map_anim_index_num;
 }
 
 /**
- * Updates the map's in_building state flag.
+ * Get the distance bucket of a visible cell in the target index.
  *
- * When entering a building, clears FoW objects from effect layer with non-zero
- * sub-layer.
- * @param in_building
- * New in_building state.
+ * @param x
+ * X coordinate of the cell, relative to the visible area.
+ * @param y
+ * Y coordinate of the cell, relative to the visible area.
+ * @return
+ * The bucket.
  */
-void map_update_in_building(uint8_t in_building)
+static size_t
+map_target_index_bucket (int x, int y)
 {
-    if (in_building && !MapData.in_building) {
-        int x, y;
-        struct MapCell *cell;
-        int layer, sub_layer;
+    double dx = x - map_width / 2.0;
+    double dy = y - map_height / 2.0;
 
-        for (x = 0; x < map_width * MAP_FOW_SIZE; x++) {
-            for (y = 0; y < map_height * MAP_FOW_SIZE; y++) {
-                cell = MAP_CELL_GET(x, y);
+    return isqrt(dx * dx + dy * dy);
+}
 
-                if (!cell->fow) {
-                    continue;
-                }
+/**
+ * Get the layers of a visible cell that have targetable objects.
+ *
+ * @param cell
+ * The cell.
+ * @return
+ * Bitmask of the layers; 0 if the cell is in the fog of war.
+ */
+static uint64_t
+map_target_index_layers (struct MapCell *cell)
+{
+    uint64_t layers = 0;
 
-                for (sub_layer = MapData.player_sub_layer + 1;
-                        sub_layer < NUM_SUB_LAYERS; sub_layer++) {
-                    for (layer = LAYER_FLOOR; layer <= NUM_LAYERS; layer++) {
-                        cell->faces[GET_MAP_LAYER(layer, sub_layer)] = 0;
-                    }
-                }
+    if (!cell->fow) {
+        for (int layer = 0; layer < NUM_REAL_LAYERS; layer++) {
+            if (cell->faces[layer] != 0 &&
+                cell->target_object_count[layer] != 0) {
+                layers |= UINT64_C(1) << layer;
             }
         }
     }
 
-    MapData.in_building = in_building;
+    return layers;
 }
 
 /**
- * Get player's direction.
- * @return
- * Player's direction.
+ * Update the target index for a visible cell whose objects have changed.
+ *
+ * @param x
+ * X coordinate of the cell, relative to the visible area.
+ * @param y
+ * Y coordinate of the cell, relative to the visible area.
  */
-int map_get_player_direction(void)
+static void
+map_target_index_update (int x, int y)
 {
-    struct MapCell *cell;
-    int direction;
+    struct MapCell *cell = MAP_CELL_GET_MIDDLE(x, y);
+    uint64_t layers = map_target_index_layers(cell);
 
-    cell = MAP_CELL_GET_MIDDLE(map_width - (map_width / 2) - 1,
-            map_height - (map_height / 2) - 1);
+    if ((layers != 0) == (cell->target_layers != 0)) {
+        cell->target_layers = layers;
+        return;
+    }
 
-    direction = cell->anim_facing[GET_MAP_LAYER(LAYER_LIVING,
-            MapData.player_sub_layer)];
+    size_t bucket = map_target_index_bucket(x, y);
+    HARD_ASSERT(bucket < map_target_index_num);
+    map_target_bucket_t *index = &map_target_index[bucket];
 
-    if (direction == 0) {
-        return 1;
+    if (layers != 0) {
+        if (index->num == index->size) {
+            index->size = index->size != 0 ? index->size * 2 : 16;
+            index->cells = erealloc(index->cells,
+                                    sizeof(*index->cells) * index->size);
+        }
+
+        cell->target_index = index->num;
+        index->cells[index->num].x = x;
+        index->cells[index->num].y = y;
+        index->num++;
+    } else {
+        /* Move the last cell in the bucket into the removed one's place. */
+        index->cells[cell->target_index] = index->cells[--index->num];
+
+        if (cell->target_index != index->num) {
+            MAP_CELL_GET_MIDDLE(index->cells[cell->target_index].x,
+                                index->cells[cell->target_index].y)->
+                target_index = cell->target_index;
+        }
     }
 
-    return direction - 1;
+    cell->target_layers = layers;
 }
 
 /**
- * Get real map X/Y coordinates adjusted for player's position.
- * @param[out] x Will contain X coordinate.
- * @param[out] y Will contain Y coordinate.
+ * Clear the target index, and make sure it has enough distance buckets for
+ * the current map size.
  */
-void map_get_real_coords(int *x, int *y)
+static void
+map_target_index_clear (void)
 {
-    *x = MapData.posx - (map_width / 2);
-    *y = MapData.posy - (map_height / 2);
+    for (size_t i = 0; i < map_target_index_num; i++) {
+        for (size_t j = 0; j < map_target_index[i].num; j++) {
+            MAP_CELL_GET_MIDDLE(map_target_index[i].cells[j].x,
+                                map_target_index[i].cells[j].y)->
+                target_layers = 0;
+        }
+
+        map_target_index[i].num = 0;
+    }
+
+    /* The corner cells are the farthest ones from the player. */
+    size_t num = map_target_index_bucket(0, 0) + 1;
+
+    if (num > map_target_index_num) {
+        map_target_index = erealloc(map_target_index,
+                                    sizeof(*map_target_index) * num);
+        memset(&map_target_index[map_target_index_num], 0,
+               sizeof(*map_target_index) * (num - map_target_index_num));
+        map_target_index_num = num;
+    }
+
+    map_target_cursor_bucket = 0;
+    map_target_cursor_pos = 0;
 }
 
 /**
- * Initialize map's data.
- * @param xl
- * Map width.
- * @param yl
- * Map height.
- * @param px
- * Player's X position.
- * @param py
- * Player's Y position.
+ * Rebuild the target index from the visible cells.
  */
-void init_map_data(int xl, int yl, int px, int py)
+static void
+map_target_index_rebuild (void)
 {
-    if (xl != -1) {
-        MapData.xlen = xl;
-    }
+    map_target_index_clear();
 
-    if (yl != -1) {
-        MapData.ylen = yl;
+    for (int x = 0; x < map_width; x++) {
+        for (int y = 0; y < map_height; y++) {
+            map_target_index_update(x, y);
+        }
     }
+}
 
-    if (px != -1) {
-        MapData.posx = px;
+/**
+ * Start a new targeting cycle, forgetting which objects have been targeted.
+ */
+static void
+map_target_cycle_reset (void)
+{
+    struct map_target_visited *visited, *tmp;
+
+    HASH_ITER(hh, map_target_visited, visited, tmp) {
+        HASH_DEL(map_target_visited, visited);
+        efree(visited);
     }
 
-    if (py != -1) {
-        MapData.posy = py;
+    map_target_cursor_bucket = 0;
+    map_target_cursor_pos = 0;
+}
+
+/**
+ * Free the target index.
+ */
+static void
+map_target_index_free (void)
+{
+    map_target_cycle_reset();
+
+    for (size_t i = 0; i < map_target_index_num; i++) {
+        if (map_target_index[i].cells != NULL) {
+            efree(map_target_index[i].cells);
+        }
     }
 
-    if (xl > 0) {
-        clear_map(false);
+    if (map_target_index != NULL) {
+        efree(map_target_index);
+        map_target_index = NULL;
     }
-}
 
-#define MAX_STRETCH 8
-#define MAX_STRETCH_DIAG 12
+    map_target_index_num = 0;
+}
 
 /**
- * Calculate height of X/Y coordinate on the specified cell.
+ * Check that the animated cells index and the target index hold exactly
+ * the visible cells they should, and that those cells point back to their
+ * entries in the indexes.
  *
- * Checks for X/Y overflows.
- * @param x
- * X position.
- * @param y
- * Y position.
- * @param w
- * Max width.
- * @param h
- * Max height.
  * @return
- * The height.
+ * True if the indexes are consistent, false otherwise; the cells that are
+ * not are logged.
  */
-static int calc_map_cell_height(int x, int y, int w, int h, int sub_layer,
-        int my_height)
+bool
+map_index_check (void)
 {
-    if (x >= 0 && x < w && y >= 0 && y < h) {
-        bool is_building_wall = false;
-
-        for (int i = 1; i < NUM_SUB_LAYERS; i++) {
-            if (cells[y * w + x].faces[GET_MAP_LAYER(LAYER_EFFECT, i)] != 0 &&
-                    cells[y * w + x].height[GET_MAP_LAYER(LAYER_FLOOR, i)]
-                    != 0) {
-                is_building_wall = true;
-                break;
+    uint64_t errors = 0;
+    size_t anim_num = 0, target_num = 0;
+
+    for (int x = 0; x < map_width * MAP_FOW_SIZE; x++) {
+        for (int y = 0; y < map_height * MAP_FOW_SIZE; y++) {
+            struct MapCell *cell = MAP_CELL_GET(x, y);
+            bool visible = map_cell_is_visible(x, y);
+            int vx = x - MAP_STARTX, vy = y - MAP_STARTY;
+            uint64_t anim = visible ? map_anim_index_layers(cell) : 0;
+            uint64_t target = visible ? map_target_index_layers(cell) : 0;
+
+            if (cell->anim_layers != anim) {
+                LOG(ERROR, "Cell %d,%d has animated layers 0x%" PRIx64
+                    " instead of 0x%" PRIx64, x, y, cell->anim_layers, anim);
+                errors++;
+            } else if (anim != 0) {
+                anim_num++;
+
+                if (cell->anim_index >= map_anim_index_num ||
+                    map_anim_index[cell->anim_index].x != vx ||
+                    map_anim_index[cell->anim_index].y != vy) {
+                    LOG(ERROR, "Cell %d,%d is not in the animated cells "
+                        "index", x, y);
+                    errors++;
+                }
             }
-        }
-
-        if (my_height < 0 && (sub_layer != 0 || is_building_wall)) {
-            for (sub_layer = NUM_SUB_LAYERS - 1; sub_layer >= 0; sub_layer--) {
-                int height = cells[y * w + x].height[GET_MAP_LAYER(LAYER_FLOOR,
-                        sub_layer)];
 
-                if (height != 0) {
-                    return height;
+            if (cell->target_layers != target) {
+                LOG(ERROR, "Cell %d,%d has targetable layers 0x%" PRIx64
+                    " instead of 0x%" PRIx64, x, y, cell->target_layers,
+                    target);
+                errors++;
+            } else if (target != 0) {
+                size_t bucket = map_target_index_bucket(vx, vy);
+                target_num++;
+
+                if (bucket >= map_target_index_num ||
+                    cell->target_index >= map_target_index[bucket].num ||
+                    map_target_index[bucket].cells[cell->target_index].x !=
+                    vx ||
+                    map_target_index[bucket].cells[cell->target_index].y !=
+                    vy) {
+                    LOG(ERROR, "Cell %d,%d is not in the target index", x, y);
+                    errors++;
                 }
             }
-
-            return 0;
         }
+    }
+
+    size_t target_index_num = 0;
 
-        return cells[y * w + x].height[GET_MAP_LAYER(LAYER_FLOOR, sub_layer)];
+    for (size_t i = 0; i < map_target_index_num; i++) {
+        target_index_num += map_target_index[i].num;
     }
 
-    return 0;
+    if (anim_num != map_anim_index_num ||
+        target_num != target_index_num) {
+        LOG(ERROR, "The animated cells index has %" PRIu64 " cells instead "
+            "of %" PRIu64 ", the target index %" PRIu64 " instead of %"
+            PRIu64, (uint64_t) map_anim_index_num, (uint64_t) anim_num,
+            (uint64_t) target_index_num, (uint64_t) target_num);
+        errors++;
+    }
+
+    return errors == 0;
 }
 
 /**
- * Align tile stretch based on X/Y.
+ * Reset a map cell that has just been scrolled into view.
+ *
  * @param x
- * X position.
+ * Logical X coordinate of the cell.
  * @param y
- * Y position.
- * @param w
- * Max width.
- * @param h
- * Max height.
- * @param sub_layer
- * Sub-layer.
+ * Logical Y coordinate of the cell.
  */
-static void align_tile_stretch(int x, int y, int w, int h, int sub_layer)
+static void
+map_cell_reset (int x, int y)
 {
-    int top, bottom, right, left, min_ht;
-    int32_t stretch;
-    int nw_height, n_height, ne_height, sw_height, s_height, se_height,
-            w_height, e_height, my_height;
+    struct MapCell *cell = MAP_CELL_GET(x, y);
+    map_cell_release_strings(cell);
+    memset(cell, 0, sizeof(*cell));
+    cell->fow = !map_cell_is_visible(x, y);
+}
 
-    if (x < 0 || y < 0 || x >= w || y >= h) {
-        return;
+/**
+ * Re-create the cells array for a new map size.
+ *
+ * @param dx
+ * X offset.
+ * @param dy
+ * Y offset.
+ * @param old_w
+ * Old width of the cells array.
+ * @param old_h
+ * Old height of the cells array.
+ */
+static void
+map_cells_resize (int dx, int dy, int old_w, int old_h)
+{
+    int w = map_width * MAP_FOW_SIZE;
+    int h = map_height * MAP_FOW_SIZE;
+    struct MapCell *cells_old = cells;
+
+    /* Release the strings of cells that will not be copied over. */
+    for (int x = 0; x < old_w; x++) {
+        for (int y = 0; y < old_h; y++) {
+            if (x - dx >= 0 && x - dx < w && y - dy >= 0 && y - dy < h) {
+                continue;
+            }
+
+            int old_x = MAP_CELL_WRAP(x, map_origin_x, old_w);
+            int old_y = MAP_CELL_WRAP(y, map_origin_y, old_h);
+            map_cell_release_strings(&cells_old[old_y * old_w + old_x]);
+        }
     }
 
-    my_height = calc_map_cell_height(x, y, w, h, sub_layer, 0);
-    nw_height = calc_map_cell_height(x - 1, y - 1, w, h, sub_layer, my_height);
-    n_height = calc_map_cell_height(x, y - 1, w, h, sub_layer, my_height);
-    ne_height = calc_map_cell_height(x + 1, y - 1, w, h, sub_layer, my_height);
-    sw_height = calc_map_cell_height(x - 1, y + 1, w, h, sub_layer, my_height);
-    s_height = calc_map_cell_height(x, y + 1, w, h, sub_layer, my_height);
-    se_height = calc_map_cell_height(x + 1, y + 1, w, h, sub_layer, my_height);
-    w_height = calc_map_cell_height(x - 1, y, w, h, sub_layer, my_height);
-    e_height = calc_map_cell_height(x + 1, y, w, h, sub_layer, my_height);
+    cells = emalloc(sizeof(*cells) * w * h);
+    cells_num = w * h;
 
-    if (abs(my_height - e_height) > MAX_STRETCH) {
-        e_height = my_height;
-    }
+    for (int x = 0; x < w; x++) {
+        for (int y = 0; y < h; y++) {
+            struct MapCell *cell = &cells[y * w + x];
 
-    if (abs(my_height - se_height) > MAX_STRETCH_DIAG) {
-        se_height = my_height;
-    }
+            if (x + dx < 0 || x + dx >= old_w || y + dy < 0 ||
+                    y + dy >= old_h) {
+                memset(cell, 0, sizeof(*cell));
+            } else {
+                int old_x = MAP_CELL_WRAP(x + dx, map_origin_x, old_w);
+                int old_y = MAP_CELL_WRAP(y + dy, map_origin_y, old_h);
+                memcpy(cell, &cells_old[old_y * old_w + old_x], sizeof(*cell));
+            }
 
-    if (abs(my_height - s_height) > MAX_STRETCH) {
-        s_height = my_height;
+            if (!map_cell_is_visible(x, y)) {
+                cell->fow = 1;
+            }
+        }
     }
 
-    if (abs(my_height - sw_height) > MAX_STRETCH_DIAG) {
-        sw_height = my_height;
-    }
+    efree(cells_old);
+    map_origin_x = 0;
+    map_origin_y = 0;
+}
 
-    if (abs(my_height - w_height) > MAX_STRETCH) {
-        w_height = my_height;
-    }
+/**
+ * Scroll the map.
+ *
+ * The cells array is a toroidal buffer, so scrolling never moves any of the
+ * cells around; the origin of the buffer is shifted instead and only the
+ * rows/columns that were scrolled into view are cleared.
+ * @param dx
+ * X offset.
+ * @param dy
+ * Y offset.
+ * @param old_w
+ * Old width. 0 if width hasn't changed.
+ * @param old_h
+ * Old height. 0 if height hasn't changed.
+ */
+void display_mapscroll(int dx, int dy, int old_w, int old_h)
+{
+    int x, y, w, h;
 
-    if (abs(my_height - nw_height) > MAX_STRETCH_DIAG) {
-        nw_height = my_height;
+    w = map_width * MAP_FOW_SIZE;
+    h = map_height * MAP_FOW_SIZE;
+
+    /* The indexes hold coordinates relative to the visible area, which are
+     * about to change, so they must be cleared while those still lead to
+     * the right cells. */
+    if (old_w == 0 && old_h == 0) {
+        map_anim_index_clear();
+        map_target_index_clear();
+    } else {
+        map_anim_index_num = 0;
+
+        for (size_t i = 0; i < map_target_index_num; i++) {
+            map_target_index[i].num = 0;
+        }
+
+        for (size_t i = 0; i < cells_num; i++) {
+            cells[i].anim_layers = 0;
+            cells[i].target_layers = 0;
+        }
     }
 
-    if (abs(my_height - n_height) > MAX_STRETCH) {
-        n_height = my_height;
+    if (old_w == 0) {
+        old_w = w;
     }
 
-    if (abs(my_height - ne_height) > MAX_STRETCH_DIAG) {
-        ne_height = my_height;
+    if (old_h == 0) {
+        old_h = h;
     }
 
-    top = MAX(w_height, nw_height);
-    top = MAX(top, n_height);
-    top = MAX(top, my_height);
+    if (old_w != w || old_h != h) {
+        map_cells_resize(dx, dy, old_w, old_h);
+    } else if (abs(dx) >= w || abs(dy) >= h) {
+        for (x = 0; x < w; x++) {
+            for (y = 0; y < h; y++) {
+                map_cell_reset(x, y);
+            }
+        }
+    } else {
+        map_origin_x = (map_origin_x + dx + w) % w;
+        map_origin_y = (map_origin_y + dy + h) % h;
 
-    bottom = MAX(s_height, se_height);
-    bottom = MAX(bottom, e_height);
-    bottom = MAX(bottom, my_height);
+        /* Clear the newly exposed columns... */
+        for (x = dx > 0 ? w - dx : 0; x < (dx > 0 ? w : -dx); x++) {
+            for (y = 0; y < h; y++) {
+                map_cell_reset(x, y);
+            }
+        }
 
-    right = MAX(n_height, ne_height);
-    right = MAX(right, e_height);
-    right = MAX(right, my_height);
+        /* ... and rows. */
+        for (y = dy > 0 ? h - dy : 0; y < (dy > 0 ? h : -dy); y++) {
+            for (x = 0; x < w; x++) {
+                map_cell_reset(x, y);
+            }
+        }
 
-    left = MAX(w_height, sw_height);
-    left = MAX(left, s_height);
-    left = MAX(left, my_height);
+        /* Cells that have just left the visible area are now in the Fog of
+         * War; only the previously visible area needs to be checked. */
+        for (x = MAP_STARTX - dx; x < MAP_STARTX - dx + map_width; x++) {
+            for (y = MAP_STARTY - dy; y < MAP_STARTY - dy + map_height; y++) {
+                if (x < 0 || x >= w || y < 0 || y >= h ||
+                        map_cell_is_visible(x, y)) {
+                    continue;
+                }
 
-    min_ht = MIN(top, bottom);
-    min_ht = MIN(min_ht, left);
-    min_ht = MIN(min_ht, right);
-    min_ht = MIN(min_ht, my_height);
+                MAP_CELL_GET(x, y)->fow = 1;
+            }
+        }
+    }
 
-    if (my_height < 0 && left == 0 && right == 0 && top == 0 && bottom == 0) {
-        int top2 = MIN(w_height, nw_height);
-        top2 = MIN(top2, n_height);
-        top2 = MIN(top2, my_height);
-
-        int bottom2 = MIN(s_height, se_height);
-        bottom2 = MIN(bottom2, e_height);
-        bottom2 = MIN(bottom2, my_height);
-
-        int right2 = MIN(n_height, ne_height);
-        right2 = MIN(right2, e_height);
-        right2 = MIN(right2, my_height);
+    map_draw_list_valid = false;
+    map_minimap_full = true;
+    map_pick_valid = false;
+    map_anim_index_rebuild();
+    map_target_index_rebuild();
+    sound_ambient_mapcroll(dx, dy);
+    map_anims_mapscroll(dx, dy);
+}
 
-        int left2 = MIN(w_height, sw_height);
-        left2 = MIN(left2, s_height);
-        left2 = MIN(left2, my_height);
+/**
+ * Update map's name.
+ * @param name
+ * New map name.
+ */
+void update_map_name(const char *name)
+{
+    snprintf(MapData.name_new, sizeof(MapData.name_new), "%s", name);
+}
 
-        top = top2 - top;
-        bottom = bottom2 - bottom;
-        right = right2 - right;
-        left = left2 - left;
+/**
+ * Update map's weather.
+ * @param weather
+ * New weather.
+ */
+void update_map_weather(const char *weather)
+{
+    effect_start(weather);
+}
 
-        min_ht = MIN(top, bottom);
-        min_ht = MIN(min_ht, left);
-        min_ht = MIN(min_ht, right);
-        min_ht = MIN(min_ht, my_height);
+/**
+ * Update map's height difference rendering flag.
+ */
+void update_map_height_diff(uint8_t height_diff)
+{
+    MapData.height_diff = height_diff;
+}
 
-        min_ht = abs(min_ht);
-        top = abs(top);
-        bottom = abs(bottom);
-        left = abs(left);
-        right = abs(right);
+/**
+ * Update map's region name.
+ * @param region_name
+ * New region name.
+ */
+void update_map_region_name(const char *region_name)
+{
+    if (strcmp(MapData.region_name, region_name) == 0) {
+        return;
     }
 
-    /* Normalize these... */
-    top -= min_ht;
-    bottom -= min_ht;
-    left -= min_ht;
-    right -= min_ht;
+    snprintf(VS(MapData.region_name), "%s", region_name);
+    region_map_update(MapData.region_map, region_name);
+}
 
-    stretch = abs(bottom) + (abs(left) << 8) + (abs(right) << 16) + (abs(top) << 24);
-    cells[y * w + x].stretch[sub_layer] = stretch;
+/**
+ * Update map's region long name.
+ * @param region_longname
+ * New region long name.
+ */
+void update_map_region_longname(const char *region_longname)
+{
+    snprintf(VS(MapData.region_longname), "%s", region_longname);
 }
 
 /**
- * Adjust the tile stretch of a map.
+ * Update map's path.
+ * @param map_path
+ * New map path.
+ */
+void update_map_path(const char *map_path)
+{
+    snprintf(VS(MapData.map_path), "%s", map_path);
+}
+
+/**
+ * Updates the map's in_building state flag.
  *
- * Goes through the whole map and for each coordinate calls align_tile_stretch()
- * in all directions. This is done to fix any inconsistencies, since the map
- * command doesn't send us the whole map all over again, but only new/changes
- * parts.
+ * When entering a building, clears FoW objects from effect layer with non-zero
+ * sub-layer.
+ * @param in_building
+ * New in_building state.
  */
-void adjust_tile_stretch(void)
+void map_update_in_building(uint8_t in_building)
 {
-    int xoff, yoff, w, h, x, y, sub_layer;
+    if (in_building && !MapData.in_building) {
+        int x, y;
+        struct MapCell *cell;
+        int layer, sub_layer;
 
-    xoff = map_width * (MAP_FOW_SIZE / 2);
-    yoff = map_height * (MAP_FOW_SIZE / 2);
-    w = map_width * MAP_FOW_SIZE;
-    h = map_height * MAP_FOW_SIZE;
+        for (x = 0; x < map_width * MAP_FOW_SIZE; x++) {
+            for (y = 0; y < map_height * MAP_FOW_SIZE; y++) {
+                cell = MAP_CELL_GET(x, y);
 
-    for (x = xoff; x < xoff + map_width; x++) {
-        for (y = yoff; y < yoff + map_height; y++) {
-            for (sub_layer = 0; sub_layer < NUM_SUB_LAYERS; sub_layer++) {
-                align_tile_stretch(x, y, w, h, sub_layer);
+                if (!cell->fow) {
+                    continue;
+                }
+
+                for (sub_layer = MapData.player_sub_layer + 1;
+                        sub_layer < NUM_SUB_LAYERS; sub_layer++) {
+                    for (layer = LAYER_FLOOR; layer <= NUM_LAYERS; layer++) {
+                        cell->faces[GET_MAP_LAYER(layer, sub_layer)] = 0;
+                    }
+                }
             }
         }
     }
+
+    if (in_building != MapData.in_building) {
+        map_draw_list_valid = false;
+    }
+
+    MapData.in_building = in_building;
 }
 
 /**
- * Set data for map cell.
- *
- * If FOW was previously set on this cell, cell data is cleared.
- * @param x
- * X of the cell.
- * @param y
- * Y of the cell.
- * @param layer
- * Layer we're doing this for.
- * @param face
- * Face to set.
- * @param quick_pos
- * Is this a multi-arch?
- * @param obj_flags
- * Flags.
- * @param name
- * Player's name.
- * @param name_color
- * Player's name color.
- * @param height
- * Z position of the tile.
- * @param probe
- * Target's HP bar.
- * @param zoom
- * How much to zoom the face by.
- * @param align
- * X align.
- * @param rotate
- * Rotation in degrees.
- * @param infravision
- * Whether to show the object in red.
+ * Get player's direction.
+ * @return
+ * Player's direction.
  */
-void map_set_data(int x, int y, int layer, int16_t face,
-        uint8_t quick_pos, uint8_t obj_flags, const char *name,
-        const char *name_color, int16_t height, uint8_t probe, int16_t zoom_x,
-        int16_t zoom_y, int16_t align, uint8_t draw_double, uint8_t alpha,
-        int16_t rotate, uint8_t infravision, uint32_t target_object_count,
-        uint8_t target_is_friend, uint8_t anim_speed, uint8_t anim_facing,
-        uint8_t anim_flags, uint8_t anim_state, uint8_t priority,
-        uint8_t secondpass, const char *glow, uint8_t glow_speed)
+int map_get_player_direction(void)
 {
     struct MapCell *cell;
-    int sub_layer;
+    int direction;
 
-    cell = MAP_CELL_GET_MIDDLE(x, y);
-    sub_layer = layer / NUM_LAYERS;
+    cell = MAP_CELL_GET_MIDDLE(map_width - (map_width / 2) - 1,
+            map_height - (map_height / 2) - 1);
 
-    if (cell->fow) {
-        int i;
+    direction = cell->anim_facing[GET_MAP_LAYER(LAYER_LIVING,
+            MapData.player_sub_layer)];
 
-        cell->fow = 0;
+    if (direction == 0) {
+        return 1;
+    }
 
-        for (i = 0; i < NUM_REAL_LAYERS; i++) {
-            cell->faces[i] = 0;
-            cell->flags[i] = 0;
-            cell->quick_pos[i] = 0;
-            cell->height[i] = 0;
-            cell->zoom_x[i] = 0;
-            cell->zoom_y[i] = 0;
-            cell->align[i] = 0;
-            cell->rotate[i] = 0;
-            cell->infravision[i] = 0;
-            cell->anim_last[i] = 0;
-            cell->anim_speed[i] = 0;
-            cell->anim_facing[i] = 0;
-            cell->anim_state[i] = 0;
+    return direction - 1;
+}
+
+/**
+ * Get real map X/Y coordinates adjusted for player's position.
+ * @param[out] x Will contain X coordinate.
+ * @param[out] y Will contain Y coordinate.
+ */
+void map_get_real_coords(int *x, int *y)
+{
+    *x = MapData.posx - (map_width / 2);
+    *y = MapData.posy - (map_height / 2);
+}
+
+/**
+ * Initialize map's data.
+ * @param xl
+ * Map width.
+ * @param yl
+ * Map height.
+ * @param px
+ * Player's X position.
+ * @param py
+ * Player's Y position.
+ */
+void init_map_data(int xl, int yl, int px, int py)
+{
+    if (xl != -1) {
+        MapData.xlen = xl;
+    }
+
+    if (yl != -1) {
+        MapData.ylen = yl;
+    }
+
+    if (px != -1) {
+        MapData.posx = px;
+    }
+
+    if (py != -1) {
+        MapData.posy = py;
+    }
+
+    if (xl > 0) {
+        clear_map(false);
+    }
+}
+
+#define MAX_STRETCH 8
+#define MAX_STRETCH_DIAG 12
+
+/**
+ * Calculate height of X/Y coordinate on the specified cell.
+ *
+ * Checks for X/Y overflows.
+ * @param x
+ * X position.
+ * @param y
+ * Y position.
+ * @param w
+ * Max width.
+ * @param h
+ * Max height.
+ * @return
+ * The height.
+ */
+static int calc_map_cell_height(int x, int y, int w, int h, int sub_layer,
+        int my_height)
+{
+    if (x >= 0 && x < w && y >= 0 && y < h) {
+        bool is_building_wall = false;
+
+        for (int i = 1; i < NUM_SUB_LAYERS; i++) {
+            if (MAP_CELL_GET(x, y)->faces[GET_MAP_LAYER(LAYER_EFFECT, i)] != 0 &&
+                    MAP_CELL_GET(x, y)->height[GET_MAP_LAYER(LAYER_FLOOR, i)]
+                    != 0) {
+                is_building_wall = true;
+                break;
+            }
+        }
+
+        if (my_height < 0 && (sub_layer != 0 || is_building_wall)) {
+            for (sub_layer = NUM_SUB_LAYERS - 1; sub_layer >= 0; sub_layer--) {
+                int height = MAP_CELL_GET(x, y)->height[GET_MAP_LAYER(
+                        LAYER_FLOOR, sub_layer)];
+
+                if (height != 0) {
+                    return height;
+                }
+            }
+
+            return 0;
+        }
+
+        return MAP_CELL_GET(x, y)->height[GET_MAP_LAYER(LAYER_FLOOR,
+                sub_layer)];
+    }
+
+    return 0;
+}
+
+/**
+ * Align tile stretch based on X/Y.
+ * @param x
+ * X position.
+ * @param y
+ * Y position.
+ * @param w
+ * Max width.
+ * @param h
+ * Max height.
+ * @param sub_layer
+ * Sub-layer.
+ */
+static void align_tile_stretch(int x, int y, int w, int h, int sub_layer)
+{
+    int top, bottom, right, left, min_ht;
+    int32_t stretch;
+    int nw_height, n_height, ne_height, sw_height, s_height, se_height,
+            w_height, e_height, my_height;
+
+    if (x < 0 || y < 0 || x >= w || y >= h) {
+        return;
+    }
+
+    my_height = calc_map_cell_height(x, y, w, h, sub_layer, 0);
+    nw_height = calc_map_cell_height(x - 1, y - 1, w, h, sub_layer, my_height);
+    n_height = calc_map_cell_height(x, y - 1, w, h, sub_layer, my_height);
+    ne_height = calc_map_cell_height(x + 1, y - 1, w, h, sub_layer, my_height);
+    sw_height = calc_map_cell_height(x - 1, y + 1, w, h, sub_layer, my_height);
+    s_height = calc_map_cell_height(x, y + 1, w, h, sub_layer, my_height);
+    se_height = calc_map_cell_height(x + 1, y + 1, w, h, sub_layer, my_height);
+    w_height = calc_map_cell_height(x - 1, y, w, h, sub_layer, my_height);
+    e_height = calc_map_cell_height(x + 1, y, w, h, sub_layer, my_height);
+
+    if (abs(my_height - e_height) > MAX_STRETCH) {
+        e_height = my_height;
+    }
+
+    if (abs(my_height - se_height) > MAX_STRETCH_DIAG) {
+        se_height = my_height;
+    }
+
+    if (abs(my_height - s_height) > MAX_STRETCH) {
+        s_height = my_height;
+    }
+
+    if (abs(my_height - sw_height) > MAX_STRETCH_DIAG) {
+        sw_height = my_height;
+    }
+
+    if (abs(my_height - w_height) > MAX_STRETCH) {
+        w_height = my_height;
+    }
+
+    if (abs(my_height - nw_height) > MAX_STRETCH_DIAG) {
+        nw_height = my_height;
+    }
+
+    if (abs(my_height - n_height) > MAX_STRETCH) {
+        n_height = my_height;
+    }
+
+    if (abs(my_height - ne_height) > MAX_STRETCH_DIAG) {
+        ne_height = my_height;
+    }
+
+    top = MAX(w_height, nw_height);
+    top = MAX(top, n_height);
+    top = MAX(top, my_height);
+
+    bottom = MAX(s_height, se_height);
+    bottom = MAX(bottom, e_height);
+    bottom = MAX(bottom, my_height);
+
+    right = MAX(n_height, ne_height);
+    right = MAX(right, e_height);
+    right = MAX(right, my_height);
+
+    left = MAX(w_height, sw_height);
+    left = MAX(left, s_height);
+    left = MAX(left, my_height);
+
+    min_ht = MIN(top, bottom);
+    min_ht = MIN(min_ht, left);
+    min_ht = MIN(min_ht, right);
+    min_ht = MIN(min_ht, my_height);
+
+    if (my_height < 0 && left == 0 && right == 0 && top == 0 && bottom == 0) {
+        int top2 = MIN(w_height, nw_height);
+        top2 = MIN(top2, n_height);
+        top2 = MIN(top2, my_height);
+
+        int bottom2 = MIN(s_height, se_height);
+        bottom2 = MIN(bottom2, e_height);
+        bottom2 = MIN(bottom2, my_height);
+
+        int right2 = MIN(n_height, ne_height);
+        right2 = MIN(right2, e_height);
+        right2 = MIN(right2, my_height);
+
+        int left2 = MIN(w_height, sw_height);
+        left2 = MIN(left2, s_height);
+        left2 = MIN(left2, my_height);
+
+        top = top2 - top;
+        bottom = bottom2 - bottom;
+        right = right2 - right;
+        left = left2 - left;
+
+        min_ht = MIN(top, bottom);
+        min_ht = MIN(min_ht, left);
+        min_ht = MIN(min_ht, right);
+        min_ht = MIN(min_ht, my_height);
+
+        min_ht = abs(min_ht);
+        top = abs(top);
+        bottom = abs(bottom);
+        left = abs(left);
+        right = abs(right);
+    }
+
+    /* Normalize these... */
+    top -= min_ht;
+    bottom -= min_ht;
+    left -= min_ht;
+    right -= min_ht;
+
+    stretch = abs(bottom) + (abs(left) << 8) + (abs(right) << 16) + (abs(top) << 24);
+
+    if (MAP_CELL_GET(x, y)->stretch[sub_layer] != stretch) {
+        MAP_CELL_GET(x, y)->stretch[sub_layer] = stretch;
+        map_cell_set_dirty(x, y);
+    }
+}
+
+/**
+ * Adjust the tile stretch of a map.
+ *
+ * Goes through the whole map and for each coordinate calls align_tile_stretch()
+ * in all directions. This is done to fix any inconsistencies, since the map
+ * command doesn't send us the whole map all over again, but only new/changes
+ * parts.
+ */
+void adjust_tile_stretch(void)
+{
+    int xoff, yoff, w, h, x, y, sub_layer;
+
+    xoff = map_width * (MAP_FOW_SIZE / 2);
+    yoff = map_height * (MAP_FOW_SIZE / 2);
+    w = map_width * MAP_FOW_SIZE;
+    h = map_height * MAP_FOW_SIZE;
+
+    for (x = xoff; x < xoff + map_width; x++) {
+        for (y = yoff; y < yoff + map_height; y++) {
+            for (sub_layer = 0; sub_layer < NUM_SUB_LAYERS; sub_layer++) {
+                align_tile_stretch(x, y, w, h, sub_layer);
+            }
+        }
+    }
+}
+
+/**
+ * Set data for map cell.
+ *
+ * If FOW was previously set on this cell, cell data is cleared.
+ * @param x
+ * X of the cell.
+ * @param y
+ * Y of the cell.
+ * @param layer
+ * Layer we're doing this for.
+ * @param face
+ * Face to set.
+ * @param quick_pos
+ * Is this a multi-arch?
+ * @param obj_flags
+ * Flags.
+ * @param name
+ * Player's name.
+ * @param name_color
+ * Player's name color.
+ * @param height
+ * Z position of the tile.
+ * @param probe
+ * Target's HP bar.
+ * @param zoom
+ * How much to zoom the face by.
+ * @param align
+ * X align.
+ * @param rotate
+ * Rotation in degrees.
+ * @param infravision
+ * Whether to show the object in red.
+ */
+void map_set_data(int x, int y, int layer, int16_t face,
+        uint8_t quick_pos, uint8_t obj_flags, const char *name,
+        const char *name_color, int16_t height, uint8_t probe, int16_t zoom_x,
+        int16_t zoom_y, int16_t align, uint8_t draw_double, uint8_t alpha,
+        int16_t rotate, uint8_t infravision, uint32_t target_object_count,
+        uint8_t target_is_friend, uint8_t anim_speed, uint8_t anim_facing,
+        uint8_t anim_flags, uint8_t anim_state, uint8_t priority,
+        uint8_t secondpass, const char *glow, uint8_t glow_speed)
+{
+    struct MapCell *cell;
+    int sub_layer;
+
+    cell = MAP_CELL_GET_MIDDLE(x, y);
+    sub_layer = layer / NUM_LAYERS;
+    map_cell_set_changed(x, y);
+
+    if (cell->fow) {
+        int i;
+
+        cell->fow = 0;
+
+        for (i = 0; i < NUM_REAL_LAYERS; i++) {
+            cell->faces[i] = 0;
+            cell->flags[i] = 0;
+            cell->quick_pos[i] = 0;
+            cell->height[i] = 0;
+            cell->zoom_x[i] = 0;
+            cell->zoom_y[i] = 0;
+            cell->align[i] = 0;
+            cell->rotate[i] = 0;
+            cell->infravision[i] = 0;
+            cell->anim_last[i] = 0;
+            cell->anim_speed[i] = 0;
+            cell->anim_facing[i] = 0;
+            cell->anim_state[i] = 0;
+        }
+
+        for (i = 0; i < NUM_SUB_LAYERS; i++) {
+            cell->anim_flags[i] = 0;
+            cell->priority[i] = 0;
+            cell->secondpass[i] = 0;
+        }
+    }
+
+    if (anim_speed != 0 && cell->faces[layer] != face) {
+        cell->anim_state[layer] = 0;
+    }
+
+    cell->priority[sub_layer] |= priority << (((layer % NUM_LAYERS) + 1) - 1);
+    cell->secondpass[sub_layer] |= secondpass << (((layer % NUM_LAYERS) + 1) -
+            1);
+
+    cell->faces[layer] = face;
+    cell->flags[layer] = obj_flags;
+
+    cell->probe[layer] = probe;
+    cell->quick_pos[layer] = quick_pos;
+
+    /* Intern the new strings before releasing the old ones, so that strings
+     * that did not change are not needlessly re-created. */
+    map_string_id_t old_pcolor = cell->pcolor[layer];
+    map_string_id_t old_pname = cell->pname[layer];
+    map_string_id_t old_glow = cell->glow[layer];
+    cell->pcolor[layer] = map_string_intern(name_color);
+    cell->pname[layer] = map_string_intern(name);
+    cell->glow[layer] = map_string_intern(glow);
+    map_string_release(old_pcolor);
+    map_string_release(old_pname);
+    map_string_release(old_glow);
+
+    cell->height[layer] = height;
+    cell->zoom_x[layer] = zoom_x;
+    cell->zoom_y[layer] = zoom_y;
+    cell->align[layer] = align;
+    cell->draw_double[layer] = draw_double;
+    cell->alpha[layer] = alpha;
+    cell->rotate[layer] = rotate;
+    cell->infravision[layer] = infravision;
+    cell->glow_speed[layer] = glow_speed;
+
+    cell->target_object_count[layer] = target_object_count;
+    cell->target_is_friend[layer] = target_is_friend;
+
+    cell->anim_speed[layer] = anim_speed;
+    cell->anim_facing[layer] = anim_facing;
+
+    if (((layer % NUM_LAYERS) + 1) == LAYER_LIVING) {
+        if (anim_flags & ANIM_FLAG_ATTACKING &&
+                !(cell->anim_flags[sub_layer] & ANIM_FLAG_ATTACKING)) {
+            cell->anim_state[layer] = 0;
+        } else if (anim_flags & ANIM_FLAG_MOVING &&
+                !(cell->anim_flags[sub_layer] & ANIM_FLAG_MOVING)) {
+            cell->anim_state[layer] = anim_state;
+        }
+
+        cell->anim_flags[sub_layer] = anim_flags;
+    }
+
+    map_anim_index_update(x, y);
+    map_target_index_update(x, y);
+
+    if (anim_speed != 0) {
+        check_animation_status(face);
+    } else {
+        image_request_face(face);
+    }
+}
+
+/**
+ * Clear map's cell.
+ *
+ * In reality, this only clears some data on the cell, and sets the FOW flag
+ * to mark that the cell is actually FOW.
+ * @param x
+ * X of the cell.
+ * @param y
+ * Y of the cell.
+ */
+void map_clear_cell(int x, int y)
+{
+    struct MapCell *cell;
+    int layer;
+
+    cell = MAP_CELL_GET_MIDDLE(x, y);
+    cell->fow = 1;
+    map_cell_set_changed(x, y);
+
+    for (layer = 0; layer < NUM_REAL_LAYERS; layer++) {
+        cell->probe[layer] = 0;
+        cell->target_object_count[layer] = 0;
+        cell->target_is_friend[layer] = 0;
+        map_string_release(cell->pname[layer]);
+        cell->pname[layer] = 0;
+    }
+
+    map_anim_index_update(x, y);
+    map_target_index_update(x, y);
+}
+
+/**
+ * Set darkness for map's cell.
+ * @param x
+ * X of the cell.
+ * @param y
+ * Y of the cell.
+ * @param sub_layer
+ * Sub-layer.
+ * @param darkness
+ * Darkness to set.
+ */
+void map_set_darkness(int x, int y, int sub_layer, uint8_t darkness)
+{
+    struct MapCell *cell;
+
+    cell = MAP_CELL_GET_MIDDLE(x, y);
+
+    if (cell->darkness[sub_layer] != darkness) {
+        cell->darkness[sub_layer] = darkness;
+        map_cell_set_dirty(MAP_STARTX + x, MAP_STARTY + y);
+
+        if (sub_layer == 0) {
+            map_minimap_set_dirty(MAP_STARTX + x, MAP_STARTY + y);
+        }
+
+        /* The light of the neighbors is interpolated with this cell's. */
+        if (setting_get_int(OPT_CAT_MAP, OPT_SMOOTH_LIGHTING)) {
+            for (int dx = -1; dx <= 1; dx++) {
+                for (int dy = -1; dy <= 1; dy++) {
+                    map_cell_set_dirty(MAP_STARTX + x + dx,
+                                       MAP_STARTY + y + dy);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Get the height of the topmost floor on the specified square.
+ * @param x
+ * X position.
+ * @param y
+ * Y position.
+ * @return
+ * The height.
+ */
+static int get_top_floor_height(struct MapCell *cell, int sub_layer)
+{
+    int16_t height;
+
+    height = cell->height[GET_MAP_LAYER(LAYER_FLOOR, sub_layer)];
+
+    return MAX(0, height);
+}
+
+static void map_animate_object(struct MapCell *cell, int layer)
+{
+    Animations *animation;
+
+    if (cell->faces[layer] == 0 || cell->anim_speed[layer] == 0 ||
+            cell->anim_facing[layer] == 0) {
+        return;
+    }
+
+    animation = &animations[cell->faces[layer]];
+
+    if (animation->num_animations == 0) {
+        return;
+    }
+
+    if (!(cell->flags[layer] & FFLAG_SLEEP) &&
+            !(cell->flags[layer] & FFLAG_PARALYZED)) {
+        cell->anim_state[layer]++;
+    }
+
+    /* If beyond drawable states, reset */
+    if (cell->anim_state[layer] >=
+            animation->num_animations / animation->facings) {
+        cell->anim_state[layer] = 0;
+    }
+}
+
+void map_animate(void)
+{
+    for (size_t i = 0; i < map_anim_index_num; i++) {
+        int x = map_anim_index[i].x;
+        int y = map_anim_index[i].y;
+        struct MapCell *cell = MAP_CELL_GET_MIDDLE(x, y);
+        uint64_t layers = cell->anim_layers;
+
+        for (int layer = 0; layers != 0; layer++, layers >>= 1) {
+            if (!(layers & 1)) {
+                continue;
+            }
+
+            if (cell->glow_speed[layer] > 1) {
+                cell->glow_state[layer]++;
+                map_cell_set_dirty(MAP_STARTX + x, MAP_STARTY + y);
+
+                if (cell->glow_state[layer] > cell->glow_speed[layer]) {
+                    cell->glow_state[layer] = 0;
+                }
+            }
+
+            if (cell->anim_speed[layer] == 0) {
+                continue;
+            }
+
+            if (cell->anim_last[layer] >= cell->anim_speed[layer]) {
+                uint8_t anim_state = cell->anim_state[layer];
+                map_animate_object(cell, layer);
+                cell->anim_last[layer] = 1;
+
+                if (cell->anim_state[layer] != anim_state) {
+                    map_cell_set_dirty(MAP_STARTX + x, MAP_STARTY + y);
+                }
+            } else {
+                cell->anim_last[layer]++;
+            }
+        }
+    }
+}
+
+static uint16_t map_object_get_face(struct MapCell *cell, int layer)
+{
+    int sub_layer, dir, state;
+    Animations *animation;
+
+    if (cell->anim_speed[layer] == 0) {
+        return cell->faces[layer];
+    }
+
+    animation = &animations[cell->faces[layer]];
+
+    if (animation->num_animations == 0) {
+        return cell->faces[layer];
+    }
+
+    sub_layer = layer / NUM_LAYERS;
+    dir = cell->anim_facing[layer] - 1;
+    state = 0;
+
+    if (animation->facings == 9) {
+        state = dir * (animation->num_animations / 9);
+    } else if (animation->facings >= 25) {
+        if (cell->anim_flags[sub_layer] & ANIM_FLAG_ATTACKING) {
+            dir += 16;
+        } else if (cell->anim_flags[sub_layer] & ANIM_FLAG_MOVING) {
+            dir += 8;
+        }
+
+        state = dir * (animation->num_animations / animation->facings);
+    }
+
+    return animation->faces[cell->anim_state[layer] + state];
+}
+
+/**
+ * A player name to show on the map surface once the map has been lit.
+ */
+typedef struct map_render_name {
+    int x; ///< X coordinate where to show the name.
+    int y; ///< Y coordinate where to show the name.
+    const char *name; ///< The name.
+    const char *color; ///< Color of the name.
+} map_render_name_t;
+
+/**
+ * Structure used to pass data between the rendering loops in map_draw_map()
+ * and the actual rendering logic in draw_map_object().
+ *
+ * Try to keep this structure aligned whenever extending it.
+ */
+typedef struct map_render_data {
+    int16_t x; ///< X index in the cells array.
+    int16_t y; ///< Y index in the cells array.
+
+    int16_t midx; ///< X index in the cells array of the middlemost cell.
+    int16_t midy; ///< Y index in the cells array of the middlemost cell.
+
+    int32_t xpos; ///< X coordinate where to render.
+    int32_t ypos; ///< Y coordinate where to render.
+    int32_t player_height_offset; ///< Player height offset.
+
+    struct MapCell *cell; ///< Cell that is being rendered.
+    struct MapCell *target_cell; ///< Cell with the player's target.
+    SDL_Rect *tiles; ///< Floor tile coordinates and IDs. Used for debugging.
+    map_render_name_t *names; ///< Player names to show.
+    struct map_draw_op *unlit; ///< Objects to draw once the map is lit.
+
+    size_t tiles_num; ///< Number of tiles.
+    size_t names_num; ///< Number of player names.
+    size_t unlit_num; ///< Number of objects to draw once the map is lit.
+
+    SDL_Rect target_rect; ///< Coordinate information for player's target.
+
+    uint8_t layer; ///< Layer to render on.
+    uint8_t sub_layer; ///< Sub-layer to render on.
+    uint8_t alpha_forced; ///< Force applying the specified alpha value.
+    uint8_t target_layer; ///< Target's layer.
+    uint8_t measure; ///< Only measure the cell's draw box.
+    uint8_t partial; ///< Only draw cells selected for a partial redraw.
+    uint8_t record; ///< Record the objects in the draw list instead.
+    uint8_t light; ///< The light map will be applied after drawing.
+} map_render_data_t;
+
+/**
+ * A single object to draw, in the retained map draw list.
+ */
+typedef struct map_draw_op {
+    int16_t x; ///< X index in the cells array.
+    int16_t y; ///< Y index in the cells array.
+
+    int32_t xpos; ///< X coordinate where to render.
+    int32_t ypos; ///< Y coordinate where to render.
+
+    uint8_t layer; ///< Layer to render.
+    uint8_t sub_layer; ///< Sub-layer to render.
+    uint8_t alpha_forced; ///< Force applying the specified alpha value.
+} map_draw_op_t;
+
+/**
+ * Retained list of the objects to draw on the map surface, in the order
+ * they must be drawn in.
+ *
+ * Working out the order means going through every layer and sub-layer of
+ * every cell several times and checking the priority, height and culling
+ * rules, which only change along with the map data. The list is therefore
+ * only rebuilt when the map changes, and replayed when drawing; animation
+ * and glow states are resolved by draw_map_object() as the list is
+ * replayed.
+ */
+static map_draw_op_t *map_draw_list = NULL;
+/** Number of entries in ::map_draw_list. */
+static size_t map_draw_list_num = 0;
+/** Allocated number of entries in ::map_draw_list. */
+static size_t map_draw_list_size = 0;
+/** Player's sub-layer ::map_draw_list was built for. */
+static uint8_t map_draw_list_sub_layer;
+/** Player height offset ::map_draw_list was built for. */
+static int map_draw_list_height_offset;
+/** Width of the map surface ::map_draw_list was built for. */
+static int map_draw_list_w;
+/** Height of the map surface ::map_draw_list was built for. */
+static int map_draw_list_h;
+/** If true, ::map_draw_list is not used; for benchmarking. */
+static bool map_draw_list_disabled = false;
+
+/**
+ * Fixed-point unit used to locate the map cell of each pixel when applying
+ * the light map; one map cell is this many units. Chosen so that moving one
+ * pixel moves a whole number of units along both cell axes.
+ */
+#define MAP_LIGHT_UNIT (MAP_TILE_YOFF * 4)
+/** Units along both cell axes moved by moving one pixel horizontally. */
+#define MAP_LIGHT_STEP_X (MAP_LIGHT_UNIT / (MAP_TILE_YOFF * 2))
+/** Units along both cell axes moved by moving one pixel vertically. */
+#define MAP_LIGHT_STEP_Y (MAP_LIGHT_UNIT / (MAP_TILE_XOFF * 2))
+
+/**
+ * Darkness of each map cell, as the alpha value of the black covering it.
+ */
+static uint8_t *map_light_shade = NULL;
+/** Whether each map cell is in the fog of war. */
+static uint8_t *map_light_fow = NULL;
+/** Number of entries in ::map_light_shade and ::map_light_fow. */
+static size_t map_light_size = 0;
+/** Whether all the map cells are fully lit and outside the fog of war. */
+static bool map_light_lit = true;
+/** Light of the pixels in the row being lit. */
+static uint16_t *map_light_row = NULL;
+/** Number of entries in ::map_light_row. */
+static int map_light_row_size = 0;
+
+/**
+ * Extend the area covered by an object on the map surface with the player
+ * name, status effect icons and target marker shown along with it.
+ *
+ * @param data
+ * Rendering data.
+ * @param map_layer
+ * Map layer of the object.
+ * @param x
+ * X coordinate where the name and target marker are centered on.
+ * @param w
+ * Width of the target marker's HP bar.
+ * @param center
+ * X coordinate of the object's center.
+ * @param yl
+ * Y coordinate of the object.
+ * @param[out] box
+ * Area to extend.
+ */
+static void
+map_object_box_extend (map_render_data_t *data,
+                       uint8_t            map_layer,
+                       int                x,
+                       int                w,
+                       int                center,
+                       int                yl,
+                       SDL_Rect          *box)
+{
+    SDL_Rect box2;
+
+    if (data->cell->pname[map_layer] != 0 &&
+        setting_get_int(OPT_CAT_MAP, OPT_PLAYER_NAMES)) {
+        const char *name = map_string_get(data->cell->pname[map_layer]);
+        box2.w = text_get_width(FONT_SANS9, name, TEXT_OUTLINE) + 4;
+        box2.h = FONT_HEIGHT(FONT_SANS9) + 2;
+        box2.x = x + w / 2 - box2.w / 2 - 2;
+        box2.y = yl - 25;
+        SDL_UnionRect(box, &box2, box);
+    }
+
+    /* The status icons are small, and shown above the object's center. */
+    if (data->cell->flags[map_layer]) {
+        box2.x = center - 1;
+        box2.y = yl - 6;
+        box2.w = MAP_TILE_POS_XOFF;
+        box2.h = MAP_TILE_POS_YOFF;
+        SDL_UnionRect(box, &box2, box);
+    }
+
+    if (!data->cell->fow && data->cell->probe[map_layer] != 0) {
+        int name_w = text_get_width(FONT_SANS9, cpl.target_name,
+                                    TEXT_OUTLINE);
+        box2.x = MIN(x - 2, x + w / 2 - name_w / 2);
+        box2.y = yl - 9 - 15;
+        box2.w = MAX(w + 4, name_w) + 2;
+        box2.h = FONT_HEIGHT(FONT_SANS9) + 15;
+        SDL_UnionRect(box, &box2, box);
+    }
+}
+
+/**
+ * Get the dark level of a map cell.
+ *
+ * @param darkness
+ * Darkness of the cell, as sent by the server; higher values are lighter.
+ * @return
+ * The dark level, from 0 (no darkness) to ::DARK_LEVELS (total darkness).
+ */
+static uint8_t
+map_dark_level (uint8_t darkness)
+{
+    return DARK_LEVELS - MIN(darkness / 30, DARK_LEVELS);
+}
+
+/**
+ * Defer drawing an object on the map surface until the light map has been
+ * applied.
+ *
+ * @param data
+ * Rendering data of the object.
+ */
+static void
+map_draw_defer (map_render_data_t *data)
+{
+    data->unlit = erealloc(data->unlit,
+                           sizeof(*data->unlit) * (data->unlit_num + 1));
+
+    map_draw_op_t *op = &data->unlit[data->unlit_num++];
+    op->x = data->x;
+    op->y = data->y;
+    op->xpos = data->xpos;
+    op->ypos = data->ypos;
+    op->layer = data->layer;
+    op->sub_layer = data->sub_layer;
+    op->alpha_forced = data->alpha_forced;
+}
+
+/**
+ * Record an object drawn on the map surface in ::map_pick.
+ *
+ * @param surface
+ * The map surface.
+ * @param src
+ * The surface the object was drawn with.
+ * @param x
+ * X position the object was drawn at.
+ * @param y
+ * Y position the object was drawn at.
+ * @param id
+ * ID of the object.
+ */
+static void
+map_pick_add (SDL_Surface *surface, SDL_Surface *src, int x, int y,
+              uint32_t id)
+{
+    SDL_Rect box, clip;
+    box.x = x;
+    box.y = y;
+    box.w = src->w;
+    box.h = src->h;
+    SDL_GetClipRect(surface, &clip);
+
+    if (!SDL_IntersectRect(&box, &clip, &box)) {
+        return;
+    }
+
+    Uint32 colorkey;
+    bool has_colorkey = SDL_GetColorKey(src, &colorkey) == 0;
+    const SDL_PixelFormat *fmt = src->format;
+
+    SDL_LockSurface(src);
+
+    /* Sprites almost always have 32-bit pixels with an 8-bit alpha channel;
+     * compare the alpha bits in place without unpacking the pixels. */
+    if (fmt->BytesPerPixel == 4 && fmt->Ashift % 8 == 0 &&
+        fmt->Amask == (uint32_t) 0xff << fmt->Ashift) {
+        uint32_t alpha_min = (uint32_t) MAP_PICK_ALPHA << fmt->Ashift;
+
+        for (int j = box.y; j < box.y + box.h; j++) {
+            uint32_t *row = map_pick + j * map_pick_w + box.x;
+            const uint32_t *pixels = (const uint32_t *)
+                ((const uint8_t *) src->pixels + (j - y) * src->pitch) +
+                (box.x - x);
+
+            for (int i = 0; i < box.w; i++) {
+                if ((pixels[i] & fmt->Amask) >= alpha_min &&
+                    (!has_colorkey || pixels[i] != colorkey)) {
+                    row[i] = id;
+                }
+            }
+        }
+
+        SDL_UnlockSurface(src);
+        return;
+    }
+
+    for (int j = box.y; j < box.y + box.h; j++) {
+        uint32_t *row = map_pick + j * map_pick_w;
+
+        for (int i = box.x; i < box.x + box.w; i++) {
+            Uint32 pixel = getpixel(src, i - x, j - y);
+
+            if (has_colorkey && pixel == colorkey) {
+                continue;
+            }
+
+            Uint8 r, g, b, a;
+            SDL_GetRGBA(pixel, src->format, &r, &g, &b, &a);
+
+            if (a >= MAP_PICK_ALPHA) {
+                row[i] = id;
+            }
+        }
+    }
+
+    SDL_UnlockSurface(src);
+}
+
+/**
+ * Clear an area of ::map_pick.
+ *
+ * @param box
+ * The area; NULL to clear all of it.
+ */
+static void
+map_pick_clear (const SDL_Rect *box)
+{
+    if (box == NULL) {
+        memset(map_pick, 0, sizeof(*map_pick) * map_pick_w * map_pick_h);
+        return;
+    }
+
+    SDL_Rect area;
+    SDL_Rect bounds = {0, 0, map_pick_w, map_pick_h};
+
+    if (!SDL_IntersectRect(box, &bounds, &area)) {
+        return;
+    }
+
+    for (int y = area.y; y < area.y + area.h; y++) {
+        memset(map_pick + y * map_pick_w + area.x, 0,
+               sizeof(*map_pick) * area.w);
+    }
+}
+
+/**
+ * Draw a single object on the map.
+ *
+ * @param surface
+ * Surface to render on.
+ * @param data
+ * Rendering data. May be modified.
+ */
+static void
+draw_map_object (SDL_Surface *surface, map_render_data_t *data)
+{
+    HARD_ASSERT(surface != NULL);
+    HARD_ASSERT(data != NULL);
+
+    uint8_t map_layer = GET_MAP_LAYER(data->layer, data->sub_layer);
+    uint16_t face = map_object_get_face(data->cell, map_layer);
+    if (face == 0 || face >= MAX_FACE_TILES) {
+        return;
+    }
+
+    sprite_struct *face_sprite = FaceList[face].sprite;
+    if (face_sprite == NULL) {
+        return;
+    }
+
+    /* When rendering on the map surface, avoid rendering the object
+     * when it's too high up and either in the FoW or the map has the
+     * "height difference" feature enabled. */
+    if (surface == cur_widget[MAP_ID]->surface &&
+        (data->cell->fow || MapData.height_diff) &&
+        abs(get_top_floor_height(data->cell, data->sub_layer) -
+            data->player_height_offset) > HEIGHT_MAX_RENDER) {
+        return;
+    }
+
+    int bitmap_h = face_sprite->bitmap->h;
+    int bitmap_w = face_sprite->bitmap->w;
+
+    sprite_effects_t effects = {0};
+    effects.rotate = data->cell->rotate[map_layer];
+    effects.zoom_x = data->cell->zoom_x[map_layer];
+    effects.zoom_y = data->cell->zoom_y[map_layer];
+
+    if (effects.rotate != 0) {
+        rotozoomSurfaceSizeXY(bitmap_w,
+                              bitmap_h,
+                              effects.rotate,
+                              effects.zoom_x != 0 ? effects.zoom_x / 100.0 :
+                                  1.0,
+                              effects.zoom_y != 0 ? effects.zoom_y / 100.0 :
+                                  1.0,
+                              &bitmap_w,
+                              &bitmap_h);
+    } else if ((effects.zoom_x != 0 && effects.zoom_x != 100) ||
+               (effects.zoom_y != 0 && effects.zoom_y != 100)) {
+        zoomSurfaceSize(bitmap_w,
+                        bitmap_h,
+                        effects.zoom_x != 0 ? effects.zoom_x / 100.0 : 1.0,
+                        effects.zoom_y != 0 ? effects.zoom_y / 100.0 : 1.0,
+                        &bitmap_w,
+                        &bitmap_h);
+    }
+
+    int xlen;
+    int xoff;
+    int yl;
+    int xl;
+    /* Multi-part object? */
+    if (data->cell->quick_pos[map_layer]) {
+        uint8_t mnr = data->cell->quick_pos[map_layer];
+        uint8_t mid = mnr >> 4;
+        mnr &= 0x0f;
+        xlen = MultiArchs[mid].xlen;
+        yl = data->ypos - MultiArchs[mid].part[mnr].yoff +
+             MultiArchs[mid].ylen - bitmap_h;
+
+        /* Center overlapping X borders */
+        xl = 0;
+        if (bitmap_w > MultiArchs[mid].xlen) {
+            xl = (MultiArchs[mid].xlen - bitmap_w) >> 1;
+        }
+
+        xoff = data->xpos - MultiArchs[mid].part[mnr].xoff;
+        xl += xoff;
+    } else {
+        /* Calculate offsets */
+        xlen = MAP_TILE_POS_XOFF;
+        yl = (data->ypos + MAP_TILE_POS_YOFF) - bitmap_h;
+        xoff = xl = data->xpos;
+
+        if (bitmap_w > MAP_TILE_POS_XOFF) {
+            xl -= (bitmap_w - MAP_TILE_POS_XOFF) / 2;
+        }
+    }
+
+    xl += data->cell->align[map_layer];
+
+    snprintf(VS(effects.glow),
+             "%s",
+             map_string_get(data->cell->glow[map_layer]));
+    effects.glow_speed = data->cell->glow_speed[map_layer];
+    effects.glow_state = data->cell->glow_state[map_layer];
+
+    if (effect_has_overlay()) {
+        BIT_SET(effects.flags, SPRITE_FLAG_EFFECTS);
+    }
+
+    /* Darkness and the fog of war are applied to the whole map surface at
+     * once by the light map; objects in total darkness are not shown. */
+    bool hidden = false;
+    if (surface != cur_widget[MAP_ID]->surface) {
+        hidden = map_dark_level(data->cell->darkness[data->sub_layer]) ==
+                 DARK_LEVELS;
+    } else if (data->cell->fow) {
+        /* Shown as is; the light map applies the fog of war. */
+    } else if (data->cell->infravision[map_layer]) {
+        BIT_SET(effects.flags, SPRITE_FLAG_RED);
+    } else if (data->cell->flags[map_layer] & FFLAG_INVISIBLE) {
+        BIT_SET(effects.flags, SPRITE_FLAG_GRAY);
+    } else {
+        hidden = map_dark_level(data->cell->darkness[data->sub_layer]) ==
+                 DARK_LEVELS;
+    }
+
+    effects.alpha = data->cell->alpha[map_layer];
+
+    if (data->alpha_forced != 0) {
+        if (effects.alpha != 0) {
+            effects.alpha = MIN(effects.alpha, data->alpha_forced);
+        } else {
+            effects.alpha = data->alpha_forced;
+        }
+    }
+
+    /* Stretch floor and floor mask layers. */
+    if (data->layer <= LAYER_FMASK) {
+        effects.stretch = data->cell->stretch[data->sub_layer];
+    }
+
+    if (data->layer == LAYER_LIVING ||
+        data->layer == LAYER_EFFECT ||
+        data->layer == LAYER_ITEM ||
+        data->layer == LAYER_ITEM2) {
+        yl -= get_top_floor_height(data->cell, data->sub_layer);
+    } else {
+        yl -= data->cell->height[GET_MAP_LAYER(LAYER_FLOOR, data->sub_layer)];
+    }
+
+    yl += data->player_height_offset;
+
+    /* Move the object up/down depending on its height, but only for
+     * non-floor layers. */
+    if (data->layer > LAYER_FLOOR) {
+        yl -= data->cell->height[map_layer];
+    }
+
+    int xoff2;
+    if (xlen == MAP_TILE_POS_XOFF) {
+        xoff2 = (int) (((double) xlen / 100.0) * 25.0);
+    } else {
+        xoff2 = (int) (((double) xlen / 100.0) * 20.0);
+    }
+
+    /* Record the area covered by the object and everything shown along
+     * with it, for partial redraws. */
+    if (surface == cur_widget[MAP_ID]->surface) {
+        SDL_Rect box;
+        box.x = xl;
+        box.y = yl;
+        box.w = bitmap_w;
+        box.h = bitmap_h;
+
+        if (data->cell->draw_double[map_layer]) {
+            box.y -= 22;
+            box.h += 22;
+        }
+
+        map_object_box_extend(data, map_layer, xoff + xoff2,
+                              xlen - xoff2 * 2, xl + bitmap_w / 2, yl, &box);
+        SDL_UnionRect(&data->cell->draw_box, &box, &data->cell->draw_box);
+    }
+
+    if (data->measure) {
+        return;
+    }
+
+    /* Infravision shows objects regardless of the light, so they are drawn
+     * after the light map has been applied. */
+    if (data->light && BIT_QUERY(effects.flags, SPRITE_FLAG_RED)) {
+        map_draw_defer(data);
+        return;
+    }
+
+    if (!hidden) {
+        SDL_Surface *drawn = surface_show_effects(surface, xl, yl, NULL,
+                                                  face_sprite->bitmap,
+                                                  &effects);
+
+        /* Double faces are shown twice, one above the other, when not lower
+         * on the screen than the player. This simulates high walls without
+         * obscuring the user's view. */
+        if (data->cell->draw_double[map_layer]) {
+            surface_show_effects(surface, xl, yl - 22, NULL,
+                                 face_sprite->bitmap, &effects);
+        }
+
+        if (drawn != NULL && map_pick_valid &&
+            surface == cur_widget[MAP_ID]->surface) {
+            uint32_t id = MAP_PICK_ID(data->x, data->y, map_layer);
+            int y = yl;
+
+            /* Stretched surfaces are drawn higher up by their extra
+             * height. */
+            if (effects.stretch != 0) {
+                y -= drawn->h - face_sprite->bitmap->h;
+            }
+
+            map_pick_add(surface, drawn, xl, y, id);
+
+            if (data->cell->draw_double[map_layer]) {
+                map_pick_add(surface, drawn, xl, y - 22, id);
+            }
+        }
+    }
+
+    /* Rest of the code deals with rendering on the map widget. */
+    if (surface != cur_widget[MAP_ID]->surface) {
+        return;
+    }
+
+    /* Do we have a playername? Then print it! */
+    if (data->cell->pname[map_layer] != 0 &&
+        setting_get_int(OPT_CAT_MAP, OPT_PLAYER_NAMES)) {
+        bool draw_name = false;
+        const char *name = map_string_get(data->cell->pname[map_layer]);
+
+        if (setting_get_int(OPT_CAT_MAP, OPT_PLAYER_NAMES) == 1) {
+            draw_name = true;
+        } else if (setting_get_int(OPT_CAT_MAP, OPT_PLAYER_NAMES) == 2) {
+            if (strncasecmp(name, cpl.name, strlen(name)) != 0) {
+                draw_name = true;
+            }
+        } else if (setting_get_int(OPT_CAT_MAP, OPT_PLAYER_NAMES) == 3) {
+            if (strncasecmp(name, cpl.name, strlen(name)) == 0) {
+                draw_name = true;
+            }
+        }
+
+        /* Shown once the map has been lit, to stay readable. */
+        if (draw_name) {
+            data->names = erealloc(data->names,
+                                   sizeof(*data->names) *
+                                       (data->names_num + 1));
+            map_render_name_t *render_name = &data->names[data->names_num++];
+            render_name->x = xoff + xoff2 + (xlen - xoff2 * 2) / 2 -
+                             text_get_width(FONT_SANS9, name, 0) / 2 - 2;
+            render_name->y = yl - 24;
+            render_name->name = name;
+            render_name->color = map_string_get(
+                data->cell->pcolor[map_layer]);
+        }
+    }
+
+    /* Show the status effect, if any, */
+    if (data->cell->flags[map_layer]) {
+        sprite_effects_t effects2 = {0};
+        effects2.alpha = effects.alpha;
+        effects2.stretch = effects.stretch;
+        effects2.zoom_x = effects.zoom_x;
+        effects2.zoom_y = effects.zoom_y;
+        effects2.rotate = effects.rotate;
+
+        if (data->cell->flags[map_layer] & FFLAG_SLEEP) {
+            surface_show_effects(surface,
+                                 xl + bitmap_w / 2,
+                                 yl - 5,
+                                 NULL,
+                                 TEXTURE_CLIENT("sleep"),
+                                 &effects2);
+        }
+
+        if (data->cell->flags[map_layer] & FFLAG_CONFUSED) {
+            surface_show_effects(surface,
+                                 xl + bitmap_w / 2 - 1,
+                                 yl - 4,
+                                 NULL,
+                                 TEXTURE_CLIENT("confused"),
+                                 &effects2);
+        }
+
+        if (data->cell->flags[map_layer] & FFLAG_SCARED) {
+            surface_show_effects(surface,
+                                 xl + bitmap_w / 2 + 10,
+                                 yl - 4,
+                                 NULL,
+                                 TEXTURE_CLIENT("scared"),
+                                 &effects2);
         }
 
-        for (i = 0; i < NUM_SUB_LAYERS; i++) {
-            cell->anim_flags[i] = 0;
-            cell->priority[i] = 0;
-            cell->secondpass[i] = 0;
+        if (data->cell->flags[map_layer] & FFLAG_BLINDED) {
+            surface_show_effects(surface,
+                                 xl + bitmap_w / 2 + 3,
+                                 yl - 6,
+                                 NULL,
+                                 TEXTURE_CLIENT("blind"),
+                                 &effects2);
         }
-    }
 
-    if (anim_speed != 0 && cell->faces[layer] != face) {
-        cell->anim_state[layer] = 0;
+        if (data->cell->flags[map_layer] & FFLAG_PARALYZED) {
+            surface_show_effects(surface,
+                                 xl + bitmap_w / 2 + 3,
+                                 yl + 3,
+                                 NULL,
+                                 TEXTURE_CLIENT("paralyzed"),
+                                 &effects2);
+        }
     }
 
-    cell->priority[sub_layer] |= priority << (((layer % NUM_LAYERS) + 1) - 1);
-    cell->secondpass[sub_layer] |= secondpass << (((layer % NUM_LAYERS) + 1) -
-            1);
-
-    cell->faces[layer] = face;
-    cell->flags[layer] = obj_flags;
+    if (data->layer == LAYER_FLOOR && tiles_debug) {
+        data->tiles = erealloc(data->tiles,
+                               sizeof(*data->tiles) * ((data->tiles_num) + 1));
+        data->tiles[data->tiles_num].x = xl;
+        data->tiles[data->tiles_num].y = yl;
+        data->tiles[data->tiles_num].w = data->x;
+        data->tiles[data->tiles_num].h = data->y;
+        data->tiles_num++;
+    }
 
-    cell->probe[layer] = probe;
-    cell->quick_pos[layer] = quick_pos;
+    if (!data->cell->fow &&
+        data->cell->probe[map_layer] != 0) {
+        data->target_cell = data->cell;
+        data->target_layer = map_layer;
+        data->target_rect.x = xoff + xoff2;
+        data->target_rect.y = yl - 9;
+        data->target_rect.w = (xlen - xoff2 * 2);
+        data->target_rect.h = 1;
+    }
+}
 
-    snprintf(VS(cell->pcolor[layer]), "%s", name_color);
-    snprintf(VS(cell->pname[layer]), "%s", name);
-    snprintf(VS(cell->glow[layer]), "%s", glow);
+/**
+ * Calculates whether the specified coordinates are behind a wall.
+ *
+ * @param dx
+ * Start X.
+ * @param dy
+ * Start Y.
+ * @param sx
+ * End X.
+ * @param sy
+ * End Y.
+ * @return
+ * Whether the coordinates @p dx and @p dy are behind a wall or not.
+ */
+static bool
+obj_is_behind_wall (int dx, int dy, int sx, int sy)
+{
+    int fraction, dx2, dy2, stepx, stepy;
+    int x = sx, y = sy;
+    int distance_x = dx - sx;
+    int distance_y = dy - sy;
 
-    cell->height[layer] = height;
-    cell->zoom_x[layer] = zoom_x;
-    cell->zoom_y[layer] = zoom_y;
-    cell->align[layer] = align;
-    cell->draw_double[layer] = draw_double;
-    cell->alpha[layer] = alpha;
-    cell->rotate[layer] = rotate;
-    cell->infravision[layer] = infravision;
-    cell->glow_speed[layer] = glow_speed;
+    BRESENHAM_INIT(distance_x, distance_y, fraction, stepx, stepy, dx2, dy2);
 
-    if (cell->target_object_count[layer] != target_object_count ||
-            cell->target_is_friend[layer] != target_is_friend) {
-        cpl.target_object_index = 0;
-    }
+    while (1) {
+        if (x == dx && y == dy) {
+            return false;
+        }
 
-    cell->target_object_count[layer] = target_object_count;
-    cell->target_is_friend[layer] = target_is_friend;
+        if (x < 0 || x >= map_width || y < 0 || y >= map_height) {
+            return false;
+        }
 
-    cell->anim_speed[layer] = anim_speed;
-    cell->anim_facing[layer] = anim_facing;
+        for (int sub_layer = 0; sub_layer < NUM_SUB_LAYERS; sub_layer++) {
+            MapCell *cell = MAP_CELL_GET_MIDDLE(x, y);
 
-    if (((layer % NUM_LAYERS) + 1) == LAYER_LIVING) {
-        if (anim_flags & ANIM_FLAG_ATTACKING &&
-                !(cell->anim_flags[sub_layer] & ANIM_FLAG_ATTACKING)) {
-            cell->anim_state[layer] = 0;
-        } else if (anim_flags & ANIM_FLAG_MOVING &&
-                !(cell->anim_flags[sub_layer] & ANIM_FLAG_MOVING)) {
-            cell->anim_state[layer] = anim_state;
+            if (cell->faces[GET_MAP_LAYER(LAYER_WALL, sub_layer)] != 0) {
+                return true;
+            }
         }
 
-        cell->anim_flags[sub_layer] = anim_flags;
-    }
-
-    if (anim_speed != 0) {
-        check_animation_status(face);
-    } else {
-        image_request_face(face);
+        BRESENHAM_STEP(x, y, fraction, stepx, stepy, dx2, dy2);
     }
 }
 
 /**
- * Clear map's cell.
+ * Determine if an object being rendered should be culled.
  *
- * In reality, this only clears some data on the cell, and sets the FOW flag
- * to mark that the cell is actually FOW.
- * @param x
- * X of the cell.
- * @param y
- * Y of the cell.
+ * @param surface
+ * Surface that rendering is being done for.
+ * @param data
+ * Rendering data.
+ * @return
+ * Whether the object should be culled.
  */
-void map_clear_cell(int x, int y)
+static bool
+map_should_cull (SDL_Surface           *surface,
+                 map_render_data_t     *data)
 {
-    struct MapCell *cell;
-    int layer;
+    /* Determine the distance of the object relative to the PC. */
+    int distance_x = data->x - map_width * MAP_FOW_SIZE / 2;
+    int distance_y = data->y - map_height * MAP_FOW_SIZE / 2;
+    int distance = isqrt(distance_x * distance_x +
+                         distance_y * distance_y);
+    if (distance > 3) {
+        /* Too far away, no culling. */
+        return false;
+    }
 
-    cell = MAP_CELL_GET_MIDDLE(x, y);
-    cell->fow = 1;
+    /* Must be in the southern or eastern quadrant to be culled. */
+    if (data->x < map_width * MAP_FOW_SIZE / 2 ||
+        data->y < map_height * MAP_FOW_SIZE / 2) {
+        return false;
+    }
 
-    for (layer = 0; layer < NUM_REAL_LAYERS; layer++) {
-        cell->probe[layer] = 0;
-        cell->target_object_count[layer] = 0;
-        cell->target_is_friend[layer] = 0;
-        cell->pname[layer][0] = '\0';
+    bool cull = false;
+    int range = 2;
+
+    for (int sub_layer2 = NUM_SUB_LAYERS - 1;
+         sub_layer2 > 0;
+         sub_layer2--) {
+        int16_t height = data->cell->height[GET_MAP_LAYER(LAYER_EFFECT,
+                                                          sub_layer2)];
+        if (height - data->player_height_offset > 50) {
+            range = 0;
+        }
     }
-}
 
-/**
- * Set darkness for map's cell.
- * @param x
- * X of the cell.
- * @param y
- * Y of the cell.
- * @param sub_layer
- * Sub-layer.
- * @param darkness
- * Darkness to set.
- */
-void map_set_darkness(int x, int y, int sub_layer, uint8_t darkness)
-{
-    struct MapCell *cell;
+    if (range == 0) {
+        cull = true;
+    }
 
-    cell = MAP_CELL_GET_MIDDLE(x, y);
-    cell->darkness[sub_layer] = darkness;
+    for (int nx = data->x - range; nx <= data->x && !cull; nx++) {
+        for (int ny = data->y - range; ny <= data->y && !cull; ny++) {
+            MapCell *cell2 = MAP_CELL_GET(nx, ny);
+
+            for (int sub_layer2 = 0;
+                 sub_layer2 < NUM_SUB_LAYERS;
+                 sub_layer2++) {
+                if (cell2->secondpass[sub_layer2] & (1 << (LAYER_WALL - 1)) &&
+                    !obj_is_behind_wall(nx,
+                                        ny,
+                                        map_width * MAP_FOW_SIZE / 2,
+                                        map_height * MAP_FOW_SIZE / 2)) {
+                    cull = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    return cull && range != 0;
 }
 
 /**
- * Get the height of the topmost floor on the specified square.
- * @param x
- * X position.
- * @param y
- * Y position.
+ * Determine if a specified tile should be rendered.
+ *
+ * Assigns the cell to be rendered in the map render data structure on success.
+ *
+ * @param surface
+ * Surface rendering is being done on.
+ * @param data
+ * Map rendering data.
  * @return
- * The height.
+ * Whether the tile should be rendered.
  */
-static int get_top_floor_height(struct MapCell *cell, int sub_layer)
+static bool
+map_should_draw (SDL_Surface *surface, map_render_data_t *data)
 {
-    int16_t height;
+    HARD_ASSERT(surface != NULL);
+    HARD_ASSERT(data != NULL);
 
-    height = cell->height[GET_MAP_LAYER(LAYER_FLOOR, sub_layer)];
+    data->xpos = surface->w / 2 - MAP_TILE_POS_XOFF / 2 +
+                 (data->x - data->midx) * MAP_TILE_YOFF -
+                 (data->y - data->midy) * MAP_TILE_YOFF;
+    data->ypos = surface->h / 2 - MAP_TILE_POS_YOFF / 2 +
+                 (data->x - data->midx) * MAP_TILE_XOFF +
+                 (data->y - data->midy) * MAP_TILE_XOFF;
 
-    return MAX(0, height);
-}
+    if (surface != cur_widget[MAP_ID]->surface) {
+        data->ypos -= map_width * MAP_TILE_XOFF + map_height *
+                      MAP_TILE_XOFF * (MAP_FOW_SIZE / 2);
+        data->ypos -= map_height * MAP_TILE_YOFF;
+    }
 
-static void map_animate_object(struct MapCell *cell, int layer)
-{
-    Animations *animation;
+    if (data->xpos > surface->w || data->xpos + MAP_TILE_POS_XOFF < 0 ||
+        data->ypos + MAP_TILE_POS_YOFF < 0) {
+        return false;
+    }
 
-    if (cell->faces[layer] == 0 || cell->anim_speed[layer] == 0 ||
-            cell->anim_facing[layer] == 0) {
-        return;
+    data->cell = MAP_CELL_GET(data->x, data->y);
+
+    if (data->partial && !data->cell->redraw) {
+        return false;
     }
 
-    animation = &animations[cell->faces[layer]];
+    int height = 0;
+    for (uint8_t sub_layer = 0; sub_layer < NUM_SUB_LAYERS; sub_layer++) {
+        uint8_t map_layer = GET_MAP_LAYER(LAYER_FLOOR, sub_layer);
+        if (data->cell->height[map_layer] > height) {
+            height = data->cell->height[map_layer];
+        }
 
-    if (animation->num_animations == 0) {
-        return;
+        map_layer = GET_MAP_LAYER(LAYER_EFFECT, sub_layer);
+        if (data->cell->height[map_layer] > height) {
+            height = data->cell->height[map_layer];
+        }
     }
 
-    if (!(cell->flags[layer] & FFLAG_SLEEP) &&
-            !(cell->flags[layer] & FFLAG_PARALYZED)) {
-        cell->anim_state[layer]++;
-        map_redraw_flag = 1;
+    if (data->ypos - height > surface->h) {
+        return false;
     }
 
-    /* If beyond drawable states, reset */
-    if (cell->anim_state[layer] >=
-            animation->num_animations / animation->facings) {
-        cell->anim_state[layer] = 0;
-    }
+    return true;
 }
 
-void map_animate(void)
+/**
+ * Setup the base information in a map render data structure and calculate
+ * X/Y cell indexes and maximum dimensions.
+ *
+ * @param surface
+ * Surface rendering is being done for.
+ * @param[out] data Map rendering data.
+ * @param[out] x Will contain X index of the cell to render. Can be NULL.
+ * @param[out] y Will contain Y index of the cell to render. Can be NULL.
+ * @param[out] w Maximum width. Can be NULL.
+ * @param[out] h Maximum height. Can be NULL.
+ */
+static void
+map_setup_render_data (SDL_Surface       *surface,
+                       map_render_data_t *data,
+                       int               *x,
+                       int               *y,
+                       int               *w,
+                       int               *h)
 {
-    int x, y, layer;
-    struct MapCell *cell;
-
-    for (x = 0; x < map_width; x++) {
-        for (y = 0; y < map_height; y++) {
-            cell = MAP_CELL_GET_MIDDLE(x, y);
+    HARD_ASSERT(surface != NULL);
+    HARD_ASSERT(data != NULL);
 
-            if (cell->fow) {
-                continue;
-            }
+    data->x = map_width - (map_width / 2) - 1;
+    data->y = map_height - (map_height / 2) - 1;
+    data->cell = MAP_CELL_GET_MIDDLE(data->x, data->y);
+    data->player_height_offset = get_top_floor_height(data->cell,
+                                                      MapData.player_sub_layer);
 
-            for (layer = 0; layer < NUM_REAL_LAYERS; layer++) {
-                if (cell->glow_speed[layer] > 1) {
-                    cell->glow_state[layer]++;
-                    map_redraw_flag = 1;
 
-                    if (cell->glow_state[layer] > cell->glow_speed[layer]) {
-                        cell->glow_state[layer] = 0;
-                    }
-                }
+    if (surface == cur_widget[MAP_ID]->surface) {
+        data->midx = map_width * MAP_FOW_SIZE / 2;
+        data->midy = map_height * MAP_FOW_SIZE / 2;
 
-                if (cell->anim_speed[layer] == 0) {
-                    continue;
-                }
+        int maxw = surface->w / 2.0 / (MAP_TILE_POS_XOFF / 2.0);
+        int maxh = surface->h / 2.0 / (MAP_TILE_POS_YOFF / 2.0);
+        int maxtiles = MAX(maxh, maxw);
 
-                if (cell->anim_last[layer] >= cell->anim_speed[layer]) {
-                    map_animate_object(cell, layer);
-                    cell->anim_last[layer] = 1;
-                } else {
-                    cell->anim_last[layer]++;
-                }
+        if (x != NULL) {
+            *x = data->midx - maxtiles;
+            if (*x < 0) {
+                *x = 0;
             }
         }
-    }
-}
-
-static uint16_t map_object_get_face(struct MapCell *cell, int layer)
-{
-    int sub_layer, dir, state;
-    Animations *animation;
 
-    if (cell->anim_speed[layer] == 0) {
-        return cell->faces[layer];
-    }
+        if (y != NULL) {
+            *y = data->midy - maxtiles;
+            if (*y < 0) {
+                *y = 0;
+            }
+        }
 
-    animation = &animations[cell->faces[layer]];
+        if (w != NULL) {
+            *w = data->midx + maxtiles;
+            if (*w > map_width * MAP_FOW_SIZE) {
+                *w = map_width * MAP_FOW_SIZE;
+            }
+        }
 
-    if (animation->num_animations == 0) {
-        return cell->faces[layer];
-    }
+        if (h != NULL) {
+            *h = data->midy + maxtiles;
+            if (*h > map_height * MAP_FOW_SIZE) {
+                *h = map_height * MAP_FOW_SIZE;
+            }
+        }
+    } else {
+        if (x != NULL) {
+            *x = 0;
+        }
 
-    sub_layer = layer / NUM_LAYERS;
-    dir = cell->anim_facing[layer] - 1;
-    state = 0;
+        if (y != NULL) {
+            *y = 0;
+        }
 
-    if (animation->facings == 9) {
-        state = dir * (animation->num_animations / 9);
-    } else if (animation->facings >= 25) {
-        if (cell->anim_flags[sub_layer] & ANIM_FLAG_ATTACKING) {
-            dir += 16;
-        } else if (cell->anim_flags[sub_layer] & ANIM_FLAG_MOVING) {
-            dir += 8;
+        if (w != NULL) {
+            *w = map_width * MAP_FOW_SIZE;
         }
 
-        state = dir * (animation->num_animations / animation->facings);
+        if (h != NULL) {
+            *h = map_height * MAP_FOW_SIZE;
+        }
     }
 
-    return animation->faces[cell->anim_state[layer] + state];
 }
 
 /**
- * Structure used to pass data between the rendering loops in map_draw_map()
- * and the actual rendering logic in draw_map_object().
+ * Draw an object on the map, or record it in ::map_draw_list.
  *
- * Try to keep this structure aligned whenever extending it.
+ * @param surface
+ * Surface rendering is being done on.
+ * @param data
+ * Rendering data.
  */
-typedef struct map_render_data {
-    int16_t x; ///< X index in the cells array.
-    int16_t y; ///< Y index in the cells array.
-
-    int16_t midx; ///< X index in the cells array of the middlemost cell.
-    int16_t midy; ///< Y index in the cells array of the middlemost cell.
-
-    int32_t xpos; ///< X coordinate where to render.
-    int32_t ypos; ///< Y coordinate where to render.
-    int32_t player_height_offset; ///< Player height offset.
-
-    struct MapCell *cell; ///< Cell that is being rendered.
-    struct MapCell *target_cell; ///< Cell with the player's target.
-    SDL_Rect *tiles; ///< Floor tile coordinates and IDs. Used for debugging.
+static void
+map_draw_emit (SDL_Surface *surface, map_render_data_t *data)
+{
+    if (!data->record) {
+        draw_map_object(surface, data);
+        return;
+    }
 
-    size_t tiles_num; ///< Number of tiles.
+    /* Only objects that were set on the cell can ever be drawn. */
+    uint8_t map_layer = GET_MAP_LAYER(data->layer, data->sub_layer);
+    if (data->cell->faces[map_layer] == 0) {
+        return;
+    }
 
-    SDL_Rect target_rect; ///< Coordinate information for player's target.
+    if (map_draw_list_num == map_draw_list_size) {
+        map_draw_list_size = map_draw_list_size != 0 ?
+                             map_draw_list_size * 2 : 1024;
+        map_draw_list = erealloc(map_draw_list,
+                                 sizeof(*map_draw_list) * map_draw_list_size);
+    }
 
-    uint8_t layer; ///< Layer to render on.
-    uint8_t sub_layer; ///< Sub-layer to render on.
-    uint8_t alpha_forced; ///< Force applying the specified alpha value.
-    uint8_t target_layer; ///< Target's layer.
-} map_render_data_t;
+    map_draw_op_t *op = &map_draw_list[map_draw_list_num++];
+    op->x = data->x;
+    op->y = data->y;
+    op->xpos = data->xpos;
+    op->ypos = data->ypos;
+    op->layer = data->layer;
+    op->sub_layer = data->sub_layer;
+    op->alpha_forced = data->alpha_forced;
+}
 
 /**
- * Draw a single object on the map.
+ * Go through the map cells in the order they must be drawn in, and emit
+ * the objects to draw using map_draw_emit().
  *
  * @param surface
- * Surface to render on.
+ * Surface rendering is being done on.
  * @param data
- * Rendering data. May be modified.
+ * Rendering data.
+ * @param x
+ * X index of the first cell.
+ * @param y
+ * Y index of the first cell.
+ * @param w
+ * Maximum X index.
+ * @param h
+ * Maximum Y index.
  */
 static void
-draw_map_object (SDL_Surface *surface, map_render_data_t *data)
+map_draw_passes (SDL_Surface       *surface,
+                 map_render_data_t *data,
+                 int                x,
+                 int                y,
+                 int                w,
+                 int                h)
 {
-    HARD_ASSERT(surface != NULL);
-    HARD_ASSERT(data != NULL);
+    /* Draw floor and fmasks. */
+    for (data->x = x; data->x < w; data->x++) {
+        for (data->y = y; data->y < h; data->y++) {
+            if (!map_should_draw(surface, data)) {
+                continue;
+            }
 
-    uint8_t map_layer = GET_MAP_LAYER(data->layer, data->sub_layer);
-    uint16_t face = map_object_get_face(data->cell, map_layer);
-    if (face == 0 || face >= MAX_FACE_TILES) {
-        return;
-    }
+            for (data->layer = LAYER_FLOOR;
+                 data->layer <= LAYER_FMASK;
+                 data->layer++) {
+                if (data->cell->priority[0] & (1 << (data->layer - 1))) {
+                    continue;
+                }
 
-    sprite_struct *face_sprite = FaceList[face].sprite;
-    if (face_sprite == NULL) {
-        return;
+                map_draw_emit(surface, data);
+            }
+        }
     }
 
-    /* When rendering on the map surface, avoid rendering the object
-     * when it's too high up and either in the FoW or the map has the
-     * "height difference" feature enabled. */
-    if (surface == cur_widget[MAP_ID]->surface &&
-        (data->cell->fow || MapData.height_diff) &&
-        abs(get_top_floor_height(data->cell, data->sub_layer) -
-            data->player_height_offset) > HEIGHT_MAX_RENDER) {
-        return;
-    }
+    uint8_t floor_layer_pl = GET_MAP_LAYER(LAYER_FLOOR,
+                                           MapData.player_sub_layer);
 
-    int bitmap_h = face_sprite->bitmap->h;
-    int bitmap_w = face_sprite->bitmap->w;
+    /* Now draw everything else. */
+    for (data->x = x; data->x < w; data->x++) {
+        for (data->y = y; data->y < h; data->y++) {
+            if (!map_should_draw(surface, data)) {
+                continue;
+            }
 
-    sprite_effects_t effects = {0};
-    effects.rotate = data->cell->rotate[map_layer];
-    effects.zoom_x = data->cell->zoom_x[map_layer];
-    effects.zoom_y = data->cell->zoom_y[map_layer];
+            for (data->layer = LAYER_FLOOR;
+                 data->layer <= NUM_LAYERS;
+                 data->layer++) {
+                for (data->sub_layer = 0;
+                     data->sub_layer < NUM_SUB_LAYERS;
+                     data->sub_layer++) {
+                    if (data->sub_layer == 0 &&
+                        (data->layer == LAYER_FLOOR ||
+                         data->layer == LAYER_FMASK)) {
+                        continue;
+                    }
 
-    if (effects.rotate != 0) {
-        rotozoomSurfaceSizeXY(bitmap_w,
-                              bitmap_h,
-                              effects.rotate,
-                              effects.zoom_x != 0 ? effects.zoom_x / 100.0 :
-                                  1.0,
-                              effects.zoom_y != 0 ? effects.zoom_y / 100.0 :
-                                  1.0,
-                              &bitmap_w,
-                              &bitmap_h);
-    } else if ((effects.zoom_x != 0 && effects.zoom_x != 100) ||
-               (effects.zoom_y != 0 && effects.zoom_y != 100)) {
-        zoomSurfaceSize(bitmap_w,
-                        bitmap_h,
-                        effects.zoom_x != 0 ? effects.zoom_x / 100.0 : 1.0,
-                        effects.zoom_y != 0 ? effects.zoom_y / 100.0 : 1.0,
-                        &bitmap_w,
-                        &bitmap_h);
-    }
+                    /* Skip objects on the effect layer with non-zero sub-layer
+                     * because they will be rendered later. */
+                    if (data->layer == LAYER_EFFECT && data->sub_layer != 0) {
+                        uint8_t effect_layer =
+                            GET_MAP_LAYER(LAYER_EFFECT, data->sub_layer);
+                        uint8_t floor_layer =
+                            GET_MAP_LAYER(LAYER_FLOOR,
+                                          MapData.player_sub_layer);
+                        if (data->cell->height[effect_layer] >=
+                            data->cell->height[floor_layer]) {
+                            continue;
+                        }
+                    }
+
+                    if (data->cell->priority[data->sub_layer] &
+                        (1 << (data->layer - 1))) {
+                        continue;
+                    }
+
+                    map_draw_emit(surface, data);
+                }
+            }
+
+            for (data->sub_layer = 0;
+                 data->sub_layer < NUM_SUB_LAYERS;
+                 data->sub_layer++) {
+                uint8_t map_layer = GET_MAP_LAYER(LAYER_FLOOR,
+                                                  data->sub_layer);
+                if (data->cell->height[map_layer] >
+                    data->cell->height[floor_layer_pl]) {
+                    continue;
+                }
+
+                for (data->layer = LAYER_FLOOR;
+                     data->layer <= NUM_LAYERS;
+                     data->layer++) {
+                    if (!(data->cell->priority[data->sub_layer] &
+                          (1 << (data->layer - 1)))) {
+                        continue;
+                    }
 
-    int xlen;
-    int xoff;
-    int yl;
-    int xl;
-    /* Multi-part object? */
-    if (data->cell->quick_pos[map_layer]) {
-        uint8_t mnr = data->cell->quick_pos[map_layer];
-        uint8_t mid = mnr >> 4;
-        mnr &= 0x0f;
-        xlen = MultiArchs[mid].xlen;
-        yl = data->ypos - MultiArchs[mid].part[mnr].yoff +
-             MultiArchs[mid].ylen - bitmap_h;
+                    if (data->layer == LAYER_EFFECT && data->sub_layer != 0) {
+                        map_layer = GET_MAP_LAYER(LAYER_EFFECT,
+                                                  data->sub_layer);
+                        if (data->cell->height[map_layer] >=
+                            data->cell->height[floor_layer_pl]) {
+                            continue;
+                        }
+                    }
 
-        /* Center overlapping X borders */
-        xl = 0;
-        if (bitmap_w > MultiArchs[mid].xlen) {
-            xl = (MultiArchs[mid].xlen - bitmap_w) >> 1;
-        }
+                    map_draw_emit(surface, data);
+                }
+            }
 
-        xoff = data->xpos - MultiArchs[mid].part[mnr].xoff;
-        xl += xoff;
-    } else {
-        /* Calculate offsets */
-        xlen = MAP_TILE_POS_XOFF;
-        yl = (data->ypos + MAP_TILE_POS_YOFF) - bitmap_h;
-        xoff = xl = data->xpos;
+            for (data->layer = LAYER_FLOOR;
+                 data->layer <= NUM_LAYERS;
+                 data->layer++) {
+                if (!(data->cell->priority[0] & (1 << (data->layer - 1)))) {
+                    continue;
+                }
 
-        if (bitmap_w > MAP_TILE_POS_XOFF) {
-            xl -= (bitmap_w - MAP_TILE_POS_XOFF) / 2;
-        }
-    }
+                map_draw_emit(surface, data);
+            }
 
-    xl += data->cell->align[map_layer];
+            data->layer = LAYER_EFFECT;
 
-    snprintf(VS(effects.glow), "%s", data->cell->glow[map_layer]);
-    effects.glow_speed = data->cell->glow_speed[map_layer];
-    effects.glow_state = data->cell->glow_state[map_layer];
+            for (data->sub_layer = NUM_SUB_LAYERS - 1;
+                 data->sub_layer >= 1;
+                 data->sub_layer--) {
+                if (data->cell->priority[data->sub_layer] &
+                    (1 << (LAYER_EFFECT - 1))) {
+                    continue;
+                }
 
-    if (effect_has_overlay()) {
-        BIT_SET(effects.flags, SPRITE_FLAG_EFFECTS);
-    }
+                uint8_t map_layer = GET_MAP_LAYER(LAYER_EFFECT, data->sub_layer);
+                if (data->cell->height[map_layer] <
+                    data->cell->height[floor_layer_pl]) {
+                    continue;
+                }
 
-    if (data->cell->fow) {
-        BIT_SET(effects.flags, SPRITE_FLAG_FOW);
-    } else if (data->cell->infravision[map_layer]) {
-        BIT_SET(effects.flags, SPRITE_FLAG_RED);
-    } else if (data->cell->flags[map_layer] & FFLAG_INVISIBLE) {
-        BIT_SET(effects.flags, SPRITE_FLAG_GRAY);
-    } else {
-        BIT_SET(effects.flags, SPRITE_FLAG_DARK);
-    }
+                if (surface == cur_widget[MAP_ID]->surface &&
+                    map_should_cull(surface, data)) {
+                    continue;
+                }
 
-    if (surface != cur_widget[MAP_ID]->surface) {
-        BITMASK_CLEAR(effects.flags,
-                      BIT_MASK(SPRITE_FLAG_RED) | BIT_MASK(SPRITE_FLAG_FOW));
-        BIT_SET(effects.flags, SPRITE_FLAG_DARK);
-    }
+                map_draw_emit(surface, data);
+            }
 
-    if (BIT_QUERY(effects.flags, SPRITE_FLAG_DARK)) {
-        effects.dark_level = 7 - data->cell->darkness[data->sub_layer] / 30;
-    }
+            for (data->sub_layer = 0;
+                 data->sub_layer < NUM_SUB_LAYERS;
+                 data->sub_layer++) {
+                uint8_t map_layer = GET_MAP_LAYER(LAYER_FLOOR,
+                                                  data->sub_layer);
+                if (data->cell->height[map_layer] <=
+                    data->cell->height[floor_layer_pl]) {
+                    continue;
+                }
 
-    effects.alpha = data->cell->alpha[map_layer];
+                for (data->layer = LAYER_FLOOR;
+                     data->layer <= NUM_LAYERS;
+                     data->layer++) {
+                    if (!(data->cell->priority[data->sub_layer] &
+                          (1 << (data->layer - 1)))) {
+                        continue;
+                    }
 
-    if (data->alpha_forced != 0) {
-        if (effects.alpha != 0) {
-            effects.alpha = MIN(effects.alpha, data->alpha_forced);
-        } else {
-            effects.alpha = data->alpha_forced;
-        }
-    }
+                    map_draw_emit(surface, data);
+                }
+            }
 
-    /* Stretch floor and floor mask layers. */
-    if (data->layer <= LAYER_FMASK) {
-        effects.stretch = data->cell->stretch[data->sub_layer];
-    }
+            data->layer = LAYER_EFFECT;
 
-    if (data->layer == LAYER_LIVING ||
-        data->layer == LAYER_EFFECT ||
-        data->layer == LAYER_ITEM ||
-        data->layer == LAYER_ITEM2) {
-        yl -= get_top_floor_height(data->cell, data->sub_layer);
-    } else {
-        yl -= data->cell->height[GET_MAP_LAYER(LAYER_FLOOR, data->sub_layer)];
-    }
+            for (data->sub_layer = NUM_SUB_LAYERS - 1;
+                 data->sub_layer >= 1;
+                 data->sub_layer--) {
+                uint8_t map_layer = GET_MAP_LAYER(LAYER_EFFECT,
+                                                  data->sub_layer);
+                if (data->cell->height[map_layer] <
+                    data->cell->height[floor_layer_pl]) {
+                    continue;
+                }
 
-    yl += data->player_height_offset;
+                uint8_t map_layer2 = GET_MAP_LAYER(LAYER_FLOOR,
+                                                   data->sub_layer - 1);
+                if (data->cell->height[map_layer] <=
+                    data->cell->height[map_layer2]) {
+                    continue;
+                }
 
-    /* Move the object up/down depending on its height, but only for
-     * non-floor layers. */
-    if (data->layer > LAYER_FLOOR) {
-        yl -= data->cell->height[map_layer];
-    }
+                map_layer2 = GET_MAP_LAYER(LAYER_EFFECT,
+                                           data->sub_layer - 1);
+                if (data->cell->height[map_layer] <=
+                    data->cell->height[map_layer2]) {
+                    continue;
+                }
 
-    surface_show_effects(surface, xl, yl, NULL, face_sprite->bitmap, &effects);
+                if (surface == cur_widget[MAP_ID]->surface &&
+                    map_should_cull(surface, data)) {
+                    continue;
+                }
+
+                map_draw_emit(surface, data);
+            }
 
-    /* Double faces are shown twice, one above the other, when not lower
-     * on the screen than the player. This simulates high walls without
-     * obscuring the user's view. */
-    if (data->cell->draw_double[map_layer]) {
-        surface_show_effects(surface, xl, yl - 22, NULL, face_sprite->bitmap,
-                             &effects);
+            if (data->cell->priority[0] & (1 << (LAYER_WALL - 1)) &&
+                data->cell->height[GET_MAP_LAYER(LAYER_WALL, 0)] > 0) {
+                data->layer = LAYER_WALL;
+                data->sub_layer = 0;
+                map_draw_emit(surface, data);
+            }
+        }
     }
 
-    /* Rest of the code deals with rendering on the map widget. */
     if (surface != cur_widget[MAP_ID]->surface) {
         return;
     }
 
-    int xoff2;
-    if (xlen == MAP_TILE_POS_XOFF) {
-        xoff2 = (int) (((double) xlen / 100.0) * 25.0);
-    } else {
-        xoff2 = (int) (((double) xlen / 100.0) * 20.0);
-    }
+    for (data->x = x; data->x < w; data->x++) {
+        for (data->y = y; data->y < h; data->y++) {
+            if (!map_should_draw(surface, data)) {
+                continue;
+            }
 
-    /* Do we have a playername? Then print it! */
-    if (data->cell->pname[map_layer][0] != '\0' &&
-        setting_get_int(OPT_CAT_MAP, OPT_PLAYER_NAMES)) {
-        bool draw_name = false;
-        char *name = data->cell->pname[map_layer];
+            for (data->sub_layer = NUM_SUB_LAYERS - 1;
+                 data->sub_layer >= 1;
+                 data->sub_layer--) {
+                uint8_t map_layer = GET_MAP_LAYER(LAYER_EFFECT, data->sub_layer);
+                if (data->cell->height[map_layer] != 0 &&
+                    data->cell->faces[map_layer] != 0) {
+                    data->cell = NULL;
+                    break;
+                }
+            }
 
-        if (setting_get_int(OPT_CAT_MAP, OPT_PLAYER_NAMES) == 1) {
-            draw_name = true;
-        } else if (setting_get_int(OPT_CAT_MAP, OPT_PLAYER_NAMES) == 2) {
-            if (strncasecmp(name, cpl.name, strlen(name)) != 0) {
-                draw_name = true;
+            if (data->cell == NULL) {
+                continue;
             }
-        } else if (setting_get_int(OPT_CAT_MAP, OPT_PLAYER_NAMES) == 3) {
-            if (strncasecmp(name, cpl.name, strlen(name)) == 0) {
-                draw_name = true;
+
+            data->layer = LAYER_LIVING;
+            data->alpha_forced = 100;
+
+            for (data->sub_layer = 0;
+                 data->sub_layer < NUM_SUB_LAYERS;
+                 data->sub_layer++) {
+                map_draw_emit(surface, data);
             }
         }
+    }
+}
 
-        if (draw_name) {
-            text_show(surface,
-                      FONT_SANS9,
-                      name,
-                      xoff + xoff2 + (xlen - xoff2 * 2) / 2 -
-                          text_get_width(FONT_SANS9, name, 0) / 2 - 2,
-                      yl - 24,
-                      data->cell->pcolor[map_layer],
-                      TEXT_OUTLINE,
-                      NULL);
-        }
+/**
+ * Draw the objects on the map surface by replaying ::map_draw_list,
+ * rebuilding it first if necessary.
+ *
+ * @param surface
+ * The map surface.
+ * @param data
+ * Rendering data.
+ * @param x
+ * X index of the first cell.
+ * @param y
+ * Y index of the first cell.
+ * @param w
+ * Maximum X index.
+ * @param h
+ * Maximum Y index.
+ */
+static void
+map_draw_list_replay (SDL_Surface       *surface,
+                      map_render_data_t *data,
+                      int                x,
+                      int                y,
+                      int                w,
+                      int                h)
+{
+    if (!map_draw_list_valid ||
+        map_draw_list_sub_layer != MapData.player_sub_layer ||
+        map_draw_list_height_offset != data->player_height_offset ||
+        map_draw_list_w != surface->w ||
+        map_draw_list_h != surface->h) {
+        map_render_data_t data2 = *data;
+        data2.partial = 0;
+        data2.record = 1;
+
+        map_draw_list_num = 0;
+        map_draw_passes(surface, &data2, x, y, w, h);
+
+        map_draw_list_valid = true;
+        map_draw_list_sub_layer = MapData.player_sub_layer;
+        map_draw_list_height_offset = data->player_height_offset;
+        map_draw_list_w = surface->w;
+        map_draw_list_h = surface->h;
     }
 
-    /* Show the status effect, if any, */
-    if (data->cell->flags[map_layer]) {
-        sprite_effects_t effects2 = {0};
-        effects2.alpha = effects.alpha;
-        effects2.stretch = effects.stretch;
-        effects2.zoom_x = effects.zoom_x;
-        effects2.zoom_y = effects.zoom_y;
-        effects2.rotate = effects.rotate;
+    for (size_t i = 0; i < map_draw_list_num; i++) {
+        const map_draw_op_t *op = &map_draw_list[i];
 
-        if (data->cell->flags[map_layer] & FFLAG_SLEEP) {
-            surface_show_effects(surface,
-                                 xl + bitmap_w / 2,
-                                 yl - 5,
-                                 NULL,
-                                 TEXTURE_CLIENT("sleep"),
-                                 &effects2);
-        }
+        data->cell = MAP_CELL_GET(op->x, op->y);
 
-        if (data->cell->flags[map_layer] & FFLAG_CONFUSED) {
-            surface_show_effects(surface,
-                                 xl + bitmap_w / 2 - 1,
-                                 yl - 4,
-                                 NULL,
-                                 TEXTURE_CLIENT("confused"),
-                                 &effects2);
+        if (data->partial && !data->cell->redraw) {
+            continue;
         }
 
-        if (data->cell->flags[map_layer] & FFLAG_SCARED) {
-            surface_show_effects(surface,
-                                 xl + bitmap_w / 2 + 10,
-                                 yl - 4,
-                                 NULL,
-                                 TEXTURE_CLIENT("scared"),
-                                 &effects2);
-        }
+        data->x = op->x;
+        data->y = op->y;
+        data->xpos = op->xpos;
+        data->ypos = op->ypos;
+        data->layer = op->layer;
+        data->sub_layer = op->sub_layer;
+        data->alpha_forced = op->alpha_forced;
+        draw_map_object(surface, data);
+    }
+}
 
-        if (data->cell->flags[map_layer] & FFLAG_BLINDED) {
-            surface_show_effects(surface,
-                                 xl + bitmap_w / 2 + 3,
-                                 yl - 6,
-                                 NULL,
-                                 TEXTURE_CLIENT("blind"),
-                                 &effects2);
-        }
+/**
+ * Get the light of a pixel on the map surface.
+ *
+ * @param fx
+ * Position of the pixel along the X axis of the map cells, in
+ * ::MAP_LIGHT_UNIT units.
+ * @param fy
+ * Position of the pixel along the Y axis of the map cells, in
+ * ::MAP_LIGHT_UNIT units.
+ * @param smooth
+ * If true, interpolate between the darkness of the surrounding cells.
+ * @return
+ * The light, as used by pixel_light_row().
+ */
+static uint16_t
+map_light_get (int fx, int fy, bool smooth)
+{
+    int w = map_width * MAP_FOW_SIZE;
+    int h = map_height * MAP_FOW_SIZE;
 
-        if (data->cell->flags[map_layer] & FFLAG_PARALYZED) {
-            surface_show_effects(surface,
-                                 xl + bitmap_w / 2 + 3,
-                                 yl + 3,
-                                 NULL,
-                                 TEXTURE_CLIENT("paralyzed"),
-                                 &effects2);
-        }
+    /* Cell centers are at whole units. */
+    int x = fx + MAP_LIGHT_UNIT / 2;
+    int y = fy + MAP_LIGHT_UNIT / 2;
+    if (x < 0 || y < 0) {
+        return 0;
     }
 
-    if (data->layer == LAYER_FLOOR && tiles_debug) {
-        data->tiles = erealloc(data->tiles,
-                               sizeof(*data->tiles) * ((data->tiles_num) + 1));
-        data->tiles[data->tiles_num].x = xl;
-        data->tiles[data->tiles_num].y = yl;
-        data->tiles[data->tiles_num].w = data->x;
-        data->tiles[data->tiles_num].h = data->y;
-        data->tiles_num++;
+    x /= MAP_LIGHT_UNIT;
+    y /= MAP_LIGHT_UNIT;
+    if (x >= w || y >= h) {
+        return 0;
     }
 
-    if (!data->cell->fow &&
-        data->cell->probe[map_layer] != 0) {
-        data->target_cell = data->cell;
-        data->target_layer = map_layer;
-        data->target_rect.x = xoff + xoff2;
-        data->target_rect.y = yl - 9;
-        data->target_rect.w = (xlen - xoff2 * 2);
-        data->target_rect.h = 1;
+    if (map_light_fow[y * w + x]) {
+        return PIXEL_LIGHT_FOW;
+    }
+
+    if (!smooth || fx < 0 || fy < 0) {
+        return map_light_shade[y * w + x];
     }
+
+    int x0 = fx / MAP_LIGHT_UNIT;
+    int y0 = fy / MAP_LIGHT_UNIT;
+    int x1 = MIN(x0 + 1, w - 1);
+    int y1 = MIN(y0 + 1, h - 1);
+    int wx = fx % MAP_LIGHT_UNIT;
+    int wy = fy % MAP_LIGHT_UNIT;
+
+    int top = map_light_shade[y0 * w + x0] * (MAP_LIGHT_UNIT - wx) +
+              map_light_shade[y0 * w + x1] * wx;
+    int bottom = map_light_shade[y1 * w + x0] * (MAP_LIGHT_UNIT - wx) +
+                 map_light_shade[y1 * w + x1] * wx;
+    return (top * (MAP_LIGHT_UNIT - wy) + bottom * wy) /
+           (MAP_LIGHT_UNIT * MAP_LIGHT_UNIT);
 }
 
 /**
- * Calculates whether the specified coordinates are behind a wall.
- *
- * @param dx
- * Start X.
- * @param dy
- * Start Y.
- * @param sx
- * End X.
- * @param sy
- * End Y.
- * @return
- * Whether the coordinates @p dx and @p dy are behind a wall or not.
+ * Build the light map from the darkness and fog of war of the map cells.
+ * Done once per redraw of the map, before any of its areas are lit by
+ * map_draw_light().
+ */
+static void
+map_light_build (void)
+{
+    int w = map_width * MAP_FOW_SIZE;
+    int h = map_height * MAP_FOW_SIZE;
+
+    if ((size_t) (w * h) > map_light_size) {
+        map_light_size = w * h;
+        map_light_shade = erealloc(map_light_shade,
+                                   sizeof(*map_light_shade) * map_light_size);
+        map_light_fow = erealloc(map_light_fow,
+                                 sizeof(*map_light_fow) * map_light_size);
+    }
+
+    map_light_lit = true;
+    for (int x = 0; x < w; x++) {
+        for (int y = 0; y < h; y++) {
+            struct MapCell *cell = MAP_CELL_GET(x, y);
+
+            /* Use the darkness of the floor the player is on, if any. */
+            uint8_t sub_layer = MapData.player_sub_layer;
+            if (cell->faces[GET_MAP_LAYER(LAYER_FLOOR, sub_layer)] == 0) {
+                sub_layer = 0;
+            }
+
+            size_t idx = y * w + x;
+            map_light_shade[idx] = sprite_dark_alpha(
+                map_dark_level(cell->darkness[sub_layer]));
+            map_light_fow[idx] = cell->fow;
+
+            if (map_light_shade[idx] != 0 || map_light_fow[idx]) {
+                map_light_lit = false;
+            }
+        }
+    }
+}
+
+/**
+ * Apply the light map to the map surface: darken every pixel according to
+ * the darkness of the map cell it is on, and apply the fog of war effect to
+ * the cells in the fog of war.
+ *
+ * This is done in screen space, using the cell each pixel is on at ground
+ * level, so that the objects do not need darkened copies of their sprites.
+ * Only the area inside the surface's clip rectangle is lit.
+ *
+ * @param surface
+ * The map surface.
+ * @param data
+ * Rendering data.
  */
-static bool
-obj_is_behind_wall (int dx, int dy, int sx, int sy)
+static void
+map_draw_light (SDL_Surface *surface, const map_render_data_t *data)
 {
-    int fraction, dx2, dy2, stepx, stepy;
-    int x = sx, y = sy;
-    int distance_x = dx - sx;
-    int distance_y = dy - sy;
+    /* Nothing to darken. */
+    if (map_light_lit) {
+        return;
+    }
 
-    BRESENHAM_INIT(distance_x, distance_y, fraction, stepx, stepy, dx2, dy2);
+    SDL_Rect clip;
+    SDL_GetClipRect(surface, &clip);
 
-    while (1) {
-        if (x == dx && y == dy) {
-            return false;
-        }
+    if (clip.w > map_light_row_size) {
+        map_light_row_size = clip.w;
+        map_light_row = erealloc(map_light_row,
+                                 sizeof(*map_light_row) * map_light_row_size);
+    }
 
-        if (x < 0 || x >= map_width || y < 0 || y >= map_height) {
-            return false;
-        }
+    bool smooth = setting_get_int(OPT_CAT_MAP, OPT_SMOOTH_LIGHTING);
 
-        for (int sub_layer = 0; sub_layer < NUM_SUB_LAYERS; sub_layer++) {
-            MapCell *cell = MAP_CELL_GET_MIDDLE(x, y);
+    /* Center of the middlemost cell. */
+    int cx = surface->w / 2;
+    int cy = surface->h / 2 - MAP_TILE_POS_YOFF / 2 + MAP_TILE_YOFF / 2;
 
-            if (cell->faces[GET_MAP_LAYER(LAYER_WALL, sub_layer)] != 0) {
-                return true;
-            }
+    SDL_LockSurface(surface);
+
+    for (int py = clip.y; py < clip.y + clip.h; py++) {
+        int dx = clip.x - cx;
+        int dy = py - cy;
+        int fx = data->midx * MAP_LIGHT_UNIT + dx * MAP_LIGHT_STEP_X +
+                 dy * MAP_LIGHT_STEP_Y;
+        int fy = data->midy * MAP_LIGHT_UNIT - dx * MAP_LIGHT_STEP_X +
+                 dy * MAP_LIGHT_STEP_Y;
+
+        for (int i = 0; i < clip.w; i++) {
+            map_light_row[i] = map_light_get(fx, fy, smooth);
+            fx += MAP_LIGHT_STEP_X;
+            fy -= MAP_LIGHT_STEP_X;
         }
 
-        BRESENHAM_STEP(x, y, fraction, stepx, stepy, dx2, dy2);
+        uint32_t *row = (uint32_t *) ((uint8_t *) surface->pixels +
+                                      py * surface->pitch);
+        pixel_light_row(row + clip.x, map_light_row, clip.w, surface->format);
     }
+
+    SDL_UnlockSurface(surface);
 }
 
 /**
- * Determine if an object being rendered should be culled.
+ * Draw the map objects.
  *
  * @param surface
- * Surface that rendering is being done for.
- * @param data
- * Rendering data.
- * @return
- * Whether the object should be culled.
+ * Surface to render on.
+ * @param partial
+ * If true, only draw cells selected for a partial redraw.
  */
-static bool
-map_should_cull (SDL_Surface           *surface,
-                 map_render_data_t     *data)
+static void
+map_draw_objects (SDL_Surface *surface, bool partial)
 {
-    /* Determine the distance of the object relative to the PC. */
-    int distance_x = data->x - map_width * MAP_FOW_SIZE / 2;
-    int distance_y = data->y - map_height * MAP_FOW_SIZE / 2;
-    int distance = isqrt(distance_x * distance_x +
-                         distance_y * distance_y);
-    if (distance > 3) {
-        /* Too far away, no culling. */
-        return false;
+    HARD_ASSERT(surface != NULL);
+
+    map_render_data_t data = {0};
+    int x, y, w, h;
+    map_setup_render_data(surface, &data, &x, &y, &w, &h);
+    data.partial = partial;
+
+    if (surface != cur_widget[MAP_ID]->surface) {
+        map_draw_passes(surface, &data, x, y, w, h);
+        return;
     }
 
-    /* Must be in the southern or eastern quadrant to be culled. */
-    if (data->x < map_width * MAP_FOW_SIZE / 2 ||
-        data->y < map_height * MAP_FOW_SIZE / 2) {
-        return false;
+    data.light = 1;
+
+    if (map_draw_list_disabled) {
+        map_draw_passes(surface, &data, x, y, w, h);
+    } else {
+        map_draw_list_replay(surface, &data, x, y, w, h);
     }
 
-    bool cull = false;
-    int range = 2;
+    map_draw_light(surface, &data);
+    data.light = 0;
+
+    if (data.unlit != NULL) {
+        for (size_t i = 0; i < data.unlit_num; i++) {
+            data.x = data.unlit[i].x;
+            data.y = data.unlit[i].y;
+            data.xpos = data.unlit[i].xpos;
+            data.ypos = data.unlit[i].ypos;
+            data.layer = data.unlit[i].layer;
+            data.sub_layer = data.unlit[i].sub_layer;
+            data.alpha_forced = data.unlit[i].alpha_forced;
+            data.cell = MAP_CELL_GET(data.x, data.y);
+            draw_map_object(surface, &data);
+        }
 
-    for (int sub_layer2 = NUM_SUB_LAYERS - 1;
-         sub_layer2 > 0;
-         sub_layer2--) {
-        int16_t height = data->cell->height[GET_MAP_LAYER(LAYER_EFFECT,
-                                                          sub_layer2)];
-        if (height - data->player_height_offset > 50) {
-            range = 0;
+        efree(data.unlit);
+    }
+
+    if (data.names != NULL) {
+        for (size_t i = 0; i < data.names_num; i++) {
+            text_show(surface,
+                      FONT_SANS9,
+                      data.names[i].name,
+                      data.names[i].x,
+                      data.names[i].y,
+                      data.names[i].color,
+                      TEXT_OUTLINE,
+                      NULL);
         }
+
+        efree(data.names);
     }
 
-    if (range == 0) {
-        cull = true;
+    if (data.tiles != NULL) {
+        for (size_t i = 0; i < data.tiles_num; i++) {
+            SDL_Rect box;
+            box.x = data.tiles[i].x;
+            box.y = data.tiles[i].y;
+            box.w = MAP_TILE_POS_XOFF;
+            box.h = MAP_TILE_POS_YOFF;
+            text_show_format(surface,
+                             FONT("arial", 9),
+                             box.x,
+                             box.y,
+                             COLOR_WHITE,
+                             TEXT_OUTLINE | TEXT_VALIGN_CENTER |
+                                 TEXT_ALIGN_CENTER,
+                             &box,
+                             "%d,%d",
+                             data.tiles[i].w,
+                             data.tiles[i].h);
+        }
+
+        efree(data.tiles);
     }
 
-    for (int nx = data->x - range; nx <= data->x && !cull; nx++) {
-        for (int ny = data->y - range; ny <= data->y && !cull; ny++) {
-            MapCell *cell2 = MAP_CELL_GET(nx, ny);
+    if (data.target_cell != NULL && cpl.target_code != 0) {
+        const char *hp_color;
 
-            for (int sub_layer2 = 0;
-                 sub_layer2 < NUM_SUB_LAYERS;
-                 sub_layer2++) {
-                if (cell2->secondpass[sub_layer2] & (1 << (LAYER_WALL - 1)) &&
-                    !obj_is_behind_wall(nx,
-                                        ny,
-                                        map_width * MAP_FOW_SIZE / 2,
-                                        map_height * MAP_FOW_SIZE / 2)) {
-                    cull = true;
-                    break;
-                }
-            }
+        if (cpl.target_hp > 90) {
+            hp_color = COLOR_GREEN;
+        } else if (cpl.target_hp > 75) {
+            hp_color = COLOR_DGOLD;
+        } else if (cpl.target_hp > 50) {
+            hp_color = COLOR_HGOLD;
+        } else if (cpl.target_hp > 25) {
+            hp_color = COLOR_YELLOW;
+        } else if (cpl.target_hp > 10) {
+            hp_color = COLOR_ORANGE;
+        } else {
+            hp_color = COLOR_RED;
+        }
+
+        if (!(setting_get_int(OPT_CAT_MAP, OPT_PLAYER_NAMES) &&
+              data.target_cell->pname[data.target_layer] != 0)) {
+            text_show(surface,
+                      FONT_SANS9,
+                      cpl.target_name,
+                      data.target_rect.x + data.target_rect.w / 2 -
+                          text_get_width(FONT_SANS9, cpl.target_name, 0) / 2,
+                      data.target_rect.y - 15,
+                      cpl.target_color,
+                      TEXT_OUTLINE,
+                      NULL);
         }
+
+        rectangle_create(surface,
+                         data.target_rect.x - 2,
+                         data.target_rect.y - 2,
+                         1,
+                         5,
+                         hp_color);
+        rectangle_create(surface,
+                         data.target_rect.x - 2,
+                         data.target_rect.y - 2,
+                         3,
+                         1,
+                         hp_color);
+        rectangle_create(surface,
+                         data.target_rect.x - 2,
+                         data.target_rect.y + 2,
+                         3,
+                         1,
+                         hp_color);
+        rectangle_create(surface,
+                         data.target_rect.x + data.target_rect.w + 1,
+                         data.target_rect.y - 2,
+                         1,
+                         5,
+                         hp_color);
+        rectangle_create(surface,
+                         data.target_rect.x + data.target_rect.w - 1,
+                         data.target_rect.y - 2,
+                         3,
+                         1,
+                         hp_color);
+        rectangle_create(surface,
+                         data.target_rect.x + data.target_rect.w - 1,
+                         data.target_rect.y + 2,
+                         3,
+                         1,
+                         hp_color);
+
+        data.target_rect.w = data.target_rect.w / 100.0 *
+                             data.target_cell->probe[data.target_layer];
+        data.target_rect.w = MAX(1, MIN(100, data.target_rect.w));
+        rectangle_create(surface,
+                         data.target_rect.x,
+                         data.target_rect.y,
+                         data.target_rect.w,
+                         data.target_rect.h,
+                         hp_color);
     }
 
-    return cull && range != 0;
+#undef CALCULATE_POSITIONS
 }
 
 /**
- * Determine if a specified tile should be rendered.
- *
- * Assigns the cell to be rendered in the map render data structure on success.
+ * Draw the map.
  *
  * @param surface
- * Surface rendering is being done on.
- * @param data
- * Map rendering data.
- * @return
- * Whether the tile should be rendered.
+ * Surface to render on.
  */
-static bool
-map_should_draw (SDL_Surface *surface, map_render_data_t *data)
+void
+map_draw_map (SDL_Surface *surface)
 {
     HARD_ASSERT(surface != NULL);
-    HARD_ASSERT(data != NULL);
 
-    data->xpos = surface->w / 2 - MAP_TILE_POS_XOFF / 2 +
-                 (data->x - data->midx) * MAP_TILE_YOFF -
-                 (data->y - data->midy) * MAP_TILE_YOFF;
-    data->ypos = surface->h / 2 - MAP_TILE_POS_YOFF / 2 +
-                 (data->x - data->midx) * MAP_TILE_XOFF +
-                 (data->y - data->midy) * MAP_TILE_XOFF;
+    if (surface == cur_widget[MAP_ID]->surface) {
+        for (size_t i = 0; i < cells_num; i++) {
+            memset(&cells[i].draw_box, 0, sizeof(cells[i].draw_box));
+            cells[i].dirty = 0;
+        }
 
-    if (surface != cur_widget[MAP_ID]->surface) {
-        data->ypos -= map_width * MAP_TILE_XOFF + map_height *
-                      MAP_TILE_XOFF * (MAP_FOW_SIZE / 2);
-        data->ypos -= map_height * MAP_TILE_YOFF;
+        map_dirty_num = 0;
+
+        map_render_data_t data = {0};
+        map_setup_render_data(surface, &data, NULL, NULL, NULL, NULL);
+        map_drawn_height_offset = data.player_height_offset;
+
+        map_pick_valid = setting_get_int(OPT_CAT_MAP, OPT_PRECISE_MOUSE);
+
+        if (map_pick_valid) {
+            if (map_pick_w != surface->w || map_pick_h != surface->h) {
+                map_pick_w = surface->w;
+                map_pick_h = surface->h;
+                map_pick = erealloc(map_pick, sizeof(*map_pick) *
+                                    map_pick_w * map_pick_h);
+            }
+
+            map_pick_clear(NULL);
+        }
+
+        map_light_build();
     }
 
-    if (data->xpos > surface->w || data->xpos + MAP_TILE_POS_XOFF < 0 ||
-        data->ypos + MAP_TILE_POS_YOFF < 0) {
-        return false;
+    map_draw_objects(surface, false);
+}
+
+/**
+ * Mark the whole minimap as changed, for example after a face it shows has
+ * finished loading.
+ */
+void
+map_minimap_invalidate (void)
+{
+    map_minimap_full = true;
+}
+
+/**
+ * Get the size of the minimap surface, which shows each map cell as a
+ * ::MAP_MINIMAP_TILE_W x ::MAP_MINIMAP_TILE_H block, in the same isometric
+ * layout as the map.
+ *
+ * @param[out] w
+ * Will contain the width.
+ * @param[out] h
+ * Will contain the height.
+ * @param[out] cx
+ * Will contain the X position of the center of the player's cell.
+ * @param[out] cy
+ * Will contain the Y position of the center of the player's cell.
+ */
+void
+map_minimap_size (int *w, int *h, int *cx, int *cy)
+{
+    int cells_w = map_width * MAP_FOW_SIZE;
+    int cells_h = map_height * MAP_FOW_SIZE;
+
+    *w = (cells_w + cells_h) * MAP_MINIMAP_TILE_W / 2;
+    *h = (cells_w + cells_h) * MAP_MINIMAP_TILE_H / 2;
+
+    int x = MAP_STARTX + map_width - (map_width / 2) - 1;
+    int y = MAP_STARTY + map_height - (map_height / 2) - 1;
+    *cx = MAP_MINIMAP_X(x, y) + MAP_MINIMAP_TILE_W / 2;
+    *cy = MAP_MINIMAP_Y(x, y) + MAP_MINIMAP_TILE_H / 2;
+}
+
+/**
+ * Get the color a map cell is shown with on the minimap: that of its
+ * topmost creature, wall or floor, using the average color of the face.
+ * Cells in the fog of war are dimmed the same way as on the map.
+ *
+ * @param cell
+ * The cell.
+ * @param fmt
+ * Format of the minimap surface.
+ * @return
+ * The color.
+ */
+static Uint32
+map_minimap_color (struct MapCell *cell, const SDL_PixelFormat *fmt)
+{
+    static const int layers[] = {LAYER_LIVING, LAYER_WALL, LAYER_FLOOR};
+
+    /* Objects in total darkness are not shown. */
+    if (map_dark_level(cell->darkness[0]) == DARK_LEVELS) {
+        return SDL_MapRGB(fmt, 0, 0, 0);
     }
 
-    data->cell = MAP_CELL_GET(data->x, data->y);
+    for (size_t i = 0; i < arraysize(layers); i++) {
+        uint16_t face = map_object_get_face(cell,
+                                            GET_MAP_LAYER(layers[i], 0));
+        if (face == 0 || face >= MAX_FACE_TILES ||
+            FaceList[face].sprite == NULL) {
+            continue;
+        }
 
-    int height = 0;
-    for (uint8_t sub_layer = 0; sub_layer < NUM_SUB_LAYERS; sub_layer++) {
-        uint8_t map_layer = GET_MAP_LAYER(LAYER_FLOOR, sub_layer);
-        if (data->cell->height[map_layer] > height) {
-            height = data->cell->height[map_layer];
+        SDL_Color color = *sprite_get_average_color(FaceList[face].sprite);
+        if (color.a == 0) {
+            continue;
         }
 
-        map_layer = GET_MAP_LAYER(LAYER_EFFECT, sub_layer);
-        if (data->cell->height[map_layer] > height) {
-            height = data->cell->height[map_layer];
+        if (cell->fow) {
+            color = pixel_effect_color(color, PIXEL_EFFECT_FOW);
         }
-    }
 
-    if (data->ypos - height > surface->h) {
-        return false;
+        return SDL_MapRGB(fmt, color.r, color.g, color.b);
     }
 
-    return true;
+    return SDL_MapRGB(fmt, 0, 0, 0);
 }
 
 /**
- * Setup the base information in a map render data structure and calculate
- * X/Y cell indexes and maximum dimensions.
+ * Update the minimap surface with the map cells that have changed since it
+ * was last updated.
  *
  * @param surface
- * Surface rendering is being done for.
- * @param[out] data Map rendering data.
- * @param[out] x Will contain X index of the cell to render. Can be NULL.
- * @param[out] y Will contain Y index of the cell to render. Can be NULL.
- * @param[out] w Maximum width. Can be NULL.
- * @param[out] h Maximum height. Can be NULL.
+ * The minimap surface; see map_minimap_size() for its size.
+ * @param full
+ * If true, update all the cells, for example because the surface is new.
+ * @return
+ * Whether anything changed.
  */
-static void
-map_setup_render_data (SDL_Surface       *surface,
-                       map_render_data_t *data,
-                       int               *x,
-                       int               *y,
-                       int               *w,
-                       int               *h)
+bool
+map_minimap_update (SDL_Surface *surface, bool full)
 {
     HARD_ASSERT(surface != NULL);
-    HARD_ASSERT(data != NULL);
-
-    data->x = map_width - (map_width / 2) - 1;
-    data->y = map_height - (map_height / 2) - 1;
-    data->cell = MAP_CELL_GET_MIDDLE(data->x, data->y);
-    data->player_height_offset = get_top_floor_height(data->cell,
-                                                      MapData.player_sub_layer);
-
 
-    if (surface == cur_widget[MAP_ID]->surface) {
-        data->midx = map_width * MAP_FOW_SIZE / 2;
-        data->midy = map_height * MAP_FOW_SIZE / 2;
+    if (map_minimap_full) {
+        full = true;
+    }
 
-        int maxw = surface->w / 2.0 / (MAP_TILE_POS_XOFF / 2.0);
-        int maxh = surface->h / 2.0 / (MAP_TILE_POS_YOFF / 2.0);
-        int maxtiles = MAX(maxh, maxw);
+    if (!full && map_minimap_dirty_num == 0) {
+        return false;
+    }
 
-        if (x != NULL) {
-            *x = data->midx - maxtiles;
-            if (*x < 0) {
-                *x = 0;
-            }
-        }
+    int cells_w = map_width * MAP_FOW_SIZE;
+    int cells_h = map_height * MAP_FOW_SIZE;
 
-        if (y != NULL) {
-            *y = data->midy - maxtiles;
-            if (*y < 0) {
-                *y = 0;
-            }
-        }
+    SDL_LockSurface(surface);
 
-        if (w != NULL) {
-            *w = data->midx + maxtiles;
-            if (*w > map_width * MAP_FOW_SIZE) {
-                *w = map_width * MAP_FOW_SIZE;
-            }
-        }
+    for (int x = 0; x < cells_w; x++) {
+        for (int y = 0; y < cells_h; y++) {
+            struct MapCell *cell = MAP_CELL_GET(x, y);
 
-        if (h != NULL) {
-            *h = data->midy + maxtiles;
-            if (*h > map_height * MAP_FOW_SIZE) {
-                *h = map_height * MAP_FOW_SIZE;
+            if (!full && !cell->minimap_dirty) {
+                continue;
             }
-        }
-    } else {
-        if (x != NULL) {
-            *x = 0;
-        }
 
-        if (y != NULL) {
-            *y = 0;
-        }
+            cell->minimap_dirty = 0;
 
-        if (w != NULL) {
-            *w = map_width * MAP_FOW_SIZE;
-        }
+            Uint32 color = map_minimap_color(cell, surface->format);
+            int px = MAP_MINIMAP_X(x, y);
+            int py = MAP_MINIMAP_Y(x, y);
 
-        if (h != NULL) {
-            *h = map_height * MAP_FOW_SIZE;
+            /* Neighboring cells are half a tile apart, so each cell only
+             * needs to fill a half-tile wide block. */
+            for (int j = 0; j < MAP_MINIMAP_TILE_H; j++) {
+                for (int i = 0; i < MAP_MINIMAP_TILE_W / 2; i++) {
+                    putpixel(surface, px + i, py + j, color);
+                }
+            }
         }
     }
 
+    SDL_UnlockSurface(surface);
+
+    map_minimap_full = false;
+    map_minimap_dirty_num = 0;
+    return true;
 }
 
 /**
- * Draw the map.
+ * Redraw only the parts of the map surface affected by the cells that have
+ * changed since the map was last drawn.
+ *
+ * The area each changed cell was drawn on, together with the area it will
+ * be drawn on now, is cleared, and all the cells drawn in that area
+ * (including neighbors whose tall objects overlap it) are redrawn in order,
+ * clipped to it.
  *
  * @param surface
- * Surface to render on.
+ * The map surface.
+ * @param[out] redrawn
+ * Will contain the areas that were redrawn; must have room for
+ * ::MAP_DIRTY_RECTS_MAX areas.
+ * @param[out] redrawn_num
+ * Will contain the number of areas that were redrawn.
+ * @return
+ * True on success, false if the whole map must be redrawn instead.
  */
-void
-map_draw_map (SDL_Surface *surface)
+static bool
+map_draw_dirty (SDL_Surface *surface, SDL_Rect *redrawn, size_t *redrawn_num)
 {
     HARD_ASSERT(surface != NULL);
 
@@ -1501,338 +3664,239 @@ map_draw_map (SDL_Surface *surface)
     int x, y, w, h;
     map_setup_render_data(surface, &data, &x, &y, &w, &h);
 
-    /* Draw floor and fmasks. */
-    for (data.x = x; data.x < w; data.x++) {
-        for (data.y = y; data.y < h; data.y++) {
-            if (!map_should_draw(surface, &data)) {
-                continue;
-            }
-
-            for (data.layer = LAYER_FLOOR;
-                 data.layer <= LAYER_FMASK;
-                 data.layer++) {
-                if (data.cell->priority[0] & (1 << (data.layer - 1))) {
-                    continue;
-                }
-
-                draw_map_object(surface, &data);
-            }
-        }
+    /* Objects are positioned relative to the player's height. */
+    if (data.player_height_offset != map_drawn_height_offset) {
+        return false;
     }
 
-    uint8_t floor_layer_pl = GET_MAP_LAYER(LAYER_FLOOR,
-                                           MapData.player_sub_layer);
+    SDL_Rect rects[MAP_DIRTY_RECTS_MAX];
+    size_t num = 0;
+    int area = 0;
 
-    /* Now draw everything else. */
     for (data.x = x; data.x < w; data.x++) {
         for (data.y = y; data.y < h; data.y++) {
-            if (!map_should_draw(surface, &data)) {
+            struct MapCell *cell = MAP_CELL_GET(data.x, data.y);
+
+            if (!cell->dirty) {
                 continue;
             }
 
-            for (data.layer = LAYER_FLOOR;
-                 data.layer <= NUM_LAYERS;
-                 data.layer++) {
-                for (data.sub_layer = 0;
-                     data.sub_layer < NUM_SUB_LAYERS;
-                     data.sub_layer++) {
-                    if (data.sub_layer == 0 &&
-                        (data.layer == LAYER_FLOOR ||
-                         data.layer == LAYER_FMASK)) {
-                        continue;
-                    }
-
-                    /* Skip objects on the effect layer with non-zero sub-layer
-                     * because they will be rendered later. */
-                    if (data.layer == LAYER_EFFECT && data.sub_layer != 0) {
-                        uint8_t effect_layer =
-                            GET_MAP_LAYER(LAYER_EFFECT, data.sub_layer);
-                        uint8_t floor_layer =
-                            GET_MAP_LAYER(LAYER_FLOOR,
-                                          MapData.player_sub_layer);
-                        if (data.cell->height[effect_layer] >=
-                            data.cell->height[floor_layer]) {
-                            continue;
-                        }
-                    }
-
-                    if (data.cell->priority[data.sub_layer] &
-                        (1 << (data.layer - 1))) {
-                        continue;
-                    }
-
-                    draw_map_object(surface, &data);
-                }
-            }
+            /* Measure where the cell will be drawn now. */
+            SDL_Rect box = cell->draw_box;
+            memset(&cell->draw_box, 0, sizeof(cell->draw_box));
 
-            for (data.sub_layer = 0;
-                 data.sub_layer < NUM_SUB_LAYERS;
-                 data.sub_layer++) {
-                uint8_t map_layer = GET_MAP_LAYER(LAYER_FLOOR,
-                                                  data.sub_layer);
-                if (data.cell->height[map_layer] >
-                    data.cell->height[floor_layer_pl]) {
-                    continue;
-                }
+            if (map_should_draw(surface, &data)) {
+                data.measure = 1;
 
                 for (data.layer = LAYER_FLOOR;
                      data.layer <= NUM_LAYERS;
                      data.layer++) {
-                    if (!(data.cell->priority[data.sub_layer] &
-                          (1 << (data.layer - 1)))) {
-                        continue;
+                    for (data.sub_layer = 0;
+                         data.sub_layer < NUM_SUB_LAYERS;
+                         data.sub_layer++) {
+                        draw_map_object(surface, &data);
                     }
+                }
 
-                    if (data.layer == LAYER_EFFECT && data.sub_layer != 0) {
-                        map_layer = GET_MAP_LAYER(LAYER_EFFECT,
-                                                  data.sub_layer);
-                        if (data.cell->height[map_layer] >=
-                            data.cell->height[floor_layer_pl]) {
-                            continue;
-                        }
-                    }
+                data.measure = 0;
+            }
 
-                    draw_map_object(surface, &data);
-                }
+            SDL_UnionRect(&box, &cell->draw_box, &box);
+            cell->draw_box = box;
+
+            if (SDL_RectEmpty(&box)) {
+                continue;
             }
 
-            for (data.layer = LAYER_FLOOR;
-                 data.layer <= NUM_LAYERS;
-                 data.layer++) {
-                if (!(data.cell->priority[0] & (1 << (data.layer - 1)))) {
-                    continue;
+            /* Merge with the overlapping areas. */
+            for (size_t i = 0; i < num; ) {
+                if (SDL_HasIntersection(&box, &rects[i])) {
+                    SDL_UnionRect(&box, &rects[i], &box);
+                    rects[i] = rects[--num];
+                    i = 0;
+                } else {
+                    i++;
                 }
+            }
 
-                draw_map_object(surface, &data);
+            if (num == MAP_DIRTY_RECTS_MAX) {
+                return false;
             }
 
-            data.layer = LAYER_EFFECT;
+            rects[num++] = box;
+        }
+    }
 
-            for (data.sub_layer = NUM_SUB_LAYERS - 1;
-                 data.sub_layer >= 1;
-                 data.sub_layer--) {
-                if (data.cell->priority[data.sub_layer] &
-                    (1 << (LAYER_EFFECT - 1))) {
-                    continue;
-                }
+    for (size_t i = 0; i < num; i++) {
+        area += rects[i].w * rects[i].h;
+    }
 
-                uint8_t map_layer = GET_MAP_LAYER(LAYER_EFFECT, data.sub_layer);
-                if (data.cell->height[map_layer] <
-                    data.cell->height[floor_layer_pl]) {
-                    continue;
-                }
+    /* Not worth it; redrawing everything is cheaper. */
+    if (area > surface->w * surface->h / 2) {
+        return false;
+    }
 
-                if (surface == cur_widget[MAP_ID]->surface &&
-                    map_should_cull(surface, &data)) {
-                    continue;
-                }
+    map_light_build();
 
-                draw_map_object(surface, &data);
-            }
+    for (size_t i = 0; i < num; i++) {
+        for (data.x = x; data.x < w; data.x++) {
+            for (data.y = y; data.y < h; data.y++) {
+                struct MapCell *cell = MAP_CELL_GET(data.x, data.y);
+                cell->redraw = SDL_HasIntersection(&cell->draw_box, &rects[i]);
 
-            for (data.sub_layer = 0;
-                 data.sub_layer < NUM_SUB_LAYERS;
-                 data.sub_layer++) {
-                uint8_t map_layer = GET_MAP_LAYER(LAYER_FLOOR,
-                                                  data.sub_layer);
-                if (data.cell->height[map_layer] <=
-                    data.cell->height[floor_layer_pl]) {
-                    continue;
+                /* Recorded again when drawn. */
+                if (cell->redraw) {
+                    memset(&cell->draw_box, 0, sizeof(cell->draw_box));
                 }
+            }
+        }
 
-                for (data.layer = LAYER_FLOOR;
-                     data.layer <= NUM_LAYERS;
-                     data.layer++) {
-                    if (!(data.cell->priority[data.sub_layer] &
-                          (1 << (data.layer - 1)))) {
-                        continue;
-                    }
+        SDL_SetClipRect(surface, &rects[i]);
+        SDL_FillRect(surface, &rects[i], 0);
 
-                    draw_map_object(surface, &data);
-                }
-            }
+        if (map_pick_valid) {
+            map_pick_clear(&rects[i]);
+        }
 
-            data.layer = LAYER_EFFECT;
+        map_draw_objects(surface, true);
+    }
 
-            for (data.sub_layer = NUM_SUB_LAYERS - 1;
-                 data.sub_layer >= 1;
-                 data.sub_layer--) {
-                uint8_t map_layer = GET_MAP_LAYER(LAYER_EFFECT,
-                                                  data.sub_layer);
-                if (data.cell->height[map_layer] <
-                    data.cell->height[floor_layer_pl]) {
-                    continue;
-                }
+    SDL_SetClipRect(surface, NULL);
 
-                uint8_t map_layer2 = GET_MAP_LAYER(LAYER_FLOOR,
-                                                   data.sub_layer - 1);
-                if (data.cell->height[map_layer] <=
-                    data.cell->height[map_layer2]) {
-                    continue;
-                }
+    for (data.x = x; data.x < w; data.x++) {
+        for (data.y = y; data.y < h; data.y++) {
+            struct MapCell *cell = MAP_CELL_GET(data.x, data.y);
+            cell->redraw = 0;
+        }
+    }
 
-                map_layer2 = GET_MAP_LAYER(LAYER_EFFECT,
-                                           data.sub_layer - 1);
-                if (data.cell->height[map_layer] <=
-                    data.cell->height[map_layer2]) {
-                    continue;
-                }
+    for (size_t i = 0; i < cells_num; i++) {
+        cells[i].dirty = 0;
+    }
 
-                if (surface == cur_widget[MAP_ID]->surface &&
-                    map_should_cull(surface, &data)) {
-                    continue;
-                }
+    map_dirty_num = 0;
 
-                draw_map_object(surface, &data);
-            }
+    memcpy(redrawn, rects, sizeof(*rects) * num);
+    *redrawn_num = num;
+    return true;
+}
 
-            if (data.cell->priority[0] & (1 << (LAYER_WALL - 1)) &&
-                data.cell->height[GET_MAP_LAYER(LAYER_WALL, 0)] > 0) {
-                data.layer = LAYER_WALL;
-                data.sub_layer = 0;
-                draw_map_object(surface, &data);
-            }
+/**
+ * Draw the map with and without using the retained draw list, check that
+ * both give exactly the same result, and log how long each took.
+ *
+ * Used after replaying a capture of the command stream, so the map widget
+ * may not have been shown yet; its surface is created if necessary.
+ *
+ * @param frames
+ * How many times to draw the map in each case.
+ * @return
+ * True if the results are the same, false if they differ or the map could
+ * not be drawn; the reason is logged.
+ */
+bool
+map_draw_check (int frames)
+{
+    widgetdata *widget = cur_widget[MAP_ID];
+
+    if (widget == NULL) {
+        LOG(ERROR, "There is no map widget.");
+        return false;
+    }
+
+    if (widget->surface == NULL) {
+        widget->surface = SDL_CreateRGBSurface(0,
+                                               widget->w,
+                                               widget->h,
+                                               video_get_bpp(),
+                                               0,
+                                               0,
+                                               0,
+                                               0);
+        if (widget->surface == NULL) {
+            LOG(ERROR, "Could not create the map surface: %s",
+                SDL_GetError());
+            return false;
         }
     }
 
-    if (surface != cur_widget[MAP_ID]->surface) {
-        return;
+    frames = MAX(1, frames);
+
+    SDL_Surface *surface = widget->surface;
+    SDL_Surface *expected = SDL_CreateRGBSurface(0,
+                                                 surface->w,
+                                                 surface->h,
+                                                 surface->format->BitsPerPixel,
+                                                 surface->format->Rmask,
+                                                 surface->format->Gmask,
+                                                 surface->format->Bmask,
+                                                 surface->format->Amask);
+    if (expected == NULL) {
+        LOG(ERROR, "Could not create a surface: %s", SDL_GetError());
+        return false;
     }
 
-    for (data.x = x; data.x < w; data.x++) {
-        for (data.y = y; data.y < h; data.y++) {
-            if (!map_should_draw(surface, &data)) {
-                continue;
-            }
+    double freq = SDL_GetPerformanceFrequency();
+    uint64_t start, passes, build, replay;
 
-            for (data.sub_layer = NUM_SUB_LAYERS - 1;
-                 data.sub_layer >= 1;
-                 data.sub_layer--) {
-                uint8_t map_layer = GET_MAP_LAYER(LAYER_EFFECT, data.sub_layer);
-                if (data.cell->height[map_layer] != 0 &&
-                    data.cell->faces[map_layer] != 0) {
-                    data.cell = NULL;
-                    break;
-                }
-            }
+    map_draw_list_disabled = true;
+    start = SDL_GetPerformanceCounter();
 
-            if (data.cell == NULL) {
-                continue;
-            }
+    for (int i = 0; i < frames; i++) {
+        SDL_FillRect(surface, NULL, 0);
+        map_draw_map(surface);
+    }
 
-            data.layer = LAYER_LIVING;
-            data.alpha_forced = 100;
+    passes = SDL_GetPerformanceCounter() - start;
+    map_draw_list_disabled = false;
+    SDL_BlitSurface(surface, NULL, expected, NULL);
 
-            for (data.sub_layer = 0;
-                 data.sub_layer < NUM_SUB_LAYERS;
-                 data.sub_layer++) {
-                draw_map_object(surface, &data);
-            }
-        }
-    }
+    map_draw_list_valid = false;
+    start = SDL_GetPerformanceCounter();
+    SDL_FillRect(surface, NULL, 0);
+    map_draw_map(surface);
+    build = SDL_GetPerformanceCounter() - start;
 
-    if (data.tiles != NULL) {
-        for (size_t i = 0; i < data.tiles_num; i++) {
-            SDL_Rect box;
-            box.x = data.tiles[i].x;
-            box.y = data.tiles[i].y;
-            box.w = MAP_TILE_POS_XOFF;
-            box.h = MAP_TILE_POS_YOFF;
-            text_show_format(surface,
-                             FONT("arial", 9),
-                             box.x,
-                             box.y,
-                             COLOR_WHITE,
-                             TEXT_OUTLINE | TEXT_VALIGN_CENTER |
-                                 TEXT_ALIGN_CENTER,
-                             &box,
-                             "%d,%d",
-                             data.tiles[i].w,
-                             data.tiles[i].h);
-        }
+    start = SDL_GetPerformanceCounter();
 
-        efree(data.tiles);
+    for (int i = 0; i < frames; i++) {
+        SDL_FillRect(surface, NULL, 0);
+        map_draw_map(surface);
     }
 
-    if (data.target_cell != NULL && cpl.target_code != 0) {
-        const char *hp_color;
+    replay = SDL_GetPerformanceCounter() - start;
 
-        if (cpl.target_hp > 90) {
-            hp_color = COLOR_GREEN;
-        } else if (cpl.target_hp > 75) {
-            hp_color = COLOR_DGOLD;
-        } else if (cpl.target_hp > 50) {
-            hp_color = COLOR_HGOLD;
-        } else if (cpl.target_hp > 25) {
-            hp_color = COLOR_YELLOW;
-        } else if (cpl.target_hp > 10) {
-            hp_color = COLOR_ORANGE;
-        } else {
-            hp_color = COLOR_RED;
-        }
+    uint64_t mismatches = 0;
+    size_t row_size = surface->w * surface->format->BytesPerPixel;
 
-        if (!(setting_get_int(OPT_CAT_MAP, OPT_PLAYER_NAMES) &&
-              data.target_cell->pname[data.target_layer][0] != '\0')) {
-            text_show(surface,
-                      FONT_SANS9,
-                      cpl.target_name,
-                      data.target_rect.x + data.target_rect.w / 2 -
-                          text_get_width(FONT_SANS9, cpl.target_name, 0) / 2,
-                      data.target_rect.y - 15,
-                      cpl.target_color,
-                      TEXT_OUTLINE,
-                      NULL);
+    SDL_LockSurface(surface);
+    SDL_LockSurface(expected);
+
+    for (int y = 0; y < surface->h; y++) {
+        if (memcmp((uint8_t *) surface->pixels + y * surface->pitch,
+                   (uint8_t *) expected->pixels + y * expected->pitch,
+                   row_size) != 0) {
+            mismatches++;
         }
+    }
 
-        rectangle_create(surface,
-                         data.target_rect.x - 2,
-                         data.target_rect.y - 2,
-                         1,
-                         5,
-                         hp_color);
-        rectangle_create(surface,
-                         data.target_rect.x - 2,
-                         data.target_rect.y - 2,
-                         3,
-                         1,
-                         hp_color);
-        rectangle_create(surface,
-                         data.target_rect.x - 2,
-                         data.target_rect.y + 2,
-                         3,
-                         1,
-                         hp_color);
-        rectangle_create(surface,
-                         data.target_rect.x + data.target_rect.w + 1,
-                         data.target_rect.y - 2,
-                         1,
-                         5,
-                         hp_color);
-        rectangle_create(surface,
-                         data.target_rect.x + data.target_rect.w - 1,
-                         data.target_rect.y - 2,
-                         3,
-                         1,
-                         hp_color);
-        rectangle_create(surface,
-                         data.target_rect.x + data.target_rect.w - 1,
-                         data.target_rect.y + 2,
-                         3,
-                         1,
-                         hp_color);
+    SDL_UnlockSurface(expected);
+    SDL_UnlockSurface(surface);
+    SDL_FreeSurface(expected);
 
-        data.target_rect.w = data.target_rect.w / 100.0 *
-                             data.target_cell->probe[data.target_layer];
-        data.target_rect.w = MAX(1, MIN(100, data.target_rect.w));
-        rectangle_create(surface,
-                         data.target_rect.x,
-                         data.target_rect.y,
-                         data.target_rect.w,
-                         data.target_rect.h,
-                         hp_color);
+    if (mismatches != 0) {
+        LOG(ERROR, "Drawing the map using the draw list gave a different "
+            "result than drawing it in full passes");
     }
 
-#undef CALCULATE_POSITIONS
+    LOG(INFO, "Map drawing over %d frames, %" PRIu64 " objects: full "
+        "passes %.3f ms/frame, draw list %.3f ms/frame (%.3f ms to "
+        "rebuild), %" PRIu64 " rows differ", frames,
+        (uint64_t) map_draw_list_num, passes * 1000.0 / freq / frames,
+        replay * 1000.0 / freq / frames, build * 1000.0 / freq, mismatches);
+
+    map_redraw_flag = 1;
+    return mismatches == 0;
 }
 
 /**
@@ -1946,110 +4010,100 @@ static void send_target(int x, int y, uint32_t count)
 }
 
 /**
- * Compare distances between two targets on the map.
- * @param a
- * First target.
- * @param b
- * Second target.
+ * Find the nearest object in the target index, starting at the specified
+ * position, that is not the current target and that has not been targeted
+ * in the current targeting cycle yet.
+ *
+ * @param is_friend
+ * 1 if looking for friendlies only.
+ * @param bucket
+ * Distance bucket to start at.
+ * @param pos
+ * Position in the distance bucket to start at.
+ * @param[out] target
+ * Will contain the target, if found.
  * @return
- * Comparison result.
+ * True if a target was found, false otherwise.
  */
-static int map_target_cmp(const void *a, const void *b)
+static bool
+map_target_find (uint8_t is_friend, size_t bucket, size_t pos,
+                 map_target_struct *target)
 {
-    double x, y, x2, y2;
-    unsigned long dist1, dist2;
-
-    x = ((const map_target_struct *) a)->x - (map_width / 2.0f);
-    y = ((const map_target_struct *) a)->y - (map_height / 2.0f);
+    for ( ; bucket < map_target_index_num; bucket++, pos = 0) {
+        for ( ; pos < map_target_index[bucket].num; pos++) {
+            int x = map_target_index[bucket].cells[pos].x;
+            int y = map_target_index[bucket].cells[pos].y;
+            struct MapCell *cell = MAP_CELL_GET_MIDDLE(x, y);
+
+            for (int layer = 0; layer < NUM_REAL_LAYERS; layer++) {
+                if (!(cell->target_layers & (UINT64_C(1) << layer)) ||
+                    cell->target_is_friend[layer] != is_friend ||
+                    cell->probe[layer] != 0) {
+                    continue;
+                }
 
-    x2 = ((const map_target_struct *) b)->x - (map_width / 2.0f);
-    y2 = ((const map_target_struct *) b)->y - (map_height / 2.0f);
+                struct map_target_visited *visited;
+                uint32_t count = cell->target_object_count[layer];
+                HASH_FIND(hh, map_target_visited, &count, sizeof(count),
+                          visited);
 
-    dist1 = isqrt(x * x + y * y);
-    dist2 = isqrt(x2 * x2 + y2 * y2);
+                if (visited != NULL) {
+                    continue;
+                }
 
-    if (dist1 < dist2) {
-        return -1;
-    } else if (dist1 > dist2) {
-        return 1;
-    } else {
-        return 0;
+                target->count = count;
+                target->x = x;
+                target->y = y;
+                map_target_cursor_bucket = bucket;
+                map_target_cursor_pos = pos;
+                return true;
+            }
+        }
     }
+
+    return false;
 }
 
 /**
  * Target something on the map.
+ *
+ * Repeated calls cycle through the targetable objects, nearest first. The
+ * objects already targeted in the current cycle are remembered by their
+ * UIDs, so objects moving around do not restart the cycle.
  * @param is_friend
  * 1 if targeting friendlies only.
  */
 void map_target_handle(uint8_t is_friend)
 {
-    int x, y, layer;
-    struct MapCell *cell;
-    UT_array *targets;
-    UT_icd icd = {sizeof(map_target_struct), NULL, NULL, NULL};
-    map_target_struct *p;
-    uint32_t curr_target;
+    map_target_struct target;
+    bool found;
 
     if (cpl.target_is_friend != is_friend) {
-        cpl.target_object_index = 0;
-    }
-
-    utarray_new(targets, &icd);
-    curr_target = 0;
-
-    for (x = 0; x < map_width; x++) {
-        for (y = 0; y < map_height; y++) {
-            cell = MAP_CELL_GET_MIDDLE(x, y);
-
-            if (cell->fow) {
-                continue;
-            }
-
-            for (layer = 0; layer < NUM_REAL_LAYERS; layer++) {
-                if (cell->faces[layer] && cell->target_object_count[layer] &&
-                        cell->target_is_friend[layer] == is_friend) {
-                    map_target_struct target;
-
-                    target.count = cell->target_object_count[layer];
-                    target.x = x;
-                    target.y = y;
-                    utarray_push_back(targets, &target);
-
-                    if (cell->probe[layer] != 0) {
-                        curr_target = target.count;
-                    }
-                }
-            }
-        }
-    }
-
-    utarray_sort(targets, map_target_cmp);
-
-    if (cpl.target_object_index >= utarray_len(targets)) {
-        cpl.target_object_index = 0;
+        map_target_cycle_reset();
     }
 
-    if (cpl.target_object_index == 0) {
-        p = (map_target_struct *) utarray_front(targets);
+    /* Continue from the previous target; objects that have moved closer
+     * than it are only picked up once the rest of the index is exhausted. */
+    found = map_target_find(is_friend, map_target_cursor_bucket,
+                            map_target_cursor_pos, &target) ||
+            map_target_find(is_friend, 0, 0, &target);
 
-        if (p != NULL && p->count == curr_target) {
-            cpl.target_object_index++;
-        }
+    if (!found && map_target_visited != NULL) {
+        map_target_cycle_reset();
+        found = map_target_find(is_friend, 0, 0, &target);
     }
 
-    p = (map_target_struct *) utarray_eltptr(targets, cpl.target_object_index);
-
-    if (p != NULL) {
-        send_target(p->x, p->y, p->count);
-        cpl.target_object_index++;
+    if (found) {
+        struct map_target_visited *visited = ecalloc(1, sizeof(*visited));
+        visited->count = target.count;
+        HASH_ADD(hh, map_target_visited, count, sizeof(visited->count),
+                 visited);
+        send_target(target.x, target.y, target.count);
     } else if (cpl.target_is_friend != is_friend) {
         send_target(-1, -1, 0);
     }
 
     cpl.target_is_friend = is_friend;
-
-    utarray_free(targets);
 }
 
 /**
@@ -2070,15 +4124,48 @@ void map_target_handle(uint8_t is_friend)
 bool
 mouse_to_tile_coords (int mx, int my, int *tx, int *ty)
 {
-    map_render_data_t data = {0};
-    int x, y, w, h;
-    map_setup_render_data(cur_widget[MAP_ID]->surface, &data, &x, &y, &w, &h);
-
     double zoom = setting_get_int(OPT_CAT_MAP, OPT_MAP_ZOOM) / 100.0;
 
     mx -= widget_x(cur_widget[MAP_ID]);
     my -= widget_y(cur_widget[MAP_ID]);
 
+    /* Look up the object drawn under the mouse, if the ID buffer is in
+     * use. */
+    if (map_pick_valid) {
+        if (mx < 0 || my < 0) {
+            return false;
+        }
+
+        int px = mx / zoom;
+        int py = my / zoom;
+
+        if (px >= map_pick_w || py >= map_pick_h) {
+            return false;
+        }
+
+        uint32_t id = map_pick[py * map_pick_w + px];
+
+        if (id == 0) {
+            return false;
+        }
+
+        id = (id - 1) / NUM_REAL_LAYERS;
+
+        if (tx != NULL) {
+            *tx = id % (map_width * MAP_FOW_SIZE);
+        }
+
+        if (ty != NULL) {
+            *ty = id / (map_width * MAP_FOW_SIZE);
+        }
+
+        return true;
+    }
+
+    map_render_data_t data = {0};
+    int x, y, w, h;
+    map_setup_render_data(cur_widget[MAP_ID]->surface, &data, &x, &y, &w, &h);
+
     for (data.x = w - 1; data.x >= x; data.x--) {
         for (data.y = h - 1; data.y >= y; data.y--) {
             if (!map_should_draw(cur_widget[MAP_ID]->surface, &data)) {
@@ -2216,6 +4303,141 @@ static void menu_map_talk_to(widgetdata *widget, widgetdata *menuitem,
     }
 }
 
+/**
+ * Update the zoomed map after the map has been drawn, if the map is zoomed.
+ *
+ * The zoomed map is kept between redraws, and after a partial redraw only
+ * the parts of it affected by the redrawn areas are scaled again.
+ * @param surface
+ * The map surface.
+ * @param redrawn
+ * Areas of the map surface that were redrawn; if NULL, the whole map was.
+ * @param redrawn_num
+ * Number of entries in @p redrawn.
+ */
+static void
+map_zoom_update (SDL_Surface *surface, const SDL_Rect *redrawn,
+                 size_t redrawn_num)
+{
+    int zoom = setting_get_int(OPT_CAT_MAP, OPT_MAP_ZOOM);
+    if (zoom == 100) {
+        return;
+    }
+
+    bool smooth = setting_get_int(OPT_CAT_CLIENT, OPT_ZOOM_SMOOTH);
+
+    if (surface->format->BytesPerPixel != 4) {
+        if (zoomed != NULL) {
+            SDL_FreeSurface(zoomed);
+        }
+
+        zoomed = zoomSurface(surface, zoom / 100.0, zoom / 100.0, smooth);
+        return;
+    }
+
+    int w, h;
+    zoomSurfaceSize(surface->w, surface->h, zoom / 100.0, zoom / 100.0, &w,
+            &h);
+
+    if (zoomed != NULL && (zoomed->w != w || zoomed->h != h ||
+            zoomed->format->format != surface->format->format)) {
+        SDL_FreeSurface(zoomed);
+        zoomed = NULL;
+    }
+
+    if (zoomed == NULL) {
+        zoomed = SDL_CreateRGBSurface(0, w, h, surface->format->BitsPerPixel,
+                surface->format->Rmask, surface->format->Gmask,
+                surface->format->Bmask, surface->format->Amask);
+
+        if (zoomed == NULL) {
+            LOG(ERROR, "Could not create zoomed map surface: %s",
+                    SDL_GetError());
+            return;
+        }
+
+        redrawn = NULL;
+    }
+
+    if (pixel_scaler_setup(&map_zoom_scaler, surface->w, surface->h, w, h,
+            smooth)) {
+        redrawn = NULL;
+    }
+
+    if (redrawn == NULL) {
+        pixel_scaler_scale(&map_zoom_scaler, surface, zoomed, NULL);
+        return;
+    }
+
+    for (size_t i = 0; i < redrawn_num; i++) {
+        pixel_scaler_scale(&map_zoom_scaler, surface, zoomed, &redrawn[i]);
+    }
+}
+
+/**
+ * Render lines of outlined text onto a new surface, so that text shown
+ * over several frames only needs to be rendered once.
+ *
+ * @param font
+ * Font to use.
+ * @param text
+ * The lines of text, separated by NUL characters.
+ * @param lines
+ * Number of lines in @p text.
+ * @param color
+ * Color of the text.
+ * @param flags
+ * Text flags; ::TEXT_OUTLINE is always added.
+ * @return
+ * The surface, with the lines centered and one pixel of room around them
+ * for the outline, or NULL on failure.
+ */
+static SDL_Surface *
+map_text_render (font_struct *font,
+                 const char  *text,
+                 size_t       lines,
+                 const char  *color,
+                 uint64_t     flags)
+{
+    flags |= TEXT_OUTLINE;
+
+    int w = 0;
+    const char *cp = text;
+
+    for (size_t i = 0; i < lines; i++) {
+        w = MAX(w, text_get_width(font, cp, flags));
+        cp += strlen(cp) + 1;
+    }
+
+    SDL_Surface *surface = SDL_CreateRGBSurface(0,
+                                                w + 2,
+                                                FONT_HEIGHT(font) * lines + 2,
+                                                32,
+                                                0xFF000000,
+                                                0x00FF0000,
+                                                0x0000FF00,
+                                                0x000000FF);
+    if (surface == NULL) {
+        return NULL;
+    }
+
+    cp = text;
+
+    for (size_t i = 0; i < lines; i++) {
+        text_show(surface,
+                  font,
+                  cp,
+                  1 + (w - text_get_width(font, cp, flags)) / 2,
+                  1 + FONT_HEIGHT(font) * i,
+                  color,
+                  flags,
+                  NULL);
+        cp += strlen(cp) + 1;
+    }
+
+    return surface;
+}
+
 /** @copydoc widgetdata::draw_func */
 static void widget_draw(widgetdata *widget)
 {
@@ -2249,22 +4471,22 @@ static void widget_draw(widgetdata *widget)
         map_redraw_flag = 1;
     }
 
-    /* We re-create the map only when there is a change. */
-    if (map_redraw_flag) {
-        SDL_FillRect(widget->surface, NULL, 0);
-        map_draw_map(widget->surface);
-        map_redraw_flag = 0;
-        effect_sprites_play();
-
-        if (setting_get_int(OPT_CAT_MAP, OPT_MAP_ZOOM) != 100) {
-            if (zoomed) {
-                SDL_FreeSurface(zoomed);
-            }
-
-            zoomed = zoomSurface(widget->surface,
-                    setting_get_int(OPT_CAT_MAP, OPT_MAP_ZOOM) / 100.0,
-                    setting_get_int(OPT_CAT_MAP, OPT_MAP_ZOOM) / 100.0,
-                    setting_get_int(OPT_CAT_CLIENT, OPT_ZOOM_SMOOTH));
+    /* We re-create the map only when there is a change; if only some cells
+     * changed, try to redraw just those. Effect sprites are drawn over the
+     * whole map, so they require a full redraw. */
+    if (map_redraw_flag || map_dirty_num != 0) {
+        SDL_Rect redrawn[MAP_DIRTY_RECTS_MAX];
+        size_t redrawn_num;
+
+        if (map_redraw_flag || effect_is_playing() ||
+                !map_draw_dirty(widget->surface, redrawn, &redrawn_num)) {
+            SDL_FillRect(widget->surface, NULL, 0);
+            map_draw_map(widget->surface);
+            map_redraw_flag = 0;
+            effect_sprites_play();
+            map_zoom_update(widget->surface, NULL, 0);
+        } else {
+            map_zoom_update(widget->surface, redrawn, redrawn_num);
         }
     }
 
@@ -2324,32 +4546,35 @@ static void widget_draw(widgetdata *widget)
     /* Process message animations */
     if (msg_anim.message[0] != '\0') {
         if ((LastTick - msg_anim.tick) < 3000) {
-            int bmoff, y_offset;
-            char *msg, *cp;
+            int bmoff;
 
             bmoff = (int) ((50.0f / 3.0f) * ((float) (LastTick - msg_anim.tick)
                     / 1000.0f) * ((float) (LastTick - msg_anim.tick) /
                     1000.0f) + ((int) (150.0f * ((float) (LastTick -
                     msg_anim.tick) / 3000.0f))));
-            y_offset = 0;
-            msg = estrdup(msg_anim.message);
 
-            cp = strtok(msg, "\n");
+            /* Rendered once, and only moved around afterwards. */
+            if (msg_anim.surface == NULL) {
+                msg_anim.surface = map_text_render(FONT_SERIF16,
+                        msg_anim.message, msg_anim.lines, msg_anim.color,
+                        TEXT_MARKUP);
+            }
 
-            while (cp) {
-                text_show(ScreenSurface, FONT_SERIF16, cp, widget_x(widget) +
-                        widget_w(widget) / 2 - text_get_width(FONT_SERIF16,
-                        cp, TEXT_OUTLINE) / 2, widget_y(widget) + 300 - bmoff +
-                        y_offset, msg_anim.color, TEXT_OUTLINE | TEXT_MARKUP,
-                        NULL);
-                y_offset += FONT_HEIGHT(FONT_SERIF16);
-                cp = strtok(NULL, "\n");
+            if (msg_anim.surface != NULL) {
+                surface_show(ScreenSurface, widget_x(widget) +
+                        widget_w(widget) / 2 - msg_anim.surface->w / 2,
+                        widget_y(widget) + 300 - bmoff - 1, NULL,
+                        msg_anim.surface);
             }
 
-            efree(msg);
             widget->redraw++;
         } else {
             msg_anim.message[0] = '\0';
+
+            if (msg_anim.surface != NULL) {
+                SDL_FreeSurface(msg_anim.surface);
+                msg_anim.surface = NULL;
+            }
         }
     }
 
@@ -2413,6 +4638,7 @@ static int widget_event(widgetdata *widget, SDL_Event *event)
             old_map_mouse_x = tx;
             old_map_mouse_y = ty;
             map_show_mouse = true;
+            widget->redraw = 1;
 
             return 1;
         }
@@ -2421,12 +4647,46 @@ static int widget_event(widgetdata *widget, SDL_Event *event)
     return 0;
 }
 
+/**
+ * Check whether the low health or food warning icon is being shown above
+ * the player.
+ * @return
+ * True if either of the warnings is shown, false otherwise.
+ */
+static bool map_warning_shown(void)
+{
+    int warn = setting_get_int(OPT_CAT_MAP, OPT_HEALTH_WARNING);
+
+    if (warn != 0 && cpl.stats.maxhp != 0 &&
+            warn >= (double) cpl.stats.hp / cpl.stats.maxhp * 100.0) {
+        return true;
+    }
+
+    warn = setting_get_int(OPT_CAT_MAP, OPT_FOOD_WARNING);
+    return warn != 0 && warn >= (double) cpl.stats.food / 1000.0 * 100.0;
+}
+
 /** @copydoc widgetdata::background_func */
 static void widget_background(widgetdata *widget, int draw)
 {
+    static bool mouse_shown = false;
+
     if (!widget->redraw) {
         region_map_ready(MapData.region_map);
     }
+
+    /* The map widget draws directly onto the screen; figure out whether
+     * anything it draws will change. */
+    bool show_mouse = map_show_mouse &&
+            widget_mouse_event.owner == cur_widget[MAP_ID];
+
+    if (map_redraw_flag || map_dirty_num != 0 || map_anims_need_redraw() ||
+            msg_anim.message[0] != '\0' || map_warning_shown() ||
+            show_mouse != mouse_shown) {
+        widget->redraw = 1;
+    }
+
+    mouse_shown = show_mouse;
 }
 
 /** @copydoc widgetdata::deinit_func */
@@ -2435,6 +4695,56 @@ static void widget_deinit(widgetdata *widget)
     if (cells != NULL) {
         efree(cells);
         cells = NULL;
+        cells_num = 0;
+    }
+
+    map_strings_clear();
+
+    if (zoomed != NULL) {
+        SDL_FreeSurface(zoomed);
+        zoomed = NULL;
+    }
+
+    pixel_scaler_free(&map_zoom_scaler);
+    map_target_index_free();
+
+    if (map_pick != NULL) {
+        efree(map_pick);
+        map_pick = NULL;
+        map_pick_w = 0;
+        map_pick_h = 0;
+    }
+
+    map_pick_valid = false;
+
+    if (msg_anim.surface != NULL) {
+        SDL_FreeSurface(msg_anim.surface);
+        msg_anim.surface = NULL;
+    }
+
+    if (map_draw_list != NULL) {
+        efree(map_draw_list);
+        map_draw_list = NULL;
+        map_draw_list_num = 0;
+        map_draw_list_size = 0;
+    }
+
+    map_draw_list_valid = false;
+
+    if (map_light_shade != NULL) {
+        efree(map_light_shade);
+        efree(map_light_fow);
+        map_light_shade = NULL;
+        map_light_fow = NULL;
+        map_light_size = 0;
+    }
+
+    map_light_lit = true;
+
+    if (map_light_row != NULL) {
+        efree(map_light_row);
+        map_light_row = NULL;
+        map_light_row_size = 0;
     }
 
     region_map_free(MapData.region_map);
@@ -2455,6 +4765,7 @@ void widget_map_init(widgetdata *widget)
     widget->background_func = widget_background;
     widget->deinit_func = widget_deinit;
     widget->menu_handle_func = NULL;
+    widget->damage_tracked = 1;
 
     SetPriorityWidget_reverse(widget);
 }
@@ -2531,6 +4842,10 @@ void maps_anims_remove(map_anim_t *anim)
 
     DL_DELETE(first_anim, anim);
 
+    if (anim->surface != NULL) {
+        SDL_FreeSurface(anim->surface);
+    }
+
     efree(anim);
 }
 
@@ -2591,50 +4906,54 @@ void map_anims_play(void)
         data.ypos += num_ticks * anim->yoff;
         data.xpos += num_ticks * anim->xoff;
 
+        /* The text is rendered the first time the animation is shown, and
+         * only moved around afterwards. */
         char buf[32];
         switch (anim->type) {
-        case ANIM_DAMAGE: {
-            snprintf(VS(buf), "%d", abs(anim->value));
-            int wd = text_get_width(FONT_MONO10, buf, TEXT_OUTLINE);
-            const char *color = anim->value < 0 ? COLOR_GREEN : COLOR_ORANGE;
-
-            text_show(ScreenSurface,
-                      FONT_MONO10,
-                      buf,
-                      data.xpos - wd / 2,
-                      data.ypos,
-                      color,
-                      TEXT_OUTLINE,
-                      NULL);
+        case ANIM_DAMAGE:
+            if (anim->surface == NULL) {
+                snprintf(VS(buf), "%d", abs(anim->value));
+                anim->surface = map_text_render(FONT_MONO10,
+                                                buf,
+                                                1,
+                                                anim->value < 0 ?
+                                                    COLOR_GREEN :
+                                                    COLOR_ORANGE,
+                                                0);
+            }
+
             break;
-        }
 
         case ANIM_KILL: {
-            snprintf(VS(buf), "%d", anim->value);
-            int wd = text_get_width(FONT_MONO10, buf, TEXT_OUTLINE);
-            int ht = text_get_height(FONT_MONO10, buf, 0);
+            if (anim->surface == NULL) {
+                snprintf(VS(buf), "%d", anim->value);
+                anim->surface = map_text_render(FONT_MONO10,
+                                                buf,
+                                                1,
+                                                COLOR_ORANGE,
+                                                0);
+            }
+
             SDL_Surface *texture = TEXTURE_CLIENT("death");
             surface_show(ScreenSurface,
                          data.xpos - texture->w / 2,
-                         data.ypos - ht / 2 + 2,
+                         data.ypos - FONT_HEIGHT(FONT_MONO10) / 2 + 2,
                          NULL,
                          texture);
-
-            text_show(ScreenSurface,
-                      FONT_MONO10,
-                      buf,
-                      data.xpos - wd / 2,
-                      data.ypos,
-                      COLOR_ORANGE,
-                      TEXT_OUTLINE,
-                      NULL);
-
             break;
         }
 
         default:
             LOG(ERROR, "Unknown animation type: %d", anim->type);
-            break;
+            continue;
+        }
+
+        if (anim->surface != NULL) {
+            surface_show(ScreenSurface,
+                         data.xpos - (anim->surface->w - 2) / 2 - 1,
+                         data.ypos - 1,
+                         NULL,
+                         anim->surface);
         }
     }
 }
@@ -2648,3 +4967,53 @@ int map_anims_need_redraw(void)
 {
     return first_anim != NULL;
 }
+
+/**
+ * Start a message animation, which shows a message rising above the
+ * player.
+ * @param color
+ * Color of the message.
+ * @param message
+ * The message; may contain markup, and several lines separated by
+ * newlines.
+ */
+void map_msg_anim_start(const char *color, const char *message)
+{
+    HARD_ASSERT(color != NULL);
+    HARD_ASSERT(message != NULL);
+
+    snprintf(VS(msg_anim.color), "%s", color);
+    msg_anim.tick = LastTick;
+    msg_anim.lines = 0;
+
+    if (msg_anim.surface != NULL) {
+        SDL_FreeSurface(msg_anim.surface);
+        msg_anim.surface = NULL;
+    }
+
+    /* Split the message into lines now, skipping empty ones, so that
+     * rendering it does not need to. */
+    size_t pos = 0;
+
+    while (*message != '\0' && pos < sizeof(msg_anim.message) - 1) {
+        size_t len = strcspn(message, "\n");
+
+        if (len != 0) {
+            len = MIN(len, sizeof(msg_anim.message) - 1 - pos);
+            memcpy(msg_anim.message + pos, message, len);
+            pos += len;
+            msg_anim.message[pos++] = '\0';
+            msg_anim.lines++;
+        }
+
+        message += len;
+
+        while (*message == '\n') {
+            message++;
+        }
+    }
+
+    if (msg_anim.lines == 0) {
+        msg_anim.message[0] = '\0';
+    }
+}
@@ -70,6 +70,77 @@ static const char *const minimap_display_modes[MINIMAP_TYPE_NUM] = {
     "Prefer region maps", "Only region maps", "Only dynamic maps"
 };
 
+/**
+ * Render the dynamic minimap onto the widget's surface, zoomed around the
+ * player's position.
+ *
+ * The minimap surface has the same format as the widget's surface, so the
+ * pixels are simply sampled (nearest-neighbour) and copied.
+ * @param widget
+ * The minimap widget.
+ * @param minimap
+ * The minimap widget sub-structure.
+ * @param cx
+ * X position of the player on the minimap surface.
+ * @param cy
+ * Y position of the player on the minimap surface.
+ */
+static void
+minimap_draw_dynamic (widgetdata *widget, minimap_widget_t *minimap, int cx,
+                      int cy)
+{
+    SDL_Surface *src = minimap->surface;
+    SDL_Surface *dst = widget->surface;
+
+    /* Same scale as the map tiles rendered at their full size and zoomed
+     * by the region map zoom level would have. */
+    double zoom = MapData.region_map->zoom / 100.0 / 100.0 /
+            (MAP_FOW_SIZE + 1.0);
+    double scale_x = widget->w * zoom * MAP_TILE_YOFF /
+            (MAP_MINIMAP_TILE_W / 2);
+    double scale_y = widget->h * zoom * MAP_TILE_XOFF /
+            (MAP_MINIMAP_TILE_H / 2);
+
+    int bpp = dst->format->BytesPerPixel;
+    int *cols = emalloc(sizeof(*cols) * dst->w);
+
+    for (int x = 0; x < dst->w; x++) {
+        cols[x] = cx + (int) floor((x - dst->w / 2.0) / scale_x);
+
+        if (cols[x] < 0 || cols[x] >= src->w) {
+            cols[x] = -1;
+        }
+    }
+
+    SDL_LockSurface(src);
+    SDL_LockSurface(dst);
+
+    for (int y = 0; y < dst->h; y++) {
+        Uint8 *dst_row = (Uint8 *) dst->pixels + y * dst->pitch;
+        int src_y = cy + (int) floor((y - dst->h / 2.0) / scale_y);
+
+        if (src_y < 0 || src_y >= src->h) {
+            memset(dst_row, 0, dst->w * bpp);
+            continue;
+        }
+
+        const Uint8 *src_row = (const Uint8 *) src->pixels + src_y * src->pitch;
+
+        for (int x = 0; x < dst->w; x++) {
+            if (cols[x] == -1) {
+                memset(dst_row + x * bpp, 0, bpp);
+            } else {
+                memcpy(dst_row + x * bpp, src_row + cols[x] * bpp, bpp);
+            }
+        }
+    }
+
+    SDL_UnlockSurface(dst);
+    SDL_UnlockSurface(src);
+
+    efree(cols);
+}
+
 /** @copydoc widgetdata::draw_func */
 static void widget_draw(widgetdata *widget)
 {
@@ -175,33 +246,28 @@ static void widget_draw(widgetdata *widget)
             SDL_BlitSurface(minimap->textures[MINIMAP_TEXTURE_BORDER_ROTATED],
                     NULL, widget->surface, NULL);
         } else {
-            SDL_Surface *zoomed;
-            SDL_Rect zoomedbox;
+            int w, h, cx, cy;
+            bool full = false;
 
-            if (minimap->surface == NULL) {
-                minimap->surface = SDL_CreateRGBSurface(0,
-                        850 * (MAP_FOW_SIZE / 2), 600 * (MAP_FOW_SIZE / 2),
-                        video_get_bpp(), 0, 0, 0, 0);
-            }
+            map_minimap_size(&w, &h, &cx, &cy);
 
-            double zoomx = (double) widget->w / minimap->surface->w *
-                    (minimap->surface->w / (MAP_FOW_SIZE + 1.0));
-            double zoomy = (double) widget->h / minimap->surface->h *
-                    (minimap->surface->h / (MAP_FOW_SIZE + 1.0));
+            /* (Re-)create the low-resolution minimap surface if the map size
+             * changed; it needs to be drawn completely then. */
+            if (minimap->surface == NULL || minimap->surface->w != w ||
+                    minimap->surface->h != h) {
+                if (minimap->surface != NULL) {
+                    SDL_FreeSurface(minimap->surface);
+                }
 
-            SDL_FillRect(minimap->surface, NULL, 0);
-            map_draw_map(minimap->surface);
+                minimap->surface = SDL_CreateRGBSurface(0, w, h,
+                        video_get_bpp(), 0, 0, 0, 0);
+                full = true;
+            }
 
-            zoomx = (MapData.region_map->zoom) / 100.0 * (zoomx / 100.0);
-            zoomy = (MapData.region_map->zoom) / 100.0 * (zoomy / 100.0);
-            zoomed = zoomSurface(minimap->surface, zoomx, zoomy,
-                    setting_get_int(OPT_CAT_CLIENT, OPT_ZOOM_SMOOTH));
-            zoomedbox.x = zoomed->w / 2 - widget->surface->w / 2;
-            zoomedbox.y = zoomed->h / 2 - widget->surface->h / 2;
-            zoomedbox.w = widget->surface->w;
-            zoomedbox.h = widget->surface->h;
-            SDL_BlitSurface(zoomed, &zoomedbox, widget->surface, NULL);
-            SDL_FreeSurface(zoomed);
+            if (minimap->surface != NULL) {
+                map_minimap_update(minimap->surface, full);
+                minimap_draw_dynamic(widget, minimap, cx, cy);
+            }
 
             SDL_BlitSurface(minimap->textures[MINIMAP_TEXTURE_MASK], NULL,
                     widget->surface, NULL);
@@ -40,6 +40,16 @@ typedef struct network_graph_widget {
      * Which traffic types to display.
      */
     uint32_t filters;
+
+    /**
+     * Whether to display server command statistics instead of the graph.
+     */
+    bool commands;
+
+    /**
+     * When the server command statistics were last redrawn.
+     */
+    uint32_t commands_ticks;
 } network_graph_widget_t;
 
 /**
@@ -66,6 +76,11 @@ static const char *const network_graph_filters[NETWORK_GRAPH_TRAFFIC_MAX] = {
     "Received", "Transmitted"
 };
 
+/**
+ * Name of the server command statistics display.
+ */
+static const char *const network_graph_commands = "Server commands";
+
 /**
  * Colors of the network graph types.
  */
@@ -87,6 +102,66 @@ static network_graph_work_t *work_queue = NULL;
 static void widget_network_graph_update(widgetdata *widget, int type,
         int traffic, size_t bytes);
 
+/**
+ * Comparison function for sorting server command types by the time spent
+ * handling them, most expensive first.
+ */
+static int network_graph_commands_compare(const void *a, const void *b)
+{
+    uint64_t time_a = client_command_stats(*(const uint8_t *) a)->handler_time;
+    uint64_t time_b = client_command_stats(*(const uint8_t *) b)->handler_time;
+
+    if (time_a > time_b) {
+        return -1;
+    } else if (time_a < time_b) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Draw the server command statistics, most expensive commands first.
+ * @param widget
+ * The widget.
+ */
+static void network_graph_draw_commands(widgetdata *widget)
+{
+    uint8_t types[CLIENT_CMD_NROF];
+    size_t num = 0;
+
+    for (size_t i = 0; i < CLIENT_CMD_NROF; i++) {
+        const client_command_stats_t *stats = client_command_stats(i);
+
+        if (stats->count != 0) {
+            types[num++] = i;
+        }
+    }
+
+    qsort(types, num, sizeof(*types), network_graph_commands_compare);
+
+    double freq = SDL_GetPerformanceFrequency();
+    int y = 2;
+
+    text_show(widget->surface, FONT_ARIAL10, "Command: count, kB, handler "
+            "ms, avg wait us", 2, y, COLOR_HGOLD, 0, NULL);
+    y += FONT_HEIGHT(FONT_ARIAL10);
+
+    for (size_t i = 0; i < num; i++) {
+        if (y + FONT_HEIGHT(FONT_ARIAL10) > widget->h) {
+            break;
+        }
+
+        const client_command_stats_t *stats = client_command_stats(types[i]);
+        text_show_format(widget->surface, FONT_ARIAL10, 2, y, COLOR_WHITE, 0,
+                NULL, "%s: %" PRIu64 ", %" PRIu64 ", %.1f, %.0f",
+                client_command_name(types[i]), stats->count,
+                stats->bytes / 1000, stats->handler_time * 1000.0 / freq,
+                stats->wait_time * 1000000.0 / freq / stats->count);
+        y += FONT_HEIGHT(FONT_ARIAL10);
+    }
+}
+
 /** @copydoc widgetdata::draw_func */
 static void widget_draw(widgetdata *widget)
 {
@@ -99,6 +174,11 @@ static void widget_draw(widgetdata *widget)
 
     SDL_FillRect(widget->surface, NULL, 0);
 
+    if (network_graph->commands) {
+        network_graph_draw_commands(widget);
+        return;
+    }
+
     if (data->data == NULL) {
         return;
     }
@@ -166,6 +246,12 @@ static void widget_background(widgetdata *widget, int draw)
     }
     SDL_UnlockMutex(network_graph_mutex);
 
+    if (network_graph->commands &&
+            LastTick - network_graph->commands_ticks > 1000) {
+        network_graph->commands_ticks = LastTick;
+        widget->redraw = 1;
+    }
+
     for (int type = 0; type < NETWORK_GRAPH_TYPE_MAX; type++) {
         network_graph_data_t *data = &network_graph->data[type];
         if (LastTick - data->ticks <= 1000) {
@@ -184,6 +270,10 @@ static int widget_event(widgetdata *widget, SDL_Event *event)
     network_graph_widget_t *network_graph = widget->subwidget;
     network_graph_data_t *data = &network_graph->data[network_graph->type];
 
+    if (network_graph->commands || data->data == NULL) {
+        return 0;
+    }
+
     if (event->type == SDL_MOUSEMOTION) {
         int x = event->motion.x - widget->x;
         if (x < 0 || x >= widget->w) {
@@ -243,10 +333,13 @@ static void menu_network_graph_display_change(widgetdata *widget,
         if (tmp->type == LABEL_ID) {
             _widget_label *label = LABEL(tmp);
 
+            network_graph->commands = strcmp(network_graph_commands,
+                    label->text) == 0;
+            widget->redraw = 1;
+
             for (int i = 0; i < NETWORK_GRAPH_TYPE_MAX; i++) {
                 if (strcmp(network_graph_types[i], label->text) == 0) {
                     network_graph->type = i;
-                    widget->redraw = 1;
                     break;
                 }
             }
@@ -265,8 +358,25 @@ static void menu_network_graph_display(widgetdata *widget, widgetdata *menuitem,
     for (int i = 0; i < NETWORK_GRAPH_TYPE_MAX; i++) {
         add_menuitem(submenu, network_graph_types[i],
                 &menu_network_graph_display_change, MENU_RADIO,
-                network_graph->type == i);
+                !network_graph->commands && network_graph->type == i);
     }
+
+    add_menuitem(submenu, network_graph_commands,
+            &menu_network_graph_display_change, MENU_RADIO,
+            network_graph->commands);
+}
+
+static void menu_network_graph_commands_dump(widgetdata *widget,
+        widgetdata *menuitem, SDL_Event *event)
+{
+    client_command_stats_dump();
+}
+
+static void menu_network_graph_commands_reset(widgetdata *widget,
+        widgetdata *menuitem, SDL_Event *event)
+{
+    client_command_stats_reset();
+    widget->redraw = 1;
 }
 
 static void menu_network_graph_filters_change(widgetdata *widget,
@@ -313,6 +423,10 @@ static int widget_menu_handle(widgetdata *widget, SDL_Event *event)
             0);
     add_menuitem(menu, "Filters  >", &menu_network_graph_filters, MENU_SUBMENU,
             0);
+    add_menuitem(menu, "Dump command statistics",
+            &menu_network_graph_commands_dump, MENU_NORMAL, 0);
+    add_menuitem(menu, "Reset command statistics",
+            &menu_network_graph_commands_reset, MENU_NORMAL, 0);
     menu_finalize(menu);
     return 1;
 }
@@ -42,6 +42,21 @@ typedef struct _anim_table {
     uint8_t *anim_cmd;
 } _anim_table;
 
+/**
+ * @defgroup COMMAND_BUFFER_xxx Command buffer states
+ * States of received command buffers.
+ *@{*/
+/** The command has been decrypted and decompressed. */
+#define COMMAND_BUFFER_READY 0
+/**
+ * The command has yet to be decrypted and decompressed by the main thread;
+ * this happens while the crypto exchange is in progress.
+ */
+#define COMMAND_BUFFER_RAW 1
+/** Decrypting the command failed. */
+#define COMMAND_BUFFER_FAILED 2
+/*@}*/
+
 /**
  * One command buffer.
  */
@@ -55,6 +70,24 @@ typedef struct command_buffer {
     /** Length of the data. */
     size_t len;
 
+    /** Allocated size of the data. */
+    size_t size;
+
+    /** State of the command, one of @ref COMMAND_BUFFER_xxx. */
+    uint8_t state;
+
+    /**
+     * When the command was read from the socket, in performance counter
+     * ticks; 0 for outgoing commands.
+     */
+    uint64_t ticks;
+
+    /**
+     * Outgoing packet that has yet to be encrypted and serialized by the
+     * writer thread, if any.
+     */
+    struct packet_struct *packet;
+
     /** The data. */
     uint8_t data[1];
 } command_buffer;
@@ -74,10 +107,54 @@ typedef struct client_socket {
         (_color)->b = (_color2)->b; \
     }
 
+/**
+ * @defgroup COMMAND_PRIORITY_xxx Command priorities
+ * Priorities of commands received from the server.
+ *@{*/
+/** Commands handled in the order they were received. */
+#define COMMAND_PRIORITY_NORMAL 0
+/**
+ * Latency-critical commands; these are handled regardless of the command
+ * processing budget, and may overtake bulk commands.
+ */
+#define COMMAND_PRIORITY_CRITICAL 1
+/**
+ * Bulk commands; these may be deferred to later frames once the command
+ * processing budget is used up.
+ */
+#define COMMAND_PRIORITY_BULK 2
+/*@}*/
+
 typedef struct socket_command_struct {
     void (*handle_func)(uint8_t *data, size_t len, size_t pos);
+
+    /** Priority of the command, one of @ref COMMAND_PRIORITY_xxx. */
+    uint8_t priority;
+
+    /** Name of the command, used for statistics. */
+    const char *name;
 } socket_command_struct;
 
+/**
+ * Statistics about one type of command received from the server.
+ */
+typedef struct client_command_stats {
+    /** Number of commands handled. */
+    uint64_t count;
+
+    /** Total size of the commands. */
+    uint64_t bytes;
+
+    /** Total time spent in the handler, in performance counter ticks. */
+    uint64_t handler_time;
+
+    /**
+     * Total time from the commands being read from the socket until they
+     * were handled, in performance counter ticks.
+     */
+    uint64_t wait_time;
+} client_command_stats_t;
+
 /**
  * @defgroup SPELL_DESC_xxx Spell flags
  * Spell flags.
@@ -109,6 +186,15 @@ typedef struct clioption_settings_struct {
     char *game_news_url;
 
     uint8_t reconnect;
+
+    /** File to capture the server command stream to. */
+    char *netcapture;
+
+    /** Capture file to replay through the command handlers. */
+    char *netreplay;
+
+    /** Name of the self-test to run. */
+    char *selftest;
 } clioption_settings_struct;
 
 #endif
@@ -20,6 +20,7 @@
 #include <zlib.h>
 #include <pthread.h>
 #include <config.h>
+#include <cmake.h>
 #include <toolkit/toolkit.h>
 #include <toolkit/socket.h>
 #include <toolkit/shstr.h>
@@ -101,14 +101,23 @@ typedef struct server_struct {
  * DrawInfoCmd2().
  */
 typedef struct msg_anim_struct {
-    /** The message to play. */
+    /**
+     * The message to play, split into lines that are separated by NUL
+     * characters; see map_msg_anim_start().
+     */
     char message[MAX_BUF];
 
+    /** Number of lines in the message. */
+    size_t lines;
+
     /** Tick when it started. */
     uint32_t tick;
 
     /** Color of the message animation. */
     char color[COLOR_BUF];
+
+    /** The rendered message, NULL if not rendered yet. */
+    SDL_Surface *surface;
 } msg_anim_struct;
 
 #define FILE_GAME_P0 "data/game.p0"
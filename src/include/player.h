@@ -178,8 +178,6 @@ typedef struct Player_Struct {
     /** Version of the server's socket. */
     int server_socket_version;
 
-    size_t target_object_index;
-
     uint8_t target_is_friend;
 
     /**
@@ -5,7 +5,13 @@ extern void anims_deinit(void);
 extern void anims_reset(void);
 /* src/client/client.c */
 extern Client_Player cpl;
+extern bool client_command_call(uint8_t *data, size_t len);
 extern void DoClient(void);
+extern void client_commands_clear(void);
+extern const char *client_command_name(uint8_t type);
+extern const client_command_stats_t *client_command_stats(uint8_t type);
+extern void client_command_stats_reset(void);
+extern void client_command_stats_dump(void);
 extern void check_animation_status(int anum);
 /* src/client/cmd_aliases.c */
 extern void cmd_aliases_init(void);
@@ -27,7 +33,6 @@ extern void socket_command_item_delete(uint8_t *data, size_t len, size_t pos);
 extern void socket_command_mapstats(uint8_t *data, size_t len, size_t pos);
 extern void socket_command_map(uint8_t *data, size_t len, size_t pos);
 extern void socket_command_version(uint8_t *data, size_t len, size_t pos);
-extern void socket_command_compressed(uint8_t *data, size_t len, size_t pos);
 extern void socket_command_control(uint8_t *data, size_t len, size_t pos);
 void
 socket_command_crypto(uint8_t *data, size_t len, size_t pos);
@@ -117,6 +122,24 @@ extern char *package_get_version_full(char *dst, size_t dstlen);
 extern char *package_get_version_partial(char *dst, size_t dstlen);
 extern int bmp2png(const char *path);
 extern void screenshot_create(SDL_Surface *surface);
+/* src/client/netcapture.c */
+extern void netcapture_open(const char *path);
+extern void netcapture_close(void);
+extern void netcapture_record(const uint8_t *data, size_t len);
+extern int netreplay_run(const char *path);
+/* src/client/pixel.c */
+extern void pixel_init(void);
+#ifdef HAVE_SELFTEST
+extern size_t pixel_kernels_num(void);
+extern const char *pixel_kernels_select(size_t idx);
+#endif
+extern void pixel_effect_surface(SDL_Surface *surface, pixel_effect_t effect);
+extern SDL_Color pixel_effect_color(SDL_Color color, pixel_effect_t effect);
+extern bool pixel_alpha_surface(SDL_Surface *surface, uint8_t alpha);
+extern void pixel_light_row(uint32_t *row, const uint16_t *light, size_t num, const SDL_PixelFormat *fmt);
+extern bool pixel_scaler_setup(pixel_scaler_t *scaler, int src_w, int src_h, int dst_w, int dst_h, bool smooth);
+extern void pixel_scaler_free(pixel_scaler_t *scaler);
+extern void pixel_scaler_scale(const pixel_scaler_t *scaler, SDL_Surface *src, SDL_Surface *dst, const SDL_Rect *box);
 /* src/client/player.c */
 extern const char *gender_noun[4];
 extern const char *gender_subjective[4];
@@ -173,7 +196,8 @@ extern command_buffer *command_buffer_new(size_t len, uint8_t *data);
 extern void command_buffer_free(command_buffer *buf);
 extern void socket_send_packet(struct packet_struct *packet);
 extern command_buffer *get_next_input_command(void);
-extern void add_input_command(command_buffer *buf);
+extern command_buffer *socket_command_prepare(command_buffer *cmd);
+extern void socket_command_raw_done(void);
 extern void socket_thread_start(void);
 extern void socket_thread_stop(void);
 extern int handle_socket_shutdown(void);
@@ -211,11 +235,15 @@ extern void sprite_init_system(void);
 extern sprite_struct *sprite_load_file(char *fname, uint32_t flags);
 extern sprite_struct *sprite_tryload_file(char *fname, uint32_t flag, SDL_RWops *rwop);
 extern void sprite_free_sprite(sprite_struct *sprite);
+extern const SDL_Color *sprite_get_average_color(sprite_struct *sprite);
 extern void sprite_cache_free_all(void);
 extern void sprite_cache_gc(void);
+extern void sprite_cache_get_stats(sprite_cache_stats_t *stats);
+extern void sprite_cache_stats_reset(void);
+extern int sprite_dark_alpha(uint8_t dark_level);
 extern void surface_show(SDL_Surface *surface, int x, int y, SDL_Rect *srcrect, SDL_Surface *src);
 extern void surface_show_fill(SDL_Surface *surface, int x, int y, SDL_Rect *srcsize, SDL_Surface *src, SDL_Rect *box);
-extern void surface_show_effects(SDL_Surface *surface, int x, int y, SDL_Rect *srcrect, SDL_Surface *src, const sprite_effects_t *effects);
+extern SDL_Surface *surface_show_effects(SDL_Surface *surface, int x, int y, SDL_Rect *srcrect, SDL_Surface *src, const sprite_effects_t *effects);
 extern Uint32 getpixel(SDL_Surface *surface, int x, int y);
 extern void putpixel(SDL_Surface *surface, int x, int y, Uint32 pixel);
 extern int surface_borders_get(SDL_Surface *surface, int *top, int *bottom, int *left, int *right, uint32_t color);
@@ -240,10 +268,11 @@ extern texture_struct *texture_get(texture_type_t type, const char *name);
 extern SDL_Surface *texture_surface(texture_struct *texture);
 /* src/client/tilestretcher.c */
 extern int tilestretcher_coords_in_tile(uint32_t stretch, int x, int y);
-extern int add_color_to_surface(SDL_Surface *dest, Uint8 red, Uint8 green, Uint8 blue);
-extern void copy_pixel_to_pixel(SDL_Surface *src, SDL_Surface *dest, int x, int y, int x2, int y2, double brightness);
-extern void copy_vertical_line(SDL_Surface *src, SDL_Surface *dest, int src_x, int src_sy, int src_ey, int dest_x, int dest_sy, int dest_ey, double brightness, _Bool extra);
+#ifdef HAVE_SELFTEST
+extern SDL_Surface *tile_stretch_reference(SDL_Surface *src, int n, int e, int s, int w);
+#endif
 extern SDL_Surface *tile_stretch(SDL_Surface *src, int n, int e, int s, int w);
+extern void tilestretcher_deinit(void);
 /* src/client/updates.c */
 extern void socket_command_file_update(uint8_t *data, size_t len, size_t pos);
 extern int file_updates_finished(void);
@@ -306,6 +335,7 @@ extern void effect_frames(int frames);
 extern int effect_start(const char *name);
 extern void effect_debug(const char *type);
 extern void effect_stop(void);
+extern uint8_t effect_is_playing(void);
 extern uint8_t effect_has_overlay(void);
 extern const char *effect_overlay_identifier(void);
 extern SDL_Surface *effect_sprite_overlay(SDL_Surface *surface);
@@ -466,6 +496,13 @@ extern void color_picker_get_rgb(color_picker_struct *color_picker, uint8_t *r,
 extern void color_picker_show(SDL_Surface *surface, color_picker_struct *color_picker);
 extern int color_picker_event(color_picker_struct *color_picker, SDL_Event *event);
 extern int color_picker_mouse_over(color_picker_struct *color_picker, int mx, int my);
+/* src/gui/toolkit/damage.c */
+extern void screen_damage_add(int x, int y, int w, int h);
+extern void screen_damage_add_rect(const SDL_Rect *box);
+extern void screen_damage_add_all(void);
+extern bool screen_damage_begin(SDL_Rect *bounds);
+extern bool screen_damage_covers(const SDL_Rect *box);
+extern void screen_damage_upload(void);
 /* src/gui/toolkit/list.c */
 extern void list_set_parent(list_struct *list, int px, int py);
 extern list_struct *list_create(uint32_t max_rows, uint32_t cols, int spacing);
@@ -493,6 +530,7 @@ extern void popup_destroy(popup_struct *popup);
 extern void popup_destroy_all(void);
 extern void popup_render(popup_struct *popup);
 extern void popup_render_all(void);
+extern void popup_damage(void);
 extern int popup_handle_event(SDL_Event *event);
 extern popup_struct *popup_get_head(void);
 extern void popup_button_set_text(popup_button *button, const char *text);
@@ -566,6 +604,7 @@ extern void tooltip_create(int mx, int my, font_struct *font, const char *text);
 extern void tooltip_enable_delay(uint32_t delay);
 extern void tooltip_multiline(int max_width);
 extern void tooltip_show(void);
+extern void tooltip_damage(void);
 extern void tooltip_dismiss(void);
 extern int tooltip_need_redraw(void);
 /* src/gui/toolkit/widget.c */
@@ -603,6 +642,7 @@ extern int widget_event_respond(int x, int y);
 extern widgetdata *get_widget_owner(int x, int y, widgetdata *start, widgetdata *end);
 extern widgetdata *get_widget_owner_rec(int x, int y, widgetdata *widget, widgetdata *end);
 extern int widgets_need_redraw(void);
+extern void widgets_damage(int draw);
 extern void process_widgets(int draw);
 extern void SetPriorityWidget(widgetdata *node);
 extern void SetPriorityWidget_reverse(widgetdata *node);
@@ -683,9 +723,12 @@ extern void map_anims_mapscroll(int xoff, int yoff);
 extern void map_anims_clear(void);
 extern void map_anims_play(void);
 extern int map_anims_need_redraw(void);
+extern void map_msg_anim_start(const char *color, const char *message);
 extern void load_mapdef_dat(void);
 extern void clear_map(_Bool hard);
 extern void map_update_size(int w, int h);
+extern size_t map_anim_index_count(void);
+extern bool map_index_check(void);
 extern void display_mapscroll(int dx, int dy, int old_w, int old_h);
 extern void update_map_name(const char *name);
 extern void update_map_weather(const char *weather);
@@ -703,6 +746,10 @@ extern void map_clear_cell(int x, int y);
 extern void map_set_darkness(int x, int y, int sub_layer, uint8_t darkness);
 extern void map_animate(void);
 extern void map_draw_map(SDL_Surface *surface);
+extern void map_minimap_invalidate(void);
+extern void map_minimap_size(int *w, int *h, int *cx, int *cy);
+extern bool map_minimap_update(SDL_Surface *surface, bool full);
+extern bool map_draw_check(int frames);
 extern void map_draw_one(int x, int y, SDL_Surface *surface);
 extern void map_target_handle(uint8_t is_friend);
 extern bool mouse_to_tile_coords(int mx, int my, int *tx, int *ty);
@@ -783,6 +830,20 @@ extern int textwin_tabs_height(widgetdata *widget);
 extern void textwin_create_scrollbar(widgetdata *widget);
 extern void widget_textwin_init(widgetdata *widget);
 extern void widget_textwin_handle_console(const char *text);
+/* src/tests/selftest.c */
+extern uint32_t selftest_random(void);
+extern SDL_Surface *selftest_surface_random(int w, int h);
+extern void selftest_surface_copy(SDL_Surface *src, SDL_Surface *dst);
+extern int selftest_surface_diff(SDL_Surface *a, SDL_Surface *b);
+extern int selftest_run(const char *name);
+/* src/tests/test_netcapture.c */
+extern bool selftest_netcapture(void);
+/* src/tests/test_pixel.c */
+extern bool selftest_pixel(void);
+/* src/tests/test_scaler.c */
+extern bool selftest_scaler(void);
+/* src/tests/test_tilestretcher.c */
+extern bool selftest_tilestretcher(void);
 
 extern SDL_Cursor* system_cursor_arrow;
 extern SDL_Cursor* system_cursor_hand;
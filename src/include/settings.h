@@ -76,6 +76,12 @@ enum {
     OPT_TEXT_WINDOW_TRANSPARENCY,
     /** Whether to use the system cursor. */
     OPT_SYSTEM_CURSOR,
+    /** How long outgoing data may be held back to coalesce writes. */
+    OPT_OUTPUT_FLUSH_DELAY,
+    /** Time budget for handling server commands each frame. */
+    OPT_COMMAND_BUDGET,
+    /** Memory budget of the sprite effects cache, in megabytes. */
+    OPT_SPRITE_CACHE_SIZE,
 
     /** Internal: stores the current resolution width. */
     OPT_RESOLUTION_X,
@@ -98,7 +104,11 @@ enum {
     /** Map width in tiles. */
     OPT_MAP_WIDTH,
     /** Map height in tiles. */
-    OPT_MAP_HEIGHT
+    OPT_MAP_HEIGHT,
+    /** Interpolate the darkness between map tiles. */
+    OPT_SMOOTH_LIGHTING,
+    /** Pick the objects under the mouse using their exact shapes. */
+    OPT_PRECISE_MOUSE
 };
 
 /**
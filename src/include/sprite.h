@@ -6,15 +6,65 @@
 #ifndef SPRITE_H
 #define SPRITE_H
 
-#define SPRITE_CACHE_GC_MAX_TIME 100000
-#define SPRITE_CACHE_GC_CHANCE 500
-#define SPRITE_CACHE_GC_FREE_TIME 60 * 15
+/**
+ * Sprite cache entries that have not been used for this many milliseconds
+ * are freed.
+ */
+#define SPRITE_CACHE_GC_FREE_TIME (60 * 15 * 1000)
+
+/**
+ * Sprite cache statistics.
+ */
+typedef struct sprite_cache_stats {
+    uint64_t hits; ///< Number of lookups that found the sprite.
+    uint64_t misses; ///< Number of lookups that had to render the sprite.
+    uint64_t evictions; ///< Entries freed to stay within the memory budget.
+    size_t entries; ///< Number of entries in the cache.
+    size_t bytes; ///< Memory used by the entries.
+    size_t peak_bytes; ///< Highest memory use since the last reset.
+} sprite_cache_stats_t;
 
 /**
  * Size of the glow effect in pixels.
  */
 #define SPRITE_GLOW_SIZE 2
 
+/**
+ * Alpha value of the glow outline pixels in glow masks, relative to the
+ * glow pixels.
+ */
+#define SPRITE_GLOW_OUTLINE_ALPHA 223
+
+/**
+ * Color effects applied by pixel_effect_surface().
+ */
+typedef enum pixel_effect {
+    PIXEL_EFFECT_RED, ///< Red version of the sprite, for infravision.
+    PIXEL_EFFECT_GRAY, ///< Gray version of the sprite, for invisibility.
+    PIXEL_EFFECT_FOW, ///< Dark bluish gray version, for fog of war.
+} pixel_effect_t;
+
+/**
+ * Light value used by pixel_light_row() to apply the fog of war effect.
+ */
+#define PIXEL_LIGHT_FOW 0xffff
+
+/**
+ * Precomputed mapping used by pixel_scaler_scale() to scale surfaces of one
+ * size to another.
+ */
+typedef struct pixel_scaler {
+    int src_w; ///< Source width.
+    int src_h; ///< Source height.
+    int dst_w; ///< Destination width.
+    int dst_h; ///< Destination height.
+    bool smooth; ///< Whether the pixels are interpolated.
+    int *cols; ///< First source column of each destination column.
+    int *rows; ///< First source row of each destination row.
+    uint16_t *col_weights; ///< Weights of the next source columns (0-256).
+    uint16_t *row_weights; ///< Weights of the next source rows (0-256).
+} pixel_scaler_t;
+
 /**
  * Used to pass data to surface_show_effects().
  */
@@ -32,11 +82,17 @@ typedef struct sprite_effects {
 } sprite_effects_t;
 
 #define SPRITE_EFFECTS_NEED_RENDERING(_effects)                                \
+    (SPRITE_EFFECTS_CHANGE_SPRITE(_effects) || (_effects)->glow[0] != '\0')
+
+/**
+ * Check whether the effects change the sprite itself, as opposed to only
+ * adding a glow around it.
+ */
+#define SPRITE_EFFECTS_CHANGE_SPRITE(_effects)                                 \
     ((_effects)->flags != 0 || (_effects)->alpha != 0 ||                       \
     (_effects)->stretch != 0 || ((_effects)->zoom_x != 0 &&                    \
     (_effects)->zoom_x != 100) || ((_effects)->zoom_y != 0 &&                  \
-    (_effects)->zoom_y != 100) || (_effects)->rotate != 0 ||                   \
-    (_effects)->glow[0] != '\0')
+    (_effects)->zoom_y != 100) || (_effects)->rotate != 0)
 
 /**
  * @defgroup SPRITE_FLAG_xxx Sprite drawing flags
@@ -70,6 +126,15 @@ typedef struct sprite_struct {
 
     /** The sprite's bitmap. */
     SDL_Surface *bitmap;
+
+    /**
+     * Average color of the sprite's visible pixels; calculated by
+     * sprite_get_average_color() the first time it is needed.
+     */
+    SDL_Color average_color;
+
+    /** Whether ::average_color has been calculated. */
+    bool average_color_done;
 } sprite_struct;
 
 #define BORDER_CREATE_TOP(_surface, _x, _y, _w, _h, _color, _thickness) \
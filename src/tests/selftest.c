@@ -0,0 +1,190 @@
+/**
+ * @file
+ * Self-tests of the rendering code, run with --selftest.
+ *
+ * Each self-test compares optimized rendering code against a reference
+ * implementation, or against another way of producing the same result,
+ * using generated surfaces, so that it can run without a window, a server
+ * or any loaded data. The results and timings are logged, and the client
+ * exits with a non-zero status if any self-test fails. The netcapture
+ * self-test instead writes a capture of the command stream for CTest to
+ * replay with --netreplay.
+ *
+ * The self-tests are only built if the ENABLE_SELFTEST CMake option is
+ * enabled, which also registers each of them with CTest.
+ */
+
+#include <global.h>
+
+/** Seed of the random number generator, reset before each self-test. */
+#define SELFTEST_RANDOM_SEED 0x2545f491
+
+/**
+ * A self-test.
+ */
+typedef struct selftest {
+    /** Name of the self-test, as used with --selftest. */
+    const char *name;
+
+    /**
+     * Run the self-test.
+     * @return
+     * True on success, false on failure.
+     */
+    bool (*func)(void);
+} selftest_t;
+
+/**
+ * All the self-tests.
+ */
+static const selftest_t selftests[] = {
+    {"netcapture", selftest_netcapture},
+    {"pixel", selftest_pixel},
+    {"scaler", selftest_scaler},
+    {"tilestretcher", selftest_tilestretcher},
+};
+
+/** State of the random number generator. */
+static uint32_t selftest_random_state = SELFTEST_RANDOM_SEED;
+
+/**
+ * Generate a random number. The numbers are the same on every run, so the
+ * generated surfaces are too.
+ * @return
+ * The random number.
+ */
+uint32_t selftest_random(void)
+{
+    uint32_t x = selftest_random_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    selftest_random_state = x;
+    return x;
+}
+
+/**
+ * Create a surface filled with random pixels.
+ * @param w
+ * Width of the surface.
+ * @param h
+ * Height of the surface.
+ * @return
+ * The surface, in the RGBA8888 format.
+ */
+SDL_Surface *selftest_surface_random(int w, int h)
+{
+    SDL_Surface *surface = SDL_CreateRGBSurface(0, w, h, 32, 0xFF000000,
+            0x00FF0000, 0x0000FF00, 0x000000FF);
+
+    if (surface == NULL) {
+        LOG(ERROR, "Could not create a surface: %s", SDL_GetError());
+        exit(1);
+    }
+
+    SDL_LockSurface(surface);
+
+    for (int y = 0; y < h; y++) {
+        uint32_t *row = (uint32_t *) ((uint8_t *) surface->pixels +
+                y * surface->pitch);
+
+        for (int x = 0; x < w; x++) {
+            row[x] = selftest_random();
+        }
+    }
+
+    SDL_UnlockSurface(surface);
+    return surface;
+}
+
+/**
+ * Copy the pixels of a surface to another surface of the same size and
+ * format.
+ * @param src
+ * Surface to copy from.
+ * @param dst
+ * Surface to copy to.
+ */
+void selftest_surface_copy(SDL_Surface *src, SDL_Surface *dst)
+{
+    HARD_ASSERT(src->w == dst->w && src->h == dst->h);
+    HARD_ASSERT(src->format->format == dst->format->format);
+
+    for (int y = 0; y < src->h; y++) {
+        memcpy((uint8_t *) dst->pixels + y * dst->pitch,
+                (const uint8_t *) src->pixels + y * src->pitch,
+                src->w * src->format->BytesPerPixel);
+    }
+}
+
+/**
+ * Get the largest difference between any channel of any pixel of two
+ * surfaces of the same format.
+ * @param a
+ * The first surface.
+ * @param b
+ * The second surface.
+ * @return
+ * The difference, or 256 if the surfaces differ in size.
+ */
+int selftest_surface_diff(SDL_Surface *a, SDL_Surface *b)
+{
+    HARD_ASSERT(a->format->format == b->format->format);
+
+    if (a->w != b->w || a->h != b->h) {
+        return 256;
+    }
+
+    int diff = 0;
+
+    for (int y = 0; y < a->h; y++) {
+        const uint8_t *row_a = (const uint8_t *) a->pixels + y * a->pitch;
+        const uint8_t *row_b = (const uint8_t *) b->pixels + y * b->pitch;
+
+        for (int x = 0; x < a->w * a->format->BytesPerPixel; x++) {
+            diff = MAX(diff, abs(row_a[x] - row_b[x]));
+        }
+    }
+
+    return diff;
+}
+
+/**
+ * Run the specified self-test.
+ * @param name
+ * Name of the self-test, or "all" to run all of them.
+ * @return
+ * 0 if the self-tests passed, 1 otherwise.
+ */
+int selftest_run(const char *name)
+{
+    HARD_ASSERT(name != NULL);
+
+    bool all = strcmp(name, "all") == 0;
+    size_t num = 0, failed = 0;
+
+    for (size_t i = 0; i < arraysize(selftests); i++) {
+        if (!all && strcmp(selftests[i].name, name) != 0) {
+            continue;
+        }
+
+        LOG(INFO, "Running self-test: %s", selftests[i].name);
+        selftest_random_state = SELFTEST_RANDOM_SEED;
+        num++;
+
+        if (!selftests[i].func()) {
+            LOG(ERROR, "Self-test failed: %s", selftests[i].name);
+            failed++;
+        }
+    }
+
+    if (num == 0) {
+        LOG(ERROR, "No such self-test: %s", name);
+        return 1;
+    }
+
+    LOG(INFO, "%" PRIu64 " of %" PRIu64 " self-tests passed",
+            (uint64_t) (num - failed), (uint64_t) num);
+    return failed != 0 ? 1 : 0;
+}
@@ -0,0 +1,231 @@
+/**
+ * @file
+ * Self-test that writes a capture of the command stream of a crowded town
+ * map, which CTest then replays with --netreplay to check the map draw list
+ * and the map indexes.
+ *
+ * The commands are built here using the protocol constants instead of
+ * being committed as a binary file, so that the capture cannot go stale
+ * when the protocol changes.
+ */
+
+#include <global.h>
+#include <toolkit/packet.h>
+
+/**
+ * File to write the capture to, relative to the working directory; must
+ * match the file replayed by the netreplay test in CMakeLists.txt.
+ */
+#define SELFTEST_NETCAPTURE_PATH "netreplay-town.cap"
+
+/** Width and height of the visible part of the map, in cells. */
+#define SELFTEST_NETCAPTURE_MAP_SIZE 17
+/** Width and height of the whole map, in cells. */
+#define SELFTEST_NETCAPTURE_MAP_LEN 48
+
+/** Number of steps the player takes through the town. */
+#define SELFTEST_NETCAPTURE_STEPS 24
+
+/** Directions of the player's steps, repeated in this order. */
+static const int selftest_netcapture_steps[][2] = {
+    {1, 0}, {1, 0}, {1, 1}, {0, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1},
+    {0, -1}, {1, -1}, {1, 0}, {0, 1}
+};
+
+/** UID of the next monster, used as its target object count. */
+static uint32_t selftest_netcapture_count;
+
+/**
+ * Record a command in the capture.
+ * @param packet
+ * The command; will be freed.
+ */
+static void selftest_netcapture_record(packet_struct *packet)
+{
+    uint8_t *data = emalloc(packet->len + 1);
+
+    data[0] = packet->type;
+    memcpy(data + 1, packet->data, packet->len);
+    netcapture_record(data, packet->len + 1);
+
+    efree(data);
+    packet_free(packet);
+}
+
+/**
+ * Append a layer without any extra data to a map command.
+ * @param packet
+ * The map command.
+ * @param layer
+ * The layer.
+ * @param sub_layer
+ * The sub-layer.
+ */
+static void selftest_netcapture_object(packet_struct *packet, int layer,
+        int sub_layer)
+{
+    packet_append_uint8(packet, GET_MAP_LAYER(layer, sub_layer));
+    packet_append_uint16(packet, 1 + selftest_random() % 64);
+    packet_append_uint8(packet, 0);
+    packet_append_uint8(packet, 0);
+}
+
+/**
+ * Append the objects of a map cell to a map command. Most cells have an
+ * item or a wall on them, and about a third of them have a targetable
+ * monster or player.
+ * @param packet
+ * The map command.
+ * @param x
+ * X coordinate of the cell, relative to the visible area.
+ * @param y
+ * Y coordinate of the cell, relative to the visible area.
+ * @param update
+ * Whether the cell is already known to the client, in which case its
+ * monster or player, if any, leaves the cell unless a new one is added.
+ */
+static void selftest_netcapture_cell(packet_struct *packet, int x, int y,
+        bool update)
+{
+    uint32_t rnd = selftest_random();
+    bool wall = rnd % 6 == 0;
+    bool item = !wall && rnd % 3 != 0;
+    bool glow = item && rnd % 5 == 0;
+    bool living = !wall && (rnd >> 8) % 3 == 0;
+    bool clear = update && !living;
+
+    packet_append_uint16(packet, (x << 11) | (y << 6) | MAP2_MASK_DARKNESS);
+    packet_append_uint8(packet, 100 + (rnd >> 16) % 156);
+    packet_append_uint8(packet, 1 + wall + item + (living || clear));
+
+    selftest_netcapture_object(packet, LAYER_FLOOR, 0);
+
+    if (wall) {
+        selftest_netcapture_object(packet, LAYER_WALL, 0);
+    }
+
+    if (item) {
+        if (glow) {
+            packet_append_uint8(packet, GET_MAP_LAYER(LAYER_ITEM, 0));
+            packet_append_uint16(packet, 1 + selftest_random() % 64);
+            packet_append_uint8(packet, 0);
+            packet_append_uint8(packet, MAP2_FLAG_MORE);
+            packet_append_uint32(packet, MAP2_FLAG2_GLOW);
+            packet_append_string_terminated(packet, "ffd700");
+            packet_append_uint8(packet, 4);
+        } else {
+            selftest_netcapture_object(packet, LAYER_ITEM, 0);
+        }
+    }
+
+    if (clear) {
+        packet_append_uint8(packet, MAP2_LAYER_CLEAR);
+        packet_append_uint8(packet, GET_MAP_LAYER(LAYER_LIVING, 0));
+    } else if (living) {
+        packet_append_uint8(packet, GET_MAP_LAYER(LAYER_LIVING, 0));
+        packet_append_uint16(packet, 1 + selftest_random() % 64);
+        packet_append_uint8(packet, 0);
+        packet_append_uint8(packet, MAP2_FLAG_MORE);
+        packet_append_uint32(packet, MAP2_FLAG2_TARGET | MAP2_FLAG2_PROBE);
+        packet_append_uint32(packet, ++selftest_netcapture_count);
+        packet_append_uint8(packet, (rnd >> 24) % 4 == 0);
+        packet_append_uint8(packet, 1 + (rnd >> 24) % 100);
+    }
+
+    /* No tile flags. */
+    packet_append_uint8(packet, 0);
+}
+
+/**
+ * Run the self-test, writing the capture.
+ * @return
+ * True on success, false on failure.
+ */
+bool selftest_netcapture(void)
+{
+    /* Make sure a capture left over from an earlier run is not mistaken
+     * for the new one if it cannot be written. */
+    remove(SELFTEST_NETCAPTURE_PATH);
+    netcapture_open(SELFTEST_NETCAPTURE_PATH);
+    selftest_netcapture_count = 0;
+
+    int size = SELFTEST_NETCAPTURE_MAP_SIZE;
+    int px = SELFTEST_NETCAPTURE_MAP_LEN / 2;
+    int py = SELFTEST_NETCAPTURE_MAP_LEN / 2;
+
+    /* Enter the town... */
+    packet_struct *packet = packet_new(CLIENT_CMD_MAP, 8192, 8192);
+    packet_append_uint8(packet, MAP_UPDATE_CMD_NEW);
+    packet_append_string_terminated(packet, "Town");
+    packet_append_string_terminated(packet, "");
+    packet_append_string_terminated(packet, "");
+    packet_append_uint8(packet, 0);
+    packet_append_uint8(packet, 0);
+    packet_append_string_terminated(packet, "");
+    packet_append_string_terminated(packet, "");
+    packet_append_string_terminated(packet, "/town");
+    packet_append_uint8(packet, SELFTEST_NETCAPTURE_MAP_LEN);
+    packet_append_uint8(packet, SELFTEST_NETCAPTURE_MAP_LEN);
+    packet_append_uint8(packet, px);
+    packet_append_uint8(packet, py);
+    packet_append_uint8(packet, 0);
+    packet_append_uint8(packet, 0);
+
+    for (int x = 0; x < size; x++) {
+        for (int y = 0; y < size; y++) {
+            selftest_netcapture_cell(packet, x, y, false);
+        }
+    }
+
+    selftest_netcapture_record(packet);
+
+    /* ... and walk around it. Each step scrolls the map, sends the cells
+     * that have come into view, clears some that have gone out of sight,
+     * and moves some of the monsters around. */
+    for (int i = 0; i < SELFTEST_NETCAPTURE_STEPS; i++) {
+        const int *step = selftest_netcapture_steps[i %
+                arraysize(selftest_netcapture_steps)];
+        px += step[0];
+        py += step[1];
+
+        packet = packet_new(CLIENT_CMD_MAP, 2048, 2048);
+        packet_append_uint8(packet, MAP_UPDATE_CMD_SAME);
+        packet_append_uint8(packet, px);
+        packet_append_uint8(packet, py);
+        packet_append_uint8(packet, 0);
+        packet_append_uint8(packet, 0);
+
+        for (int x = 0; x < size; x++) {
+            for (int y = 0; y < size; y++) {
+                if ((step[0] > 0 && x == size - 1) ||
+                        (step[0] < 0 && x == 0) ||
+                        (step[1] > 0 && y == size - 1) ||
+                        (step[1] < 0 && y == 0)) {
+                    selftest_netcapture_cell(packet, x, y, false);
+                } else if (selftest_random() % 16 == 0) {
+                    packet_append_uint16(packet, (x << 11) | (y << 6) |
+                            MAP2_MASK_CLEAR);
+                } else if (selftest_random() % 8 == 0) {
+                    selftest_netcapture_cell(packet, x, y, true);
+                }
+            }
+        }
+
+        selftest_netcapture_record(packet);
+    }
+
+    netcapture_close();
+
+    FILE *fp = fopen(SELFTEST_NETCAPTURE_PATH, "rb");
+
+    if (fp == NULL) {
+        LOG(ERROR, "Could not write %s", SELFTEST_NETCAPTURE_PATH);
+        return false;
+    }
+
+    fclose(fp);
+    LOG(INFO, "Wrote %s with %" PRIu64 " monsters and players over %d steps",
+            SELFTEST_NETCAPTURE_PATH, (uint64_t) selftest_netcapture_count,
+            SELFTEST_NETCAPTURE_STEPS);
+    return true;
+}
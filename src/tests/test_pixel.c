@@ -0,0 +1,200 @@
+/**
+ * @file
+ * Self-test of the pixel kernels; compares each set of pixel kernels
+ * supported by the CPU with the floating-point math the sprite effects used
+ * to use.
+ */
+
+#include <global.h>
+
+/**
+ * Largest difference allowed between any channel of the pixels produced by
+ * the pixel kernels and the reference implementation.
+ */
+#define SELFTEST_PIXEL_TOLERANCE 1
+
+/** How many times to process the surfaces when measuring. */
+#define SELFTEST_PIXEL_ITERATIONS 10
+
+/**
+ * Widths of the generated surfaces; the odd ones make the SIMD kernels
+ * process partial vectors at the end of the rows.
+ */
+static const int selftest_pixel_widths[] = {
+    1, 3, 4, 7, 8, 9, 15, 16, 17, 31, 33, 48, 67, 256
+};
+
+/** Height of the generated surfaces. */
+#define SELFTEST_PIXEL_HEIGHT 64
+
+/**
+ * Apply a color effect to a surface the way it was done before the pixel
+ * kernels existed, one pixel at a time using floating-point math.
+ * @param surface
+ * The surface; must be in the RGBA8888 format.
+ * @param effect
+ * The effect.
+ */
+static void pixel_reference_effect(SDL_Surface *surface, pixel_effect_t effect)
+{
+    for (int y = 0; y < surface->h; y++) {
+        for (int x = 0; x < surface->w; x++) {
+            Uint8 r, g, b, a;
+            SDL_GetRGBA(getpixel(surface, x, y), surface->format, &r, &g, &b,
+                    &a);
+            double lum = 0.212671 * r + 0.715160 * g + 0.072169 * b;
+
+            switch (effect) {
+            case PIXEL_EFFECT_RED:
+                r = (Uint8) lum;
+                g = b = 0;
+                break;
+
+            case PIXEL_EFFECT_GRAY:
+                r = g = b = (Uint8) lum;
+                break;
+
+            case PIXEL_EFFECT_FOW:
+                r = g = b = (Uint8) (lum * 0.34);
+                b += 16;
+                break;
+            }
+
+            putpixel(surface, x, y, SDL_MapRGBA(surface->format, r, g, b, a));
+        }
+    }
+}
+
+/**
+ * Scale the alpha channel of a surface the way it was done before the pixel
+ * kernels existed.
+ * @param surface
+ * The surface.
+ * @param alpha
+ * Alpha value to scale by.
+ */
+static void pixel_reference_alpha(SDL_Surface *surface, uint8_t alpha)
+{
+    SDL_PixelFormat *fmt = surface->format;
+    double scale = alpha / 255.0f;
+
+    for (int y = 0; y < surface->h; y++) {
+        for (int x = 0; x < surface->w; x++) {
+            Uint8 r, g, b, a;
+            Uint32 *pixel_ptr = (Uint32 *) ((Uint8 *) surface->pixels +
+                    y * surface->pitch + x * fmt->BytesPerPixel);
+            SDL_GetRGBA(*pixel_ptr, fmt, &r, &g, &b, &a);
+            *pixel_ptr = SDL_MapRGBA(fmt, r, g, b, scale * a);
+        }
+    }
+}
+
+/**
+ * Run the pixel kernels self-test.
+ * @return
+ * True on success, false on failure.
+ */
+bool selftest_pixel(void)
+{
+    static const struct {
+        const char *name;
+        int effect; ///< The effect, -1 to scale the alpha channel.
+        uint8_t alpha; ///< Alpha value to scale by.
+    } tests[] = {
+        {"red", PIXEL_EFFECT_RED, 0}, {"gray", PIXEL_EFFECT_GRAY, 0},
+        {"fow", PIXEL_EFFECT_FOW, 0}, {"alpha 0", -1, 0},
+        {"alpha 77", -1, 77}, {"alpha 128", -1, 128}, {"alpha 255", -1, 255}
+    };
+
+    size_t num = arraysize(selftest_pixel_widths);
+    SDL_Surface *surfaces[arraysize(selftest_pixel_widths)];
+    SDL_Surface *work[arraysize(selftest_pixel_widths)];
+    SDL_Surface *expected[arraysize(selftest_pixel_widths)];
+
+    for (size_t i = 0; i < num; i++) {
+        surfaces[i] = selftest_surface_random(selftest_pixel_widths[i],
+                SELFTEST_PIXEL_HEIGHT);
+        work[i] = selftest_surface_random(selftest_pixel_widths[i],
+                SELFTEST_PIXEL_HEIGHT);
+        expected[i] = selftest_surface_random(selftest_pixel_widths[i],
+                SELFTEST_PIXEL_HEIGHT);
+    }
+
+    double freq = SDL_GetPerformanceFrequency();
+    bool ret = true;
+
+    for (size_t t = 0; t < arraysize(tests); t++) {
+        uint64_t elapsed = 0;
+
+        for (int it = 0; it < SELFTEST_PIXEL_ITERATIONS; it++) {
+            for (size_t i = 0; i < num; i++) {
+                selftest_surface_copy(surfaces[i], expected[i]);
+                uint64_t start = SDL_GetPerformanceCounter();
+
+                if (tests[t].effect == -1) {
+                    pixel_reference_alpha(expected[i], tests[t].alpha);
+                } else {
+                    pixel_reference_effect(expected[i], tests[t].effect);
+                }
+
+                elapsed += SDL_GetPerformanceCounter() - start;
+            }
+        }
+
+        LOG(INFO, "%s: reference %.3f ms", tests[t].name,
+                elapsed * 1000.0 / freq / SELFTEST_PIXEL_ITERATIONS);
+
+        for (size_t k = 0; k < pixel_kernels_num(); k++) {
+            const char *name = pixel_kernels_select(k);
+
+            if (name == NULL) {
+                continue;
+            }
+
+            int diff = 0;
+            elapsed = 0;
+
+            for (int it = 0; it < SELFTEST_PIXEL_ITERATIONS; it++) {
+                for (size_t i = 0; i < num; i++) {
+                    selftest_surface_copy(surfaces[i], work[i]);
+                    uint64_t start = SDL_GetPerformanceCounter();
+
+                    if (tests[t].effect == -1) {
+                        pixel_alpha_surface(work[i], tests[t].alpha);
+                    } else {
+                        pixel_effect_surface(work[i], tests[t].effect);
+                    }
+
+                    elapsed += SDL_GetPerformanceCounter() - start;
+
+                    if (it == 0) {
+                        /* The expected surfaces hold the last iteration of
+                         * the reference, which is the same every time. */
+                        diff = MAX(diff, selftest_surface_diff(work[i],
+                                expected[i]));
+                    }
+                }
+            }
+
+            LOG(INFO, "%s: %s kernels %.3f ms, max diff %d", tests[t].name,
+                    name, elapsed * 1000.0 / freq / SELFTEST_PIXEL_ITERATIONS,
+                    diff);
+
+            if (diff > SELFTEST_PIXEL_TOLERANCE) {
+                LOG(ERROR, "%s: %s kernels differ from the reference by %d",
+                        tests[t].name, name, diff);
+                ret = false;
+            }
+        }
+    }
+
+    pixel_init();
+
+    for (size_t i = 0; i < num; i++) {
+        SDL_FreeSurface(surfaces[i]);
+        SDL_FreeSurface(work[i]);
+        SDL_FreeSurface(expected[i]);
+    }
+
+    return ret;
+}
@@ -0,0 +1,245 @@
+/**
+ * @file
+ * Self-test of the surface scaler used to zoom the map; compares the
+ * surfaces scaled by pixel_scaler_scale() with zoomSurface(), and checks
+ * that scaling only the changed areas of a surface gives exactly the same
+ * result as scaling all of it.
+ */
+
+#include <global.h>
+
+/** Width of the generated map surface. */
+#define SELFTEST_SCALER_W 850
+/** Height of the generated map surface. */
+#define SELFTEST_SCALER_H 600
+
+/** Number of changed areas scaled again in each case. */
+#define SELFTEST_SCALER_RECTS 16
+
+/**
+ * Largest difference allowed between any color channel of the surfaces
+ * scaled by the scaler and by zoomSurface(). The generated surface is a
+ * gradient, so sampling a neighboring pixel or rounding differently when
+ * interpolating only changes the colors slightly, while sampling the wrong
+ * area of the surface does not.
+ */
+#define SELFTEST_SCALER_TOLERANCE 4
+
+/** Zoom levels to check, in percent. */
+static const int selftest_scaler_zooms[] = {50, 75, 150, 200};
+
+/**
+ * Fill a surface with a gradient.
+ * @param surface
+ * The surface; must use 32-bit pixels.
+ */
+static void selftest_scaler_gradient(SDL_Surface *surface)
+{
+    SDL_LockSurface(surface);
+
+    for (int y = 0; y < surface->h; y++) {
+        uint32_t *row = (uint32_t *) ((uint8_t *) surface->pixels +
+                y * surface->pitch);
+
+        for (int x = 0; x < surface->w; x++) {
+            row[x] = SDL_MapRGB(surface->format, x * 255 / (surface->w - 1),
+                    y * 255 / (surface->h - 1),
+                    (x + y) * 255 / (surface->w + surface->h - 2));
+        }
+    }
+
+    SDL_UnlockSurface(surface);
+}
+
+/**
+ * Get the largest difference between any color channel of two surfaces of
+ * the same size, which may use different pixel formats.
+ * @param a
+ * The first surface.
+ * @param b
+ * The second surface.
+ * @return
+ * The difference.
+ */
+static int selftest_scaler_diff(SDL_Surface *a, SDL_Surface *b)
+{
+    int diff = 0;
+
+    for (int y = 0; y < a->h; y++) {
+        for (int x = 0; x < a->w; x++) {
+            Uint8 r1, g1, b1, r2, g2, b2;
+            SDL_GetRGB(getpixel(a, x, y), a->format, &r1, &g1, &b1);
+            SDL_GetRGB(getpixel(b, x, y), b->format, &r2, &g2, &b2);
+            diff = MAX(diff, MAX(abs(r1 - r2), MAX(abs(g1 - g2),
+                    abs(b1 - b2))));
+        }
+    }
+
+    return diff;
+}
+
+/**
+ * Create a surface in the same format as another one.
+ * @param surface
+ * Surface whose format to use.
+ * @param w
+ * Width of the new surface.
+ * @param h
+ * Height of the new surface.
+ * @return
+ * The new surface.
+ */
+static SDL_Surface *selftest_scaler_surface(SDL_Surface *surface, int w, int h)
+{
+    SDL_Surface *tmp = SDL_CreateRGBSurface(0, w, h,
+            surface->format->BitsPerPixel, surface->format->Rmask,
+            surface->format->Gmask, surface->format->Bmask,
+            surface->format->Amask);
+
+    if (tmp == NULL) {
+        LOG(ERROR, "Could not create a surface: %s", SDL_GetError());
+        exit(1);
+    }
+
+    return tmp;
+}
+
+/**
+ * Check the scaler at one zoom level.
+ * @param src
+ * Source surface; it is modified.
+ * @param zoom
+ * Zoom level, in percent.
+ * @param smooth
+ * Whether to interpolate the pixels.
+ * @return
+ * True on success, false on failure.
+ */
+static bool selftest_scaler_zoom(SDL_Surface *src, int zoom, bool smooth)
+{
+    double freq = SDL_GetPerformanceFrequency();
+    bool ret = true;
+
+    selftest_scaler_gradient(src);
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    SDL_Surface *expected = zoomSurface(src, zoom / 100.0, zoom / 100.0,
+            smooth);
+    uint64_t elapsed_expected = SDL_GetPerformanceCounter() - start;
+
+    if (expected == NULL) {
+        LOG(ERROR, "%d%%: zoomSurface() failed", zoom);
+        return false;
+    }
+
+    int w, h;
+    zoomSurfaceSize(src->w, src->h, zoom / 100.0, zoom / 100.0, &w, &h);
+
+    if (expected->w != w || expected->h != h) {
+        LOG(ERROR, "%d%%: zoomSurface() gave %dx%d instead of %dx%d", zoom,
+                expected->w, expected->h, w, h);
+        SDL_FreeSurface(expected);
+        return false;
+    }
+
+    SDL_Surface *full = selftest_scaler_surface(src, w, h);
+    SDL_Surface *partial = selftest_scaler_surface(src, w, h);
+
+    pixel_scaler_t scaler = {0};
+    pixel_scaler_setup(&scaler, src->w, src->h, w, h, smooth);
+
+    start = SDL_GetPerformanceCounter();
+    pixel_scaler_scale(&scaler, src, full, NULL);
+    uint64_t elapsed_full = SDL_GetPerformanceCounter() - start;
+
+    int diff = selftest_scaler_diff(full, expected);
+
+    if (diff > SELFTEST_SCALER_TOLERANCE) {
+        LOG(ERROR, "%d%%%s: the scaler differs from zoomSurface() by %d",
+                zoom, smooth ? " smooth" : "", diff);
+        ret = false;
+    }
+
+    /* Change some areas of the surface, including its edges, and only
+     * scale those again. */
+    SDL_Rect rects[SELFTEST_SCALER_RECTS];
+    pixel_scaler_scale(&scaler, src, partial, NULL);
+
+    for (size_t i = 0; i < arraysize(rects); i++) {
+        rects[i].w = 1 + selftest_random() % (MAP_TILE_POS_XOFF * 2);
+        rects[i].h = 1 + selftest_random() % (MAP_TILE_YOFF * 4);
+
+        if (i == 0) {
+            rects[i].x = 0;
+            rects[i].y = 0;
+        } else if (i == 1) {
+            rects[i].x = src->w - rects[i].w;
+            rects[i].y = src->h - rects[i].h;
+        } else {
+            rects[i].x = selftest_random() % (src->w - rects[i].w + 1);
+            rects[i].y = selftest_random() % (src->h - rects[i].h + 1);
+        }
+
+        SDL_FillRect(src, &rects[i], selftest_random());
+    }
+
+    start = SDL_GetPerformanceCounter();
+
+    for (size_t i = 0; i < arraysize(rects); i++) {
+        pixel_scaler_scale(&scaler, src, partial, &rects[i]);
+    }
+
+    uint64_t elapsed_partial = SDL_GetPerformanceCounter() - start;
+
+    pixel_scaler_scale(&scaler, src, full, NULL);
+    int partial_diff = selftest_surface_diff(full, partial);
+
+    if (partial_diff != 0) {
+        LOG(ERROR, "%d%%%s: scaling only the changed areas differs from "
+                "scaling all of the surface by %d", zoom,
+                smooth ? " smooth" : "", partial_diff);
+        ret = false;
+    }
+
+    LOG(INFO, "%d%%%s: zoomSurface() %.3f ms, scaler %.3f ms (max diff %d), "
+            "%d changed areas %.3f ms", zoom, smooth ? " smooth" : "",
+            elapsed_expected * 1000.0 / freq, elapsed_full * 1000.0 / freq,
+            diff, SELFTEST_SCALER_RECTS, elapsed_partial * 1000.0 / freq);
+
+    pixel_scaler_free(&scaler);
+    SDL_FreeSurface(expected);
+    SDL_FreeSurface(full);
+    SDL_FreeSurface(partial);
+    return ret;
+}
+
+/**
+ * Run the scaler self-test.
+ * @return
+ * True on success, false on failure.
+ */
+bool selftest_scaler(void)
+{
+    /* The same format as the map surface. */
+    SDL_Surface *src = SDL_CreateRGBSurface(0, SELFTEST_SCALER_W,
+            SELFTEST_SCALER_H, 32, 0, 0, 0, 0);
+
+    if (src == NULL) {
+        LOG(ERROR, "Could not create a surface: %s", SDL_GetError());
+        return false;
+    }
+
+    bool ret = true;
+
+    for (size_t i = 0; i < arraysize(selftest_scaler_zooms); i++) {
+        for (int smooth = 0; smooth <= 1; smooth++) {
+            if (!selftest_scaler_zoom(src, selftest_scaler_zooms[i],
+                    smooth)) {
+                ret = false;
+            }
+        }
+    }
+
+    SDL_FreeSurface(src);
+    return ret;
+}
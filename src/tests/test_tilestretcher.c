@@ -0,0 +1,193 @@
+/**
+ * @file
+ * Self-test of tile stretching; compares the tiles stretched by
+ * tile_stretch() using precomputed plans with the ones stretched one pixel
+ * at a time by tile_stretch_reference().
+ *
+ * tile_stretch_reference() only supports 32-bit tiles, so palettized tiles
+ * are compared with the reference stretching the same tile converted to
+ * RGBA8888 by hand, with the pixels of the color key made transparent.
+ */
+
+#include <global.h>
+
+/** Number of generated RGBA8888 floor tiles. */
+#define SELFTEST_TILESTRETCHER_TILES 16
+/** Number of generated palettized floor tiles, which use a color key. */
+#define SELFTEST_TILESTRETCHER_PALETTIZED 4
+/** Total number of generated floor tiles. */
+#define SELFTEST_TILESTRETCHER_ALL \
+    (SELFTEST_TILESTRETCHER_TILES + SELFTEST_TILESTRETCHER_PALETTIZED)
+
+/**
+ * Stretch values used for each direction; all their combinations are
+ * checked.
+ */
+static const int selftest_tilestretcher_values[] = {0, 1, 4, 8, 12};
+
+/**
+ * Create a palettized tile with random colors, using a color key for a
+ * quarter of its pixels.
+ * @param[out] converted
+ * Will contain the tile converted to RGBA8888, with the pixels of the color
+ * key fully transparent.
+ * @return
+ * The palettized tile.
+ */
+static SDL_Surface *selftest_tilestretcher_palettized(SDL_Surface **converted)
+{
+    SDL_Surface *tile = SDL_CreateRGBSurface(0, MAP_TILE_POS_XOFF,
+            MAP_TILE_YOFF, 8, 0, 0, 0, 0);
+
+    if (tile == NULL) {
+        LOG(ERROR, "Could not create a surface: %s", SDL_GetError());
+        exit(1);
+    }
+
+    SDL_Color colors[256];
+
+    for (size_t i = 0; i < arraysize(colors); i++) {
+        uint32_t rnd = selftest_random();
+        colors[i].r = rnd >> 24;
+        colors[i].g = rnd >> 16;
+        colors[i].b = rnd >> 8;
+        colors[i].a = 255;
+    }
+
+    /* The color key is black, so its pixels are zero once converted to
+     * RGBA8888, whether or not the conversion keeps their color. */
+    colors[0].r = colors[0].g = colors[0].b = 0;
+
+    SDL_SetPaletteColors(tile->format->palette, colors, 0, arraysize(colors));
+    SDL_SetColorKey(tile, SDL_TRUE, 0);
+
+    *converted = selftest_surface_random(tile->w, tile->h);
+    SDL_LockSurface(tile);
+    SDL_LockSurface(*converted);
+
+    for (int y = 0; y < tile->h; y++) {
+        uint8_t *row = (uint8_t *) tile->pixels + y * tile->pitch;
+        uint32_t *row_converted = (uint32_t *) ((uint8_t *)
+                (*converted)->pixels + y * (*converted)->pitch);
+
+        for (int x = 0; x < tile->w; x++) {
+            row[x] = selftest_random() % 4 == 0 ? 0 :
+                    1 + selftest_random() % 255;
+            SDL_Color *color = &colors[row[x]];
+            row_converted[x] = SDL_MapRGBA((*converted)->format, color->r,
+                    color->g, color->b, row[x] == 0 ? 0 : 255);
+        }
+    }
+
+    SDL_UnlockSurface(*converted);
+    SDL_UnlockSurface(tile);
+    return tile;
+}
+
+/**
+ * Run the tile stretching self-test.
+ * @return
+ * True on success, false on failure.
+ */
+bool selftest_tilestretcher(void)
+{
+    /* Tiles to stretch, and the tiles the reference stretches instead. */
+    SDL_Surface *tiles[SELFTEST_TILESTRETCHER_ALL];
+    SDL_Surface *refs[SELFTEST_TILESTRETCHER_ALL];
+
+    for (size_t i = 0; i < SELFTEST_TILESTRETCHER_TILES; i++) {
+        tiles[i] = refs[i] = selftest_surface_random(MAP_TILE_POS_XOFF,
+                MAP_TILE_YOFF);
+
+        /* Make a quarter of the pixels fully transparent, as they are
+         * skipped when stretching. */
+        SDL_LockSurface(tiles[i]);
+
+        for (int y = 0; y < tiles[i]->h; y++) {
+            uint32_t *row = (uint32_t *) ((uint8_t *) tiles[i]->pixels +
+                    y * tiles[i]->pitch);
+
+            for (int x = 0; x < tiles[i]->w; x++) {
+                if (selftest_random() % 4 == 0) {
+                    row[x] &= ~tiles[i]->format->Amask;
+                }
+            }
+        }
+
+        SDL_UnlockSurface(tiles[i]);
+    }
+
+    for (size_t i = SELFTEST_TILESTRETCHER_TILES; i < arraysize(tiles);
+            i++) {
+        tiles[i] = selftest_tilestretcher_palettized(&refs[i]);
+    }
+
+    size_t num = arraysize(selftest_tilestretcher_values);
+    uint64_t combinations = 0, mismatches = 0;
+    uint64_t elapsed_reference = 0, elapsed = 0;
+
+    /* Start with no plans, so that creating them is measured too. */
+    tilestretcher_deinit();
+
+    for (size_t ni = 0; ni < num; ni++) {
+        for (size_t ei = 0; ei < num; ei++) {
+            for (size_t si = 0; si < num; si++) {
+                for (size_t wi = 0; wi < num; wi++) {
+                    int n = selftest_tilestretcher_values[ni];
+                    int e = selftest_tilestretcher_values[ei];
+                    int s = selftest_tilestretcher_values[si];
+                    int w = selftest_tilestretcher_values[wi];
+                    combinations++;
+
+                    for (size_t i = 0; i < arraysize(tiles); i++) {
+                        uint64_t start = SDL_GetPerformanceCounter();
+                        SDL_Surface *expected = tile_stretch_reference(
+                                refs[i], n, e, s, w);
+                        elapsed_reference += SDL_GetPerformanceCounter() -
+                                start;
+
+                        start = SDL_GetPerformanceCounter();
+                        SDL_Surface *result = tile_stretch(tiles[i], n, e, s,
+                                w);
+                        elapsed += SDL_GetPerformanceCounter() - start;
+
+                        if (expected == NULL || result == NULL ||
+                                selftest_surface_diff(expected, result) != 0) {
+                            LOG(ERROR, "Stretching tile %" PRIu64 " by "
+                                    "%d,%d,%d,%d differs from the reference",
+                                    (uint64_t) i, n, e, s, w);
+                            mismatches++;
+                        }
+
+                        if (expected != NULL) {
+                            SDL_FreeSurface(expected);
+                        }
+
+                        if (result != NULL) {
+                            SDL_FreeSurface(result);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    double freq = SDL_GetPerformanceFrequency();
+    LOG(INFO, "Stretched %" PRIu64 " tiles in %" PRIu64 " ways: reference "
+            "%.3f ms, plans %.3f ms, %" PRIu64 " mismatches",
+            (uint64_t) arraysize(tiles), combinations,
+            elapsed_reference * 1000.0 / freq, elapsed * 1000.0 / freq,
+            mismatches);
+
+    tilestretcher_deinit();
+
+    for (size_t i = 0; i < arraysize(tiles); i++) {
+        if (refs[i] != tiles[i]) {
+            SDL_FreeSurface(refs[i]);
+        }
+
+        SDL_FreeSurface(tiles[i]);
+    }
+
+    return mismatches == 0;
+}